@@ -71,11 +71,12 @@ struct AGCCoeffs {
   FPType decim;
 };
 
-// Automatic gain control filter state.
+// Automatic gain control filter state.  The arrays and the decimation phase
+// are stored in the state arena of an Ear.
 struct AGCState {
-  ArrayX agc_memory;
-  ArrayX input_accum;
-  int decim_phase;
+  ArrayXMap agc_memory{nullptr, 0};
+  ArrayXMap input_accum{nullptr, 0};
+  int* decim_phase = nullptr;
 };
 
 #endif  // CARFAC_AGC_H
@@ -38,7 +38,7 @@ class BinauralSAI : public sai_internal::SAIBase {
   void Reset() override;
 
   // Fills each of two entries in output_frame with a
-  // params().num_channels by params().width SAI frame computed from the
+  // params().num_channels by output_width() SAI frame computed from the
   // given input segments.  The first element in output_frame vector
   // uses the first element of the input as the trigger and the second
   // element as the scaled waveform.  The second element in
@@ -56,13 +56,13 @@ class BinauralSAI : public sai_internal::SAIBase {
                   std::vector<ArrayXX>* output_frame);
 
  private:
-  // Buffer to store a large enough window of input frames to compute
-  // a full SAI frame.  Two elements, each of size
-  // params().num_channels by buffer_width().
-  std::vector<ArrayXX> input_buffer_;
+  // Histories of a large enough window of input samples to compute a full
+  // SAI frame.  Two elements, each of size params().num_channels by
+  // buffer_width().
+  std::vector<sai_internal::InputHistory> input_history_;
   // Output frame buffer.  Two elements, each of size
-  // params().num_channels by params().width.
-  std::vector<ArrayXX> output_buffer_;
+  // params().num_channels by output_width().
+  std::vector<RowMajorArrayXX> output_buffer_;
 
   DISALLOW_COPY_AND_ASSIGN(BinauralSAI);
 };
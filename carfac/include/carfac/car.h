@@ -42,7 +42,10 @@ struct CARParams {
     erb_q = 1000 / (24.7 * 4.37);
   }
 
-  FPType velocity_scale;  // Used for the velocity nonlinearity.
+  // Used for the velocity nonlinearity of the OHCs.  Setting both to zero
+  // disables it, which makes the CAR linear when running open loop, e.g. for
+  // reproducible offline features.
+  FPType velocity_scale;
   FPType v_offset;  // The offset gives us quadratic part.
   FPType min_zeta;  // The minimum damping factor in mid-freq channels.
   FPType max_zeta;  // The maximum damping factor in mid-freq channels.
@@ -68,16 +71,16 @@ struct CARCoeffs {
 };
 
 
-// CAR filter state.
+// CAR filter state.  The arrays are views into the state arena of an Ear.
 struct CARState {
-  ArrayX z1_memory;
-  ArrayX z2_memory;
-  ArrayX za_memory;
-  ArrayX zb_memory;
-  ArrayX dzb_memory;
-  ArrayX zy_memory;
-  ArrayX g_memory;
-  ArrayX dg_memory;
+  ArrayXMap z1_memory{nullptr, 0};
+  ArrayXMap z2_memory{nullptr, 0};
+  ArrayXMap za_memory{nullptr, 0};
+  ArrayXMap zb_memory{nullptr, 0};
+  ArrayXMap dzb_memory{nullptr, 0};
+  ArrayXMap zy_memory{nullptr, 0};
+  ArrayXMap g_memory{nullptr, 0};
+  ArrayXMap dg_memory{nullptr, 0};
 };
 
 // Computes CAR pole frequency in Hz for each channel.
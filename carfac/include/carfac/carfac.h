@@ -21,15 +21,40 @@
 #ifndef CARFAC_CARFAC_H
 #define CARFAC_CARFAC_H
 
+#include <cstddef>
+#include <memory>
 #include <vector>
 
 #include "agc.h"
 #include "car.h"
 #include "common.h"
+#include "ear.h"
 #include "ihc.h"
+#include "nap_sink.h"
+#include "worker_pool.h"
 
 class CARFACOutput;
-class Ear;
+
+// Selects how CARFAC::RunSegment evaluates the cascade of asymmetric
+// resonators.  All kernels compute the same model, but since they order the
+// floating point operations differently, the outputs may differ slightly.
+enum class CARKernel {
+  // Calls Ear::CARStep on every sample, rippling the input serially through
+  // the channels.
+  kPerSample,
+  // Calls Ear::CARBlock on the blocks of samples between AGC updates, which
+  // evaluates the cascade as a diagonal wavefront across channels.  This
+  // pays off most when running open loop or without AGC, where blocks are
+  // long.
+  kWavefront,
+  // Calls Ear::FusedBlock on the blocks of samples between AGC updates, which
+  // runs the CAR, IHC and AGC input steps of each channel together along the
+  // same wavefront as kWavefront, without storing the CAR outputs.  Fastest
+  // when open loop or without AGC, where blocks are long, and more so with a
+  // linear CAR, see Ear::car_is_linear, whose step is cheaper while its
+  // damping is frozen.
+  kFusedBlock,
+};
 
 // Top-level class implementing the Cascade of Asymmetric Resonators
 // with Fast-Acting Compression (CARFAC) cochlear model.
@@ -45,7 +70,6 @@ class CARFAC {
   // If agc_params.num_stages == 0 the AGC will be disabled.
   CARFAC(int num_ears, FPType sample_rate, const CARParams& car_params,
          const IHCParams& ihc_params, const AGCParams& agc_params);
-  ~CARFAC();
 
   // Reinitializes using the specified parameters.
   void Redesign(int num_ears, FPType sample_rate, const CARParams& car_params,
@@ -55,8 +79,41 @@ class CARFAC {
   // independent of previous calls.  Does not modify the filterbank design.
   void Reset();
 
+  // The complete state of the model is the concatenated state of the ears,
+  // state_size_bytes() bytes long.  It can be saved by SaveState and restored
+  // into a CARFAC with the same design by RestoreState, e.g. to resume
+  // processing a recording from a snapshot instead of from its start.
+  std::size_t state_size_bytes() const;
+  void SaveState(void* state_data) const;
+  void RestoreState(const void* state_data);
+
   const CARParams& car_params() const { return car_params_; }
 
+  // Selects the CAR kernel used by subsequent calls to RunSegment.  The
+  // default is CARKernel::kPerSample.
+  void set_car_kernel(CARKernel car_kernel) { car_kernel_ = car_kernel; }
+  CARKernel car_kernel() const { return car_kernel_; }
+
+  // Selects how subsequent calls to RunSegment evaluate the OHC and IHC
+  // nonlinearities, with any CAR kernel.  kFast trades a small deviation of
+  // the outputs for fewer divisions.  The default is
+  // NonlinearityPrecision::kExact.  Running open loop does not make the CAR
+  // step cheaper under either precision, since the OHC nonlinearity still
+  // runs at every sample.  CARKernel::kFusedBlock takes its cheaper linear
+  // step only with kExact and the nonlinearity disabled, see
+  // Ear::car_is_linear.
+  void set_nonlinearity_precision(NonlinearityPrecision precision);
+  NonlinearityPrecision nonlinearity_precision() const {
+    return nonlinearity_precision_;
+  }
+
+  // Selects whether subsequent calls to RunSegment run each ear on its own
+  // thread, when there is more than one ear.  The ears then only meet at the
+  // AGC updates, where they are cross-coupled, and the outputs are identical
+  // to running them in sequence.  The default is false.
+  void set_parallel_ears(bool parallel_ears);
+  bool parallel_ears() const { return parallel_ears_; }
+
   // Consumes the entire sound data segment specified by sound_data
   // and stores the model output in output overwriting it.  Setting
   // open_loop to true breaks the AGC feedback loop, making the
@@ -67,7 +124,10 @@ class CARFAC {
   //
   // The input sound_data should have size num_ears by num_samples.  Note that
   // this is the transpose of the input to CARFAC_Run_Segment.m
-  void RunSegment(const ArrayXX& sound_data, bool open_loop,
+  //
+  // Once output has been sized by a first call, later calls with the same
+  // number of samples make no heap allocations.
+  void RunSegment(const Eigen::Ref<const ArrayXX>& sound_data, bool open_loop,
                   CARFACOutput* output);
 
   int num_channels() const { return num_channels_; }
@@ -77,15 +137,39 @@ class CARFAC {
   const ArrayX& pole_frequencies() const { return pole_freqs_; }
 
   // Access Ears for testing.
-  const Ear& get_ear(int ear_index) const { return *(ears_[ear_index]); }
+  const Ear& get_ear(int ear_index) const { return ears_[ear_index]; }
 
- private:
+  // Designs the filter coefficients from the model parameters.  These are
+  // shared with the other engines built on the same model, e.g. CARFACBatch.
   static void DesignCARCoeffs(const CARParams& car_params, FPType sample_rate,
                               const ArrayX& pole_freqs, CARCoeffs* car_coeffs);
   static void DesignIHCCoeffs(const IHCParams& ihc_params, FPType sample_rate,
                               IHCCoeffs* ihc_coeffs);
   static void DesignAGCCoeffs(const AGCParams& agc_params, FPType sample_rate,
                               std::vector<AGCCoeffs>* agc_coeffs);
+
+ private:
+  // Applies car_kernel_ to the block of num_samples samples of one ear
+  // starting at sample start, and stores its outputs.  Returns true iff the
+  // AGC memory is updated, which can only happen at the last sample.
+  bool RunEarBlock(int ear_index, const Eigen::Ref<const ArrayXX>& sound_data,
+                   int start, int num_samples, bool open_loop,
+                   CARFACOutput* output);
+
+  // Runs one ear over the whole segment on the calling thread, as one of the
+  // parallel ears.  The ears meet at agc_barrier_ at every AGC update.
+  void RunEarSegment(int ear_index, const Eigen::Ref<const ArrayXX>& sound_data,
+                     bool open_loop, CARFACOutput* output);
+
+  // Returns the length of the next block of an ear, given the number of
+  // samples remaining in the segment.  When running closed loop, the block
+  // ends at the next update of the first AGC stage, since the CAR
+  // coefficients must stay fixed within a block.
+  int NextBlockSize(const Ear& ear, int num_remaining, bool open_loop) const;
+
+  // Creates or destroys the threads and barrier used for the parallel ears.
+  void UpdateWorkerPool();
+
   void CrossCouple();
 
   // Close (in the sense of complete the circuit) the gain-control feedback;
@@ -100,12 +184,22 @@ class CARFAC {
   FPType sample_rate_;
   int num_channels_;
   FPType max_channels_per_octave_;
+  CARKernel car_kernel_ = CARKernel::kPerSample;
+  NonlinearityPrecision nonlinearity_precision_ =
+      NonlinearityPrecision::kExact;
 
-  // One Ear per input audio channel.
-  std::vector<Ear*> ears_;
+  // One Ear per input audio channel, stored contiguously.
+  std::vector<Ear> ears_;
   ArrayX pole_freqs_;
   ArrayX accumulator_;  // Temp space for CrossCouple.
 
+  // The threads running the parallel ears, one per ear including the caller
+  // of RunSegment, and the barrier at which they meet at AGC updates.  Only
+  // allocated when there is more than one parallel ear.
+  bool parallel_ears_ = false;
+  std::unique_ptr<WorkerPool> worker_pool_;
+  std::unique_ptr<SpinBarrier> agc_barrier_;
+
   DISALLOW_COPY_AND_ASSIGN(CARFAC);
 };
 
@@ -130,19 +224,44 @@ class CARFACOutput {
   const std::vector<ArrayXX>& agc() const { return agc_; }
   std::vector<ArrayXX>* mutable_agc() { return &agc_; }
 
+  // Sends the NAP of ear ear_index to nap_sink sample by sample, as it is
+  // computed, instead of storing it in nap(), whose array for that ear is
+  // then left without columns.  This saves writing and reading back the
+  // whole segment when the NAP is only fed to a consumer like the SAI.  A
+  // null nap_sink stores the NAP again.  Requires store_nap.
+  void set_nap_sink(int ear_index, NAPSink* nap_sink);
+  NAPSink* nap_sink(int ear_index) const {
+    return ear_index < static_cast<int>(nap_sinks_.size())
+               ? nap_sinks_[ear_index]
+               : nullptr;
+  }
+
  private:
   friend class CARFAC;
+  friend class CARFACBatch;
+  friend class FixedPointCARFAC;
 
   // Resizes the internal containers for each output type, destroying the
-  // previous contents.  Must be called before AssignFromEars.
+  // previous contents.  Must be called before AssignFromEar.
   void Resize(int num_ears, int num_channels, int num_samples);
 
-  // For each ear, assigns a single frame of state at time sample_index to the
+  // Assigns a single frame of state of the ear at time sample_index to the
   // the individual data members selected for storage.  sample_index must be
   // less than num_samples specified in the last call to Resize.
   //
-  // This is called on a sample by sample basis by CARFAC::RunSegment.
-  void AssignFromEars(const std::vector<Ear*>& ears, int sample_index);
+  // This is called on a sample by sample basis by CARFAC::RunSegment.  Calls
+  // for different ears may run concurrently.
+  void AssignFromEar(int ear_index, const Ear& ear, int sample_index);
+
+  // Like AssignFromEar, but takes the CAR state from column block_index of
+  // the block outputs of the last call to Ear::CARBlock.
+  void AssignFromEarBlock(int ear_index, const Ear& ear, int block_index,
+                          int sample_index);
+
+  // Stores the NAP of ear ear_index at time sample_index, or sends it to the
+  // ear's NAP sink.  Only called if store_nap_.
+  void AssignNAP(int ear_index, int sample_index,
+                 const Eigen::Ref<const ArrayX, 0, Eigen::InnerStride<>>& nap);
 
   bool store_nap_;
   bool store_bm_;
@@ -151,6 +270,9 @@ class CARFACOutput {
 
   // Neural activity pattern rates.
   std::vector<ArrayXX> nap_;
+  // The NAP sink of each ear, or null where the NAP is stored in nap_.  Ears
+  // past the end have no sink.
+  std::vector<NAPSink*> nap_sinks_;
   // Basilar membrane displacement.
   std::vector<ArrayXX> bm_;
   // Outer hair cell state.
@@ -0,0 +1,137 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// This file is part of an implementation of Lyon's cochlear model:
+// "Cascade of Asymmetric Resonators with Fast-Acting Compression"
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// This header declares a CARFAC engine that runs many independent monaural
+// audio streams at once.
+
+#ifndef CARFAC_CARFAC_BATCH_H
+#define CARFAC_CARFAC_BATCH_H
+
+#include <vector>
+
+#include "agc.h"
+#include "car.h"
+#include "carfac.h"
+#include "common.h"
+#include "ihc.h"
+
+// Runs the CARFAC model on a batch of independent monaural audio streams.
+//
+// The CAR ripple in Ear::CARStep can't be vectorized across channels, since
+// the input to each channel is the output of the previous channel for the
+// same sample.  CARFACBatch instead stores the state of all streams in a
+// structure-of-arrays layout, as num_streams by num_channels arrays, so that
+// every step of the model, including the ripple, runs with SIMD lanes across
+// streams.  Each stream produces exactly the output of a single-ear CARFAC
+// object designed with the same parameters.
+//
+// Since all streams share one design and start together, their AGC
+// decimation phases stay aligned, and the AGC filters update for all streams
+// at the same samples.
+class CARFACBatch {
+ public:
+  CARFACBatch(int num_streams, FPType sample_rate, const CARParams& car_params,
+              const IHCParams& ihc_params, const AGCParams& agc_params);
+
+  // Reinitializes using the specified parameters.
+  void Redesign(int num_streams, FPType sample_rate,
+                const CARParams& car_params, const IHCParams& ihc_params,
+                const AGCParams& agc_params);
+
+  // Resets the internal state of all streams.
+  void Reset();
+
+  // Consumes one segment for each stream and stores the model output of
+  // stream i in outputs[i], overwriting it.  Each output holds a single ear.
+  //
+  // The input sound_data should have size num_streams by num_samples, and
+  // outputs should have num_streams elements.  See CARFAC::RunSegment for the
+  // meaning of open_loop.
+  void RunSegment(const ArrayXX& sound_data, bool open_loop,
+                  const std::vector<CARFACOutput*>& outputs);
+
+  int num_streams() const { return num_streams_; }
+  int num_channels() const { return num_channels_; }
+
+  // Returns an array of pole/center frequencies in Hertz for each output
+  // channel.
+  const ArrayX& pole_frequencies() const { return pole_freqs_; }
+
+ private:
+  // Batched counterparts of the Ear methods.  All state and temporary arrays
+  // have size num_streams by num_channels.  CARStep expects in_out_ to hold
+  // the input sample of each stream.
+  void CARStep();
+  void IHCStep();
+  bool AGCStep();
+  bool AGCRecurse(int stage, ArrayXX* agc_in_out);
+  void AGCSpatialSmooth(const AGCCoeffs& agc_coeffs, ArrayXX* stage_state);
+  void AGCSmoothDoubleExponential(FPType pole_z1, FPType pole_z2,
+                                  ArrayXX* stage_state);
+  void CloseAGCLoop(bool open_loop);
+
+  int num_streams_;
+  FPType sample_rate_;
+  int num_channels_;
+  ArrayX pole_freqs_;
+
+  CARCoeffs car_coeffs_;
+  IHCCoeffs ihc_coeffs_;
+  std::vector<AGCCoeffs> agc_coeffs_;
+
+  // The per-channel CAR coefficients, replicated for each stream.
+  ArrayXX r1_coeffs_;
+  ArrayXX a0_coeffs_;
+  ArrayXX c0_coeffs_;
+  ArrayXX h_coeffs_;
+  ArrayXX zr_coeffs_;
+
+  // CAR state.
+  ArrayXX z1_memory_;
+  ArrayXX z2_memory_;
+  ArrayXX za_memory_;
+  ArrayXX zb_memory_;
+  ArrayXX dzb_memory_;
+  ArrayXX zy_memory_;
+  ArrayXX g_memory_;
+  ArrayXX dg_memory_;
+
+  // IHC state.
+  ArrayXX ihc_out_;
+  ArrayXX cap1_voltage_;
+  ArrayXX cap2_voltage_;
+  ArrayXX lpf1_state_;
+  ArrayXX lpf2_state_;
+  ArrayXX ac_coupler_;
+
+  // AGC state, one element per stage.  The decimation phase is shared by all
+  // streams.
+  std::vector<ArrayXX> agc_memory_;
+  std::vector<ArrayXX> agc_input_accum_;
+  std::vector<int> agc_decim_phase_;
+
+  // Temporary storage, used as in Ear.
+  ArrayXX tmp1_;
+  ArrayXX tmp2_;
+  // The rippled input-output sample of each stream.  Size: num_streams.
+  ArrayX in_out_;
+  ArrayX smoother_state_;
+
+  DISALLOW_COPY_AND_ASSIGN(CARFACBatch);
+};
+
+#endif  // CARFAC_CARFAC_BATCH_H
@@ -25,16 +25,19 @@
 
 // Computes the IHC detection nonlinearity function of the filter output
 // values.  This is here because it is called both in design and run phases.
-inline void CARFACDetect(ArrayX* input_output) {
+// It accepts any Eigen array, so that it can also be applied to a whole
+// (stream x channel) block at once.
+template <typename Derived>
+inline void CARFACDetect(Eigen::ArrayBase<Derived>* input_output) {
   constexpr FPType a = 0.175;
   constexpr FPType b = 0.1;
   // This offsets the low-end tail into negative x territory.
   // The parameter a is adjusted for the book, to make the 20% DC response
   // threshold at 0.1.
-  ArrayX& c = *input_output;
+  Derived& c = input_output->derived();
   c = c.cwiseMax(-a) + a;
   // Zero is the final answer for many points.
-  *input_output = c.cube() / (c.cube() + c.square() + b);
+  c = c.cube() / (c.cube() + c.square() + b);
 }
 
 #endif  // CARFAC_CARFAC_UTIL_H
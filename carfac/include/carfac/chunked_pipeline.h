@@ -0,0 +1,136 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// This file is part of an implementation of Lyon's cochlear model:
+// "Cascade of Asymmetric Resonators with Fast-Acting Compression"
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// This header declares an offline driver that runs the CARFAC and SAI stages
+// of a PitchogramPipeline over a whole recording on several threads.
+
+#ifndef CARFAC_CHUNKED_PIPELINE_H
+#define CARFAC_CHUNKED_PIPELINE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "carfac.h"
+#include "common.h"
+#include "pitchogram_pipeline.h"
+#include "worker_pool.h"
+
+struct ChunkedPipelineParams {
+  // Number of threads processing chunks, including the caller.
+  int num_threads;
+  // Number of chunks the recording is split into, or 0 for one per thread.
+  // Chunks run on the threads in turn, so more chunks than threads balance
+  // the load better, at the cost of one more warm-up per chunk.
+  int num_chunks;
+  // Length in seconds of the audio preceding each chunk that is processed,
+  // with its outputs discarded, before the first frame of the chunk.  The
+  // CARFAC and SAI states then converge towards those of a sequential run,
+  // which the frames of the chunk approximate.  Rounded up to whole segments.
+  float warmup_s;
+
+  ChunkedPipelineParams()
+      : num_threads(std::max(1u, std::thread::hardware_concurrency())),
+        num_chunks(0),
+        warmup_s(0.5f) {}
+};
+
+// The difference between the frames of one chunk and the same frames of a
+// sequential run over the whole recording.
+struct ChunkDivergence {
+  int first_frame;
+  int num_frames;
+  // Largest absolute differences of the NAP and the SAI over the chunk.
+  float max_nap_error;
+  float max_sai_error;
+  // Largest absolute values of the sequential NAP and SAI over the chunk, to
+  // give the errors a scale.
+  float max_nap;
+  float max_sai;
+};
+
+// Runs PitchogramPipeline::ProcessJustSamples over a whole recording, one
+// segment per frame, by splitting the frames into contiguous chunks that are
+// processed concurrently, each by its own pipeline.  The first chunk matches
+// a sequential run exactly, and the others start from a warm-up over the
+// preceding audio, so that their outputs converge to it.
+class ChunkedPipeline {
+ public:
+  ChunkedPipeline(float sample_rate_hz,
+                  const PitchogramPipelineParams& pipeline_params,
+                  const ChunkedPipelineParams& params);
+
+  // Called with the NAP and the SAI of each frame, see
+  // PitchogramPipeline::nap.
+  typedef std::function<void(int frame_index,
+                             const Eigen::Ref<const RowMajorArrayXX>& nap,
+                             const ArrayXX& sai_output)>
+      FrameCallback;
+
+  // Number of frames in a recording of num_samples samples.  The samples
+  // after the last whole segment are not processed.
+  int NumFrames(int num_samples) const {
+    return num_samples / pipeline_params_.num_samples_per_segment;
+  }
+  // Number of segments processed before the first frame of each chunk but
+  // the first.
+  int num_warmup_frames() const { return num_warmup_frames_; }
+  int num_threads() const { return worker_pool_.num_threads(); }
+
+  // Processes the recording, calling frame_callback for every frame.  The
+  // calls for the frames of a chunk are made in order by one thread, but the
+  // chunks run concurrently, so frame_callback must be safe to call from
+  // several threads for different frames, e.g. by storing each frame at its
+  // index.
+  void Run(const float* samples, int num_samples,
+           const FrameCallback& frame_callback);
+
+  // Processes the recording and stitches the NAP of all frames into nap,
+  // which is resized to num_channels by NumFrames(num_samples) times the
+  // model_samples_per_segment() of the pipeline.
+  void RunNAP(const float* samples, int num_samples, ArrayXX* nap);
+
+  // Runs the chunks and a sequential pipeline over the recording side by
+  // side on the calling thread, and returns the divergence of each chunk
+  // from the sequential run for the current warm-up.  This is intended for
+  // choosing warmup_s, and is no faster than a sequential run.
+  std::vector<ChunkDivergence> MeasureDivergence(const float* samples,
+                                                 int num_samples);
+
+ private:
+  int num_chunks(int num_frames) const {
+    return std::max(1, std::min(num_chunks_, num_frames));
+  }
+  // Returns the first frame of the chunk, which is also the frame after the
+  // last frame of the previous chunk.
+  int ChunkStart(int chunk_index, int num_chunks, int num_frames) const {
+    return static_cast<int>(static_cast<int64_t>(chunk_index) * num_frames /
+                            num_chunks);
+  }
+
+  float sample_rate_hz_;
+  PitchogramPipelineParams pipeline_params_;
+  int num_chunks_;
+  int num_warmup_frames_;
+  WorkerPool worker_pool_;
+
+  DISALLOW_COPY_AND_ASSIGN(ChunkedPipeline);
+};
+
+#endif  // CARFAC_CHUNKED_PIPELINE_H
@@ -30,6 +30,31 @@
 typedef float FPType;
 typedef Eigen::Array<FPType, Eigen::Dynamic, 1> ArrayX;
 typedef Eigen::Array<FPType, Eigen::Dynamic, Eigen::Dynamic> ArrayXX;
+// A channels by samples array whose rows, the signals of the channels, are
+// contiguous, for code that scans along time, like the SAI.
+typedef Eigen::Array<FPType, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+    RowMajorArrayXX;
+
+// The alignment in bytes of the model state, which is the size of a cache line
+// on most current processors, and a multiple of every SIMD vector size.
+constexpr int kCacheLineBytes = 64;
+
+// A view of an array in memory owned elsewhere, such as the state arena of an
+// Ear, which must be aligned to kCacheLineBytes.
+typedef Eigen::Map<ArrayX, Eigen::Aligned64> ArrayXMap;
+
+// Selects how the outer hair cell (OHC) nonlinearity of the CAR, 1 / (1 + v^2),
+// and the inner hair cell (IHC) detection nonlinearity, x^3 / (x^3 + x^2 + b),
+// are evaluated on every sample of every channel.
+enum class NonlinearityPrecision {
+  // Divides to full precision.
+  kExact,
+  // Multiplies by ApproximateReciprocal of the denominator instead, which
+  // avoids the divider but has a relative error of up to 1e-6.  Whether this
+  // is faster depends on the divide throughput of the CPU, see
+  // BM_CarfacNonlinearityPrecision.
+  kFast,
+};
 
 // This macro disallows the copy constructor and operator= functions.
 // This should be used in the private: declarations for a class.
@@ -43,4 +68,15 @@ typedef Eigen::Array<FPType, Eigen::Dynamic, Eigen::Dynamic> ArrayXX;
 // this library if the basic assert macro is insufficient.
 #define CARFAC_ASSERT(expression) assert(expression);
 
+// This macro asserts that the following loop carries no dependence between
+// iterations through memory, so that the compiler can vectorize it without
+// checking at runtime whether the arrays it accesses overlap.
+#if defined(__clang__)
+#define CARFAC_IVDEP _Pragma("clang loop vectorize(assume_safety)")
+#elif defined(__GNUC__)
+#define CARFAC_IVDEP _Pragma("GCC ivdep")
+#else
+#define CARFAC_IVDEP
+#endif
+
 #endif  // CARFAC_COMMON_H
@@ -19,12 +19,16 @@
 #ifndef CARFAC_EAR_H
 #define CARFAC_EAR_H
 
+#include <cstddef>
+#include <memory>
+#include <new>
 #include <vector>
 
 #include "agc.h"
 #include "car.h"
 #include "common.h"
 #include "ihc.h"
+#include "nap_sink.h"
 
 // The Ear object carries out the three steps of the CARFAC model on a single
 // channel of audio data, and stores information about the CAR, IHC and AGC
@@ -36,6 +40,10 @@ class Ear {
       const IHCCoeffs& ihc_coeffs,
       const std::vector<AGCCoeffs>& agc_coeffs);
 
+  // Ears are moved, rather than copied, into the contiguous array of ears of
+  // a CARFAC object.  The state arena stays in place.
+  Ear(Ear&& other) = default;
+
   // Reinitializes using the specified parameters.
   void Redesign(int num_channels,
                 const CARCoeffs& car_coeffs,
@@ -45,6 +53,13 @@ class Ear {
   // Resets the internal state.
   void Reset();
 
+  // Selects how the OHC and IHC nonlinearities are evaluated by all of the
+  // step and block methods.  The default is NonlinearityPrecision::kExact.
+  void set_nonlinearity_precision(NonlinearityPrecision precision);
+  NonlinearityPrecision nonlinearity_precision() const {
+    return nonlinearity_precision_;
+  }
+
   // These three methods apply the different steps of the model in sequence
   // to individual audio samples during the call to CARFAC::RunSegment.
   void CARStep(FPType input);
@@ -53,32 +68,84 @@ class Ear {
   // requiring callers to confusingly have to call an accessor method
   // just to pass internal data back into the same object as in:
   //   ear.IHCStep(ear.car_out());
-  void IHCStep(const ArrayX& car_out);
+  void IHCStep(const Eigen::Ref<const ArrayX>& car_out);
   // Returns true iff the AGC memory is updated.
-  bool AGCStep(const ArrayX& ihc_out);
+  bool AGCStep(const Eigen::Ref<const ArrayX>& ihc_out);
+
+  // Applies CARStep to a block of consecutive input samples, evaluating the
+  // cascade as a diagonal wavefront: channel c at sample t is computed
+  // together with channel c - 1 at sample t + 1, so that every step operates
+  // on a contiguous run of channels instead of rippling one channel at a
+  // time.  The result is sample-exact with calling CARStep on each sample.
+  //
+  // The deltas set by CloseAGCLoop are applied at every sample, so it must
+  // not be called within the block.  On return the CAR state is that after
+  // the last sample, and column t of the block accessors below holds the
+  // state after sample t.
+  void CARBlock(const Eigen::Ref<const ArrayX, 0, Eigen::InnerStride<>>& input);
+
+  // Runs CARStep, IHCStep and AGCStep on a block of consecutive input
+  // samples.  The block is traversed as a wavefront as in CARBlock, and each
+  // channel runs all three steps in a single pass, so that its state is
+  // loaded and stored once per sample.  The deltas set by CloseAGCLoop are
+  // applied at every sample, so the block must end no later than the next
+  // update of the first AGC stage.  Returns true iff the AGC memory is
+  // updated, which can only happen at the last sample.  If update_agc is
+  // false, the AGC is left untouched as when running open loop.
+  //
+  // The model outputs at sample t of the block are written to column
+  // output_start + t of nap, bm, ohc and agc, any of which may be null.  If
+  // nap is null and nap_sink is not, the NAP of sample t is appended to
+  // nap_sink as its sample output_start + t instead.
+  //
+  // Running open loop only freezes the damping and gain.  The OHC
+  // nonlinearity still varies the pole radius at every sample, so the step
+  // costs as much as when the loop is closed, including with the default
+  // CARParams.  Only if the nonlinearity is disabled, see car_is_linear, and
+  // the nonlinearities are exact, does FusedBlock take a cheaper linear step.
+  bool FusedBlock(
+      const Eigen::Ref<const ArrayX, 0, Eigen::InnerStride<>>& input,
+      bool update_agc, int output_start, ArrayXX* nap, NAPSink* nap_sink,
+      ArrayXX* bm, ArrayXX* ohc, ArrayXX* agc);
+
+  // Returns true iff the OHC nonlinearity is disabled, by a CAR design with
+  // both velocity_scale and v_offset zero.  The CAR is then linear while its
+  // damping and gain are frozen, as when running open loop, and FusedBlock
+  // runs a cheaper step with the same results.
+  bool car_is_linear() const {
+    return car_coeffs_.velocity_scale == 0 && car_coeffs_.v_offset == 0;
+  }
 
   // These accessor functions return portions of the CAR state for storage in
-  // the CAROutput structures.
-  const ArrayX& za_memory() const { return car_state_.za_memory; }
-  const ArrayX& zb_memory() const { return car_state_.zb_memory; }
+  // the CAROutput structures.  They are views into the state arena.
+  const ArrayXMap& za_memory() const { return car_state_.za_memory; }
+  const ArrayXMap& zb_memory() const { return car_state_.zb_memory; }
 
   // The zy_memory_ of the CARState is equivalent to the CAR output. A second
   // accessor function is included for documentation purposes.
-  const ArrayX& zy_memory() const { return car_state_.zy_memory; }
-  const ArrayX& car_out() const { return car_state_.zy_memory; }
-  const ArrayX& g_memory() const { return car_state_.g_memory; }
-  const ArrayX& ihc_out() const { return ihc_state_.ihc_out; }
-  const ArrayX& dzb_memory() const { return car_state_.dzb_memory; }
+  const ArrayXMap& zy_memory() const { return car_state_.zy_memory; }
+  const ArrayXMap& car_out() const { return car_state_.zy_memory; }
+  const ArrayXMap& g_memory() const { return car_state_.g_memory; }
+  const ArrayXMap& ihc_out() const { return ihc_state_.ihc_out; }
+  const ArrayXMap& dzb_memory() const { return car_state_.dzb_memory; }
   const ArrayX& zr_coeffs() const { return car_coeffs_.zr_coeffs; }
 
+  // These return the per-sample CAR state from the last call to CARBlock.
+  // Only the first block-length columns are valid.
+  const ArrayXX& car_out_block() const { return zy_block_; }
+  const ArrayXX& za_block() const { return za_block_; }
+  const ArrayXX& zb_block() const { return zb_block_; }
+
   // These accessor functions return portions of the AGC state during the cross
   // coupling of the ears.
   int agc_num_stages() const { return agc_coeffs_.size(); }
-  int agc_decim_phase(int stage) const { return agc_state_[stage].decim_phase; }
+  int agc_decim_phase(int stage) const {
+    return *agc_state_[stage].decim_phase;
+  }
   FPType agc_mix_coeff(int stage) const {
     return agc_coeffs_[stage].agc_mix_coeffs;
   }
-  const ArrayX& agc_memory(int stage) const {
+  const ArrayXMap& agc_memory(int stage) const {
     return agc_state_[stage].agc_memory;
   }
   int agc_decimation(int stage) const { return agc_coeffs_[stage].decimation; }
@@ -88,6 +155,14 @@ class Ear {
     return agc_coeffs_[stage];
   }
 
+  // The complete state of the ear, including the AGC decimation phases, is
+  // stored in the first state_size_bytes() bytes of its arena.  It can be
+  // saved by copying them from state_data(), and restored into an ear with
+  // the same design by RestoreState.
+  std::size_t state_size_bytes() const { return state_size_bytes_; }
+  const void* state_data() const { return arena_.get(); }
+  void RestoreState(const void* state_data);
+
   // Sets the CAR memory state from AGC feedback.
   void CloseAGCLoop(bool open_loop);
 
@@ -95,6 +170,10 @@ class Ear {
   void CrossCouple(const ArrayX& mean_state, int stage);
 
  private:
+  // Allocates the state arena for the current design, and points the state
+  // arrays and temporaries into it.
+  void AllocateArena();
+
   // These initialize the model state variables prior to runtime.
   void InitIHCState();
   void InitAGCState();
@@ -102,13 +181,34 @@ class Ear {
 
   // Helper sub-functions called during the model runtime.
   // Returns true iff the AGC memory is updated.
-  bool AGCRecurse(int stage, ArrayX* agc_in);
+  bool AGCRecurse(int stage, ArrayXMap* agc_in);
+  // Runs one diagonal of the FusedBlock wavefront over the channels in
+  // [first, last], for the given IHC topology and nonlinearity precision,
+  // also storing the IHC output of each channel to nap_diagonal[channel].
+  // If kLinear, the CAR must be linear with its deltas zero and kFast false,
+  // and its step skips the interpolation and the OHC nonlinearity, see
+  // car_is_linear.
+  template <bool kJustHalfWaveRectify, bool kOneCapacitor, bool kFast,
+            bool kLinear>
+  void FusedWavefrontStep(int first, int last, const FPType* in_out,
+                          FPType* next_in_out, FPType* nap_diagonal);
+  // Calls FusedWavefrontStep for the IHC topology of the design.
+  template <bool kFast, bool kLinear>
+  void FusedWavefrontStepForTopology(int first, int last, const FPType* in_out,
+                                     FPType* next_in_out,
+                                     FPType* nap_diagonal);
+
+  // Advances the decimation phase of the stage by num_inputs, whose sum has
+  // already been added to its input_accum, and runs the decimated update if
+  // the phase reaches the stage decimation.  agc_in_out is used as temporary
+  // storage.  Returns true iff the AGC memory is updated.
+  bool AGCAdvance(int stage, int num_inputs, ArrayXMap* agc_in_out);
 
   // Not const since it uses a temp array.
-  void AGCSpatialSmooth(const AGCCoeffs& agc_coeffs, ArrayX* stage_state);
+  void AGCSpatialSmooth(const AGCCoeffs& agc_coeffs, ArrayXMap* stage_state);
 
   void AGCSmoothDoubleExponential(FPType pole_z1, FPType pole_z2,
-                                  ArrayX* stage_state) const;
+                                  ArrayXMap* stage_state) const;
 
   CARCoeffs car_coeffs_;
   CARState car_state_;
@@ -121,14 +221,57 @@ class Ear {
   std::vector<AGCState> agc_state_;
 
   int num_channels_;
+  NonlinearityPrecision nonlinearity_precision_ =
+      NonlinearityPrecision::kExact;
+  // The indices of the step kernels specialized for the design, see
+  // StepKernelVariant in kernels.h.
+  int step_kernel_variant_ = 0;
+  int ihc_topology_ = 0;
 
   // Temporary storage to avoid allocations inside the .*Step methods, which
   // are called once per sample, and in CloseAGCLoop, called less often.
   // The use of these temps is unrelated from one function to another.  Their
   // values are used only within a function, not across calls (except for one
   // use between AGCStep and its helper AGCRecurse).
-  ArrayX tmp1_;
-  ArrayX tmp2_;
+  ArrayXMap tmp1_{nullptr, 0};
+  ArrayXMap tmp2_{nullptr, 0};
+
+  // Frees the arena, which is allocated with cache line alignment.
+  struct ArenaDeleter {
+    void operator()(char* arena) const {
+      operator delete[](arena, std::align_val_t(kCacheLineBytes));
+    }
+  };
+
+  // The state arena holds the whole state of the ear, followed by tmp1_ and
+  // tmp2_, in a single allocation laid out as follows:
+  //   the decimation phase of each AGC stage;
+  //   the CAR state, in the order the CAR step reads it: g, dg, zb, dzb, z1,
+  //   z2, za and zy;
+  //   the IHC state: ihc_out, ac_coupler, cap1, cap2, lpf1 and lpf2;
+  //   the AGC state of each stage: input_accum and agc_memory.
+  // Each of these starts on a cache line and is padded to whole cache lines.
+  // The arrays hold one variable for all channels, rather than interleaving
+  // the variables of each channel, since the model steps are vectorized
+  // across channels: a SIMD step then loads whole cache lines, each holding
+  // one variable of a run of adjacent channels, and consecutive variables of
+  // those channels are a fixed stride apart, which the hardware prefetcher
+  // follows.
+  std::unique_ptr<char[], ArenaDeleter> arena_;
+  std::size_t arena_size_bytes_ = 0;
+  std::size_t state_size_bytes_ = 0;
+
+  // Storage for CARBlock and FusedBlock.  The block arrays have size
+  // num_channels by the longest block seen so far, and wavefront_in_out_
+  // holds the inputs and outputs of each channel on the current diagonal of
+  // the wavefront.
+  ArrayXX zy_block_;
+  ArrayXX za_block_;
+  ArrayXX zb_block_;
+  ArrayX wavefront_in_out_;
+  // The IHC outputs of FusedBlock, with one column per diagonal of the
+  // wavefront, so that the kernel stores them contiguously.
+  ArrayXX skewed_nap_;
 
   DISALLOW_COPY_AND_ASSIGN(Ear);
 };
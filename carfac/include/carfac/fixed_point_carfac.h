@@ -0,0 +1,179 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// This file is part of an implementation of Lyon's cochlear model:
+// "Cascade of Asymmetric Resonators with Fast-Acting Compression"
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// This header declares a CARFAC engine that runs in integer fixed-point
+// arithmetic, and the measure of its accuracy against the floating point
+// model.
+
+#ifndef CARFAC_FIXED_POINT_CARFAC_H
+#define CARFAC_FIXED_POINT_CARFAC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "agc.h"
+#include "car.h"
+#include "carfac.h"
+#include "common.h"
+#include "ihc.h"
+#include "kernels.h"
+
+// Runs the CARFAC model in integer fixed-point arithmetic on a batch of
+// independent monaural audio streams, with the same layout as CARFACBatch.
+//
+// The CAR signals are 32-bit, with kFixedPointSignalBits fractional bits, and
+// are multiplied by 16-bit coefficients with 15 fractional bits.  The damping
+// r1 + zb and the stage gain g keep 30 fractional bits, since they are
+// interpolated in small steps between AGC updates, and are rounded to 15 for
+// the products.  The OHC and the IHC detection nonlinearities are read off
+// tables, interpolating linearly between entries.  The IHC and the AGC
+// coefficients have 30 fractional bits, with 64-bit products, since their
+// slow time constants need the precision.
+//
+// The signals are not 16-bit, since the cascade amplifies the rounding noise
+// of each channel by the gain of all the channels after it, up to 60 dB for
+// quiet sounds, which leaves 16-bit signals without headroom.
+//
+// The outputs are converted to floating point for CARFACOutput.  They differ
+// from those of CARFAC by the rounding noise, see SignalToNoiseRatioDb, and
+// saturate where the CAR signals exceed +/-64.
+class FixedPointCARFAC {
+ public:
+  FixedPointCARFAC(int num_streams, FPType sample_rate,
+                   const CARParams& car_params, const IHCParams& ihc_params,
+                   const AGCParams& agc_params);
+
+  // Resets the internal state of all streams.
+  void Reset();
+
+  // Consumes one segment for each stream and stores the model output of
+  // stream i in outputs[i], overwriting it, as CARFACBatch::RunSegment.
+  void RunSegment(const Eigen::Ref<const ArrayXX>& sound_data, bool open_loop,
+                  const std::vector<CARFACOutput*>& outputs);
+
+  int num_streams() const { return num_streams_; }
+  int num_channels() const { return num_channels_; }
+
+  // Returns an array of pole/center frequencies in Hertz for each output
+  // channel.
+  const ArrayX& pole_frequencies() const { return pole_freqs_; }
+
+  // The complete state of all streams is state_size_bytes() bytes long.  It
+  // can be restored into an engine with the same design.
+  std::size_t state_size_bytes() const;
+  void SaveState(void* state_data) const;
+  void RestoreState(const void* state_data);
+
+ private:
+  // Fixed-point counterparts of the CARFACBatch methods.  The CAR and IHC
+  // steps are KernelTable::fixed_point_car_step and fixed_point_ihc_step.
+  bool AGCStep();
+  bool AGCRecurse(int stage, int32_t* agc_in_out);
+  void AGCSpatialSmooth(int stage, int32_t* stage_state);
+  void AGCSmoothDoubleExponential(int stage, int32_t* stage_state);
+  void CloseAGCLoop(bool open_loop);
+
+  // The fixed-point coefficients of an AGC stage.  The coefficients have 30
+  // fractional bits, except for stage_gain, which has 24.
+  struct AGCStageCoeffs {
+    int decimation;
+    int32_t decimation_scale;
+    int32_t stage_gain;
+    int32_t epsilon;
+    int spatial_iterations;
+    int spatial_n_taps;
+    int32_t fir_left;
+    int32_t fir_mid;
+    int32_t fir_right;
+    int32_t one_minus_pole_z1;
+    int32_t one_minus_pole_z2;
+  };
+
+  int num_streams_;
+  FPType sample_rate_;
+  int num_channels_;
+  ArrayX pole_freqs_;
+  IHCCoeffs ihc_coeffs_;
+
+  // The per-channel CAR coefficients, replicated for each stream, in the
+  // formats of FixedPointCARKernelArrays.
+  std::vector<int32_t> r1_coeffs_;
+  std::vector<int16_t> a0_coeffs_;
+  std::vector<int16_t> c0_coeffs_;
+  std::vector<int16_t> h_coeffs_;
+  std::vector<int32_t> state_shifts_;
+  // The per-channel coefficients of CloseAGCLoop, with 30 fractional bits.
+  std::vector<int32_t> r1_coeffs_q30_;
+  std::vector<int32_t> a0_coeffs_q30_;
+  std::vector<int32_t> c0_coeffs_q30_;
+  std::vector<int32_t> h_coeffs_q30_;
+  std::vector<int32_t> zr_coeffs_q30_;
+  std::vector<int32_t> g0_coeffs_q30_;
+  // See FixedPointCARKernelArrays::ohc_nonlinearity.
+  std::vector<int32_t> ohc_nonlinearity_;
+
+  FixedPointIHCCoeffs ihc_fixed_coeffs_;
+  // See FixedPointIHCCoeffs::detect_nonlinearity.
+  std::vector<int32_t> detect_nonlinearity_;
+
+  std::vector<AGCStageCoeffs> agc_coeffs_;
+  int32_t agc_detect_scale_;
+
+  // The state arrays are num_channels by num_streams, and are stored in
+  // state_, in this order, so that saving the state copies a single block.
+  // The CAR signals have kFixedPointSignalBits fractional bits and g and zb
+  // 30, the IHC arrays are as in FixedPointIHCKernelArrays, and the AGC state
+  // has 24.
+  std::vector<int32_t> state_;
+  int32_t* z1_memory_;
+  int32_t* z2_memory_;
+  int32_t* za_memory_;
+  int32_t* zy_memory_;
+  int32_t* g_memory_;
+  int32_t* dg_memory_;
+  int32_t* zb_memory_;
+  int32_t* dzb_memory_;
+  int32_t* ac_coupler_;
+  int32_t* cap1_voltage_;
+  int32_t* cap2_voltage_;
+  int32_t* lpf1_state_;
+  int32_t* lpf2_state_;
+  int32_t* ihc_out_;
+  // AGC state, one element per stage.  The decimation phase is shared by all
+  // streams.
+  std::vector<int32_t*> agc_memory_;
+  std::vector<int32_t*> agc_input_accum_;
+  std::vector<int> agc_decim_phase_;
+
+  // Temporary storage.
+  std::vector<int32_t> tmp1_;
+  std::vector<int32_t> tmp2_;
+  std::vector<int32_t> in_out_;
+  std::vector<int32_t> smoother_state_;
+  // The NAP of one stream at one sample, in floating point.
+  ArrayX nap_column_;
+
+  DISALLOW_COPY_AND_ASSIGN(FixedPointCARFAC);
+};
+
+// Returns the ratio in decibels of the energy of reference to the energy of
+// its difference from test, which must have the same size.  Returns infinity
+// if they are equal.
+FPType SignalToNoiseRatioDb(const ArrayXX& reference, const ArrayXX& test);
+
+#endif  // CARFAC_FIXED_POINT_CARFAC_H
@@ -63,14 +63,15 @@ struct IHCCoeffs {
   FPType cap2_voltage;
 };
 
-// Inner hair cell filter state.
+// Inner hair cell filter state.  The arrays are views into the state arena
+// of an Ear.
 struct IHCState {
-  ArrayX ihc_out;
-  ArrayX cap1_voltage;
-  ArrayX cap2_voltage;
-  ArrayX lpf1_state;
-  ArrayX lpf2_state;
-  ArrayX ac_coupler;
+  ArrayXMap ihc_out{nullptr, 0};
+  ArrayXMap cap1_voltage{nullptr, 0};
+  ArrayXMap cap2_voltage{nullptr, 0};
+  ArrayXMap lpf1_state{nullptr, 0};
+  ArrayXMap lpf2_state{nullptr, 0};
+  ArrayXMap ac_coupler{nullptr, 0};
 };
 
 #endif  // CARFAC_IHC_H
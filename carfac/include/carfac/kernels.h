@@ -0,0 +1,277 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// This file is part of an implementation of Lyon's cochlear model:
+// "Cascade of Asymmetric Resonators with Fast-Acting Compression"
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// This header declares the hot loops of the CARFAC and SAI models, which are
+// built once per instruction set and dispatched at runtime, so that a single
+// binary uses the widest vectors each CPU supports.
+
+#ifndef CARFAC_KERNELS_H
+#define CARFAC_KERNELS_H
+
+#include <cstdint>
+#include <type_traits>
+
+#include "common.h"
+#include "ihc.h"
+
+// The instruction sets the kernels are built for.  All variants compute
+// bit-identical results, since they are built without contracting multiplies
+// and adds into fused multiply-adds.
+enum class KernelISA {
+  // The baseline instruction set of the build target, e.g. SSE2 on x86-64.
+  kGeneric,
+  // x86-64 with SSE4.2.
+  kSSE4,
+  // x86-64 with AVX2 and FMA.
+  kAVX2,
+  // x86-64 with AVX-512 F, VL, DQ and BW.
+  kAVX512,
+};
+
+// Returns the name of the instruction set, e.g. "avx2".
+const char* KernelISAName(KernelISA isa);
+
+// Returns true iff the kernels were built for isa and the CPU supports it.
+bool IsKernelISASupported(KernelISA isa);
+
+// Returns the instruction set of the kernels in use.  By default, this is
+// the widest one supported, unless the CARFAC_KERNEL_ISA environment
+// variable names a supported one, e.g. CARFAC_KERNEL_ISA=sse4.
+KernelISA ActiveKernelISA();
+
+// Forces the kernels of the given instruction set, e.g. for testing or
+// benchmarking.  Returns false, leaving the kernels unchanged, if isa is not
+// supported.  Affects all CARFAC and SAI objects, and should not be called
+// while any of them is running.
+bool SetKernelISA(KernelISA isa);
+
+// Approximates 1 / x for positive, normal x with a relative error below 1e-6,
+// using only multiplies and adds, by refining an estimate read off the bits of
+// x with three Newton steps.  Each step underestimates, so stopping after two,
+// with an error of up to 7e-6, biases the model enough to move SAI triggers.
+// This is static, so that every kernel variant has its own copy built for its
+// instruction set.
+static inline FPType ApproximateReciprocal(FPType x) {
+  typedef std::conditional_t<sizeof(FPType) == 4, uint32_t, uint64_t> Bits;
+  constexpr Bits kMagic = sizeof(FPType) == 4
+                              ? Bits(0x7EF311C3)
+                              : Bits(uint64_t{0x7FDE623822FC16E6});
+  FPType estimate =
+      __builtin_bit_cast(FPType, kMagic - __builtin_bit_cast(Bits, x));
+  estimate = estimate * (2 - x * estimate);
+  estimate = estimate * (2 - x * estimate);
+  return estimate * (2 - x * estimate);
+}
+
+// Returns numerator / denominator, or its approximation if kFast.
+template <bool kFast>
+static inline FPType DivideNonlinearity(FPType numerator, FPType denominator) {
+  if constexpr (kFast) {
+    return numerator * ApproximateReciprocal(denominator);
+  } else {
+    return numerator / denominator;
+  }
+}
+
+// Pointers to the per-channel CAR coefficients and state arrays read and
+// written by the kernels, which must not alias each other.
+struct CARKernelArrays {
+  const FPType* r1_coeffs;
+  const FPType* a0_coeffs;
+  const FPType* c0_coeffs;
+  const FPType* h_coeffs;
+  const FPType* dg_memory;
+  const FPType* dzb_memory;
+  FPType* g_memory;
+  FPType* zb_memory;
+  FPType* z1_memory;
+  FPType* z2_memory;
+  FPType* za_memory;
+  FPType* zy_memory;
+};
+
+// Pointers to the per-channel IHC state arrays, which must not alias each
+// other.
+struct IHCKernelArrays {
+  FPType* ac_coupler;
+  FPType* ihc_out;
+  FPType* cap1_voltage;
+  FPType* cap2_voltage;
+  FPType* lpf1_state;
+  FPType* lpf2_state;
+};
+
+// The topologies of the IHC model selected by IHCCoeffs.
+enum class IHCTopology {
+  kJustHalfWaveRectify,
+  kOneCapacitor,
+  kTwoCapacitors,
+};
+constexpr int kNumIHCTopologies = 3;
+
+IHCTopology GetIHCTopology(const IHCCoeffs& coeffs);
+
+// The channel count of the CARFAC in a PitchogramPipeline, which is the same
+// at every sample rate.  The step kernels are also built with this count
+// fixed at compile time, so that their loops are fully unrolled, without a
+// remainder loop or a trip count check.
+constexpr int kFixedStepKernelNumChannels = 65;
+
+// The step kernels are built for each NonlinearityPrecision, with either a
+// dynamic channel count or kFixedStepKernelNumChannels.
+constexpr int kNumStepKernelVariants = 4;
+
+// Returns the index of the step kernels specialized for a design, which have
+// a fixed channel count if num_channels is kFixedStepKernelNumChannels.
+int StepKernelVariant(int num_channels, NonlinearityPrecision precision);
+
+// The part of Ear::CARStep that is parallel across channels: interpolates g
+// and zb, updates the OHC nonlinearity, rotates the state and stores the
+// channel outputs before the ripple, h * z2, to zy_memory.
+typedef void (*CARStepKernel)(int num_channels, FPType velocity_scale,
+                              FPType v_offset, const CARKernelArrays& car);
+
+// Ear::IHCStep, including CARFACDetect.  car_out must not alias the state.
+typedef void (*IHCStepKernel)(int num_channels, const IHCCoeffs& coeffs,
+                              const FPType* car_out,
+                              const IHCKernelArrays& ihc);
+
+// The number of fractional bits of the 32-bit CAR signals of
+// FixedPointCARFAC.  The signals saturate at +/-2^30, i.e. at +/-64, so that
+// the kernel can multiply them by 16-bit coefficients in 32 bits, see MulQ15
+// in kernels_impl.inc.
+constexpr int kFixedPointSignalBits = 24;
+
+// The OHC nonlinearity table of FixedPointCARFAC samples the difference
+// z2 - za, offset by 2^30, every 2^kFixedPointOHCTableShift steps, and
+// interpolates linearly between the entries.
+constexpr int kFixedPointOHCTableShift = 20;
+constexpr int kFixedPointOHCTableSize =
+    (1 << (31 - kFixedPointOHCTableShift)) + 1;
+
+// Pointers to the coefficient and state arrays of FixedPointCARFAC read and
+// written by the fixed-point CAR kernel, which must not alias each other.
+// Each array is num_channels by num_streams, with the streams of a channel
+// contiguous.  The signals have kFixedPointSignalBits fractional bits, r1, g
+// and zb have 30, and the 16-bit a0, c0 and h have 15.
+//
+// The resonator state z1, z2 and za of each channel is scaled down by
+// 2^state_shifts, since it is larger than the channel output by up to 1 / h,
+// which is nearly 100 in the lowest channels.  The shift is the largest that
+// keeps h * 2^state_shifts below 1, which is the h_coeffs stored.
+struct FixedPointCARKernelArrays {
+  const int32_t* r1_coeffs;
+  const int16_t* a0_coeffs;
+  const int16_t* c0_coeffs;
+  const int16_t* h_coeffs;
+  const int32_t* state_shifts;
+  const int32_t* dg_memory;
+  const int32_t* dzb_memory;
+  // The OHC nonlinearity with 15 fractional bits, see
+  // kFixedPointOHCTableShift.
+  const int32_t* ohc_nonlinearity;
+  int32_t* g_memory;
+  int32_t* zb_memory;
+  int32_t* z1_memory;
+  int32_t* z2_memory;
+  int32_t* za_memory;
+  int32_t* zy_memory;
+};
+
+// A whole CAR step of FixedPointCARFAC, including the ripple, for all streams.
+// in_out holds the input sample of each stream, and is overwritten with the
+// output of the last channel.
+typedef void (*FixedPointCARStepKernel)(int num_channels, int num_streams,
+                                        const FixedPointCARKernelArrays& car,
+                                        int32_t* in_out);
+
+// The IHC detection nonlinearity table of FixedPointCARFAC samples the AC
+// coupled signal, which has kFixedPointSignalBits fractional bits, at
+// 2^kFixedPointDetectTableBits points per unit from -0.25 to 15.75, and
+// interpolates linearly between the entries.  Above its range, the
+// nonlinearity is within 11% of its limit 1.
+constexpr int kFixedPointDetectTableBits = 8;
+constexpr int kFixedPointDetectTableSize =
+    (16 << kFixedPointDetectTableBits) + 1;
+constexpr int32_t kFixedPointDetectTableMin =
+    -(int32_t{1} << (kFixedPointSignalBits - 2));
+
+// The IHC coefficients of FixedPointCARFAC.  The rates have 30 fractional
+// bits, rest_output 24, like the IHC output, and output_gain 22, since it is
+// up to 150 with two capacitors.
+struct FixedPointIHCCoeffs {
+  int32_t ac_coeff;
+  int32_t out1_rate;
+  int32_t in1_rate;
+  int32_t out2_rate;
+  int32_t in2_rate;
+  int32_t lpf_coeff;
+  int32_t output_gain;
+  int32_t rest_output;
+  // The detection nonlinearity with 15 fractional bits, see
+  // kFixedPointDetectTableBits.
+  const int32_t* detect_nonlinearity;
+};
+
+// Pointers to the IHC state arrays of FixedPointCARFAC, which must not alias
+// each other.  The AC coupler has kFixedPointSignalBits fractional bits, the
+// capacitor voltages 30, and the lowpass filters and the output 24.
+struct FixedPointIHCKernelArrays {
+  int32_t* ac_coupler;
+  int32_t* ihc_out;
+  int32_t* cap1_voltage;
+  int32_t* cap2_voltage;
+  int32_t* lpf1_state;
+  int32_t* lpf2_state;
+};
+
+// The IHC step of FixedPointCARFAC over size elements of all channels and
+// streams.  car_out must not alias the state.
+typedef void (*FixedPointIHCStepKernel)(int size,
+                                        const FixedPointIHCCoeffs& coeffs,
+                                        const int32_t* car_out,
+                                        const FixedPointIHCKernelArrays& ihc);
+
+// The kernels of one instruction set.
+struct KernelTable {
+  // Indexed by StepKernelVariant.
+  CARStepKernel car_step[kNumStepKernelVariants];
+  // Indexed by StepKernelVariant and IHCTopology.
+  IHCStepKernel ihc_step[kNumStepKernelVariants][kNumIHCTopologies];
+  // The FIR smoothing of Ear::AGCSpatialSmooth, with 3 or 5 taps.
+  // smoothed_state is used as temporary storage.
+  void (*agc_spatial_smooth_fir)(int num_channels, int num_taps,
+                                 int num_iterations, FPType fir_left,
+                                 FPType fir_mid, FPType fir_right,
+                                 FPType* stage_state, FPType* smoothed_state);
+  // Returns the maximum of input[i * input_stride] * window[i] over i in
+  // [0, width), and stores its first index to peak_index.
+  FPType (*windowed_peak)(int width, const FPType* input, int input_stride,
+                          const FPType* window, int* peak_index);
+  // Sets output[i * output_stride] to output[i * output_stride] * (1 - alpha)
+  // + alpha * input[i * input_stride] for i in [0, width).
+  void (*blend)(int width, FPType alpha, const FPType* input, int input_stride,
+                FPType* output, int output_stride);
+  FixedPointCARStepKernel fixed_point_car_step;
+  // Indexed by IHCTopology.
+  FixedPointIHCStepKernel fixed_point_ihc_step[kNumIHCTopologies];
+};
+
+// Returns the kernels of ActiveKernelISA().
+const KernelTable& ActiveKernels();
+
+#endif  // CARFAC_KERNELS_H
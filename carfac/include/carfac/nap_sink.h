@@ -0,0 +1,69 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// This file is part of an implementation of Lyon's cochlear model:
+// "Cascade of Asymmetric Resonators with Fast-Acting Compression"
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CARFAC_NAP_SINK_H
+#define CARFAC_NAP_SINK_H
+
+#include <vector>
+
+#include "common.h"
+
+// Receives the neural activity pattern (NAP) of one ear sample by sample, as
+// a CARFAC engine computes it, in place of CARFACOutput::nap().  This lets a
+// consumer such as the SAI take the NAP straight into its own buffers,
+// without the whole segment being stored first, see
+// CARFACOutput::set_nap_sink.
+class NAPSink {
+ public:
+  virtual ~NAPSink() {}
+
+  // Called before the first sample of each segment of num_samples samples.
+  virtual void BeginSegment(int num_samples) = 0;
+
+  // Receives the NAP of all channels at sample sample_index of the segment.
+  // The samples of a segment arrive in increasing order, but may arrive from
+  // a different thread than BeginSegment.
+  virtual void AppendSample(
+      int sample_index,
+      const Eigen::Ref<const ArrayX, 0, Eigen::InnerStride<>>& nap) = 0;
+};
+
+// Forwards the NAP to several sinks in turn, e.g. to feed SAIs of different
+// designs from a single CARFAC pass.  The sinks are not owned.
+class NAPSinkGroup : public NAPSink {
+ public:
+  explicit NAPSinkGroup(const std::vector<NAPSink*>& sinks) : sinks_(sinks) {}
+
+  void BeginSegment(int num_samples) override {
+    for (NAPSink* sink : sinks_) {
+      sink->BeginSegment(num_samples);
+    }
+  }
+
+  void AppendSample(
+      int sample_index,
+      const Eigen::Ref<const ArrayX, 0, Eigen::InnerStride<>>& nap) override {
+    for (NAPSink* sink : sinks_) {
+      sink->AppendSample(sample_index, nap);
+    }
+  }
+
+ private:
+  std::vector<NAPSink*> sinks_;
+};
+
+#endif  // CARFAC_NAP_SINK_H
@@ -18,6 +18,7 @@
 #ifndef CARFAC_PITCHOGRAM_H_
 #define CARFAC_PITCHOGRAM_H_
 
+#include <cstddef>
 #include <vector>
 
 #include "car.h"
@@ -72,17 +73,33 @@ class Pitchogram {
   // Resets to initial state.
   void Reset();
 
+  // The state carried between frames is the smoothed channel energy of the
+  // vowel embedding, state_size_bytes() bytes long.  It can be saved by
+  // SaveState and restored into a Pitchogram with the same design by
+  // RestoreState, which also restores vowel_coords().
+  std::size_t state_size_bytes() const {
+    return cgram_.size() * sizeof(FPType);
+  }
+  void SaveState(void* state_data) const;
+  void RestoreState(const void* state_data);
+
   // Runs the pitchogram on the given input SAI frame. Returns the next column
   // of the pitchogram, having num_lags() rows. To create a scrolling pitchogram
   // plot, the caller should stack the columns from successive RunFrame() calls.
   const ArrayX& RunFrame(const ArrayXX& sai_frame);
+  // Access the column computed by the last RunFrame() call.
+  const ArrayX& output() const { return output_; }
 
   using VowelCoords = Eigen::Matrix<FPType, 2, 1>;
   // Map the nap to a 2D coordinate in an embedding space that tends to
   // distinguish monophthong vowels.
-  const VowelCoords& VowelEmbedding(const ArrayXX& nap);
+  const VowelCoords& VowelEmbedding(
+      const Eigen::Ref<const RowMajorArrayXX>& nap);
   // Access the current vowel embedding coords.
   const VowelCoords& vowel_coords() const { return vowel_coords_; }
+  // Access the smoothed mean of the nap in each channel, from which the vowel
+  // embedding is computed.
+  const ArrayX& cgram() const { return cgram_; }
 
   // Draw one column of a scrolling pitchogram visualization with vowel coloring
   // into the x=0 column of image `dest`. The image is expected to have height
@@ -101,30 +118,7 @@ class Pitchogram {
   FPType cgram_smoother_;
 
   // Resampling weights, used to resample the pitchogram when log_lag is true.
-  // Conceptually, the linear lag pitchogram is considered as a piecewise
-  // constant function "f(x) = samples[round(x)]." Each ResamplingCell
-  // represents averaging f(x) over the interval [left_edge, right_edge] by a
-  // computation of the form
-  //
-  //   CellAverage(samples) =
-  //       left_weight * samples[left_index]
-  //     + interior_weight * (samples[left_index + 1]
-  //                          + ... + samples[right_index - 1])
-  //     + right_weight * samples[right_index].
-  struct ResamplingCell {
-    int left_index;
-    int right_index;
-    float left_weight;
-    float interior_weight;
-    float right_weight;
-
-    ResamplingCell() = default;
-    ResamplingCell(const ResamplingCell&) = default;
-    ResamplingCell(float left_edge, float right_edge);
-
-    float CellAverage(const ArrayX& samples) const;
-  };
-  std::vector<ResamplingCell> log_lag_cells_;
+  std::vector<LagCell> log_lag_cells_;
 };
 
 #endif  // CARFAC_PITCHOGRAM_H_
@@ -17,28 +17,93 @@
 #define THIRD_PARTY_CARFAC_CPP_PITCHOGRAM_PIPELINE_H_
 
 #include <cmath>
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
 
 #include "agc.h"
 #include "car.h"
 #include "carfac.h"
 #include "common.h"
+#include "fixed_point_carfac.h"
 #include "ihc.h"
 #include "image.h"
+#include "nap_sink.h"
 #include "pitchogram.h"
+#include "resampler.h"
 #include "sai.h"
+#include "worker_pool.h"
+
+// Design of an SAI of the bank of a PitchogramPipeline, which is computed
+// from the same NAP as the main SAI, with the same hop, but its own range of
+// lags, e.g. longer lags for low notes and shorter ones for high notes.
+struct PitchogramSAIParams {
+  // Longest lag of the SAI in seconds.
+  float max_lag_s;
+  // Number of trigger windows to consider when computing a single SAI frame.
+  int num_triggers_per_frame;
+  // If positive, the lags are pooled linearly into this many columns, as
+  // PitchogramPipelineParams::sai_output_width does for the main SAI.
+  int output_width;
+
+  PitchogramSAIParams()
+    : max_lag_s(0.05f),
+      num_triggers_per_frame(2),
+      output_width(0) {}
+
+  bool operator==(const PitchogramSAIParams& other) const {
+    return max_lag_s == other.max_lag_s &&
+           num_triggers_per_frame == other.num_triggers_per_frame &&
+           output_width == other.output_width;
+  }
+};
 
 struct PitchogramPipelineParams {
   // Number of frames plotted in the visualization.
   int num_frames;
   // The hop step, number of additional samples processed per SAI frame.
   int num_samples_per_segment;
-  // Highest CARFAC pole frequency in Hz.
+  // Highest and lowest CARFAC pole frequencies in Hz.  Channels above the
+  // band of interest can be dropped by lowering highest_pole_hz, and the ones
+  // below it by raising min_pole_hz, which changes the channel layout.
   float highest_pole_hz;
+  float min_pole_hz;
   // Longest lag computed in the pitchogram in seconds.
   float max_lag_s;
   // Number of trigger windows to consider when computing a single SAI frame.
   int num_triggers_per_frame;
+  // Sample rate in Hz at which CARFAC and the SAI run, or 0 to run them at
+  // the input sample rate.  The input is resampled to this rate, which should
+  // leave room above highest_pole_hz for the resampling filter, e.g. 22050
+  // or 16000.  The cost of CARFAC and the SAI scales with this rate.  It is
+  // adjusted slightly if needed, so that each segment resamples to a whole
+  // number of samples.
+  float internal_sample_rate_hz;
+  // Runs CARFAC in integer fixed-point arithmetic with FixedPointCARFAC,
+  // whose NAP differs from the floating point one by rounding noise.
+  bool fixed_point_carfac;
+  // Number of threads computing the SAI rows of each frame, including the
+  // calling thread.  More than 1 starts a WorkerPool owned by the pipeline,
+  // which pays off at small num_samples_per_segment, where the SAI is a large
+  // share of the time per frame.  The output does not depend on it.
+  int num_sai_threads;
+  // If positive, the SAI pools its lags linearly into this many columns while
+  // computing them, see SAIBase::SetLagCells, so that sai_output() has
+  // sai_output_width columns instead of one per lag.  This saves time when
+  // the columns are several lags wide, and memory in any case.  If
+  // sai_log_lag_output is true, the SAI instead pools its lags into the
+  // log-lag cells of pitchogram_params.  The pitchogram needs every lag, so
+  // with either only ProcessJustSamples may be used.
+  int sai_output_width;
+  bool sai_log_lag_output;
+  // Additional SAIs computed from the same CARFAC output as the main one, see
+  // PitchogramPipeline::sai_bank_output.  Sharing the NAP costs much less
+  // than running a pipeline per SAI design.
+  std::vector<PitchogramSAIParams> sai_bank;
 
   PitchogramParams pitchogram_params;
 
@@ -46,8 +111,17 @@ struct PitchogramPipelineParams {
     : num_frames(400),
       num_samples_per_segment(256),
       highest_pole_hz(7000.0f),
+      min_pole_hz(30.0f),
       max_lag_s(0.05f),
-      num_triggers_per_frame(2) {}
+      num_triggers_per_frame(2),
+      internal_sample_rate_hz(0.0f),
+      fixed_point_carfac(false),
+      num_sai_threads(1),
+      sai_output_width(0),
+      sai_log_lag_output(false) {}
+
+  // True if pipelines with either params have the same design.
+  bool operator==(const PitchogramPipelineParams& other) const;
 };
 
 // Class that runs the full pipeline of CARFAC -> SAI -> Pitchogram computation
@@ -57,55 +131,233 @@ class PitchogramPipeline {
   PitchogramPipeline(float sample_rate_hz,
                      const PitchogramPipelineParams& params);
 
+  // Resets the state and clears the image, as if no samples had been
+  // processed, keeping the design and the active bands.
+  void Reset();
+
+  // The params the pipeline was constructed with.
+  const PitchogramPipelineParams& params() const { return params_; }
+
   // Process audio samples in a streaming manner. `num_samples` should match
   // `num_samples_per_segment()`.
   void ProcessSamples(const float* samples, int num_samples);
+  // Like ProcessSamples, but only runs CARFAC and the SAI, without updating
+  // the pitchogram.  After the first call, this makes no heap allocations, so
+  // it is safe to call from a real-time audio thread.
   void ProcessJustSamples(const float* samples, int num_samples);
 
+  // Computes only the SAI rows of the channels whose pole frequency is in
+  // one of the bands, given as pairs of lowest and highest frequencies in Hz,
+  // and of margin_channels neighboring channels on each side of them, which
+  // respond to the edges of the band.  The other rows stay zero.  CARFAC
+  // still runs all channels, as each channel is an input of the next.  An
+  // empty list of bands computes all rows.  Applies to the main SAI and the
+  // bank, and resets them.
+  void SetActiveBands(const std::vector<std::pair<float, float>>& bands_hz,
+                      int margin_channels = 2);
+
+  // Number of SAI rows that are computed.
+  int num_active_channels() const { return sai_->num_active_channels(); }
+
+  // Saves the state of the resampler, CARFAC, the SAIs and the pitchogram
+  // smoothing into a binary blob, reusing its capacity.  The scrolling image
+  // is not part of the state.  Restoring the blob into a pipeline with the
+  // same params resumes processing exactly where the saved pipeline was, e.g.
+  // to seek in a recording or to continue a long file after a restart.
+  // RestoreState returns false, leaving the pipeline unchanged, if the blob
+  // was saved by a pipeline with a different design, i.e. another sample rate
+  // or params other than num_sai_threads, which the blob records as a
+  // fingerprint.  After RestoreState, nap() is the last segment of the saved
+  // pipeline, while sai_output() is stale until the next call to
+  // ProcessSamples.
+  void SaveState(std::vector<uint8_t>* state) const;
+  bool RestoreState(const std::vector<uint8_t>& state);
+
   // Input audio sample rate in Hz.
   float sample_rate_hz() const { return sample_rate_hz_; }
 
+  // Sample rate in Hz at which CARFAC and the SAI run, which is
+  // sample_rate_hz() unless the input is resampled.
+  float model_sample_rate_hz() const { return model_sample_rate_hz_; }
+
   // CARFAC pole frequencies for each channel in Hz.
-  const ArrayX& pole_frequencies() const { return carfac_->pole_frequencies(); }
+  const ArrayX& pole_frequencies() const {
+    return carfac_ != nullptr ? carfac_->pole_frequencies()
+                              : fixed_point_carfac_->pole_frequencies();
+  }
 
-  // Number of samples per segment for SAI computation.
-  int num_samples_per_segment() const {
+  // Number of input samples per segment.
+  int num_samples_per_segment() const { return num_samples_per_segment_; }
+
+  // Number of samples per segment at the model sample rate, which is the
+  // width of the CARFAC output of each segment.
+  int model_samples_per_segment() const {
     return sai_params_.input_segment_width;
   }
 
-  // CARFAC output for the current frame.
-  const CARFACOutput& carfac_output() const { return *carfac_output_buffer_; }
+  // CARFAC NAP output for the current frame, num_channels by
+  // model_samples_per_segment().  CARFAC streams the NAP straight into the
+  // SAI input buffer, without storing the segment, and this is a view of the
+  // end of that buffer.
+  Eigen::Ref<const RowMajorArrayXX> nap() const {
+    return sai_->latest_input_segment();
+  }
 
-  // Current SAI frame.
+  // Current SAI frame, num_channels by the number of SAI lags, or of lag
+  // cells if the lags are pooled.
   const ArrayXX& sai_output() const { return sai_output_buffer_; }
 
-  // Current pitchogram plot image.
-  const Image<uint8_t>& image() const { return image_; }
-  int width() const { return image_.width(); }
-  int height() const { return image_.height(); }
+  // Current frame of the bank SAI designed by
+  // params().sai_bank[index].  The bank SAIs compute the same rows as the
+  // main one, see SetActiveBands.
+  int sai_bank_size() const { return sai_bank_.size(); }
+  const ArrayXX& sai_bank_output(int index) const {
+    return sai_bank_output_[index];
+  }
+
+  // Current pitchogram plot image, with the newest frame in the rightmost
+  // column.  The frames are drawn into a ring of columns, so a frame costs a
+  // column rather than scrolling the whole image, and image() puts the ring
+  // in order only when it is called after new frames.
+  const Image<uint8_t>& image() const;
+  // The plot image as two runs of columns, the older frames and then the
+  // newer ones, which side by side are image().  Each column is contiguous
+  // in memory.  The second run is empty when the ring is in order.  The views
+  // are valid until the next frame.
+  std::array<Image<const uint8_t>, 2> image_spans() const;
+  int width() const { return image_ring_.width(); }
+  int height() const { return image_ring_.height(); }
 
   using VowelCoords = Pitchogram::VowelCoords;
   // Current vowel embedding coordinate.
   const VowelCoords& vowel_coords() const {
     return pitchogram_->vowel_coords();
   }
+  // Current pitchogram column, height() long, and smoothed mean NAP of each
+  // channel.  Together with vowel_coords() they are a compact summary of the
+  // frame.  Like the image, they are updated only by ProcessSamples.
+  const ArrayX& pitchogram_output() const { return pitchogram_->output(); }
+  const ArrayX& channel_energy() const { return pitchogram_->cgram(); }
 
  public:
   enum { kNumEars = 1 };  // This class processes only monoaural input.
 
+  // Resamples the segment if needed, and runs CARFAC and the SAIs on it.
+  void RunCARFACAndSAI(const float* samples, int num_samples);
+  std::size_t carfac_state_size_bytes() const;
+  // Size of the states of the main SAI and the bank.
+  std::size_t sai_state_size_bytes() const;
+  std::size_t resampler_state_size_bytes() const;
+  // Sets the channel mask of the main SAI and the bank.
+  void SetSAIChannelMask(const std::vector<bool>& channel_mask);
+  // Fills the image with the background color of the theme.
+  void ClearImage();
+  // Copies the ring of columns to image_ in order.
+  void LinearizeImage() const;
+
+  PitchogramPipelineParams params_;
   float sample_rate_hz_;
+  float model_sample_rate_hz_;
+  int num_samples_per_segment_;
+  // Null unless the input is resampled to model_sample_rate_hz_.
+  std::unique_ptr<Resampler> resampler_;
+  ArrayX resampled_segment_;
   CARParams car_params_;
   IHCParams ihc_params_;
   AGCParams agc_params_;
   SAIParams sai_params_;
   PitchogramParams pitchogram_params_;
+  // Exactly one of carfac_ and fixed_point_carfac_ is set.
   std::unique_ptr<CARFAC> carfac_;
+  std::unique_ptr<FixedPointCARFAC> fixed_point_carfac_;
+  // Sends the NAP to sai_ instead of storing it.
   std::unique_ptr<CARFACOutput> carfac_output_buffer_;
+  // Holds carfac_output_buffer_, for FixedPointCARFAC::RunSegment.
+  std::vector<CARFACOutput*> fixed_point_outputs_;
   std::unique_ptr<SAI> sai_;
+  // The SAIs of params_.sai_bank and their outputs.
+  std::vector<std::unique_ptr<SAI>> sai_bank_;
+  std::vector<ArrayXX> sai_bank_output_;
+  // Sends the NAP to sai_ and the bank, if there is a bank.
+  std::unique_ptr<NAPSinkGroup> nap_sinks_;
+  // Null unless params_.num_sai_threads > 1.
+  std::unique_ptr<WorkerPool> sai_worker_pool_;
   ArrayXX sai_output_buffer_;
   std::unique_ptr<Pitchogram> pitchogram_;
-  Image<uint8_t> image_;
-  Image<uint8_t> image_rightmost_col_;
+  // Hash of the sample rate and the params, see RestoreState.
+  uint64_t design_fingerprint_;
+  // Owns the ring of image columns, transposed so that columns are rows.
+  Image<uint8_t> image_ring_storage_;
+  // View of image_ring_storage_ as the num_frames wide ring of columns, the
+  // next of which to draw is image_next_col_.
+  Image<uint8_t> image_ring_;
+  int image_next_col_;
+  // image() of the ring, updated on demand.
+  mutable Image<uint8_t> image_;
+  mutable bool image_is_linear_;
+};
+
+// Snapshots of the state of a PitchogramPipeline taken every few seconds
+// during a pass over a recording, so that seeking to any frame only needs to
+// process the frames since the preceding snapshot, instead of all frames from
+// the start.
+class PitchogramKeyframeIndex {
+ public:
+  // Takes the first keyframe from the current state of pipeline, which
+  // should not have processed any samples yet.  Later keyframes are taken
+  // every interval_s seconds, rounded to whole segments.
+  PitchogramKeyframeIndex(const PitchogramPipeline& pipeline, float interval_s);
+
+  // Number of frames between keyframes.
+  int keyframe_interval() const { return keyframe_interval_; }
+  int num_keyframes() const { return keyframes_.size(); }
+
+  // Called after each frame of the pass, with the number of frames pipeline
+  // has processed so far.  Stores a keyframe if num_frames is the next
+  // multiple of keyframe_interval().  Frames already covered by keyframes,
+  // e.g. when processing them again after a seek, are ignored.
+  void Update(int num_frames, const PitchogramPipeline& pipeline);
+
+  // Restores the latest keyframe at or before num_frames into pipeline, and
+  // returns the number of frames it had processed when the keyframe was
+  // taken.  The caller then processes the frames from there up to num_frames
+  // to reach the state after num_frames frames.
+  int Seek(int num_frames, PitchogramPipeline* pipeline) const;
+
+ private:
+  int keyframe_interval_;
+  // keyframes_[k] is the state after k * keyframe_interval_ frames.
+  std::vector<std::vector<uint8_t>> keyframes_;
+};
+
+// Pipelines kept for reuse, so that a caller processing many short
+// recordings, e.g. to train on a dataset, does not construct a pipeline for
+// every recording.  Pipelines are matched by sample rate and params.  Safe to
+// use from several threads.
+class PitchogramPipelinePool {
+ public:
+  // At most max_idle_pipelines released pipelines are kept, dropping the
+  // least recently released ones.
+  explicit PitchogramPipelinePool(int max_idle_pipelines = 8);
+
+  // Returns a pipeline with the given design, in the state of a new one with
+  // all bands active.  Reuses a released pipeline if one matches, otherwise
+  // constructs one.
+  std::unique_ptr<PitchogramPipeline> Acquire(
+      float sample_rate_hz, const PitchogramPipelineParams& params);
+
+  // Keeps pipeline for a later Acquire.
+  void Release(std::unique_ptr<PitchogramPipeline> pipeline);
+
+  int num_idle_pipelines() const;
+
+ private:
+  const std::size_t max_idle_pipelines_;
+  mutable std::mutex mutex_;
+  // In order of release.
+  std::vector<std::unique_ptr<PitchogramPipeline>> idle_pipelines_;
+
+  DISALLOW_COPY_AND_ASSIGN(PitchogramPipelinePool);
 };
 
 #endif  // THIRD_PARTY_CARFAC_CPP_PITCHOGRAM_PIPELINE_H_
@@ -0,0 +1,105 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// This file is part of an implementation of Lyon's cochlear model:
+// "Cascade of Asymmetric Resonators with Fast-Acting Compression"
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CARFAC_RESAMPLER_H
+#define CARFAC_RESAMPLER_H
+
+#include <cstddef>
+#include <vector>
+
+#include "common.h"
+
+// Design parameters for a Resampler.
+struct ResamplerParams {
+  ResamplerParams() {
+    num_zero_crossings = 16;
+    cutoff = 0.9;
+    kaiser_beta = 8.6;
+  }
+
+  // Number of zero crossings of the windowed sinc on each side of its
+  // center.  The filter spans 2 * num_zero_crossings samples at the lower of
+  // the two rates.
+  int num_zero_crossings;
+  // Cutoff of the anti-aliasing lowpass filter, as a fraction of the lower of
+  // the two Nyquist frequencies.
+  FPType cutoff;
+  // Shape of the Kaiser window.  8.6 gives about 85 dB of stopband
+  // attenuation.
+  FPType kaiser_beta;
+};
+
+// Streaming resampler by a rational factor, which interpolates by
+// interpolation and then decimates by decimation with a polyphase
+// windowed-sinc lowpass filter, without computing the discarded samples.
+//
+// Every call to Process continues the signal of the previous calls.  After
+// construction, Process makes no heap allocations.
+class Resampler {
+ public:
+  // The factors are reduced by their greatest common divisor.  Each call to
+  // Process accepts at most max_input_samples samples.
+  Resampler(int interpolation, int decimation, int max_input_samples,
+            const ResamplerParams& params = ResamplerParams());
+
+  // Resets the signal history, as if no samples had been processed.
+  void Reset();
+
+  // Resamples num_samples input samples and stores the output to output,
+  // which must have room for MaxOutputSamples(num_samples) samples.  Returns
+  // the number of output samples, which is exactly
+  // num_samples * interpolation() / decimation() on every call if that is a
+  // whole number.
+  int Process(const FPType* input, int num_samples, FPType* output);
+
+  // Returns an upper bound of the number of output samples of Process.
+  int MaxOutputSamples(int num_samples) const;
+
+  int interpolation() const { return interpolation_; }
+  int decimation() const { return decimation_; }
+  int num_taps_per_phase() const { return num_taps_; }
+
+  // The delay of the output behind the input, in input samples.
+  FPType delay() const;
+
+  // The complete state, which is the signal history and the output phase,
+  // is state_size_bytes() bytes long.  It can be restored into a resampler
+  // with the same design.
+  std::size_t state_size_bytes() const;
+  void SaveState(void* state_data) const;
+  void RestoreState(const void* state_data);
+
+ private:
+  int interpolation_;
+  int decimation_;
+  int max_input_samples_;
+  int num_taps_;
+  // The filter phases, each num_taps_ long and time reversed, so that each
+  // output sample is a dot product with consecutive input samples.
+  std::vector<FPType> phases_;
+  // The last num_taps_ - 1 input samples of the previous call, followed by
+  // the input of the current call.
+  std::vector<FPType> buffer_;
+  // The input index, relative to the start of the next call, and the filter
+  // phase of the next output sample.
+  int next_input_ = 0;
+  int next_phase_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(Resampler);
+};
+
+#endif  // CARFAC_RESAMPLER_H
@@ -19,7 +19,13 @@
 #ifndef CARFAC_SAI_H_
 #define CARFAC_SAI_H_
 
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
 #include "common.h"
+#include "nap_sink.h"
+#include "worker_pool.h"
 
 // Design parameters for an SAI object.
 //
@@ -64,15 +70,100 @@ struct SAIParams {
   // Since each call to RunSegment generates exactly one output SAI frame,
   // this parameter implicitly controls the output frame rate and the hop
   // size (i.e. number of new input samples consumed) between adjacent SAI
-  // frames.  See ShiftAndAppendInput() below for details.
+  // frames.  See InputHistory below for details.
   int input_segment_width;
 
   FPType channel_smoothing_scale;
 };
 
+// A cell of lags of an SAI frame, over which the frame is averaged to pool
+// its lags, e.g. into fewer or log-spaced columns.  Conceptually, a row of
+// the frame is considered as a piecewise constant function "f(x) =
+// samples[round(x)]."  A LagCell represents averaging f(x) over the interval
+// [left_edge, right_edge] by a computation of the form
+//
+//   CellAverage(samples) =
+//       left_weight * samples[left_index]
+//     + interior_weight * (samples[left_index + 1]
+//                          + ... + samples[right_index - 1])
+//     + right_weight * samples[right_index].
+struct LagCell {
+  int left_index;
+  int right_index;
+  float left_weight;
+  float interior_weight;
+  float right_weight;
+
+  LagCell() = default;
+  LagCell(const LagCell&) = default;
+  LagCell(float left_edge, float right_edge);
+
+  float CellAverage(const ArrayX& samples) const;
+  // The same average of a row in memory, summing the interior in a fixed
+  // order of several partial sums, which pipelines better than a single
+  // running sum.
+  float CellAverage(const FPType* samples) const;
+};
+
+// Returns num_cells cells of equal width covering the lags of an SAI frame
+// sai_width lags wide, which decimate the lags linearly.
+std::vector<LagCell> LinearLagCells(int sai_width, int num_cells);
+
+// Returns the cells warping the lags of an SAI frame sai_width lags wide,
+// computed at sample_rate, to a log axis with lags_per_octave cells per
+// octave, from min_lag_s up to the longest lag that fits the frame.
+// log_offset_s is added to the lag before taking the log.  The lag of column
+// j is taken to be j samples, as when future_lags = sai_width - 1.
+std::vector<LagCell> LogLagCells(FPType sample_rate, int sai_width,
+                                 float lags_per_octave, float min_lag_s,
+                                 float log_offset_s);
+
 // Internal implementation of some common SAI functionality.
 namespace sai_internal {
 
+// History of the latest samples of a multichannel input, the input buffer of
+// an SAI.  It is a mirrored ring buffer: each sample is stored twice, width()
+// columns apart, so the latest width() samples of each channel are always
+// contiguous in memory, while appending a segment only writes its own columns
+// instead of shifting the whole history.  The channels are rows of a
+// RowMajorArrayXX, so that the SAI scans each of them with unit stride.
+class InputHistory {
+ public:
+  InputHistory() : width_(0), head_(0) {}
+
+  // Sets the size of the history, filled with zeros.
+  void Reset(int num_channels, int width);
+
+  int num_channels() const { return buffer_.rows(); }
+  int width() const { return width_; }
+
+  // Appends a segment of any number of samples, of which at most the latest
+  // width() are kept.
+  void Append(const Eigen::Ref<const ArrayXX>& segment);
+  // Appends a single sample.
+  void AppendSample(
+      const Eigen::Ref<const ArrayX, 0, Eigen::InnerStride<>>& sample);
+
+  // The latest width() samples, oldest first, num_channels() by width().
+  Eigen::Ref<const RowMajorArrayXX> samples() const {
+    return buffer_.middleCols(head_, width_);
+  }
+
+  // Copies samples() to and from num_channels() * width() values in column
+  // major order, the state of the history.  The order is independent of the
+  // layout of the buffer, so that saved states stay valid.
+  void Save(FPType* data) const;
+  void Restore(const FPType* data);
+
+ private:
+  // Size num_channels by 2 * width_.  Columns head_ + t and head_ + t +
+  // width_, modulo 2 * width_, both hold sample t of samples().
+  RowMajorArrayXX buffer_;
+  int width_;
+  // Column of the oldest sample, in [0, width_).
+  int head_;
+};
+
 // Base class from which the monaural and binaural Stabilized Auditory
 // Image implementations inherit.
 class SAIBase {
@@ -89,13 +180,51 @@ class SAIBase {
   // Resets the internal state.
   virtual void Reset() {}
 
+  // Restricts the computation to the channels whose entry in channel_mask,
+  // which has params().num_channels entries, is true.  The output rows of the
+  // other channels are not computed and stay zero.  An empty mask selects all
+  // channels, which is the default after Redesign.  Calls Reset().
+  void SetChannelMask(const std::vector<bool>& channel_mask);
+
+  // Number of channels selected by the channel mask.
+  int num_active_channels() const { return active_channels_.size(); }
+
+  // Splits the active channels into contiguous blocks, one per thread of
+  // worker_pool, which then computes the rows of each frame in parallel.
+  // Each row is computed the same way in any block, so the output does not
+  // depend on the number of threads.  The pool is not owned, and may be
+  // shared with other objects that do not use it at the same time, but not
+  // with a ParallelFor that calls this SAI from one of its tasks.  Null, the
+  // default, computes all rows on the calling thread.
+  void set_worker_pool(WorkerPool* worker_pool) { worker_pool_ = worker_pool; }
+  WorkerPool* worker_pool() const { return worker_pool_; }
+
+  // Pools the lags of each output row into lag_cells while blending, so
+  // that the output frames have one column per cell, params().num_channels
+  // by output_width(), e.g. LinearLagCells to decimate the lags or
+  // LogLagCells for a log-lag axis.  Blending is linear, so a pooled frame
+  // matches the full frame averaged over the cells, up to rounding, but the
+  // full frame is never stored or copied.  The cells index the columns of
+  // the full params().sai_width frame.  An empty list, the default after
+  // Redesign, outputs every lag.  Calls Reset().
+  void SetLagCells(const std::vector<LagCell>& lag_cells);
+  const std::vector<LagCell>& lag_cells() const { return lag_cells_; }
+
+  // Number of columns of the output frames.
+  int output_width() const {
+    return lag_cells_.empty() ? params_.sai_width : lag_cells_.size();
+  }
+
  protected:
   // Chooses trigger points and blends windowed signals into
   // output_buffer.  triggering_input_buffer and
-  // nontriggering_input_buffer must be the same shape.
-  void StabilizeSegment(const ArrayXX& triggering_input_buffer,
-                        const ArrayXX& nontriggering_input_buffer,
-                        ArrayXX* output_buffer) const;
+  // nontriggering_input_buffer must be the same shape.  All buffers are
+  // row major, so that the trigger search and the blend run along
+  // contiguous rows.
+  void StabilizeSegment(
+      const Eigen::Ref<const RowMajorArrayXX>& triggering_input_buffer,
+      const Eigen::Ref<const RowMajorArrayXX>& nontriggering_input_buffer,
+      RowMajorArrayXX* output_buffer) const;
 
   int buffer_width() const {
     // The buffer must be large enough to store num_triggers_per_frame
@@ -115,24 +244,6 @@ class SAIBase {
                params().trigger_window_width);
   }
 
-  // Shifts and appends new data to an input buffer.
-  void ShiftAndAppendInput(const ArrayXX& fresh_input_segment,
-                           ArrayXX* input_buffer) const {
-    CARFAC_ASSERT(fresh_input_segment.rows() == params().num_channels &&
-                  "Unexpected number of input channels.");
-
-    const int input_width = fresh_input_segment.cols();
-    const int overlap_width = buffer_width() - input_width;
-    if (overlap_width > 0) {
-      input_buffer->leftCols(overlap_width) =
-          input_buffer->rightCols(overlap_width);
-      input_buffer->rightCols(input_width) = fresh_input_segment;
-    } else {
-      // No overlap with old buffer contents; ignore extra input.
-      *input_buffer = fresh_input_segment.rightCols(buffer_width());
-    }
-  }
-
   const SAIParams& params() const { return params_; }
 
  private:
@@ -140,6 +251,11 @@ class SAIBase {
   // Window function to apply before selecting a trigger point.
   // Size: params_.window_width.
   ArrayX window_;
+  // Indices of the channels selected by SetChannelMask, in increasing order.
+  std::vector<int> active_channels_;
+  // Cells set by SetLagCells, or empty.
+  std::vector<LagCell> lag_cells_;
+  WorkerPool* worker_pool_ = nullptr;
 
   DISALLOW_COPY_AND_ASSIGN(SAIBase);
 };
@@ -152,16 +268,27 @@ class SAIBase {
 // to the running autocorrelation of a multi-channel input signal,
 // typically a segment of the neural activity pattern (NAP) outputs of the
 // CARFAC filterbank.
-class SAI : public sai_internal::SAIBase {
+//
+// As a NAPSink, an SAI can also take its input straight from CARFAC, see
+// CARFACOutput::set_nap_sink, as if each CARFAC segment were passed to
+// RunInput.
+class SAI : public sai_internal::SAIBase, public NAPSink {
  public:
   explicit SAI(const SAIParams& params);
 
   // Resets the internal state.
   void Reset() override;
 
-  // Fills output_frame with a params().num_channels by params().sai_width
+  // The state of the SAI is its input and output buffers, state_size_bytes()
+  // bytes long.  It can be saved by SaveState and restored into an SAI with
+  // the same params and lag cells by RestoreState.
+  std::size_t state_size_bytes() const;
+  void SaveState(void* state_data) const;
+  void RestoreState(const void* state_data);
+
+  // Fills output_frame with a params().num_channels by output_width()
   // SAI frame computed from the given input segment and the contents of
-  // input_buffer_.
+  // the input history.
   //
   // The input_segment must have size of params_.num_channels by
   // params_.input_segment_width.  Dies if the size is incorrect.  Callers
@@ -174,12 +301,26 @@ class SAI : public sai_internal::SAIBase {
   void RunInput(const ArrayXX& input_segment);
   void GetOutput(ArrayXX* output_frame);
 
+  // NAPSink interface, which appends a segment to the input history one
+  // sample at a time.  Call GetOutput once the segment is complete.
+  void BeginSegment(int num_samples) override;
+  void AppendSample(
+      int sample_index,
+      const Eigen::Ref<const ArrayX, 0, Eigen::InnerStride<>>& nap) override;
+
+  // The last params().input_segment_width samples of input, which is the
+  // latest segment when the segments have that width.
+  Eigen::Ref<const RowMajorArrayXX> latest_input_segment() const {
+    return input_history_.samples().rightCols(
+        std::min(params().input_segment_width, buffer_width()));
+  }
+
  private:
-  // Buffer to store a large enough window of input frames to compute
-  // a full SAI frame.  Size: params().num_channels by buffer_width().
-  ArrayXX input_buffer_;
-  // Output frame buffer.  Size: params().num_channels by params().sai_width.
-  ArrayXX output_buffer_;
+  // A large enough window of input samples to compute a full SAI frame.
+  // Size: params().num_channels by buffer_width().
+  sai_internal::InputHistory input_history_;
+  // Output frame buffer.  Size: params().num_channels by output_width().
+  RowMajorArrayXX output_buffer_;
 
   DISALLOW_COPY_AND_ASSIGN(SAI);
 };
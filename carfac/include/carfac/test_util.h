@@ -22,11 +22,13 @@
 #define CARFAC_TEST_UTIL_H
 
 #include <fstream>
+#include <limits>
 #include <string>
 
 #include "gtest/gtest.h"
 
 #include "common.h"
+#include "nap_sink.h"
 #include "sai.h"
 #include <Eigen/Core>
 
@@ -87,6 +89,31 @@ template <> constexpr double GetTestPrecision<double>() { return 1e-7; }
 template <> constexpr double GetTestPrecision<float>() { return 7e-3; }
 static constexpr double kTestPrecision = GetTestPrecision<FPType>();
 
+// NAPSink that stores the latest segment, for comparison with the NAP stored
+// by CARFACOutput.  Samples that are never appended are left NaN.
+class SegmentNAPSink : public NAPSink {
+ public:
+  explicit SegmentNAPSink(int num_channels) : num_channels_(num_channels) {}
+
+  void BeginSegment(int num_samples) override {
+    segment_.setConstant(num_channels_, num_samples,
+                         std::numeric_limits<FPType>::quiet_NaN());
+  }
+
+  void AppendSample(
+      int sample_index,
+      const Eigen::Ref<const ArrayX, 0, Eigen::InnerStride<>>& nap) override {
+    ASSERT_EQ(num_channels_, nap.size());
+    segment_.col(sample_index) = nap;
+  }
+
+  const ArrayXX& segment() const { return segment_; }
+
+ private:
+  int num_channels_;
+  ArrayXX segment_;
+};
+
 // Base class for SAI unit tests that provides helper functions for
 // constructing test signals and analyzing results.
 class SAITestBase : public ::testing::Test {
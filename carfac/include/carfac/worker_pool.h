@@ -0,0 +1,134 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// This file is part of an implementation of Lyon's cochlear model:
+// "Cascade of Asymmetric Resonators with Fast-Acting Compression"
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// This header declares the threading primitives used to run parts of the
+// model in parallel.
+
+#ifndef CARFAC_WORKER_POOL_H
+#define CARFAC_WORKER_POOL_H
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+
+// Waits until done() returns true, spinning at first, since the waits in the
+// model are usually shorter than it takes to put a thread to sleep, and then
+// yielding, in case there are more threads than cores.
+template <typename Done>
+void SpinWait(Done done) {
+  constexpr int kNumSpins = 4096;
+  for (int spin = 0; !done(); ++spin) {
+    if (spin >= kNumSpins) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+// A reusable barrier for a fixed number of threads.  The waits are expected
+// to be short, e.g. between blocks of samples, so it spins rather than
+// sleeping.
+class SpinBarrier {
+ public:
+  explicit SpinBarrier(int num_threads)
+      : num_threads_(num_threads), num_waiting_(num_threads), generation_(0) {
+    CARFAC_ASSERT(num_threads > 0);
+  }
+
+  // Blocks until all threads have arrived.  The last thread to arrive calls
+  // completion() before releasing the others, so its effects are visible to
+  // all threads when they return.
+  template <typename Completion>
+  void ArriveAndWait(Completion completion) {
+    const uint32_t generation = generation_.load(std::memory_order_acquire);
+    if (num_waiting_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      completion();
+      num_waiting_.store(num_threads_, std::memory_order_relaxed);
+      generation_.store(generation + 1, std::memory_order_release);
+    } else {
+      SpinWait([this, generation] {
+        return generation_.load(std::memory_order_acquire) != generation;
+      });
+    }
+  }
+  void ArriveAndWait() {
+    ArriveAndWait([] {});
+  }
+
+  int num_threads() const { return num_threads_; }
+
+ private:
+  const int num_threads_;
+  std::atomic<int> num_waiting_;
+  std::atomic<uint32_t> generation_;
+
+  DISALLOW_COPY_AND_ASSIGN(SpinBarrier);
+};
+
+// A fixed set of threads that run the tasks of ParallelFor together with the
+// calling thread.  Idle workers sleep until the next call.
+class WorkerPool {
+ public:
+  // Starts num_threads - 1 worker threads.  The caller of ParallelFor is the
+  // remaining thread.
+  explicit WorkerPool(int num_threads);
+  ~WorkerPool();
+
+  int num_threads() const { return num_threads_; }
+
+  // Calls task(i) for each i in [0, num_tasks), and returns once all calls
+  // have finished.  Task i always runs on thread i % num_threads(), where
+  // thread 0 is the caller, so the assignment of tasks to threads is
+  // deterministic, and up to num_threads() tasks run concurrently and may
+  // synchronize with each other, e.g. through a SpinBarrier.
+  //
+  // Does not allocate, so that it can be used on a real-time audio thread.
+  template <typename Task>
+  void ParallelFor(int num_tasks, const Task& task) {
+    Run(num_tasks,
+        [](const void* task, int task_index) {
+          (*static_cast<const Task*>(task))(task_index);
+        },
+        &task);
+  }
+
+ private:
+  typedef void (*TaskFunction)(const void* task, int task_index);
+
+  void Run(int num_tasks, TaskFunction function, const void* task);
+  void WorkerLoop(int thread_index);
+
+  const int num_threads_;
+  std::vector<std::thread> workers_;
+
+  // The current call to ParallelFor.  These are written by the caller before
+  // generation_ is incremented to wake the workers.
+  int num_tasks_ = 0;
+  TaskFunction function_ = nullptr;
+  const void* task_ = nullptr;
+  bool stopping_ = false;
+
+  std::atomic<uint32_t> generation_;
+  // The number of workers still running tasks of the current call.
+  std::atomic<int> num_busy_workers_;
+
+  DISALLOW_COPY_AND_ASSIGN(WorkerPool);
+};
+
+#endif  // CARFAC_WORKER_POOL_H
@@ -26,12 +26,12 @@ BinauralSAI::BinauralSAI(const SAIParams& params) : SAIBase(params) {
 }
 
 void BinauralSAI::Reset() {
-  input_buffer_.resize(2);
+  input_history_.resize(2);
   output_buffer_.resize(2);
 
   for (int i = 0; i < 2; ++i) {
-    input_buffer_[i].setZero(params().num_channels, buffer_width());
-    output_buffer_[i].setZero(params().num_channels, params().sai_width);
+    input_history_[i].Reset(params().num_channels, buffer_width());
+    output_buffer_[i].setZero(params().num_channels, output_width());
   }
 }
 
@@ -39,10 +39,17 @@ void BinauralSAI::RunSegment(const std::vector<ArrayXX>& input_segment,
                              std::vector<ArrayXX>* output_frame) {
   CARFAC_ASSERT(input_segment.size() == 2);
   for (int i = 0; i < 2; ++i) {
-    ShiftAndAppendInput(input_segment[i], &input_buffer_[i]);
+    CARFAC_ASSERT(input_segment[i].rows() == params().num_channels &&
+                  "Unexpected number of input channels.");
+    input_history_[i].Append(input_segment[i]);
   }
 
-  StabilizeSegment(input_buffer_[0], input_buffer_[1], &output_buffer_[0]);
-  StabilizeSegment(input_buffer_[1], input_buffer_[0], &output_buffer_[1]);
-  *output_frame = output_buffer_;
+  StabilizeSegment(input_history_[0].samples(), input_history_[1].samples(),
+                   &output_buffer_[0]);
+  StabilizeSegment(input_history_[1].samples(), input_history_[0].samples(),
+                   &output_buffer_[1]);
+  output_frame->resize(2);
+  for (int i = 0; i < 2; ++i) {
+    (*output_frame)[i] = output_buffer_[i];
+  }
 }
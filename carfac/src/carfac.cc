@@ -18,22 +18,24 @@
 
 #include "carfac.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 
 #include "carfac_util.h"
 #include "ear.h"
 
+namespace {
+// The longest block processed at once by the block kernels, which keeps the
+// per-block buffers in cache.
+constexpr int kMaxBlockSize = 128;
+}  // namespace
+
 CARFAC::CARFAC(int num_ears, FPType sample_rate, const CARParams& car_params,
                const IHCParams& ihc_params, const AGCParams& agc_params) {
   Redesign(num_ears, sample_rate, car_params, ihc_params, agc_params);
 }
 
-CARFAC::~CARFAC() {
-  for (Ear* ear : ears_) {
-    delete ear;
-  }
-}
-
 void CARFAC::Redesign(int num_ears, FPType sample_rate,
                       const CARParams& car_params, const IHCParams& ihc_params,
                       const AGCParams& agc_params) {
@@ -54,27 +56,79 @@ void CARFAC::Redesign(int num_ears, FPType sample_rate,
   DesignIHCCoeffs(ihc_params_, sample_rate_, &ihc_coeffs);
   DesignAGCCoeffs(agc_params_, sample_rate_, &agc_coeffs);
   // Once we have the coefficient structure we can design the ears.
+  while (static_cast<int>(ears_.size()) > num_ears_) {
+    ears_.pop_back();
+  }
   ears_.reserve(num_ears_);
   for (int i = 0; i < num_ears_; ++i) {
-    if (ears_.size() > i && ears_[i] != NULL) {
+    if (ears_.size() > i) {
       // Reinitialize any existing ears.
-      ears_[i]->Redesign(num_channels_, car_coeffs, ihc_coeffs, agc_coeffs);
+      ears_[i].Redesign(num_channels_, car_coeffs, ihc_coeffs, agc_coeffs);
     } else {
-      ears_.push_back(
-          new Ear(num_channels_, car_coeffs, ihc_coeffs, agc_coeffs));
+      ears_.emplace_back(num_channels_, car_coeffs, ihc_coeffs, agc_coeffs);
     }
+    ears_[i].set_nonlinearity_precision(nonlinearity_precision_);
   }
   accumulator_.setZero(num_channels_);
+  UpdateWorkerPool();
 }
 
 void CARFAC::Reset() {
-  for (Ear* ear : ears_) {
-    ear->Reset();
+  for (Ear& ear : ears_) {
+    ear.Reset();
+  }
+}
+
+std::size_t CARFAC::state_size_bytes() const {
+  std::size_t size_bytes = 0;
+  for (const Ear& ear : ears_) {
+    size_bytes += ear.state_size_bytes();
+  }
+  return size_bytes;
+}
+
+void CARFAC::SaveState(void* state_data) const {
+  char* data = static_cast<char*>(state_data);
+  for (const Ear& ear : ears_) {
+    std::memcpy(data, ear.state_data(), ear.state_size_bytes());
+    data += ear.state_size_bytes();
+  }
+}
+
+void CARFAC::RestoreState(const void* state_data) {
+  const char* data = static_cast<const char*>(state_data);
+  for (Ear& ear : ears_) {
+    ear.RestoreState(data);
+    data += ear.state_size_bytes();
+  }
+}
+
+void CARFAC::set_nonlinearity_precision(NonlinearityPrecision precision) {
+  nonlinearity_precision_ = precision;
+  for (Ear& ear : ears_) {
+    ear.set_nonlinearity_precision(precision);
+  }
+}
+
+void CARFAC::set_parallel_ears(bool parallel_ears) {
+  parallel_ears_ = parallel_ears;
+  UpdateWorkerPool();
+}
+
+void CARFAC::UpdateWorkerPool() {
+  if (parallel_ears_ && num_ears_ > 1) {
+    if (worker_pool_ == nullptr || worker_pool_->num_threads() != num_ears_) {
+      worker_pool_.reset(new WorkerPool(num_ears_));
+      agc_barrier_.reset(new SpinBarrier(num_ears_));
+    }
+  } else {
+    worker_pool_.reset();
+    agc_barrier_.reset();
   }
 }
 
-void CARFAC::RunSegment(const ArrayXX& sound_data, bool open_loop,
-                        CARFACOutput* output) {
+void CARFAC::RunSegment(const Eigen::Ref<const ArrayXX>& sound_data,
+                        bool open_loop, CARFACOutput* output) {
   CARFAC_ASSERT(sound_data.rows() == num_ears_);
   output->Resize(num_ears_, num_channels_, sound_data.cols());
 
@@ -83,25 +137,25 @@ void CARFAC::RunSegment(const ArrayXX& sound_data, bool open_loop,
     // freeze the damping, since it may have been running closed-loop last time.
     CloseAGCLoop(open_loop);
   }
-  // A nested loop structure is used to iterate through the individual samples
-  // for each ear (audio channel).
-  bool agc_memory_updated = false;
-  for (int32_t timepoint = 0; timepoint < sound_data.cols(); ++timepoint) {
-    for (int audio_channel = 0; audio_channel < num_ears_; ++audio_channel) {
-      FPType input_sample = sound_data(audio_channel, timepoint);
-
-      Ear* ear = ears_[audio_channel];
-      // Apply the three stages of the model in sequence to the current sample.
-      ear->CARStep(input_sample);
-      ear->IHCStep(ear->car_out());
-      // The AGC work can be skipped if running open loop, since it will not
-      // affect the output.  I had kept it running, in the Matlab version, as
-      // a way to get at what the AGC filter is doing, for visualization.
-      if (!open_loop) {
-        agc_memory_updated = ear->AGCStep(ear->ihc_out());
-      }
+  if (worker_pool_ != nullptr) {
+    worker_pool_->ParallelFor(num_ears_, [&](int ear_index) {
+      RunEarSegment(ear_index, sound_data, open_loop, output);
+    });
+    return;
+  }
+  // The ears are independent between AGC updates, so each ear runs a whole
+  // block before the next.
+  const int num_samples = sound_data.cols();
+  int timepoint = 0;
+  while (timepoint < num_samples) {
+    const int block_size =
+        NextBlockSize(ears_[0], num_samples - timepoint, open_loop);
+    bool agc_memory_updated = false;
+    for (int ear_index = 0; ear_index < num_ears_; ++ear_index) {
+      agc_memory_updated = RunEarBlock(ear_index, sound_data, timepoint,
+                                       block_size, open_loop, output);
     }
-    output->AssignFromEars(ears_, timepoint);
+    timepoint += block_size;
     if (agc_memory_updated) {
       if (num_ears_ > 1) {
         CrossCouple();
@@ -111,21 +165,109 @@ void CARFAC::RunSegment(const ArrayXX& sound_data, bool open_loop,
   }
 }
 
+void CARFAC::RunEarSegment(int ear_index,
+                           const Eigen::Ref<const ArrayXX>& sound_data,
+                           bool open_loop, CARFACOutput* output) {
+  Ear& ear = ears_[ear_index];
+  const int num_samples = sound_data.cols();
+  int timepoint = 0;
+  while (timepoint < num_samples) {
+    // The decimation phases of all ears stay in step, so all ears reach the
+    // same AGC updates.
+    const int block_size = NextBlockSize(ear, num_samples - timepoint,
+                                         open_loop);
+    const bool agc_memory_updated = RunEarBlock(
+        ear_index, sound_data, timepoint, block_size, open_loop, output);
+    timepoint += block_size;
+    if (agc_memory_updated) {
+      // The last ear to finish its block cross-couples all ears, while the
+      // others wait.
+      agc_barrier_->ArriveAndWait([this] { CrossCouple(); });
+      ear.CloseAGCLoop(open_loop);
+    }
+  }
+}
+
+bool CARFAC::RunEarBlock(int ear_index,
+                         const Eigen::Ref<const ArrayXX>& sound_data,
+                         int start, int num_samples, bool open_loop,
+                         CARFACOutput* output) {
+  Ear& ear = ears_[ear_index];
+  bool agc_memory_updated = false;
+  switch (car_kernel_) {
+    case CARKernel::kPerSample:
+      for (int timepoint = start; timepoint < start + num_samples;
+           ++timepoint) {
+        // Apply the three stages of the model in sequence to the current
+        // sample.
+        ear.CARStep(sound_data(ear_index, timepoint));
+        ear.IHCStep(ear.car_out());
+        // The AGC work can be skipped if running open loop, since it will not
+        // affect the output.  I had kept it running, in the Matlab version, as
+        // a way to get at what the AGC filter is doing, for visualization.
+        if (!open_loop) {
+          agc_memory_updated = ear.AGCStep(ear.ihc_out());
+        }
+        output->AssignFromEar(ear_index, ear, timepoint);
+      }
+      break;
+    case CARKernel::kWavefront:
+      ear.CARBlock(sound_data.row(ear_index).segment(start, num_samples)
+                       .transpose());
+      for (int i = 0; i < num_samples; ++i) {
+        ear.IHCStep(ear.car_out_block().col(i));
+        if (!open_loop) {
+          agc_memory_updated = ear.AGCStep(ear.ihc_out());
+        }
+        output->AssignFromEarBlock(ear_index, ear, i, start + i);
+      }
+      break;
+    case CARKernel::kFusedBlock: {
+      auto output_or_null = [ear_index](bool store,
+                                        std::vector<ArrayXX>* outputs) {
+        return store ? &(*outputs)[ear_index] : nullptr;
+      };
+      agc_memory_updated = ear.FusedBlock(
+          sound_data.row(ear_index).segment(start, num_samples).transpose(),
+          !open_loop, start,
+          output_or_null(output->store_nap_ &&
+                             output->nap_sink(ear_index) == nullptr,
+                         &output->nap_),
+          output->nap_sink(ear_index),
+          output_or_null(output->store_bm_, &output->bm_),
+          output_or_null(output->store_ohc_, &output->ohc_),
+          output_or_null(output->store_agc_, &output->agc_));
+      break;
+    }
+  }
+  return agc_memory_updated;
+}
+
+int CARFAC::NextBlockSize(const Ear& ear, int num_remaining,
+                          bool open_loop) const {
+  int block_size = std::min(num_remaining, kMaxBlockSize);
+  if (!open_loop && ear.agc_num_stages() > 0) {
+    block_size = std::min(block_size,
+                          ear.agc_decimation(0) - ear.agc_decim_phase(0));
+  }
+  return block_size;
+}
+
 void CARFAC::CrossCouple() {
-  for (int stage = 0; stage < ears_[0]->agc_num_stages(); ++stage) {
-    if (ears_[0]->agc_decim_phase(stage) > 0) {
+  for (int stage = 0; stage < ears_[0].agc_num_stages(); ++stage) {
+    if (ears_[0].agc_decim_phase(stage) > 0) {
       break;
     } else {
-      FPType mix_coeff = ears_[0]->agc_mix_coeff(stage);
+      FPType mix_coeff = ears_[0].agc_mix_coeff(stage);
       if (mix_coeff > 0) {
         accumulator_.setZero(num_channels_);
-        for (Ear* ear : ears_) {
-          accumulator_ += ear->agc_memory(stage);
+        for (const Ear& ear : ears_) {
+          accumulator_ += ear.agc_memory(stage);
         }
         accumulator_ *= FPType(1.0) / num_ears_;  // Ears' mean AGC state.
         // Mix the mean into all.
-        for (Ear* ear : ears_) {
-          ear->CrossCouple(accumulator_, stage);
+        for (Ear& ear : ears_) {
+          ear.CrossCouple(accumulator_, stage);
         }
       }
     }
@@ -133,10 +275,10 @@ void CARFAC::CrossCouple() {
 }
 
 void CARFAC::CloseAGCLoop(bool open_loop) {
-  for (Ear* ear : ears_) {
+  for (Ear& ear : ears_) {
     // This updates the target damping and stage gain, or just sets the
     // deltas to zero in the open-loop case.
-    ear->CloseAGCLoop(open_loop);
+    ear.CloseAGCLoop(open_loop);
   }
 }
 
@@ -386,9 +528,27 @@ void ResizeContainer(int num_ears, int num_channels, int num_samples,
 }
 }  // namespace
 
+void CARFACOutput::set_nap_sink(int ear_index, NAPSink* nap_sink) {
+  CARFAC_ASSERT(store_nap_ && "The NAP sink requires store_nap.");
+  CARFAC_ASSERT(ear_index >= 0);
+  if (ear_index >= static_cast<int>(nap_sinks_.size())) {
+    nap_sinks_.resize(ear_index + 1, nullptr);
+  }
+  nap_sinks_[ear_index] = nap_sink;
+}
+
 void CARFACOutput::Resize(int num_ears, int num_channels, int num_samples) {
   if (store_nap_) {
-    ResizeContainer(num_ears, num_channels, num_samples, &nap_);
+    nap_.resize(num_ears);
+    for (int ear = 0; ear < num_ears; ++ear) {
+      NAPSink* sink = nap_sink(ear);
+      if (sink != nullptr) {
+        nap_[ear].resize(num_channels, 0);
+        sink->BeginSegment(num_samples);
+      } else {
+        nap_[ear].resize(num_channels, num_samples);
+      }
+    }
   }
   if (store_bm_) {
     ResizeContainer(num_ears, num_channels, num_samples, &bm_);
@@ -401,21 +561,45 @@ void CARFACOutput::Resize(int num_ears, int num_channels, int num_samples) {
   }
 }
 
-void CARFACOutput::AssignFromEars(const std::vector<Ear*>& ears,
-                                  int sample_index) {
-  for (int i = 0; i < ears.size(); ++i) {
-    const Ear* ear = ears[i];
-    if (store_nap_) {
-      nap_[i].col(sample_index) = ear->ihc_out();
-    }
-    if (store_bm_) {
-      bm_[i].col(sample_index) = ear->zy_memory();
-    }
-    if (store_ohc_) {
-      ohc_[i].col(sample_index) = ear->za_memory();
-    }
-    if (store_agc_) {
-      agc_[i].col(sample_index) = ear->zb_memory();
-    }
+void CARFACOutput::AssignNAP(
+    int ear_index, int sample_index,
+    const Eigen::Ref<const ArrayX, 0, Eigen::InnerStride<>>& nap) {
+  NAPSink* sink = nap_sink(ear_index);
+  if (sink != nullptr) {
+    sink->AppendSample(sample_index, nap);
+  } else {
+    nap_[ear_index].col(sample_index) = nap;
+  }
+}
+
+void CARFACOutput::AssignFromEar(int ear_index, const Ear& ear,
+                                 int sample_index) {
+  if (store_nap_) {
+    AssignNAP(ear_index, sample_index, ear.ihc_out());
+  }
+  if (store_bm_) {
+    bm_[ear_index].col(sample_index) = ear.zy_memory();
+  }
+  if (store_ohc_) {
+    ohc_[ear_index].col(sample_index) = ear.za_memory();
+  }
+  if (store_agc_) {
+    agc_[ear_index].col(sample_index) = ear.zb_memory();
+  }
+}
+
+void CARFACOutput::AssignFromEarBlock(int ear_index, const Ear& ear,
+                                      int block_index, int sample_index) {
+  if (store_nap_) {
+    AssignNAP(ear_index, sample_index, ear.ihc_out());
+  }
+  if (store_bm_) {
+    bm_[ear_index].col(sample_index) = ear.car_out_block().col(block_index);
+  }
+  if (store_ohc_) {
+    ohc_[ear_index].col(sample_index) = ear.za_block().col(block_index);
+  }
+  if (store_agc_) {
+    agc_[ear_index].col(sample_index) = ear.zb_block().col(block_index);
   }
 }
@@ -0,0 +1,313 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// This file is part of an implementation of Lyon's cochlear model:
+// "Cascade of Asymmetric Resonators with Fast-Acting Compression"
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "carfac_batch.h"
+
+#include "carfac_util.h"
+
+CARFACBatch::CARFACBatch(int num_streams, FPType sample_rate,
+                         const CARParams& car_params,
+                         const IHCParams& ihc_params,
+                         const AGCParams& agc_params) {
+  Redesign(num_streams, sample_rate, car_params, ihc_params, agc_params);
+}
+
+void CARFACBatch::Redesign(int num_streams, FPType sample_rate,
+                           const CARParams& car_params,
+                           const IHCParams& ihc_params,
+                           const AGCParams& agc_params) {
+  CARFAC_ASSERT(num_streams > 0 && "num_streams must be positive.");
+  num_streams_ = num_streams;
+  sample_rate_ = sample_rate;
+  pole_freqs_ = CARPoleFrequencies(sample_rate, car_params);
+  num_channels_ = pole_freqs_.size();
+
+  CARFAC::DesignCARCoeffs(car_params, sample_rate_, pole_freqs_, &car_coeffs_);
+  CARFAC::DesignIHCCoeffs(ihc_params, sample_rate_, &ihc_coeffs_);
+  CARFAC::DesignAGCCoeffs(agc_params, sample_rate_, &agc_coeffs_);
+
+  // Each column of a (stream x channel) array is contiguous, so replicating
+  // the coefficients down the columns lets every CAR operation run as a
+  // plain elementwise expression.
+  r1_coeffs_ = car_coeffs_.r1_coeffs.transpose().replicate(num_streams_, 1);
+  a0_coeffs_ = car_coeffs_.a0_coeffs.transpose().replicate(num_streams_, 1);
+  c0_coeffs_ = car_coeffs_.c0_coeffs.transpose().replicate(num_streams_, 1);
+  h_coeffs_ = car_coeffs_.h_coeffs.transpose().replicate(num_streams_, 1);
+  zr_coeffs_ = car_coeffs_.zr_coeffs.transpose().replicate(num_streams_, 1);
+  Reset();
+}
+
+void CARFACBatch::Reset() {
+  const int n = num_streams_;
+  const int c = num_channels_;
+  z1_memory_.setZero(n, c);
+  z2_memory_.setZero(n, c);
+  za_memory_.setZero(n, c);
+  zb_memory_ = zr_coeffs_;
+  dzb_memory_.setZero(n, c);
+  zy_memory_.setZero(n, c);
+  g_memory_ = car_coeffs_.g0_coeffs.transpose().replicate(n, 1);
+  dg_memory_.setZero(n, c);
+
+  ac_coupler_.setZero(n, c);
+  ihc_out_.setZero(n, c);
+  if (!ihc_coeffs_.just_half_wave_rectify) {
+    lpf1_state_.setConstant(n, c, ihc_coeffs_.rest_output);
+    lpf2_state_.setConstant(n, c, ihc_coeffs_.rest_output);
+    cap1_voltage_.setConstant(n, c, ihc_coeffs_.rest_cap1);
+    if (!ihc_coeffs_.one_capacitor) {
+      cap2_voltage_.setConstant(n, c, ihc_coeffs_.rest_cap2);
+    }
+  }
+
+  const int num_stages = agc_coeffs_.size();
+  agc_memory_.resize(num_stages);
+  agc_input_accum_.resize(num_stages);
+  agc_decim_phase_.assign(num_stages, 0);
+  for (int stage = 0; stage < num_stages; ++stage) {
+    agc_memory_[stage].setZero(n, c);
+    agc_input_accum_[stage].setZero(n, c);
+  }
+
+  tmp1_.resize(n, c);
+  tmp2_.resize(n, c);
+  in_out_.resize(n);
+  smoother_state_.resize(n);
+}
+
+void CARFACBatch::RunSegment(const ArrayXX& sound_data, bool open_loop,
+                             const std::vector<CARFACOutput*>& outputs) {
+  CARFAC_ASSERT(sound_data.rows() == num_streams_);
+  CARFAC_ASSERT(static_cast<int>(outputs.size()) == num_streams_);
+  const int num_samples = sound_data.cols();
+  for (CARFACOutput* output : outputs) {
+    output->Resize(1, num_channels_, num_samples);
+  }
+
+  if (open_loop) {
+    CloseAGCLoop(open_loop);
+  }
+  for (int32_t timepoint = 0; timepoint < num_samples; ++timepoint) {
+    in_out_ = sound_data.col(timepoint);
+    CARStep();
+    IHCStep();
+    const bool agc_memory_updated = !open_loop && AGCStep();
+    for (int stream = 0; stream < num_streams_; ++stream) {
+      CARFACOutput* output = outputs[stream];
+      if (output->store_nap_) {
+        output->AssignNAP(0, timepoint, ihc_out_.row(stream).transpose());
+      }
+      if (output->store_bm_) {
+        output->bm_[0].col(timepoint) = zy_memory_.row(stream).transpose();
+      }
+      if (output->store_ohc_) {
+        output->ohc_[0].col(timepoint) = za_memory_.row(stream).transpose();
+      }
+      if (output->store_agc_) {
+        output->agc_[0].col(timepoint) = zb_memory_.row(stream).transpose();
+      }
+    }
+    if (agc_memory_updated) {
+      CloseAGCLoop(open_loop);
+    }
+  }
+}
+
+void CARFACBatch::CARStep() {
+  g_memory_ += dg_memory_;
+  zb_memory_ += dzb_memory_;
+  ArrayXX& r(tmp1_);
+  r = r1_coeffs_ +
+      (zb_memory_ *
+       (1 + ((car_coeffs_.velocity_scale * (z2_memory_ - za_memory_)) +
+             car_coeffs_.v_offset).square()).inverse());
+  za_memory_ = z2_memory_;
+  tmp2_ = r * z2_memory_;
+  tmp1_ = r * z1_memory_;
+  z1_memory_ = a0_coeffs_ * tmp1_ - c0_coeffs_ * tmp2_;
+  z2_memory_ = c0_coeffs_ * tmp1_ + a0_coeffs_ * tmp2_;
+  zy_memory_ = h_coeffs_ * z2_memory_;
+  // The ripple still runs serially over channels, but each step now
+  // processes one contiguous column holding that channel for every stream.
+  for (int channel = 0; channel < num_channels_; ++channel) {
+    z1_memory_.col(channel) += in_out_;
+    in_out_ = g_memory_.col(channel) * (in_out_ + zy_memory_.col(channel));
+    zy_memory_.col(channel) = in_out_;
+  }
+}
+
+void CARFACBatch::IHCStep() {
+  ArrayXX& ac_diff = ihc_out_;
+  ac_diff = zy_memory_ - ac_coupler_;
+  ac_coupler_ = ac_coupler_ + (ihc_coeffs_.ac_coeff * ac_diff);
+  if (ihc_coeffs_.just_half_wave_rectify) {
+    ihc_out_ = ac_diff.cwiseMax(FPType(0)).cwiseMin(FPType(2));
+  } else {
+    CARFACDetect(&ac_diff);
+    ArrayXX& conductance = ac_diff;
+    if (ihc_coeffs_.one_capacitor) {
+      ihc_out_ = conductance * cap1_voltage_;
+      cap1_voltage_ = cap1_voltage_ - (ihc_out_ * ihc_coeffs_.out1_rate) +
+                      ((1 - cap1_voltage_) * ihc_coeffs_.in1_rate);
+    } else {
+      ihc_out_ = conductance * cap2_voltage_;
+      cap1_voltage_ =
+          cap1_voltage_ -
+          ((cap1_voltage_ - cap2_voltage_) * ihc_coeffs_.out1_rate) +
+          ((1 - cap1_voltage_) * ihc_coeffs_.in1_rate);
+      cap2_voltage_ = cap2_voltage_ - (ihc_out_ * ihc_coeffs_.out2_rate) +
+                      ((cap1_voltage_ - cap2_voltage_) * ihc_coeffs_.in2_rate);
+    }
+    lpf1_state_ += ihc_coeffs_.lpf_coeff *
+                   (ihc_out_ * ihc_coeffs_.output_gain - lpf1_state_);
+    lpf2_state_ += ihc_coeffs_.lpf_coeff * (lpf1_state_ - lpf2_state_);
+    ihc_out_ = lpf2_state_ - ihc_coeffs_.rest_output;
+  }
+}
+
+bool CARFACBatch::AGCStep() {
+  bool updated = false;
+  const int num_stages = agc_coeffs_.size();
+  if (num_stages > 0) {
+    FPType detect_scale = agc_coeffs_[num_stages - 1].detect_scale;
+    ArrayXX& agc_in(tmp1_);
+    agc_in = detect_scale * ihc_out_;
+    updated = AGCRecurse(0, &agc_in);
+  }
+  return updated;
+}
+
+bool CARFACBatch::AGCRecurse(int stage, ArrayXX* agc_in_out) {
+  bool updated = false;
+  const AGCCoeffs& agc_coeffs = agc_coeffs_[stage];
+  ArrayXX& input_accum = agc_input_accum_[stage];
+  ArrayXX& agc_memory = agc_memory_[stage];
+  input_accum += *agc_in_out;
+  int decim = agc_coeffs.decimation;
+  if (++agc_decim_phase_[stage] >= decim) {
+    agc_decim_phase_[stage] = 0;
+    *agc_in_out = input_accum * FPType(1.0 / decim);
+    if (stage < static_cast<int>(agc_coeffs_.size()) - 1) {
+      input_accum = *agc_in_out;
+      AGCRecurse(stage + 1, &input_accum);
+      *agc_in_out += agc_coeffs.agc_stage_gain * agc_memory_[stage + 1];
+    }
+    input_accum.setZero();
+    agc_memory += agc_coeffs.agc_epsilon * (*agc_in_out - agc_memory);
+    AGCSpatialSmooth(agc_coeffs, &agc_memory);
+    updated = true;
+  }
+  return updated;
+}
+
+void CARFACBatch::AGCSpatialSmooth(const AGCCoeffs& agc_coeffs,
+                                   ArrayXX* stage_state) {
+  const int num_iterations = agc_coeffs.agc_spatial_iterations;
+  if (num_iterations < 0) {
+    AGCSmoothDoubleExponential(agc_coeffs.agc_pole_z1, agc_coeffs.agc_pole_z2,
+                               stage_state);
+    return;
+  }
+  const FPType fir_coeffs_left = agc_coeffs.agc_spatial_fir_left;
+  const FPType fir_coeffs_mid = agc_coeffs.agc_spatial_fir_mid;
+  const FPType fir_coeffs_right = agc_coeffs.agc_spatial_fir_right;
+  const int n = num_channels_;
+  ArrayXX& state = *stage_state;
+  ArrayXX& smoothed_state(tmp2_);  // While tmp1_ is in use as agc_in.
+  switch (agc_coeffs.agc_spatial_n_taps) {
+    case 3:
+      for (int count = 0; count < num_iterations; ++count) {
+        smoothed_state.middleCols(1, n - 2) =
+            fir_coeffs_mid * state.middleCols(1, n - 2) +
+            fir_coeffs_left * state.middleCols(0, n - 2) +
+            fir_coeffs_right * state.middleCols(2, n - 2);
+        smoothed_state.col(0) = fir_coeffs_mid * state.col(0) +
+                                fir_coeffs_left * state.col(0) +
+                                fir_coeffs_right * state.col(1);
+        smoothed_state.col(n - 1) = fir_coeffs_mid * state.col(n - 1) +
+                                    fir_coeffs_left * state.col(n - 2) +
+                                    fir_coeffs_right * state.col(n - 1);
+        state = smoothed_state;
+      }
+      break;
+    case 5:
+      for (int count = 0; count < num_iterations; ++count) {
+        smoothed_state.middleCols(2, n - 4) =
+            fir_coeffs_mid * state.middleCols(2, n - 4) +
+            fir_coeffs_left *
+                (state.middleCols(0, n - 4) + state.middleCols(1, n - 4)) +
+            fir_coeffs_right *
+                (state.middleCols(3, n - 4) + state.middleCols(4, n - 4));
+        smoothed_state.col(0) =
+            fir_coeffs_mid * state.col(0) +
+            fir_coeffs_left * (state.col(0) + state.col(1)) +
+            fir_coeffs_right * (state.col(1) + state.col(2));
+        smoothed_state.col(1) =
+            fir_coeffs_mid * state.col(1) +
+            fir_coeffs_left * (state.col(0) + state.col(0)) +
+            fir_coeffs_right * (state.col(2) + state.col(3));
+        smoothed_state.col(n - 1) =
+            fir_coeffs_mid * state.col(n - 1) +
+            fir_coeffs_left * (state.col(n - 2) + state.col(n - 3)) +
+            fir_coeffs_right * (state.col(n - 1) + state.col(n - 1));
+        smoothed_state.col(n - 2) =
+            fir_coeffs_mid * state.col(n - 2) +
+            fir_coeffs_left * (state.col(n - 3) + state.col(n - 4)) +
+            fir_coeffs_right * (state.col(n - 1) + state.col(n - 1));
+        state = smoothed_state;
+      }
+      break;
+    default:
+      CARFAC_ASSERT(false &&
+                    "Bad n_taps in AGCSpatialSmooth; should be 3 or 5.");
+      break;
+  }
+}
+
+void CARFACBatch::AGCSmoothDoubleExponential(FPType pole_z1, FPType pole_z2,
+                                             ArrayXX* stage_state) {
+  const int num_points = stage_state->cols();
+  ArrayX& state = smoother_state_;
+  state.setZero();
+  for (int i = num_points - 11; i < num_points; ++i) {
+    state = state + (1 - pole_z1) * (stage_state->col(i) - state);
+  }
+  for (int i = num_points - 1; i > -1; --i) {
+    state += (1 - pole_z2) * (stage_state->col(i) - state);
+  }
+  for (int i = 0; i < num_points; ++i) {
+    state += (1 - pole_z1) * (stage_state->col(i) - state);
+    stage_state->col(i) = state;
+  }
+}
+
+void CARFACBatch::CloseAGCLoop(bool open_loop) {
+  if (open_loop) {
+    dzb_memory_.setZero();
+    dg_memory_.setZero();
+  } else {
+    FPType scaling = 1.0 / agc_coeffs_[0].decimation;
+    ArrayXX& undamping(tmp1_);
+    undamping = 1 - agc_memory_[0];
+    dzb_memory_ = (zr_coeffs_ * undamping - zb_memory_) * scaling;
+    ArrayXX& g_values(tmp2_);
+    auto r = r1_coeffs_ + zr_coeffs_ * undamping;
+    g_values = (1 - 2 * r * a0_coeffs_ + (r * r)) /
+               (1 - 2 * r * a0_coeffs_ + h_coeffs_ * r * c0_coeffs_ + (r * r));
+    dg_memory_ = (g_values - g_memory_) * scaling;
+  }
+}
@@ -0,0 +1,135 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// This file is part of an implementation of Lyon's cochlear model:
+// "Cascade of Asymmetric Resonators with Fast-Acting Compression"
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "chunked_pipeline.h"
+
+#include <cmath>
+#include <memory>
+
+ChunkedPipeline::ChunkedPipeline(
+    float sample_rate_hz, const PitchogramPipelineParams& pipeline_params,
+    const ChunkedPipelineParams& params)
+    : sample_rate_hz_(sample_rate_hz),
+      pipeline_params_(pipeline_params),
+      num_chunks_(params.num_chunks > 0 ? params.num_chunks
+                                        : params.num_threads),
+      worker_pool_(params.num_threads) {
+  CARFAC_ASSERT(pipeline_params.num_samples_per_segment > 0);
+  CARFAC_ASSERT(params.warmup_s >= 0.0f);
+  num_warmup_frames_ = static_cast<int>(
+      std::ceil(params.warmup_s * sample_rate_hz_ /
+                pipeline_params_.num_samples_per_segment));
+}
+
+void ChunkedPipeline::Run(const float* samples, int num_samples,
+                          const FrameCallback& frame_callback) {
+  const int num_frames = NumFrames(num_samples);
+  const int num_chunks = this->num_chunks(num_frames);
+  const int segment_width = pipeline_params_.num_samples_per_segment;
+  worker_pool_.ParallelFor(num_chunks, [&](int chunk_index) {
+    const int first_frame = ChunkStart(chunk_index, num_chunks, num_frames);
+    const int end_frame = ChunkStart(chunk_index + 1, num_chunks, num_frames);
+    PitchogramPipeline pipeline(sample_rate_hz_, pipeline_params_);
+    for (int frame = std::max(0, first_frame - num_warmup_frames_);
+         frame < end_frame; ++frame) {
+      pipeline.ProcessJustSamples(samples + frame * segment_width,
+                                  segment_width);
+      if (frame >= first_frame) {
+        frame_callback(frame, pipeline.nap(), pipeline.sai_output());
+      }
+    }
+  });
+}
+
+void ChunkedPipeline::RunNAP(const float* samples, int num_samples,
+                             ArrayXX* nap) {
+  // The pipeline is only needed for the shape of the NAP.
+  PitchogramPipeline pipeline(sample_rate_hz_, pipeline_params_);
+  const int segment_width = pipeline.model_samples_per_segment();
+  nap->resize(pipeline.pole_frequencies().size(),
+              NumFrames(num_samples) * segment_width);
+  Run(samples, num_samples,
+      [nap, segment_width](int frame_index,
+                           const Eigen::Ref<const RowMajorArrayXX>& frame_nap,
+                           const ArrayXX& /*sai_output*/) {
+        nap->middleCols(frame_index * segment_width, segment_width) =
+            frame_nap;
+      });
+}
+
+std::vector<ChunkDivergence> ChunkedPipeline::MeasureDivergence(
+    const float* samples, int num_samples) {
+  const int num_frames = NumFrames(num_samples);
+  const int num_chunks = this->num_chunks(num_frames);
+  const int segment_width = pipeline_params_.num_samples_per_segment;
+  std::vector<ChunkDivergence> divergences(num_chunks);
+  for (int chunk_index = 0; chunk_index < num_chunks; ++chunk_index) {
+    ChunkDivergence& divergence = divergences[chunk_index];
+    divergence.first_frame = ChunkStart(chunk_index, num_chunks, num_frames);
+    divergence.num_frames =
+        ChunkStart(chunk_index + 1, num_chunks, num_frames) -
+        divergence.first_frame;
+    divergence.max_nap_error = 0.0f;
+    divergence.max_sai_error = 0.0f;
+    divergence.max_nap = 0.0f;
+    divergence.max_sai = 0.0f;
+  }
+
+  // Only the chunks whose warm-up or frames overlap the current frame have a
+  // pipeline, so there are at most a few at a time.
+  PitchogramPipeline sequential(sample_rate_hz_, pipeline_params_);
+  std::vector<std::unique_ptr<PitchogramPipeline>> chunk_pipelines(num_chunks);
+  for (int frame = 0; frame < num_frames; ++frame) {
+    const float* segment = samples + frame * segment_width;
+    sequential.ProcessJustSamples(segment, segment_width);
+    const Eigen::Ref<const RowMajorArrayXX> sequential_nap = sequential.nap();
+    const ArrayXX& sequential_sai = sequential.sai_output();
+    for (int chunk_index = 0; chunk_index < num_chunks; ++chunk_index) {
+      ChunkDivergence& divergence = divergences[chunk_index];
+      const int end_frame = divergence.first_frame + divergence.num_frames;
+      if (frame < divergence.first_frame - num_warmup_frames_ ||
+          frame >= end_frame) {
+        continue;
+      }
+      std::unique_ptr<PitchogramPipeline>& pipeline =
+          chunk_pipelines[chunk_index];
+      if (!pipeline) {
+        pipeline.reset(
+            new PitchogramPipeline(sample_rate_hz_, pipeline_params_));
+      }
+      pipeline->ProcessJustSamples(segment, segment_width);
+      if (frame >= divergence.first_frame) {
+        divergence.max_nap_error = std::max(
+            divergence.max_nap_error,
+            (pipeline->nap() - sequential_nap)
+                .abs()
+                .maxCoeff());
+        divergence.max_sai_error = std::max(
+            divergence.max_sai_error,
+            (pipeline->sai_output() - sequential_sai).abs().maxCoeff());
+        divergence.max_nap =
+            std::max(divergence.max_nap, sequential_nap.abs().maxCoeff());
+        divergence.max_sai =
+            std::max(divergence.max_sai, sequential_sai.abs().maxCoeff());
+      }
+      if (frame == end_frame - 1) {
+        pipeline.reset();
+      }
+    }
+  }
+  return divergences;
+}
@@ -18,7 +18,11 @@
 
 #include "ear.h"
 
+#include <algorithm>
+#include <cstring>
+
 #include "carfac_util.h"
+#include "kernels.h"
 
 Ear::Ear(int num_channels,
          const CARCoeffs& car_coeffs,
@@ -42,82 +46,151 @@ void Ear::Redesign(int num_channels,
                 "car_coeffs should be size num_channels.");
   ihc_coeffs_ = ihc_coeffs;
   agc_coeffs_ = agc_coeffs;
+  step_kernel_variant_ =
+      StepKernelVariant(num_channels_, nonlinearity_precision_);
+  ihc_topology_ = static_cast<int>(GetIHCTopology(ihc_coeffs_));
+  AllocateArena();
   Reset();
 }
 
+void Ear::set_nonlinearity_precision(NonlinearityPrecision precision) {
+  nonlinearity_precision_ = precision;
+  step_kernel_variant_ = StepKernelVariant(num_channels_, precision);
+}
+
+namespace {
+// The number of arrays in the state arena of an Ear, which have one element
+// per channel.
+constexpr int kNumCARStateArrays = 8;
+constexpr int kNumIHCStateArrays = 6;
+constexpr int kNumAGCStageStateArrays = 2;
+constexpr int kNumTemporaryArrays = 2;
+
+// Rounds size_bytes up to a whole number of cache lines.
+std::size_t PadToCacheLines(std::size_t size_bytes) {
+  return (size_bytes + kCacheLineBytes - 1) / kCacheLineBytes *
+         kCacheLineBytes;
+}
+}  // namespace
+
+void Ear::AllocateArena() {
+  const int num_stages = agc_coeffs_.size();
+  const std::size_t phases_size_bytes =
+      PadToCacheLines(num_stages * sizeof(int));
+  const std::size_t array_size_bytes =
+      PadToCacheLines(num_channels_ * sizeof(FPType));
+  state_size_bytes_ =
+      phases_size_bytes +
+      (kNumCARStateArrays + kNumIHCStateArrays +
+       num_stages * kNumAGCStageStateArrays) * array_size_bytes;
+  const std::size_t arena_size_bytes =
+      state_size_bytes_ + kNumTemporaryArrays * array_size_bytes;
+  if (arena_size_bytes != arena_size_bytes_) {
+    arena_.reset(new (std::align_val_t(kCacheLineBytes))
+                     char[arena_size_bytes]);
+    arena_size_bytes_ = arena_size_bytes;
+  }
+  // Clear the padding too, so that copies of the state are deterministic.
+  std::memset(arena_.get(), 0, arena_size_bytes_);
+
+  char* next = arena_.get();
+  agc_state_.resize(num_stages);
+  for (int stage = 0; stage < num_stages; ++stage) {
+    agc_state_[stage].decim_phase = reinterpret_cast<int*>(next) + stage;
+  }
+  next += phases_size_bytes;
+  // Points an array at the next free cache line of the arena.  This is the
+  // documented way of changing the array that an Eigen::Map refers to.
+  auto place = [this, &next, array_size_bytes](ArrayXMap* array) {
+    new (array) ArrayXMap(reinterpret_cast<FPType*>(next), num_channels_);
+    next += array_size_bytes;
+  };
+  place(&car_state_.g_memory);
+  place(&car_state_.dg_memory);
+  place(&car_state_.zb_memory);
+  place(&car_state_.dzb_memory);
+  place(&car_state_.z1_memory);
+  place(&car_state_.z2_memory);
+  place(&car_state_.za_memory);
+  place(&car_state_.zy_memory);
+  place(&ihc_state_.ihc_out);
+  place(&ihc_state_.ac_coupler);
+  place(&ihc_state_.cap1_voltage);
+  place(&ihc_state_.cap2_voltage);
+  place(&ihc_state_.lpf1_state);
+  place(&ihc_state_.lpf2_state);
+  for (AGCState& stage_state : agc_state_) {
+    place(&stage_state.input_accum);
+    place(&stage_state.agc_memory);
+  }
+  CARFAC_ASSERT(next == arena_.get() + state_size_bytes_);
+  place(&tmp1_);
+  place(&tmp2_);
+  CARFAC_ASSERT(next == arena_.get() + arena_size_bytes_);
+}
+
 void Ear::Reset() {
   InitCARState();
   InitIHCState();
   InitAGCState();
-  tmp1_.resize(num_channels_);
-  tmp2_.resize(num_channels_);
+  wavefront_in_out_.resize(2 * (num_channels_ + 1));
+}
+
+void Ear::RestoreState(const void* state_data) {
+  std::memcpy(arena_.get(), state_data, state_size_bytes_);
 }
 
 void Ear::InitCARState() {
-  car_state_.z1_memory.setZero(num_channels_);
-  car_state_.z2_memory.setZero(num_channels_);
-  car_state_.za_memory.setZero(num_channels_);
+  car_state_.z1_memory.setZero();
+  car_state_.z2_memory.setZero();
+  car_state_.za_memory.setZero();
   car_state_.zb_memory = car_coeffs_.zr_coeffs;
-  car_state_.dzb_memory.setZero(num_channels_);
-  car_state_.zy_memory.setZero(num_channels_);
+  car_state_.dzb_memory.setZero();
+  car_state_.zy_memory.setZero();
   car_state_.g_memory = car_coeffs_.g0_coeffs;
-  car_state_.dg_memory.setZero(num_channels_);
+  car_state_.dg_memory.setZero();
 }
 
 void Ear::InitIHCState() {
-  ihc_state_.ac_coupler.setZero(num_channels_);
-  ihc_state_.ihc_out.setZero(num_channels_);
+  ihc_state_.ac_coupler.setZero();
+  ihc_state_.ihc_out.setZero();
   if (!ihc_coeffs_.just_half_wave_rectify) {
-    ihc_state_.lpf1_state.setConstant(num_channels_, ihc_coeffs_.rest_output);
-    ihc_state_.lpf2_state.setConstant(num_channels_, ihc_coeffs_.rest_output);
+    ihc_state_.lpf1_state.setConstant(ihc_coeffs_.rest_output);
+    ihc_state_.lpf2_state.setConstant(ihc_coeffs_.rest_output);
     if (ihc_coeffs_.one_capacitor) {
-      ihc_state_.cap1_voltage.setConstant(num_channels_, ihc_coeffs_.rest_cap1);
+      ihc_state_.cap1_voltage.setConstant(ihc_coeffs_.rest_cap1);
     } else {
-      ihc_state_.cap1_voltage.setConstant(num_channels_, ihc_coeffs_.rest_cap1);
-      ihc_state_.cap2_voltage.setConstant(num_channels_, ihc_coeffs_.rest_cap2);
+      ihc_state_.cap1_voltage.setConstant(ihc_coeffs_.rest_cap1);
+      ihc_state_.cap2_voltage.setConstant(ihc_coeffs_.rest_cap2);
     }
   }
 }
 
 void Ear::InitAGCState() {
-  int n_agc_stages = agc_coeffs_.size();
-  agc_state_.resize(n_agc_stages);
   for (AGCState& stage_state : agc_state_) {
-    stage_state.decim_phase = 0;
-    stage_state.agc_memory.setZero(num_channels_);
-    stage_state.input_accum.setZero(num_channels_);
+    *stage_state.decim_phase = 0;
+    stage_state.agc_memory.setZero();
+    stage_state.input_accum.setZero();
   }
 }
 
 void Ear::CARStep(FPType input) {
-  // Interpolates g.
-  car_state_.g_memory = car_state_.g_memory + car_state_.dg_memory;
-  // Calculates the AGC interpolation state.
-  car_state_.zb_memory = car_state_.zb_memory + car_state_.dzb_memory;
-  // This updates the nonlinear function of 'velocity' along with zA, which is
-  // a delay of z2.
-  ArrayX& r(tmp1_);  // Alias the radius factor r to tmp1_.
-  r = car_coeffs_.r1_coeffs +
-      // This product is the "undamping" delta r.
-      (car_state_.zb_memory *
-       // OHC nonlinear function.
-       // We start with a quadratic nonlinear function, and limit it via a
-       // rational function. This makes the result go to zero at high
-       // absolute velocities, so it will do nothing there.
-       (1 + ((car_coeffs_.velocity_scale *
-              (car_state_.z2_memory - car_state_.za_memory)) +  // velocities.
-             car_coeffs_.v_offset).square()).inverse());
-  car_state_.za_memory = car_state_.z2_memory;
-  // Here we reduce the CAR state by r and then rotate with the fixed cos/sin
-  // coeffs, using both temp arrays, ending the scope of tmp1_ as r.
-  tmp2_ = r * car_state_.z2_memory;
-  // But first stop using tmp1_ for r, and use it for r * z1 instead.
-  tmp1_ = r * car_state_.z1_memory;
-  car_state_.z1_memory =  // This still needs stage inputs to be added.
-      car_coeffs_.a0_coeffs * tmp1_ - car_coeffs_.c0_coeffs * tmp2_;
-  car_state_.z2_memory =
-      car_coeffs_.c0_coeffs * tmp1_ + car_coeffs_.a0_coeffs * tmp2_;
-  car_state_.zy_memory = car_coeffs_.h_coeffs * car_state_.z2_memory;
+  // Interpolates g and the AGC interpolation state zb, updates the nonlinear
+  // function of 'velocity' along with zA, which is a delay of z2, reduces the
+  // CAR state by the radius factor r and rotates it with the fixed cos/sin
+  // coeffs.  The OHC nonlinear function starts with a quadratic nonlinear
+  // function, and limits it via a rational function.  This makes the result
+  // go to zero at high absolute velocities, so it will do nothing there.
+  // The stage inputs still need to be added to z1_memory.
+  const CARKernelArrays car = {
+      car_coeffs_.r1_coeffs.data(), car_coeffs_.a0_coeffs.data(),
+      car_coeffs_.c0_coeffs.data(), car_coeffs_.h_coeffs.data(),
+      car_state_.dg_memory.data(),  car_state_.dzb_memory.data(),
+      car_state_.g_memory.data(),   car_state_.zb_memory.data(),
+      car_state_.z1_memory.data(),  car_state_.z2_memory.data(),
+      car_state_.za_memory.data(),  car_state_.zy_memory.data()};
+  ActiveKernels().car_step[step_kernel_variant_](
+      num_channels_, car_coeffs_.velocity_scale, car_coeffs_.v_offset, car);
   // This section ripples the input-output path, to avoid added delays...
   // It's the only part that doesn't get computed "in parallel".
   // Add inputs to z1_memory while looping, since the loop can't run
@@ -132,70 +205,355 @@ void Ear::CARStep(FPType input) {
   }
 }
 
-// This step is a one sample-time update of the inner-hair-cell (IHC) model,
-// including the detection nonlinearity and either one or two capacitor state
-// variables.
-void Ear::IHCStep(const ArrayX& car_out) {
-  ArrayX& ac_diff = ihc_state_.ihc_out;
-  ac_diff = car_out - ihc_state_.ac_coupler;
-  ihc_state_.ac_coupler = ihc_state_.ac_coupler +
-      (ihc_coeffs_.ac_coeff * ac_diff);
+namespace {
+// Applies CARStep to one sample of each channel in [first, last], with the
+// same operations in the same order, given the input to each channel in
+// in_out[channel].  The output of each channel is stored to
+// next_in_out[channel + 1].  The pointers must not alias, which lets the
+// loop be vectorized.
+template <bool kFast>
+void CARWavefrontStep(int first, int last, const CARCoeffs& car_coeffs,
+                      const FPType* __restrict dg_memory,
+                      const FPType* __restrict dzb_memory,
+                      FPType* __restrict g_memory, FPType* __restrict zb_memory,
+                      FPType* __restrict z1_memory,
+                      FPType* __restrict z2_memory,
+                      FPType* __restrict za_memory,
+                      FPType* __restrict zy_memory,
+                      const FPType* __restrict in_out,
+                      FPType* __restrict next_in_out) {
+  const FPType velocity_scale = car_coeffs.velocity_scale;
+  const FPType v_offset = car_coeffs.v_offset;
+  const FPType* __restrict r1_coeffs = car_coeffs.r1_coeffs.data();
+  const FPType* __restrict a0_coeffs = car_coeffs.a0_coeffs.data();
+  const FPType* __restrict c0_coeffs = car_coeffs.c0_coeffs.data();
+  const FPType* __restrict h_coeffs = car_coeffs.h_coeffs.data();
+  for (int channel = first; channel <= last; ++channel) {
+    const FPType g = g_memory[channel] + dg_memory[channel];
+    const FPType zb = zb_memory[channel] + dzb_memory[channel];
+    const FPType z2 = z2_memory[channel];
+    const FPType velocity =
+        velocity_scale * (z2 - za_memory[channel]) + v_offset;
+    const FPType r =
+        r1_coeffs[channel] +
+        zb * DivideNonlinearity<kFast>(1, 1 + velocity * velocity);
+    const FPType r_z1 = r * z1_memory[channel];
+    const FPType r_z2 = r * z2;
+    const FPType new_z2 = c0_coeffs[channel] * r_z1 + a0_coeffs[channel] * r_z2;
+    const FPType zy = h_coeffs[channel] * new_z2;
+    const FPType car_out = g * (in_out[channel] + zy);
+    g_memory[channel] = g;
+    zb_memory[channel] = zb;
+    za_memory[channel] = z2;
+    z1_memory[channel] = a0_coeffs[channel] * r_z1 -
+                         c0_coeffs[channel] * r_z2 + in_out[channel];
+    z2_memory[channel] = new_z2;
+    zy_memory[channel] = car_out;
+    next_in_out[channel + 1] = car_out;
+  }
+}
+}  // namespace
+
+void Ear::CARBlock(
+    const Eigen::Ref<const ArrayX, 0, Eigen::InnerStride<>>& input) {
+  const int num_samples = input.size();
+  if (zy_block_.cols() < num_samples) {
+    zy_block_.resize(num_channels_, num_samples);
+    za_block_.resize(num_channels_, num_samples);
+    zb_block_.resize(num_channels_, num_samples);
+  }
+  // On diagonal d, channel c processes sample d - c, so the active channels
+  // are those with 0 <= d - c < num_samples.  Each channel's input is the
+  // output of the previous channel from the previous diagonal, which is the
+  // same sample.  The two halves of wavefront_in_out_ hold the inputs and
+  // outputs of the current diagonal, and swap roles on every diagonal.
+  FPType* in_out = wavefront_in_out_.data();
+  FPType* next_in_out = in_out + num_channels_ + 1;
+  const int num_diagonals = num_samples + num_channels_ - 1;
+  for (int diagonal = 0; diagonal < num_diagonals; ++diagonal) {
+    const int first = std::max(0, diagonal - num_samples + 1);
+    const int last = std::min(diagonal, num_channels_ - 1);
+    if (diagonal < num_samples) {
+      in_out[0] = input(diagonal);
+    }
+    if (nonlinearity_precision_ == NonlinearityPrecision::kFast) {
+      CARWavefrontStep<true>(
+          first, last, car_coeffs_, car_state_.dg_memory.data(),
+          car_state_.dzb_memory.data(), car_state_.g_memory.data(),
+          car_state_.zb_memory.data(), car_state_.z1_memory.data(),
+          car_state_.z2_memory.data(), car_state_.za_memory.data(),
+          car_state_.zy_memory.data(), in_out, next_in_out);
+    } else {
+      CARWavefrontStep<false>(
+          first, last, car_coeffs_, car_state_.dg_memory.data(),
+          car_state_.dzb_memory.data(), car_state_.g_memory.data(),
+          car_state_.zb_memory.data(), car_state_.z1_memory.data(),
+          car_state_.z2_memory.data(), car_state_.za_memory.data(),
+          car_state_.zy_memory.data(), in_out, next_in_out);
+    }
+    for (int channel = first; channel <= last; ++channel) {
+      const int sample = diagonal - channel;
+      zy_block_(channel, sample) = car_state_.zy_memory(channel);
+      za_block_(channel, sample) = car_state_.za_memory(channel);
+      zb_block_(channel, sample) = car_state_.zb_memory(channel);
+    }
+    std::swap(in_out, next_in_out);
+  }
+}
+
+template <bool kJustHalfWaveRectify, bool kOneCapacitor, bool kFast,
+          bool kLinear>
+void Ear::FusedWavefrontStep(int first, int last, const FPType* in_out,
+                             FPType* next_in_out, FPType* nap_diagonal) {
+  const FPType velocity_scale = car_coeffs_.velocity_scale;
+  const FPType v_offset = car_coeffs_.v_offset;
+  const FPType* r1_coeffs = car_coeffs_.r1_coeffs.data();
+  const FPType* a0_coeffs = car_coeffs_.a0_coeffs.data();
+  const FPType* c0_coeffs = car_coeffs_.c0_coeffs.data();
+  const FPType* h_coeffs = car_coeffs_.h_coeffs.data();
+  const FPType* dg_memory = car_state_.dg_memory.data();
+  const FPType* dzb_memory = car_state_.dzb_memory.data();
+  FPType* g_memory = car_state_.g_memory.data();
+  FPType* zb_memory = car_state_.zb_memory.data();
+  FPType* z1_memory = car_state_.z1_memory.data();
+  FPType* z2_memory = car_state_.z2_memory.data();
+  FPType* za_memory = car_state_.za_memory.data();
+  FPType* zy_memory = car_state_.zy_memory.data();
+  FPType* ac_coupler = ihc_state_.ac_coupler.data();
+  FPType* ihc_out = ihc_state_.ihc_out.data();
+  FPType* cap1_voltage = ihc_state_.cap1_voltage.data();
+  FPType* cap2_voltage = ihc_state_.cap2_voltage.data();
+  FPType* lpf1_state = ihc_state_.lpf1_state.data();
+  FPType* lpf2_state = ihc_state_.lpf2_state.data();
+  const IHCCoeffs& ihc = ihc_coeffs_;
+  CARFAC_IVDEP
+  for (int channel = first; channel <= last; ++channel) {
+    // CARStep, with the same operations in the same order.  If kLinear, the
+    // deltas and the velocity are zero, so the interpolation is a no-op and
+    // the nonlinearity is exactly 1.
+    FPType g;
+    FPType zb;
+    const FPType z2 = z2_memory[channel];
+    FPType r;
+    if constexpr (kLinear) {
+      g = g_memory[channel];
+      zb = zb_memory[channel];
+      r = r1_coeffs[channel] + zb;
+    } else {
+      g = g_memory[channel] + dg_memory[channel];
+      zb = zb_memory[channel] + dzb_memory[channel];
+      const FPType velocity =
+          velocity_scale * (z2 - za_memory[channel]) + v_offset;
+      r = r1_coeffs[channel] +
+          zb * DivideNonlinearity<kFast>(1, 1 + velocity * velocity);
+    }
+    const FPType r_z1 = r * z1_memory[channel];
+    const FPType r_z2 = r * z2;
+    const FPType new_z2 = c0_coeffs[channel] * r_z1 + a0_coeffs[channel] * r_z2;
+    const FPType car_out = g * (in_out[channel] + h_coeffs[channel] * new_z2);
+    if constexpr (!kLinear) {
+      g_memory[channel] = g;
+      zb_memory[channel] = zb;
+    }
+    za_memory[channel] = z2;
+    z1_memory[channel] = a0_coeffs[channel] * r_z1 -
+                         c0_coeffs[channel] * r_z2 + in_out[channel];
+    z2_memory[channel] = new_z2;
+    zy_memory[channel] = car_out;
+    next_in_out[channel + 1] = car_out;
+    // IHCStep, likewise.
+    const FPType ac_diff = car_out - ac_coupler[channel];
+    ac_coupler[channel] = ac_coupler[channel] + ihc.ac_coeff * ac_diff;
+    FPType out;
+    if (kJustHalfWaveRectify) {
+      out = std::min(std::max(ac_diff, FPType(0)), FPType(2));
+    } else {
+      // CARFACDetect.
+      constexpr FPType kDetectA = 0.175;
+      constexpr FPType kDetectB = 0.1;
+      const FPType x = std::max(ac_diff, -kDetectA) + kDetectA;
+      const FPType x_cubed = x * x * x;
+      const FPType conductance =
+          DivideNonlinearity<kFast>(x_cubed, x_cubed + x * x + kDetectB);
+      FPType cap1 = cap1_voltage[channel];
+      if (kOneCapacitor) {
+        out = conductance * cap1;
+        cap1 = cap1 - out * ihc.out1_rate + (1 - cap1) * ihc.in1_rate;
+      } else {
+        FPType cap2 = cap2_voltage[channel];
+        out = conductance * cap2;
+        cap1 = cap1 - (cap1 - cap2) * ihc.out1_rate + (1 - cap1) * ihc.in1_rate;
+        cap2 = cap2 - out * ihc.out2_rate + (cap1 - cap2) * ihc.in2_rate;
+        cap2_voltage[channel] = cap2;
+      }
+      cap1_voltage[channel] = cap1;
+      const FPType lpf1 =
+          lpf1_state[channel] +
+          ihc.lpf_coeff * (out * ihc.output_gain - lpf1_state[channel]);
+      const FPType lpf2 =
+          lpf2_state[channel] + ihc.lpf_coeff * (lpf1 - lpf2_state[channel]);
+      lpf1_state[channel] = lpf1;
+      lpf2_state[channel] = lpf2;
+      out = lpf2 - ihc.rest_output;
+    }
+    ihc_out[channel] = out;
+    nap_diagonal[channel] = out;
+  }
+}
+
+template <bool kFast, bool kLinear>
+void Ear::FusedWavefrontStepForTopology(int first, int last,
+                                        const FPType* in_out,
+                                        FPType* next_in_out,
+                                        FPType* nap_diagonal) {
   if (ihc_coeffs_.just_half_wave_rectify) {
-    ihc_state_.ihc_out = ac_diff.max(ArrayX::Zero(num_channels_))
-        .min(ArrayX::Constant(num_channels_, 2));
+    FusedWavefrontStep<true, false, kFast, kLinear>(first, last, in_out,
+                                                    next_in_out, nap_diagonal);
+  } else if (ihc_coeffs_.one_capacitor) {
+    FusedWavefrontStep<false, true, kFast, kLinear>(first, last, in_out,
+                                                    next_in_out, nap_diagonal);
   } else {
-    CARFACDetect(&ac_diff);
-    ArrayX& conductance = ac_diff;
-    if (ihc_coeffs_.one_capacitor) {
-      ihc_state_.ihc_out = conductance * ihc_state_.cap1_voltage;
-      ihc_state_.cap1_voltage = ihc_state_.cap1_voltage -
-          (ihc_state_.ihc_out * ihc_coeffs_.out1_rate) +
-          ((1 - ihc_state_.cap1_voltage) * ihc_coeffs_.in1_rate);
+    FusedWavefrontStep<false, false, kFast, kLinear>(first, last, in_out,
+                                                     next_in_out, nap_diagonal);
+  }
+}
+
+bool Ear::FusedBlock(
+    const Eigen::Ref<const ArrayX, 0, Eigen::InnerStride<>>& input,
+    bool update_agc, int output_start, ArrayXX* nap, NAPSink* nap_sink,
+    ArrayXX* bm, ArrayXX* ohc, ArrayXX* agc) {
+  const int num_samples = input.size();
+  const int num_diagonals = num_samples + num_channels_ - 1;
+  if (skewed_nap_.cols() < num_diagonals) {
+    skewed_nap_.resize(num_channels_, num_diagonals);
+  }
+  update_agc = update_agc && !agc_coeffs_.empty();
+  const FPType detect_scale =
+      update_agc ? agc_coeffs_.back().detect_scale : FPType(0);
+  FPType* agc_input_accum =
+      update_agc ? agc_state_[0].input_accum.data() : nullptr;
+  const FPType* ihc_out = ihc_state_.ihc_out.data();
+  // While the damping and gain are frozen, a CAR without the OHC
+  // nonlinearity is linear, and its step reduces to the rotation.  The fast
+  // reciprocal of 1 is not exactly 1, so only the exact step reduces to it.
+  const bool fast = nonlinearity_precision_ == NonlinearityPrecision::kFast;
+  const bool linear = !fast && car_is_linear() &&
+                      (car_state_.dg_memory == 0).all() &&
+                      (car_state_.dzb_memory == 0).all();
+  // The block is traversed as the same diagonal wavefront as in CARBlock, but
+  // each channel also runs its IHC step as soon as its CAR output is ready,
+  // so all of a channel's state is touched once per sample in a single
+  // vectorized pass.
+  FPType* in_out = wavefront_in_out_.data();
+  FPType* next_in_out = in_out + num_channels_ + 1;
+  for (int diagonal = 0; diagonal < num_diagonals; ++diagonal) {
+    const int first = std::max(0, diagonal - num_samples + 1);
+    const int last = std::min(diagonal, num_channels_ - 1);
+    if (diagonal < num_samples) {
+      in_out[0] = input(diagonal);
+    }
+    FPType* nap_diagonal = &skewed_nap_(0, diagonal);
+    if (linear) {
+      FusedWavefrontStepForTopology<false, true>(first, last, in_out,
+                                                 next_in_out, nap_diagonal);
+    } else if (fast) {
+      FusedWavefrontStepForTopology<true, false>(first, last, in_out,
+                                                 next_in_out, nap_diagonal);
     } else {
-      ihc_state_.ihc_out = conductance * ihc_state_.cap2_voltage;
-      ihc_state_.cap1_voltage = ihc_state_.cap1_voltage -
-          ((ihc_state_.cap1_voltage - ihc_state_.cap2_voltage)
-           * ihc_coeffs_.out1_rate) + ((1 - ihc_state_.cap1_voltage) *
-                                       ihc_coeffs_.in1_rate);
-      ihc_state_.cap2_voltage = ihc_state_.cap2_voltage -
-          (ihc_state_.ihc_out * ihc_coeffs_.out2_rate) +
-          ((ihc_state_.cap1_voltage - ihc_state_.cap2_voltage)
-           * ihc_coeffs_.in2_rate);
+      FusedWavefrontStepForTopology<false, false>(first, last, in_out,
+                                                  next_in_out, nap_diagonal);
+    }
+    // The input accumulation of the first AGC stage.
+    if (update_agc) {
+      for (int channel = first; channel <= last; ++channel) {
+        agc_input_accum[channel] += detect_scale * ihc_out[channel];
+      }
+    }
+    // The other outputs are rarely stored, so they are written directly to
+    // the diagonal of the output block.
+    const int output_diagonal = output_start + diagonal;
+    if (bm != nullptr) {
+      for (int channel = first; channel <= last; ++channel) {
+        (*bm)(channel, output_diagonal - channel) =
+            car_state_.zy_memory(channel);
+      }
+    }
+    if (ohc != nullptr) {
+      for (int channel = first; channel <= last; ++channel) {
+        (*ohc)(channel, output_diagonal - channel) =
+            car_state_.za_memory(channel);
+      }
+    }
+    if (agc != nullptr) {
+      for (int channel = first; channel <= last; ++channel) {
+        (*agc)(channel, output_diagonal - channel) =
+            car_state_.zb_memory(channel);
+      }
+    }
+    std::swap(in_out, next_in_out);
+  }
+  // Sample t of channel c is at (c, t + c) in skewed_nap_, so each output
+  // column is a strided view of it.
+  typedef Eigen::Map<const ArrayX, 0, Eigen::InnerStride<>> SkewedColumn;
+  const Eigen::InnerStride<> stride(num_channels_ + 1);
+  if (nap != nullptr) {
+    for (int i = 0; i < num_samples; ++i) {
+      nap->col(output_start + i) =
+          SkewedColumn(&skewed_nap_(0, i), num_channels_, stride);
+    }
+  } else if (nap_sink != nullptr) {
+    for (int i = 0; i < num_samples; ++i) {
+      nap_sink->AppendSample(
+          output_start + i,
+          SkewedColumn(&skewed_nap_(0, i), num_channels_, stride));
     }
-    // Smooth the output twice using an LPF.
-    ihc_state_.lpf1_state += ihc_coeffs_.lpf_coeff *
-        (ihc_state_.ihc_out * ihc_coeffs_.output_gain -
-         ihc_state_.lpf1_state);
-    ihc_state_.lpf2_state += ihc_coeffs_.lpf_coeff *
-        (ihc_state_.lpf1_state - ihc_state_.lpf2_state);
-    ihc_state_.ihc_out = ihc_state_.lpf2_state - ihc_coeffs_.rest_output;
   }
+  return update_agc && AGCAdvance(0, num_samples, &tmp1_);
 }
 
-bool Ear::AGCStep(const ArrayX& ihc_out) {
+// This step is a one sample-time update of the inner-hair-cell (IHC) model,
+// including the detection nonlinearity and either one or two capacitor state
+// variables.
+void Ear::IHCStep(const Eigen::Ref<const ArrayX>& car_out) {
+  const IHCKernelArrays ihc = {
+      ihc_state_.ac_coupler.data(),   ihc_state_.ihc_out.data(),
+      ihc_state_.cap1_voltage.data(), ihc_state_.cap2_voltage.data(),
+      ihc_state_.lpf1_state.data(),   ihc_state_.lpf2_state.data()};
+  ActiveKernels().ihc_step[step_kernel_variant_][ihc_topology_](
+      num_channels_, ihc_coeffs_, car_out.data(), ihc);
+}
+
+bool Ear::AGCStep(const Eigen::Ref<const ArrayX>& ihc_out) {
   bool updated = false;
   const int num_stages = agc_coeffs_.size();
   if (num_stages > 0) {  // AGC is enabled.
     int stage = 0;
     FPType detect_scale = agc_coeffs_[num_stages - 1].detect_scale;
-    ArrayX& agc_in(tmp1_);
+    ArrayXMap& agc_in(tmp1_);
     agc_in = detect_scale * ihc_out;
     updated = AGCRecurse(stage, &agc_in);
   }
   return updated;
 }
 
-bool Ear::AGCRecurse(int stage, ArrayX* agc_in_out) {
+bool Ear::AGCRecurse(int stage, ArrayXMap* agc_in_out) {
+  // Unconditionally accumulate input for this stage from the previous stage:
+  agc_state_[stage].input_accum += *agc_in_out;
+  return AGCAdvance(stage, 1, agc_in_out);
+}
+
+bool Ear::AGCAdvance(int stage, int num_inputs, ArrayXMap* agc_in_out) {
   bool updated = false;
   const AGCCoeffs& agc_coeffs = agc_coeffs_[stage];
   AGCState& agc_state = agc_state_[stage];
-  // Unconditionally accumulate input for this stage from the previous stage:
-  agc_state.input_accum += *agc_in_out;
   // This is the decim factor for this stage, relative to input or prev. stage:
   int decim = agc_coeffs.decimation;
-  // Increment the decimation phase of this stage (do work on phase 0 only):
-  if (++agc_state.decim_phase >= decim) {
-    agc_state.decim_phase = 0;
+  // Advance the decimation phase of this stage (do work on phase 0 only):
+  *agc_state.decim_phase += num_inputs;
+  CARFAC_ASSERT(*agc_state.decim_phase <= decim &&
+                "AGC inputs were accumulated past a decimated update.");
+  if (*agc_state.decim_phase >= decim) {
+    *agc_state.decim_phase = 0;
     // Now do lots of time and space filtering work, at the decimated rate.
     // These are the decimated inputs for this stage, which will be further
     // decimated at the next stage.
@@ -213,7 +571,7 @@ bool Ear::AGCRecurse(int stage, ArrayX* agc_in_out) {
           agc_state_[stage + 1].agc_memory;
     }
     // This resets the accumulator.
-    agc_state.input_accum = ArrayX::Zero(num_channels_);
+    agc_state.input_accum.setZero();
     // This performs a first-order recursive smoothing filter update, in time,
     // at this stage's update rate.
     agc_state.agc_memory += agc_coeffs.agc_epsilon *
@@ -226,73 +584,18 @@ bool Ear::AGCRecurse(int stage, ArrayX* agc_in_out) {
 }
 
 void Ear::AGCSpatialSmooth(const AGCCoeffs& agc_coeffs,
-                           ArrayX* stage_state) {
+                           ArrayXMap* stage_state) {
   const int num_iterations = agc_coeffs.agc_spatial_iterations;
   const bool use_fir = num_iterations >= 0;
   if (use_fir) {
-    const FPType fir_coeffs_left = agc_coeffs.agc_spatial_fir_left;
-    const FPType fir_coeffs_mid = agc_coeffs.agc_spatial_fir_mid;
-    const FPType fir_coeffs_right = agc_coeffs.agc_spatial_fir_right;
-    ArrayX& smoothed_state(tmp2_);  // While tmp1_ is in use as agc_in.
-    switch (agc_coeffs.agc_spatial_n_taps) {
-      case 3:
-        for (int count = 0; count < num_iterations; ++count) {
-          // First filter most points, with vector parallelism.
-          smoothed_state.segment(1, num_channels_ - 2) =
-              fir_coeffs_mid * ((*stage_state).segment(1, num_channels_ - 2)) +
-              fir_coeffs_left * ((*stage_state).segment(0, num_channels_ - 2)) +
-              fir_coeffs_right * ((*stage_state).segment(2, num_channels_ - 2));
-          // Then patch up one point on each end, with clamped edge condition.
-          smoothed_state(0) = fir_coeffs_mid * (*stage_state)(0) +
-                              fir_coeffs_left * (*stage_state)(0) +
-                              fir_coeffs_right * (*stage_state)(1);
-          smoothed_state(num_channels_ - 1) =
-              fir_coeffs_mid * (*stage_state)(num_channels_ - 1) +
-              fir_coeffs_left * (*stage_state)(num_channels_ - 2) +
-              fir_coeffs_right * (*stage_state)(num_channels_ - 1);
-          // Copy smoothed state back from temp.
-          *stage_state = smoothed_state;
-        }
-        break;
-      case 5:
-        for (int count = 0; count < num_iterations; ++count) {
-          // First filter most points, with vector parallelism.
-          smoothed_state.segment(2, num_channels_ - 4) =
-              fir_coeffs_mid * ((*stage_state).segment(2, num_channels_ - 4)) +
-              fir_coeffs_left * ((*stage_state).segment(0, num_channels_ - 4) +
-                                 (*stage_state).segment(1, num_channels_ - 4)) +
-              fir_coeffs_right * ((*stage_state).segment(3, num_channels_ - 4) +
-                                  (*stage_state).segment(4, num_channels_ - 4));
-          // Then patch up 2 points on each end.
-          smoothed_state(0) =
-              fir_coeffs_mid * (*stage_state)(0) +
-              fir_coeffs_left * ((*stage_state)(0) + (*stage_state)(1)) +
-              fir_coeffs_right * ((*stage_state)(1) + (*stage_state)(2));
-          smoothed_state(1) =
-              fir_coeffs_mid * (*stage_state)(1) +
-              fir_coeffs_left * ((*stage_state)(0) + (*stage_state)(0)) +
-              fir_coeffs_right * ((*stage_state)(2) + (*stage_state)(3));
-          smoothed_state(num_channels_ - 1) =
-              fir_coeffs_mid * (*stage_state)(num_channels_ - 1) +
-              fir_coeffs_left * ((*stage_state)(num_channels_ - 2) +
-                                 (*stage_state)(num_channels_ - 3)) +
-              fir_coeffs_right * ((*stage_state)(num_channels_ - 1) +
-                                  (*stage_state)(num_channels_ - 1));
-          smoothed_state(num_channels_ - 2) =
-              fir_coeffs_mid * (*stage_state)(num_channels_ - 2) +
-              fir_coeffs_left * ((*stage_state)(num_channels_ - 3) +
-                                 (*stage_state)(num_channels_ - 4)) +
-              fir_coeffs_right * ((*stage_state)(num_channels_ - 1) +
-                                  (*stage_state)(num_channels_ - 1));
-          // Copy smoothed state back from temp.
-          *stage_state = smoothed_state;
-        }
-        break;
-      default:
-        CARFAC_ASSERT(false &&
-                      "Bad n_taps in AGCSpatialSmooth; should be 3 or 5.");
-        break;
-    }
+    CARFAC_ASSERT((agc_coeffs.agc_spatial_n_taps == 3 ||
+                   agc_coeffs.agc_spatial_n_taps == 5) &&
+                  "Bad n_taps in AGCSpatialSmooth; should be 3 or 5.");
+    // tmp2_ holds the smoothed state, while tmp1_ is in use as agc_in.
+    ActiveKernels().agc_spatial_smooth_fir(
+        num_channels_, agc_coeffs.agc_spatial_n_taps, num_iterations,
+        agc_coeffs.agc_spatial_fir_left, agc_coeffs.agc_spatial_fir_mid,
+        agc_coeffs.agc_spatial_fir_right, stage_state->data(), tmp2_.data());
   } else {
     // Fall back on IIR smoothing.
     AGCSmoothDoubleExponential(agc_coeffs.agc_pole_z1, agc_coeffs.agc_pole_z2,
@@ -302,7 +605,7 @@ void Ear::AGCSpatialSmooth(const AGCCoeffs& agc_coeffs,
 
 void Ear::AGCSmoothDoubleExponential(FPType pole_z1,
                                      FPType pole_z2,
-                                     ArrayX* stage_state) const {
+                                     ArrayXMap* stage_state) const {
   int32_t num_points = stage_state->size();
   FPType input;
   FPType state = 0.0;
@@ -326,17 +629,17 @@ void Ear::AGCSmoothDoubleExponential(FPType pole_z1,
 void Ear::CloseAGCLoop(bool open_loop) {
   if (open_loop) {
     // Zero the deltas to make the parameters not keep changing.
-    car_state_.dzb_memory.setZero(num_channels_);
-    car_state_.dg_memory.setZero(num_channels_);
+    car_state_.dzb_memory.setZero();
+    car_state_.dg_memory.setZero();
   } else {
     // Scale factor to get the deltas to update in this many steps.
     FPType scaling = 1.0 / agc_decimation(0);
-    ArrayX& undamping(tmp1_);
+    ArrayXMap& undamping(tmp1_);
     undamping = 1 - agc_memory(0);
     // This sets the delta for the damping zb.
     car_state_.dzb_memory = (zr_coeffs() * undamping - zb_memory()) * scaling;
     // Find new stage gains to go with new dampings.
-    ArrayX& g_values(tmp2_);
+    ArrayXMap& g_values(tmp2_);
     auto r = car_coeffs_.r1_coeffs + car_coeffs_.zr_coeffs * undamping;
     g_values = (1 - 2 * r * car_coeffs_.a0_coeffs + (r * r)) /
                (1 - 2 * r * car_coeffs_.a0_coeffs +
@@ -347,6 +650,6 @@ void Ear::CloseAGCLoop(bool open_loop) {
 }
 
 void Ear::CrossCouple(const ArrayX& mean_state, int stage) {
-  ArrayX& stage_state = agc_state_[stage].agc_memory;
+  ArrayXMap& stage_state = agc_state_[stage].agc_memory;
   stage_state += agc_coeffs_[stage].agc_mix_coeffs * (mean_state - stage_state);
 }
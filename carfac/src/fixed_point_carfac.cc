@@ -0,0 +1,468 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// This file is part of an implementation of Lyon's cochlear model:
+// "Cascade of Asymmetric Resonators with Fast-Acting Compression"
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fixed_point_carfac.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include "carfac_util.h"
+#include "kernels.h"
+
+namespace {
+
+// The numbers of fractional bits of the fixed-point formats.
+constexpr int kQ15 = 15;
+constexpr int kQ22 = 22;
+constexpr int kQ24 = 24;
+constexpr int kQ30 = 30;
+
+// Returns x with the given number of fractional bits, rounded and saturated
+// to 32 bits.
+int32_t ToFixed(double x, int fraction_bits) {
+  const double scaled = std::round(std::ldexp(x, fraction_bits));
+  return static_cast<int32_t>(std::clamp<double>(
+      scaled, std::numeric_limits<int32_t>::min(),
+      std::numeric_limits<int32_t>::max()));
+}
+
+std::vector<int16_t> ToFixed16(const ArrayX& x, int fraction_bits) {
+  std::vector<int16_t> fixed(x.size());
+  for (int i = 0; i < x.size(); ++i) {
+    fixed[i] = std::clamp(ToFixed(x(i), fraction_bits), -32768, 32767);
+  }
+  return fixed;
+}
+
+std::vector<int32_t> ToFixed32(const ArrayX& x, int fraction_bits) {
+  std::vector<int32_t> fixed(x.size());
+  for (int i = 0; i < x.size(); ++i) {
+    fixed[i] = ToFixed(x(i), fraction_bits);
+  }
+  return fixed;
+}
+
+// Replicates each per-channel coefficient for num_streams streams.
+template <typename T>
+std::vector<T> Replicate(const std::vector<T>& coeffs, int num_streams) {
+  std::vector<T> replicated(coeffs.size() * num_streams);
+  for (std::size_t channel = 0; channel < coeffs.size(); ++channel) {
+    std::fill_n(replicated.begin() + channel * num_streams, num_streams,
+                coeffs[channel]);
+  }
+  return replicated;
+}
+
+// Returns a * b / 2^shift, rounded, for shift > 0.
+inline int64_t MulShift(int64_t a, int64_t b, int shift) {
+  return (a * b + (int64_t{1} << (shift - 1))) >> shift;
+}
+
+}  // namespace
+
+FixedPointCARFAC::FixedPointCARFAC(int num_streams, FPType sample_rate,
+                                   const CARParams& car_params,
+                                   const IHCParams& ihc_params,
+                                   const AGCParams& agc_params) {
+  CARFAC_ASSERT(num_streams > 0 && "num_streams must be positive.");
+  num_streams_ = num_streams;
+  sample_rate_ = sample_rate;
+  pole_freqs_ = CARPoleFrequencies(sample_rate, car_params);
+  num_channels_ = pole_freqs_.size();
+  const int n = num_streams_;
+
+  CARCoeffs car_coeffs;
+  std::vector<AGCCoeffs> agc_coeffs;
+  CARFAC::DesignCARCoeffs(car_params, sample_rate_, pole_freqs_, &car_coeffs);
+  CARFAC::DesignIHCCoeffs(ihc_params, sample_rate_, &ihc_coeffs_);
+  CARFAC::DesignAGCCoeffs(agc_params, sample_rate_, &agc_coeffs);
+
+  r1_coeffs_q30_ = ToFixed32(car_coeffs.r1_coeffs, kQ30);
+  a0_coeffs_q30_ = ToFixed32(car_coeffs.a0_coeffs, kQ30);
+  c0_coeffs_q30_ = ToFixed32(car_coeffs.c0_coeffs, kQ30);
+  h_coeffs_q30_ = ToFixed32(car_coeffs.h_coeffs, kQ30);
+  zr_coeffs_q30_ = ToFixed32(car_coeffs.zr_coeffs, kQ30);
+  g0_coeffs_q30_ = ToFixed32(car_coeffs.g0_coeffs, kQ30);
+  r1_coeffs_ = Replicate(r1_coeffs_q30_, n);
+  a0_coeffs_ = Replicate(ToFixed16(car_coeffs.a0_coeffs, kQ15), n);
+  c0_coeffs_ = Replicate(ToFixed16(car_coeffs.c0_coeffs, kQ15), n);
+  // See FixedPointCARKernelArrays::state_shifts.
+  ArrayX scaled_h_coeffs = car_coeffs.h_coeffs;
+  std::vector<int32_t> state_shifts(num_channels_, 0);
+  for (int channel = 0; channel < num_channels_; ++channel) {
+    while (2 * scaled_h_coeffs(channel) < 1) {
+      scaled_h_coeffs(channel) *= 2;
+      ++state_shifts[channel];
+    }
+  }
+  h_coeffs_ = Replicate(ToFixed16(scaled_h_coeffs, kQ15), n);
+  state_shifts_ = Replicate(state_shifts, n);
+
+  ohc_nonlinearity_.resize(kFixedPointOHCTableSize);
+  for (int i = 0; i < kFixedPointOHCTableSize; ++i) {
+    const double difference =
+        std::ldexp(std::ldexp(i, kFixedPointOHCTableShift) - std::ldexp(1, 30),
+                   -kFixedPointSignalBits);
+    const double velocity =
+        car_coeffs.velocity_scale * difference + car_coeffs.v_offset;
+    ohc_nonlinearity_[i] = ToFixed(1 / (1 + velocity * velocity), kQ15);
+  }
+
+  ArrayX detect(kFixedPointDetectTableSize);
+  for (int i = 0; i < kFixedPointDetectTableSize; ++i) {
+    detect(i) = std::ldexp(kFixedPointDetectTableMin, -kFixedPointSignalBits) +
+                std::ldexp(i, -kFixedPointDetectTableBits);
+  }
+  CARFACDetect(&detect);
+  detect_nonlinearity_ = ToFixed32(detect, kQ15);
+  ihc_fixed_coeffs_ = {ToFixed(ihc_coeffs_.ac_coeff, kQ30),
+                       ToFixed(ihc_coeffs_.out1_rate, kQ30),
+                       ToFixed(ihc_coeffs_.in1_rate, kQ30),
+                       ToFixed(ihc_coeffs_.out2_rate, kQ30),
+                       ToFixed(ihc_coeffs_.in2_rate, kQ30),
+                       ToFixed(ihc_coeffs_.lpf_coeff, kQ30),
+                       ToFixed(ihc_coeffs_.output_gain, kQ22),
+                       ToFixed(ihc_coeffs_.rest_output, kQ24),
+                       detect_nonlinearity_.data()};
+
+  const int num_stages = agc_coeffs.size();
+  agc_coeffs_.resize(num_stages);
+  for (int stage = 0; stage < num_stages; ++stage) {
+    const AGCCoeffs& coeffs = agc_coeffs[stage];
+    AGCStageCoeffs& fixed = agc_coeffs_[stage];
+    fixed.decimation = coeffs.decimation;
+    fixed.decimation_scale = ToFixed(1.0 / coeffs.decimation, kQ30);
+    fixed.stage_gain = ToFixed(coeffs.agc_stage_gain, kQ24);
+    fixed.epsilon = ToFixed(coeffs.agc_epsilon, kQ30);
+    fixed.spatial_iterations = coeffs.agc_spatial_iterations;
+    fixed.spatial_n_taps = coeffs.agc_spatial_n_taps;
+    fixed.fir_left = ToFixed(coeffs.agc_spatial_fir_left, kQ30);
+    fixed.fir_mid = ToFixed(coeffs.agc_spatial_fir_mid, kQ30);
+    fixed.fir_right = ToFixed(coeffs.agc_spatial_fir_right, kQ30);
+    fixed.one_minus_pole_z1 = ToFixed(1 - coeffs.agc_pole_z1, kQ30);
+    fixed.one_minus_pole_z2 = ToFixed(1 - coeffs.agc_pole_z2, kQ30);
+  }
+  agc_detect_scale_ =
+      num_stages > 0 ? ToFixed(agc_coeffs.back().detect_scale, kQ30) : 0;
+
+  // Place the state arrays.
+  const int size = num_channels_ * n;
+  state_.resize((14 + 2 * num_stages) * size);
+  int32_t* next = state_.data();
+  for (int32_t** array :
+       {&z1_memory_, &z2_memory_, &za_memory_, &zy_memory_, &g_memory_,
+        &dg_memory_, &zb_memory_, &dzb_memory_, &ac_coupler_, &cap1_voltage_,
+        &cap2_voltage_, &lpf1_state_, &lpf2_state_, &ihc_out_}) {
+    *array = next;
+    next += size;
+  }
+  agc_memory_.resize(num_stages);
+  agc_input_accum_.resize(num_stages);
+  for (int stage = 0; stage < num_stages; ++stage) {
+    agc_memory_[stage] = next;
+    agc_input_accum_[stage] = next + size;
+    next += 2 * size;
+  }
+  tmp1_.resize(size);
+  tmp2_.resize(size);
+  in_out_.resize(n);
+  smoother_state_.resize(n);
+  nap_column_.resize(num_channels_);
+  Reset();
+}
+
+void FixedPointCARFAC::Reset() {
+  const int n = num_streams_;
+  std::fill(state_.begin(), state_.end(), 0);
+  for (int channel = 0; channel < num_channels_; ++channel) {
+    std::fill_n(&zb_memory_[channel * n], n, zr_coeffs_q30_[channel]);
+    std::fill_n(&g_memory_[channel * n], n, g0_coeffs_q30_[channel]);
+  }
+  const int size = num_channels_ * n;
+  if (!ihc_coeffs_.just_half_wave_rectify) {
+    std::fill_n(lpf1_state_, size, ihc_fixed_coeffs_.rest_output);
+    std::fill_n(lpf2_state_, size, ihc_fixed_coeffs_.rest_output);
+    std::fill_n(cap1_voltage_, size, ToFixed(ihc_coeffs_.rest_cap1, kQ30));
+    if (!ihc_coeffs_.one_capacitor) {
+      std::fill_n(cap2_voltage_, size, ToFixed(ihc_coeffs_.rest_cap2, kQ30));
+    }
+  }
+  agc_decim_phase_.assign(agc_coeffs_.size(), 0);
+}
+
+void FixedPointCARFAC::RunSegment(const Eigen::Ref<const ArrayXX>& sound_data,
+                                  bool open_loop,
+                                  const std::vector<CARFACOutput*>& outputs) {
+  CARFAC_ASSERT(sound_data.rows() == num_streams_);
+  CARFAC_ASSERT(static_cast<int>(outputs.size()) == num_streams_);
+  const int num_samples = sound_data.cols();
+  for (CARFACOutput* output : outputs) {
+    output->Resize(1, num_channels_, num_samples);
+  }
+
+  const FixedPointCARKernelArrays car = {
+      r1_coeffs_.data(),        a0_coeffs_.data(), c0_coeffs_.data(),
+      h_coeffs_.data(),         state_shifts_.data(), dg_memory_,
+      dzb_memory_,              ohc_nonlinearity_.data(), g_memory_,
+      zb_memory_,               z1_memory_,        z2_memory_,
+      za_memory_,               zy_memory_};
+  const FixedPointIHCKernelArrays ihc = {ac_coupler_,  ihc_out_,
+                                         cap1_voltage_, cap2_voltage_,
+                                         lpf1_state_,  lpf2_state_};
+  const KernelTable& kernels = ActiveKernels();
+  const FixedPointCARStepKernel car_step = kernels.fixed_point_car_step;
+  const FixedPointIHCStepKernel ihc_step =
+      kernels.fixed_point_ihc_step[static_cast<int>(
+          GetIHCTopology(ihc_coeffs_))];
+  const FPType input_scale = std::ldexp(FPType(1), kFixedPointSignalBits);
+  const FPType max_input = std::ldexp(FPType(1), 30) - 128;
+  const FPType signal_scale = 1 / input_scale;
+  const FPType nap_scale = std::ldexp(FPType(1), -kQ24);
+  const FPType agc_scale = std::ldexp(FPType(1), -kQ30);
+  const int n = num_streams_;
+
+  if (open_loop) {
+    CloseAGCLoop(open_loop);
+  }
+  for (int32_t timepoint = 0; timepoint < num_samples; ++timepoint) {
+    for (int stream = 0; stream < n; ++stream) {
+      in_out_[stream] = std::clamp<FPType>(
+          std::round(sound_data(stream, timepoint) * input_scale), -max_input,
+          max_input);
+    }
+    car_step(num_channels_, n, car, in_out_.data());
+    ihc_step(num_channels_ * n, ihc_fixed_coeffs_, zy_memory_, ihc);
+    const bool agc_memory_updated = !open_loop && AGCStep();
+    for (int stream = 0; stream < n; ++stream) {
+      CARFACOutput* output = outputs[stream];
+      if (output->store_nap_) {
+        for (int channel = 0; channel < num_channels_; ++channel) {
+          nap_column_[channel] = ihc_out_[channel * n + stream] * nap_scale;
+        }
+        output->AssignNAP(0, timepoint, nap_column_);
+      }
+      for (int channel = 0; channel < num_channels_; ++channel) {
+        const int i = channel * n + stream;
+        if (output->store_bm_) {
+          output->bm_[0](channel, timepoint) = zy_memory_[i] * signal_scale;
+        }
+        if (output->store_ohc_) {
+          output->ohc_[0](channel, timepoint) =
+              std::ldexp(za_memory_[i] * signal_scale, state_shifts_[i]);
+        }
+        if (output->store_agc_) {
+          output->agc_[0](channel, timepoint) = zb_memory_[i] * agc_scale;
+        }
+      }
+    }
+    if (agc_memory_updated) {
+      CloseAGCLoop(open_loop);
+    }
+  }
+}
+
+bool FixedPointCARFAC::AGCStep() {
+  bool updated = false;
+  if (!agc_coeffs_.empty()) {
+    int32_t* agc_in = tmp1_.data();
+    const int size = num_channels_ * num_streams_;
+    for (int i = 0; i < size; ++i) {
+      agc_in[i] = MulShift(agc_detect_scale_, ihc_out_[i], kQ30);
+    }
+    updated = AGCRecurse(0, agc_in);
+  }
+  return updated;
+}
+
+bool FixedPointCARFAC::AGCRecurse(int stage, int32_t* agc_in_out) {
+  const AGCStageCoeffs& coeffs = agc_coeffs_[stage];
+  const int size = num_channels_ * num_streams_;
+  int32_t* input_accum = agc_input_accum_[stage];
+  int32_t* agc_memory = agc_memory_[stage];
+  for (int i = 0; i < size; ++i) {
+    input_accum[i] += agc_in_out[i];
+  }
+  if (++agc_decim_phase_[stage] < coeffs.decimation) {
+    return false;
+  }
+  agc_decim_phase_[stage] = 0;
+  for (int i = 0; i < size; ++i) {
+    agc_in_out[i] = MulShift(input_accum[i], coeffs.decimation_scale, kQ30);
+  }
+  if (stage + 1 < static_cast<int>(agc_coeffs_.size())) {
+    for (int i = 0; i < size; ++i) {
+      input_accum[i] = agc_in_out[i];
+    }
+    AGCRecurse(stage + 1, input_accum);
+    const int32_t* next_memory = agc_memory_[stage + 1];
+    for (int i = 0; i < size; ++i) {
+      agc_in_out[i] += MulShift(coeffs.stage_gain, next_memory[i], kQ24);
+    }
+  }
+  for (int i = 0; i < size; ++i) {
+    input_accum[i] = 0;
+    agc_memory[i] +=
+        MulShift(coeffs.epsilon, agc_in_out[i] - agc_memory[i], kQ30);
+  }
+  AGCSpatialSmooth(stage, agc_memory);
+  return true;
+}
+
+void FixedPointCARFAC::AGCSpatialSmooth(int stage, int32_t* stage_state) {
+  const AGCStageCoeffs& coeffs = agc_coeffs_[stage];
+  if (coeffs.spatial_iterations < 0) {
+    AGCSmoothDoubleExponential(stage, stage_state);
+    return;
+  }
+  const int64_t left = coeffs.fir_left;
+  const int64_t mid = coeffs.fir_mid;
+  const int64_t right = coeffs.fir_right;
+  const int n = num_streams_;
+  const int last = num_channels_ - 1;
+  int32_t* smoothed_state = tmp2_.data();  // While tmp1_ is in use as agc_in.
+  // Returns the element of the stream in the given channel.
+  auto at = [stage_state, n](int channel, int stream) -> int64_t {
+    return stage_state[channel * n + stream];
+  };
+  for (int count = 0; count < coeffs.spatial_iterations; ++count) {
+    for (int channel = 0; channel <= last; ++channel) {
+      for (int stream = 0; stream < n; ++stream) {
+        int64_t sum;
+        if (coeffs.spatial_n_taps == 3) {
+          // The edges are clamped.
+          sum = mid * at(channel, stream) +
+                left * at(std::max(channel - 1, 0), stream) +
+                right * at(std::min(channel + 1, last), stream);
+        } else {
+          CARFAC_ASSERT(coeffs.spatial_n_taps == 5 &&
+                        "Bad n_taps in AGCSpatialSmooth; should be 3 or 5.");
+          // The edges follow CARFACBatch::AGCSpatialSmooth, where the first
+          // channel takes the second as its outer left neighbor.
+          const int left1 = std::max(channel - 1, 0);
+          const int left2 = channel >= 2 ? channel - 2 : 1 - channel;
+          sum = mid * at(channel, stream) +
+                left * (at(left2, stream) + at(left1, stream)) +
+                right * (at(std::min(channel + 1, last), stream) +
+                         at(std::min(channel + 2, last), stream));
+        }
+        smoothed_state[channel * n + stream] =
+            (sum + (int64_t{1} << (kQ30 - 1))) >> kQ30;
+      }
+    }
+    std::copy(smoothed_state, smoothed_state + num_channels_ * n,
+              stage_state);
+  }
+}
+
+void FixedPointCARFAC::AGCSmoothDoubleExponential(int stage,
+                                                  int32_t* stage_state) {
+  const AGCStageCoeffs& coeffs = agc_coeffs_[stage];
+  const int n = num_streams_;
+  const int num_points = num_channels_;
+  int32_t* state = smoother_state_.data();
+  std::fill_n(state, n, 0);
+  for (int i = num_points - 11; i < num_points; ++i) {
+    for (int stream = 0; stream < n; ++stream) {
+      state[stream] += MulShift(coeffs.one_minus_pole_z1,
+                                stage_state[i * n + stream] - state[stream],
+                                kQ30);
+    }
+  }
+  for (int i = num_points - 1; i > -1; --i) {
+    for (int stream = 0; stream < n; ++stream) {
+      state[stream] += MulShift(coeffs.one_minus_pole_z2,
+                                stage_state[i * n + stream] - state[stream],
+                                kQ30);
+    }
+  }
+  for (int i = 0; i < num_points; ++i) {
+    for (int stream = 0; stream < n; ++stream) {
+      state[stream] += MulShift(coeffs.one_minus_pole_z1,
+                                stage_state[i * n + stream] - state[stream],
+                                kQ30);
+      stage_state[i * n + stream] = state[stream];
+    }
+  }
+}
+
+void FixedPointCARFAC::CloseAGCLoop(bool open_loop) {
+  const int size = num_channels_ * num_streams_;
+  if (open_loop) {
+    std::fill_n(dzb_memory_, size, 0);
+    std::fill_n(dg_memory_, size, 0);
+    return;
+  }
+  const int64_t one = int64_t{1} << kQ30;
+  const int64_t scaling = agc_coeffs_[0].decimation_scale;
+  const int32_t* agc_memory = agc_memory_[0];
+  for (int channel = 0; channel < num_channels_; ++channel) {
+    const int64_t r1 = r1_coeffs_q30_[channel];
+    const int64_t a0 = a0_coeffs_q30_[channel];
+    const int64_t c0 = c0_coeffs_q30_[channel];
+    const int64_t h = h_coeffs_q30_[channel];
+    const int64_t zr = zr_coeffs_q30_[channel];
+    for (int stream = 0; stream < num_streams_; ++stream) {
+      const int i = channel * num_streams_ + stream;
+      // The AGC state has 24 fractional bits.
+      const int64_t undamping =
+          one - (int64_t{agc_memory[i]} << (kQ30 - kQ24));
+      const int64_t zb_target = MulShift(zr, undamping, kQ30);
+      dzb_memory_[i] = MulShift(zb_target - zb_memory_[i], scaling, kQ30);
+      const int64_t r = r1 + zb_target;
+      const int64_t numerator =
+          one - 2 * MulShift(r, a0, kQ30) + MulShift(r, r, kQ30);
+      const int64_t denominator =
+          numerator + MulShift(MulShift(h, r, kQ30), c0, kQ30);
+      const int64_t g = (numerator << kQ30) / denominator;
+      dg_memory_[i] = MulShift(g - g_memory_[i], scaling, kQ30);
+    }
+  }
+}
+
+std::size_t FixedPointCARFAC::state_size_bytes() const {
+  return state_.size() * sizeof(int32_t) +
+         agc_decim_phase_.size() * sizeof(int);
+}
+
+void FixedPointCARFAC::SaveState(void* state_data) const {
+  char* data = static_cast<char*>(state_data);
+  const std::size_t arrays_size_bytes = state_.size() * sizeof(int32_t);
+  std::memcpy(data, state_.data(), arrays_size_bytes);
+  std::memcpy(data + arrays_size_bytes, agc_decim_phase_.data(),
+              agc_decim_phase_.size() * sizeof(int));
+}
+
+void FixedPointCARFAC::RestoreState(const void* state_data) {
+  const char* data = static_cast<const char*>(state_data);
+  const std::size_t arrays_size_bytes = state_.size() * sizeof(int32_t);
+  std::memcpy(state_.data(), data, arrays_size_bytes);
+  std::memcpy(agc_decim_phase_.data(), data + arrays_size_bytes,
+              agc_decim_phase_.size() * sizeof(int));
+}
+
+FPType SignalToNoiseRatioDb(const ArrayXX& reference, const ArrayXX& test) {
+  CARFAC_ASSERT(reference.rows() == test.rows() &&
+                reference.cols() == test.cols());
+  const double signal_energy = reference.cast<double>().square().sum();
+  const double noise_energy = (reference - test).cast<double>().square().sum();
+  if (noise_energy == 0) {
+    return std::numeric_limits<FPType>::infinity();
+  }
+  return 10 * std::log10(signal_energy / noise_energy);
+}
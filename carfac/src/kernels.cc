@@ -0,0 +1,171 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// This file is part of an implementation of Lyon's cochlear model:
+// "Cascade of Asymmetric Resonators with Fast-Acting Compression"
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kernels.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+// The generic kernels are built with the flags of the rest of the library.
+#define CARFAC_KERNEL_NAMESPACE kernels_generic
+#include "kernels_impl.inc"
+#undef CARFAC_KERNEL_NAMESPACE
+
+#if defined(CARFAC_X86_KERNEL_VARIANTS)
+namespace kernels_sse4 {
+extern const KernelTable kKernelTable;
+}  // namespace kernels_sse4
+namespace kernels_avx2 {
+extern const KernelTable kKernelTable;
+}  // namespace kernels_avx2
+namespace kernels_avx512 {
+extern const KernelTable kKernelTable;
+}  // namespace kernels_avx512
+#endif
+
+namespace {
+
+constexpr KernelISA kAllISAs[] = {KernelISA::kGeneric, KernelISA::kSSE4,
+                                  KernelISA::kAVX2, KernelISA::kAVX512};
+
+// Returns the kernels of isa, or null if they were not built.
+const KernelTable* GetKernelTable(KernelISA isa) {
+  switch (isa) {
+    case KernelISA::kGeneric:
+      return &kernels_generic::kKernelTable;
+#if defined(CARFAC_X86_KERNEL_VARIANTS)
+    case KernelISA::kSSE4:
+      return &kernels_sse4::kKernelTable;
+    case KernelISA::kAVX2:
+      return &kernels_avx2::kKernelTable;
+    case KernelISA::kAVX512:
+      return &kernels_avx512::kKernelTable;
+#endif
+    default:
+      return nullptr;
+  }
+}
+
+bool CPUSupports(KernelISA isa) {
+#if defined(CARFAC_X86_KERNEL_VARIANTS)
+  // The checks include whether the OS saves the wider vector registers.
+  __builtin_cpu_init();
+  switch (isa) {
+    case KernelISA::kGeneric:
+      return true;
+    case KernelISA::kSSE4:
+      return __builtin_cpu_supports("sse4.2");
+    case KernelISA::kAVX2:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case KernelISA::kAVX512:
+      return __builtin_cpu_supports("avx512f") &&
+             __builtin_cpu_supports("avx512vl") &&
+             __builtin_cpu_supports("avx512dq") &&
+             __builtin_cpu_supports("avx512bw");
+  }
+  return false;
+#else
+  return isa == KernelISA::kGeneric;
+#endif
+}
+
+// Returns the widest supported instruction set, unless CARFAC_KERNEL_ISA
+// names another supported one.
+KernelISA DefaultKernelISA() {
+  const char* forced_name = std::getenv("CARFAC_KERNEL_ISA");
+  KernelISA best_isa = KernelISA::kGeneric;
+  for (KernelISA isa : kAllISAs) {
+    if (!IsKernelISASupported(isa)) {
+      continue;
+    }
+    if (forced_name != nullptr &&
+        std::strcmp(forced_name, KernelISAName(isa)) == 0) {
+      return isa;
+    }
+    best_isa = isa;
+  }
+  return best_isa;
+}
+
+// The kernels in use.  This is initialized on first use, rather than as a
+// global, so that it is ready for CARFAC objects constructed by the static
+// initializers of other files.
+struct ActiveKernelState {
+  ActiveKernelState()
+      : isa(DefaultKernelISA()), kernels(GetKernelTable(isa.load())) {}
+
+  std::atomic<KernelISA> isa;
+  std::atomic<const KernelTable*> kernels;
+};
+
+ActiveKernelState& GetActiveKernelState() {
+  static ActiveKernelState state;
+  return state;
+}
+
+}  // namespace
+
+const char* KernelISAName(KernelISA isa) {
+  switch (isa) {
+    case KernelISA::kGeneric:
+      return "generic";
+    case KernelISA::kSSE4:
+      return "sse4";
+    case KernelISA::kAVX2:
+      return "avx2";
+    case KernelISA::kAVX512:
+      return "avx512";
+  }
+  return "unknown";
+}
+
+IHCTopology GetIHCTopology(const IHCCoeffs& coeffs) {
+  if (coeffs.just_half_wave_rectify) {
+    return IHCTopology::kJustHalfWaveRectify;
+  }
+  return coeffs.one_capacitor ? IHCTopology::kOneCapacitor
+                              : IHCTopology::kTwoCapacitors;
+}
+
+int StepKernelVariant(int num_channels, NonlinearityPrecision precision) {
+  const int fixed = num_channels == kFixedStepKernelNumChannels ? 1 : 0;
+  const int fast = precision == NonlinearityPrecision::kFast ? 1 : 0;
+  return 2 * fixed + fast;
+}
+
+bool IsKernelISASupported(KernelISA isa) {
+  return GetKernelTable(isa) != nullptr && CPUSupports(isa);
+}
+
+KernelISA ActiveKernelISA() {
+  return GetActiveKernelState().isa.load(std::memory_order_relaxed);
+}
+
+bool SetKernelISA(KernelISA isa) {
+  if (!IsKernelISASupported(isa)) {
+    return false;
+  }
+  ActiveKernelState& state = GetActiveKernelState();
+  state.isa.store(isa, std::memory_order_relaxed);
+  state.kernels.store(GetKernelTable(isa), std::memory_order_relaxed);
+  return true;
+}
+
+const KernelTable& ActiveKernels() {
+  return *GetActiveKernelState().kernels.load(std::memory_order_relaxed);
+}
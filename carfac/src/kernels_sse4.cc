@@ -0,0 +1,24 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// This file is part of an implementation of Lyon's cochlear model:
+// "Cascade of Asymmetric Resonators with Fast-Acting Compression"
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The kernels built for SSE4.2, on x86-64 only.  The compiler flags
+// are set in CMakeLists.txt.
+
+#if defined(CARFAC_X86_KERNEL_VARIANTS)
+#define CARFAC_KERNEL_NAMESPACE kernels_sse4
+#include "kernels_impl.inc"
+#endif
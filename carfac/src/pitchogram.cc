@@ -16,6 +16,7 @@
 #include "pitchogram.h"
 
 #include <cmath>
+#include <cstring>
 
 #include "color.h"
 
@@ -70,32 +71,12 @@ void Pitchogram::Redesign(FPType sample_rate, const CARParams& car_params,
   if (!pitchogram_params_.log_lag) {
     output_.resize(sai_params.sai_width);
   } else {
-    // If log_lag is true, set up ResamplingCells to warp the pitchogram to a
-    // log axis. The ith cell covers the interval
-    //
-    //   (min_lag_s + log_offset_s) * spacing^i - log_offset_s
-    //   <= lag
-    //   <= (min_lag_s + log_offset_s) * spacing^(i + 1) - log_offset_s
-    //
-    // with spacing = 2^(1/lags_per_octave) such that
-    //
-    //   i / lags_per_octave
-    //   <= log2(lag + log_offset_s) - log2(min_lag_s + log_offset_s)
-    //   <= (i + 1) / lags_per_octave.
-    //
-    // We iteratively construct cells until we exceed sai_width.
-    const double spacing = std::exp2(1.0 / pitchogram_params_.lags_per_octave);
-    const double log_offset = sample_rate * pitchogram_params_.log_offset_s;
-    double left_edge = sample_rate * pitchogram_params_.min_lag_s;
-
-    while (true) {
-      const double right_edge = (left_edge + log_offset) * spacing - log_offset;
-      ResamplingCell cell(left_edge, right_edge);
-      if (cell.right_index >= sai_params.sai_width) { break; }
-      log_lag_cells_.push_back(cell);
-      left_edge = right_edge;
-    }
-
+    // If log_lag is true, set up LagCells to warp the pitchogram to a log
+    // axis.
+    log_lag_cells_ = LogLagCells(sample_rate, sai_params.sai_width,
+                                 pitchogram_params_.lags_per_octave,
+                                 pitchogram_params_.min_lag_s,
+                                 pitchogram_params_.log_offset_s);
     workspace_.resize(sai_params.sai_width);
     output_.resize(log_lag_cells_.size());
   }
@@ -109,6 +90,15 @@ void Pitchogram::Reset() {
   cgram_.setZero();
 }
 
+void Pitchogram::SaveState(void* state_data) const {
+  std::memcpy(state_data, cgram_.data(), state_size_bytes());
+}
+
+void Pitchogram::RestoreState(const void* state_data) {
+  std::memcpy(cgram_.data(), state_data, state_size_bytes());
+  vowel_coords_ = vowel_matrix_ * cgram_.matrix();
+}
+
 const ArrayX& Pitchogram::RunFrame(const ArrayXX& sai_frame) {
   CARFAC_ASSERT(mask_.rows() == sai_frame.rows() &&
                 mask_.cols() == sai_frame.cols() &&
@@ -124,7 +114,8 @@ const ArrayX& Pitchogram::RunFrame(const ArrayXX& sai_frame) {
   return output_;
 }
 
-const Pitchogram::VowelCoords& Pitchogram::VowelEmbedding(const ArrayXX& nap) {
+const Pitchogram::VowelCoords& Pitchogram::VowelEmbedding(
+    const Eigen::Ref<const RowMajorArrayXX>& nap) {
   cgram_ += cgram_smoother_ * (nap.rowwise().mean() - cgram_);
   vowel_coords_ = vowel_matrix_ * cgram_.matrix();
   return vowel_coords_;
@@ -165,38 +156,3 @@ void Pitchogram::DrawColumn(Image<uint8_t> dest) const {
     }
   }
 }
-
-Pitchogram::ResamplingCell::ResamplingCell(float left_edge, float right_edge) {
-  float cell_width = right_edge - left_edge;
-
-  if (cell_width < 1.0f) {  // Make the cell width at least one sample period.
-    float grow = 0.5f * (1.0f - cell_width);
-    left_edge -= grow;
-    right_edge += grow;
-  }
-
-  left_edge = std::max<float>(0.0f, left_edge);
-  right_edge = std::max<float>(0.0f, right_edge);
-  cell_width = right_edge - left_edge;
-
-  left_index = static_cast<int>(std::round(left_edge));
-  right_index = static_cast<int>(std::round(right_edge));
-  if (right_index > left_index && cell_width > 0.999f) {
-    left_weight = (0.5f - (left_edge - left_index)) / cell_width;
-    interior_weight = 1.0f / cell_width;
-    right_weight = (0.5f + (right_edge - right_index)) / cell_width;
-  } else {
-    left_weight = 1.0f;
-    interior_weight = 0.0f;
-    right_weight = 0.0f;
-  }
-}
-
-float Pitchogram::ResamplingCell::CellAverage(const ArrayX& samples) const {
-  if (left_index == right_index) { return samples[left_index]; }
-  return left_weight * samples[left_index] +
-          interior_weight *
-              samples.segment(left_index + 1, right_index - left_index - 1)
-                  .sum() +
-          right_weight * samples[right_index];
-}
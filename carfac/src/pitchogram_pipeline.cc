@@ -17,72 +17,543 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <type_traits>
 
 #include "color.h"
 #include "common.h"
 
+namespace {
+
+// Identifies pipeline state blobs, and their format version in the low byte.
+constexpr uint64_t kStateMagic = 0x43465053'54415403;  // "CFPSTAT" v3.
+
+// The blob starts with kStateMagic, the design fingerprint of the pipeline and
+// the sizes in bytes of the CARFAC, SAI, pitchogram and resampler states,
+// which follow in that order.  The resampler state is empty if the input is
+// not resampled.
+enum { kStateHeaderSize = 6 };
+
+// Accumulates a 64-bit FNV-1a hash of values, one field at a time so that
+// struct padding does not enter it.
+class DesignHasher {
+ public:
+  template <typename T>
+  void Add(T value) {
+    static_assert(std::is_arithmetic<T>::value, "Add fields one by one.");
+    unsigned char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    for (unsigned char byte : bytes) {
+      hash_ = (hash_ ^ byte) * 0x100000001b3;
+    }
+  }
+
+  template <typename T>
+  void Add(const std::vector<T>& values) {
+    Add(values.size());
+    for (const T& value : values) {
+      Add(value);
+    }
+  }
+
+  uint64_t hash() const { return hash_; }
+
+ private:
+  uint64_t hash_ = 0xcbf29ce484222325;
+};
+
+}  // namespace
+
+bool PitchogramPipelineParams::operator==(
+    const PitchogramPipelineParams& other) const {
+  const PitchogramParams& pitchogram = pitchogram_params;
+  const PitchogramParams& other_pitchogram = other.pitchogram_params;
+  return num_frames == other.num_frames &&
+         num_samples_per_segment == other.num_samples_per_segment &&
+         highest_pole_hz == other.highest_pole_hz &&
+         min_pole_hz == other.min_pole_hz && max_lag_s == other.max_lag_s &&
+         num_triggers_per_frame == other.num_triggers_per_frame &&
+         internal_sample_rate_hz == other.internal_sample_rate_hz &&
+         fixed_point_carfac == other.fixed_point_carfac &&
+         num_sai_threads == other.num_sai_threads &&
+         sai_output_width == other.sai_output_width &&
+         sai_log_lag_output == other.sai_log_lag_output &&
+         sai_bank == other.sai_bank &&
+         pitchogram.log_lag == other_pitchogram.log_lag &&
+         pitchogram.lags_per_octave == other_pitchogram.lags_per_octave &&
+         pitchogram.min_lag_s == other_pitchogram.min_lag_s &&
+         pitchogram.log_offset_s == other_pitchogram.log_offset_s &&
+         pitchogram.vowel_time_constant_s ==
+             other_pitchogram.vowel_time_constant_s &&
+         pitchogram.light_color_theme == other_pitchogram.light_color_theme;
+}
+
 PitchogramPipeline::PitchogramPipeline(float sample_rate_hz,
                                        const PitchogramPipelineParams& params) {
   CARFAC_ASSERT(sample_rate_hz > 0.0f && "sample_rate_hz must be positive.");
+  params_ = params;
   sample_rate_hz_ = sample_rate_hz;
   pitchogram_params_ = params.pitchogram_params;
+  num_samples_per_segment_ = params.num_samples_per_segment;
+
+  // Initialize the resampler, if the model runs at another rate.  The model
+  // rate is rounded to a whole number of samples per segment, so that every
+  // segment resamples to the same number of samples.
+  model_sample_rate_hz_ = sample_rate_hz_;
+  int model_samples_per_segment = num_samples_per_segment_;
+  if (params.internal_sample_rate_hz > 0.0f &&
+      params.internal_sample_rate_hz != sample_rate_hz_) {
+    model_samples_per_segment = std::max(
+        1, static_cast<int>(std::round(num_samples_per_segment_ *
+                                       params.internal_sample_rate_hz /
+                                       sample_rate_hz_)));
+    model_sample_rate_hz_ = sample_rate_hz_ * model_samples_per_segment /
+                            num_samples_per_segment_;
+    resampler_.reset(new Resampler(model_samples_per_segment,
+                                   num_samples_per_segment_,
+                                   num_samples_per_segment_));
+    resampled_segment_.resize(model_samples_per_segment);
+  }
 
   // Initialize CARFAC.
   car_params_.first_pole_theta =
-      2 * M_PI * params.highest_pole_hz / sample_rate_hz_;
-  carfac_.reset(new CARFAC(kNumEars, sample_rate_hz_, car_params_, ihc_params_,
-                           agc_params_));
+      2 * M_PI * params.highest_pole_hz / model_sample_rate_hz_;
+  car_params_.min_pole_hz = params.min_pole_hz;
+  int num_channels;
+  if (params.fixed_point_carfac) {
+    fixed_point_carfac_.reset(
+        new FixedPointCARFAC(kNumEars, model_sample_rate_hz_, car_params_,
+                             ihc_params_, agc_params_));
+    num_channels = fixed_point_carfac_->num_channels();
+  } else {
+    carfac_.reset(new CARFAC(kNumEars, model_sample_rate_hz_, car_params_,
+                             ihc_params_, agc_params_));
+    num_channels = carfac_->num_channels();
+  }
   carfac_output_buffer_.reset(new CARFACOutput(true, false, false, false));
+  fixed_point_outputs_ = {carfac_output_buffer_.get()};
 
   // Initialize SAI computation.
-  sai_params_.num_channels = carfac_->num_channels();
+  sai_params_.num_channels = num_channels;
   sai_params_.sai_width =
-      static_cast<int>(std::round(params.max_lag_s * sample_rate_hz_));
-  sai_params_.input_segment_width = params.num_samples_per_segment;
+      static_cast<int>(std::round(params.max_lag_s * model_sample_rate_hz_));
+  sai_params_.input_segment_width = model_samples_per_segment;
   sai_params_.trigger_window_width = sai_params_.input_segment_width + 1;
   sai_params_.future_lags = sai_params_.sai_width - 1;
   sai_params_.num_triggers_per_frame = params.num_triggers_per_frame;
   sai_.reset(new SAI(sai_params_));
-  sai_output_buffer_.resize(sai_params_.num_channels, sai_params_.sai_width);
+  carfac_output_buffer_->set_nap_sink(0, sai_.get());
+  if (params_.num_sai_threads > 1) {
+    sai_worker_pool_.reset(new WorkerPool(params_.num_sai_threads));
+    sai_->set_worker_pool(sai_worker_pool_.get());
+  }
+  CARFAC_ASSERT(
+      !(params_.sai_log_lag_output && params_.sai_output_width > 0) &&
+      "The SAI lags are pooled either linearly or on a log axis.");
+  if (params_.sai_log_lag_output) {
+    const PitchogramParams& pitchogram_params = params.pitchogram_params;
+    sai_->SetLagCells(LogLagCells(
+        model_sample_rate_hz_, sai_params_.sai_width,
+        pitchogram_params.lags_per_octave, pitchogram_params.min_lag_s,
+        pitchogram_params.log_offset_s));
+  } else if (params_.sai_output_width > 0) {
+    sai_->SetLagCells(
+        LinearLagCells(sai_params_.sai_width, params_.sai_output_width));
+  }
+  sai_output_buffer_.setZero(sai_params_.num_channels, sai_->output_width());
+
+  // Initialize the SAI bank, which takes the same input as sai_.
+  if (!params_.sai_bank.empty()) {
+    std::vector<NAPSink*> sinks = {sai_.get()};
+    for (const PitchogramSAIParams& bank_params : params_.sai_bank) {
+      SAIParams sai_params = sai_params_;
+      sai_params.sai_width = static_cast<int>(
+          std::round(bank_params.max_lag_s * model_sample_rate_hz_));
+      sai_params.future_lags = sai_params.sai_width - 1;
+      sai_params.num_triggers_per_frame = bank_params.num_triggers_per_frame;
+      sai_bank_.emplace_back(new SAI(sai_params));
+      SAI* sai = sai_bank_.back().get();
+      sai->set_worker_pool(sai_worker_pool_.get());
+      if (bank_params.output_width > 0) {
+        sai->SetLagCells(
+            LinearLagCells(sai_params.sai_width, bank_params.output_width));
+      }
+      sai_bank_output_.push_back(
+          ArrayXX::Zero(sai_params.num_channels, sai->output_width()));
+      sinks.push_back(sai);
+    }
+    nap_sinks_.reset(new NAPSinkGroup(sinks));
+    carfac_output_buffer_->set_nap_sink(0, nap_sinks_.get());
+  }
 
   // Initialize pitchogram computation.
-  pitchogram_.reset(new Pitchogram(sample_rate_hz_, car_params_, sai_params_,
-                                   pitchogram_params_));
-  image_ = Image<uint8_t>(params.num_frames, pitchogram_->num_lags(), 4);
-  image_rightmost_col_ = image_.col(params.num_frames - 1);
+  pitchogram_.reset(new Pitchogram(model_sample_rate_hz_, car_params_,
+                                   sai_params_, pitchogram_params_));
+  const int num_lags = pitchogram_->num_lags();
+  image_ring_storage_ = Image<uint8_t>(num_lags, params.num_frames, 4);
+  image_ring_ = Image<uint8_t>(image_ring_storage_.data(), params.num_frames,
+                               4 * num_lags, num_lags, 4, 4, 1);
+  image_ = Image<uint8_t>(params.num_frames, num_lags, 4);
+  ClearImage();
+
+  // Fingerprint the design, which is all of the params but num_sai_threads,
+  // on which the output does not depend.
+  DesignHasher hasher;
+  hasher.Add(sample_rate_hz_);
+  hasher.Add(params_.num_frames);
+  hasher.Add(params_.num_samples_per_segment);
+  hasher.Add(params_.highest_pole_hz);
+  hasher.Add(params_.min_pole_hz);
+  hasher.Add(params_.max_lag_s);
+  hasher.Add(params_.num_triggers_per_frame);
+  hasher.Add(params_.internal_sample_rate_hz);
+  hasher.Add(params_.fixed_point_carfac);
+  hasher.Add(params_.sai_output_width);
+  hasher.Add(params_.sai_log_lag_output);
+  hasher.Add(params_.sai_bank.size());
+  for (const PitchogramSAIParams& bank_params : params_.sai_bank) {
+    hasher.Add(bank_params.max_lag_s);
+    hasher.Add(bank_params.num_triggers_per_frame);
+    hasher.Add(bank_params.output_width);
+  }
+  hasher.Add(pitchogram_params_.log_lag);
+  hasher.Add(pitchogram_params_.lags_per_octave);
+  hasher.Add(pitchogram_params_.min_lag_s);
+  hasher.Add(pitchogram_params_.log_offset_s);
+  hasher.Add(pitchogram_params_.vowel_time_constant_s);
+  hasher.Add(pitchogram_params_.light_color_theme);
+  hasher.Add(car_params_.velocity_scale);
+  hasher.Add(car_params_.v_offset);
+  hasher.Add(car_params_.min_zeta);
+  hasher.Add(car_params_.max_zeta);
+  hasher.Add(car_params_.first_pole_theta);
+  hasher.Add(car_params_.zero_ratio);
+  hasher.Add(car_params_.high_f_damping_compression);
+  hasher.Add(car_params_.erb_per_step);
+  hasher.Add(car_params_.min_pole_hz);
+  hasher.Add(car_params_.erb_break_freq);
+  hasher.Add(car_params_.erb_q);
+  hasher.Add(ihc_params_.just_half_wave_rectify);
+  hasher.Add(ihc_params_.one_capacitor);
+  hasher.Add(ihc_params_.tau_lpf);
+  hasher.Add(ihc_params_.tau1_out);
+  hasher.Add(ihc_params_.tau1_in);
+  hasher.Add(ihc_params_.tau2_out);
+  hasher.Add(ihc_params_.tau2_in);
+  hasher.Add(ihc_params_.ac_corner_hz);
+  hasher.Add(agc_params_.num_stages);
+  hasher.Add(agc_params_.agc_stage_gain);
+  hasher.Add(agc_params_.agc_mix_coeff);
+  hasher.Add(agc_params_.time_constants);
+  hasher.Add(agc_params_.decimation);
+  hasher.Add(agc_params_.agc1_scales);
+  hasher.Add(agc_params_.agc2_scales);
+  design_fingerprint_ = hasher.hash();
+}
+
+void PitchogramPipeline::Reset() {
+  if (resampler_ != nullptr) {
+    resampler_->Reset();
+  }
+  if (carfac_ != nullptr) {
+    carfac_->Reset();
+  } else {
+    fixed_point_carfac_->Reset();
+  }
+  sai_->Reset();
+  sai_output_buffer_.setZero();
+  for (std::size_t i = 0; i < sai_bank_.size(); ++i) {
+    sai_bank_[i]->Reset();
+    sai_bank_output_[i].setZero();
+  }
+  pitchogram_->Reset();
+  ClearImage();
+}
 
+void PitchogramPipeline::ClearImage() {
   // Initialize image background color according to theme.
-  Color<uint8_t> background_rgb = (params.pitchogram_params.light_color_theme)
+  Color<uint8_t> background_rgb = (pitchogram_params_.light_color_theme)
                                       ? Color<uint8_t>::Gray(255)
                                       : Color<uint8_t>::Gray(0);
   const uint8_t background_rgba[4] = {background_rgb[0], background_rgb[1],
                                       background_rgb[2], 255};
   uint32_t background;
   std::memcpy(&background, background_rgba, 4);
-  uint32_t* data = reinterpret_cast<uint32_t*>(image_.data());
-  std::fill(data, data + image_.num_pixels(), background);
+  uint32_t* data = reinterpret_cast<uint32_t*>(image_ring_storage_.data());
+  std::fill(data, data + image_ring_storage_.num_pixels(), background);
+  image_next_col_ = 0;
+  image_is_linear_ = false;
+}
+
+const Image<uint8_t>& PitchogramPipeline::image() const {
+  if (!image_is_linear_) {
+    LinearizeImage();
+  }
+  return image_;
+}
+
+std::array<Image<const uint8_t>, 2> PitchogramPipeline::image_spans() const {
+  return {image_ring_.crop(image_next_col_, 0, width() - image_next_col_,
+                           height()),
+          image_ring_.crop(0, 0, image_next_col_, height())};
 }
 
-void PitchogramPipeline::ProcessJustSamples(const float* samples, int num_samples) {
+void PitchogramPipeline::LinearizeImage() const {
+  uint8_t* dest = image_.data();
+  for (const Image<const uint8_t>& span : image_spans()) {
+    for (int x = 0; x < span.width(); ++x, dest += image_.x_stride()) {
+      const uint8_t* src = span.data() + x * span.x_stride();
+      for (int y = 0; y < span.height(); ++y) {
+        std::memcpy(dest + y * image_.y_stride(), src + y * span.y_stride(),
+                    4);
+      }
+    }
+  }
+  image_is_linear_ = true;
+}
+
+void PitchogramPipeline::RunCARFACAndSAI(const float* samples,
+                                         int num_samples) {
+  if (resampler_ != nullptr) {
+    CARFAC_ASSERT(num_samples == num_samples_per_segment_ &&
+                  "Resampled segments must be num_samples_per_segment long.");
+    num_samples =
+        resampler_->Process(samples, num_samples, resampled_segment_.data());
+    samples = resampled_segment_.data();
+  }
+  CARFAC_ASSERT(num_samples == kNumEars * model_samples_per_segment() &&
+                "Unexpected number of input samples.");
   auto input_map = ArrayXX::Map(samples, kNumEars, num_samples / kNumEars);
-  carfac_->RunSegment(input_map, false /* open_loop */,
-                      carfac_output_buffer_.get());
-  sai_->RunSegment(carfac_output_buffer_->nap()[0], &sai_output_buffer_);
+  // CARFAC appends the NAP to the SAI input buffer as it goes.
+  if (carfac_ != nullptr) {
+    carfac_->RunSegment(input_map, false /* open_loop */,
+                        carfac_output_buffer_.get());
+  } else {
+    fixed_point_carfac_->RunSegment(input_map, false /* open_loop */,
+                                    fixed_point_outputs_);
+  }
+  sai_->GetOutput(&sai_output_buffer_);
+  for (std::size_t i = 0; i < sai_bank_.size(); ++i) {
+    sai_bank_[i]->GetOutput(&sai_bank_output_[i]);
+  }
+}
+
+void PitchogramPipeline::ProcessJustSamples(const float* samples,
+                                            int num_samples) {
+  RunCARFACAndSAI(samples, num_samples);
 }
 
 void PitchogramPipeline::ProcessSamples(const float* samples, int num_samples) {
-  auto input_map = ArrayXX::Map(samples, kNumEars, num_samples / kNumEars);
-  carfac_->RunSegment(input_map, false /* open_loop */,
-                      carfac_output_buffer_.get());
-  sai_->RunSegment(carfac_output_buffer_->nap()[0], &sai_output_buffer_);
+  CARFAC_ASSERT(sai_->lag_cells().empty() &&
+                "The pitchogram needs the SAI output of every lag.");
+  RunCARFACAndSAI(samples, num_samples);
 
   // Compute the next pitchogram frame and 2D vowel embedding.
   pitchogram_->RunFrame(sai_output_buffer_);
-  pitchogram_->VowelEmbedding(carfac_output_buffer_->nap()[0]);
+  pitchogram_->VowelEmbedding(nap());
+
+  // Draw the new frame over the oldest column of the ring.
+  pitchogram_->DrawColumn(image_ring_.col(image_next_col_));
+  image_next_col_ = (image_next_col_ + 1) % image_ring_.width();
+  image_is_linear_ = false;
+}
+
+void PitchogramPipeline::SetActiveBands(
+    const std::vector<std::pair<float, float>>& bands_hz,
+    int margin_channels) {
+  CARFAC_ASSERT(margin_channels >= 0);
+  if (bands_hz.empty()) {
+    SetSAIChannelMask({});
+    return;
+  }
+  const ArrayX& pole_frequencies = this->pole_frequencies();
+  const int num_channels = pole_frequencies.size();
+  std::vector<bool> channel_mask(num_channels, false);
+  for (const auto& [low_hz, high_hz] : bands_hz) {
+    CARFAC_ASSERT(low_hz <= high_hz);
+    // The pole frequencies decrease with the channel index.  A band between
+    // two poles selects the channel nearest to it.
+    int first = num_channels;
+    int last = -1;
+    for (int channel = 0; channel < num_channels; ++channel) {
+      if (pole_frequencies(channel) >= low_hz &&
+          pole_frequencies(channel) <= high_hz) {
+        first = std::min(first, channel);
+        last = std::max(last, channel);
+      }
+    }
+    if (last < 0) {
+      (pole_frequencies - std::sqrt(low_hz * high_hz)).abs().minCoeff(&first);
+      last = first;
+    }
+    first = std::max(0, first - margin_channels);
+    last = std::min(num_channels - 1, last + margin_channels);
+    std::fill(channel_mask.begin() + first, channel_mask.begin() + last + 1,
+              true);
+  }
+  SetSAIChannelMask(channel_mask);
+}
+
+void PitchogramPipeline::SetSAIChannelMask(
+    const std::vector<bool>& channel_mask) {
+  sai_->SetChannelMask(channel_mask);
+  for (const std::unique_ptr<SAI>& sai : sai_bank_) {
+    sai->SetChannelMask(channel_mask);
+  }
+}
+
+std::size_t PitchogramPipeline::carfac_state_size_bytes() const {
+  return carfac_ != nullptr ? carfac_->state_size_bytes()
+                            : fixed_point_carfac_->state_size_bytes();
+}
+
+std::size_t PitchogramPipeline::sai_state_size_bytes() const {
+  std::size_t size = sai_->state_size_bytes();
+  for (const std::unique_ptr<SAI>& sai : sai_bank_) {
+    size += sai->state_size_bytes();
+  }
+  return size;
+}
+
+std::size_t PitchogramPipeline::resampler_state_size_bytes() const {
+  return resampler_ != nullptr ? resampler_->state_size_bytes() : 0;
+}
+
+void PitchogramPipeline::SaveState(std::vector<uint8_t>* state) const {
+  const uint64_t header[kStateHeaderSize] = {
+      kStateMagic, design_fingerprint_, carfac_state_size_bytes(),
+      sai_state_size_bytes(), pitchogram_->state_size_bytes(),
+      resampler_state_size_bytes()};
+  state->resize(sizeof(header) + header[2] + header[3] + header[4] +
+                header[5]);
+  uint8_t* data = state->data();
+  std::memcpy(data, header, sizeof(header));
+  data += sizeof(header);
+  if (carfac_ != nullptr) {
+    carfac_->SaveState(data);
+  } else {
+    fixed_point_carfac_->SaveState(data);
+  }
+  data += header[2];
+  // The bank SAIs follow the main one.
+  sai_->SaveState(data);
+  uint8_t* sai_data = data + sai_->state_size_bytes();
+  for (const std::unique_ptr<SAI>& sai : sai_bank_) {
+    sai->SaveState(sai_data);
+    sai_data += sai->state_size_bytes();
+  }
+  data += header[3];
+  pitchogram_->SaveState(data);
+  data += header[4];
+  if (resampler_ != nullptr) {
+    resampler_->SaveState(data);
+  }
+}
 
-  // Scroll image content one pixel left.
-  std::memmove(image_.data(), image_.data() + 4, 4 * (image_.num_pixels() - 1));
+bool PitchogramPipeline::RestoreState(const std::vector<uint8_t>& state) {
+  const uint64_t expected_header[kStateHeaderSize] = {
+      kStateMagic, design_fingerprint_, carfac_state_size_bytes(),
+      sai_state_size_bytes(), pitchogram_->state_size_bytes(),
+      resampler_state_size_bytes()};
+  if (state.size() != sizeof(expected_header) + expected_header[2] +
+                          expected_header[3] + expected_header[4] +
+                          expected_header[5] ||
+      std::memcmp(state.data(), expected_header, sizeof(expected_header))) {
+    return false;
+  }
+  const uint8_t* data = state.data() + sizeof(expected_header);
+  if (carfac_ != nullptr) {
+    carfac_->RestoreState(data);
+  } else {
+    fixed_point_carfac_->RestoreState(data);
+  }
+  data += expected_header[2];
+  sai_->RestoreState(data);
+  const uint8_t* sai_data = data + sai_->state_size_bytes();
+  for (const std::unique_ptr<SAI>& sai : sai_bank_) {
+    sai->RestoreState(sai_data);
+    sai_data += sai->state_size_bytes();
+  }
+  data += expected_header[3];
+  pitchogram_->RestoreState(data);
+  data += expected_header[4];
+  if (resampler_ != nullptr) {
+    resampler_->RestoreState(data);
+  }
+  return true;
+}
+
+PitchogramKeyframeIndex::PitchogramKeyframeIndex(
+    const PitchogramPipeline& pipeline, float interval_s) {
+  CARFAC_ASSERT(interval_s > 0.0f);
+  keyframe_interval_ = std::max(
+      1, static_cast<int>(std::round(interval_s * pipeline.sample_rate_hz() /
+                                     pipeline.num_samples_per_segment())));
+  keyframes_.emplace_back();
+  pipeline.SaveState(&keyframes_.back());
+}
+
+void PitchogramKeyframeIndex::Update(int num_frames,
+                                     const PitchogramPipeline& pipeline) {
+  if (num_frames == num_keyframes() * keyframe_interval_) {
+    keyframes_.emplace_back();
+    pipeline.SaveState(&keyframes_.back());
+  }
+}
+
+int PitchogramKeyframeIndex::Seek(int num_frames,
+                                  PitchogramPipeline* pipeline) const {
+  CARFAC_ASSERT(num_frames >= 0);
+  const int keyframe =
+      std::min(num_frames / keyframe_interval_, num_keyframes() - 1);
+  const bool restored = pipeline->RestoreState(keyframes_[keyframe]);
+  CARFAC_ASSERT(restored && "Pipeline design differs from the keyframes.");
+  (void)restored;
+  return keyframe * keyframe_interval_;
+}
+
+PitchogramPipelinePool::PitchogramPipelinePool(int max_idle_pipelines)
+    : max_idle_pipelines_(max_idle_pipelines) {
+  CARFAC_ASSERT(max_idle_pipelines >= 0);
+}
+
+std::unique_ptr<PitchogramPipeline> PitchogramPipelinePool::Acquire(
+    float sample_rate_hz, const PitchogramPipelineParams& params) {
+  std::unique_ptr<PitchogramPipeline> pipeline;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The most recently released match is the most likely to be in cache.
+    for (int i = idle_pipelines_.size() - 1; i >= 0; --i) {
+      if (idle_pipelines_[i]->sample_rate_hz() == sample_rate_hz &&
+          idle_pipelines_[i]->params() == params) {
+        pipeline = std::move(idle_pipelines_[i]);
+        idle_pipelines_.erase(idle_pipelines_.begin() + i);
+        break;
+      }
+    }
+  }
+  if (pipeline == nullptr) {
+    return std::make_unique<PitchogramPipeline>(sample_rate_hz, params);
+  }
+  pipeline->SetActiveBands({});
+  pipeline->Reset();
+  return pipeline;
+}
+
+void PitchogramPipelinePool::Release(
+    std::unique_ptr<PitchogramPipeline> pipeline) {
+  CARFAC_ASSERT(pipeline != nullptr);
+  std::unique_ptr<PitchogramPipeline> dropped;
+  std::lock_guard<std::mutex> lock(mutex_);
+  idle_pipelines_.push_back(std::move(pipeline));
+  if (idle_pipelines_.size() > max_idle_pipelines_) {
+    // Destroyed after the lock is released.
+    dropped = std::move(idle_pipelines_.front());
+    idle_pipelines_.erase(idle_pipelines_.begin());
+  }
+}
 
-  // Write the new frame to the rightmost column.
-  pitchogram_->DrawColumn(image_rightmost_col_);
+int PitchogramPipelinePool::num_idle_pipelines() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return idle_pipelines_.size();
 }
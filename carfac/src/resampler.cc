@@ -0,0 +1,152 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// This file is part of an implementation of Lyon's cochlear model:
+// "Cascade of Asymmetric Resonators with Fast-Acting Compression"
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+
+namespace {
+
+// Returns the modified Bessel function of the first kind of order zero, by
+// its power series.
+double BesselI0(double x) {
+  double sum = 1;
+  double term = 1;
+  for (int k = 1; term > 1e-12 * sum; ++k) {
+    const double half_x_over_k = x / (2 * k);
+    term *= half_x_over_k * half_x_over_k;
+    sum += term;
+  }
+  return sum;
+}
+
+}  // namespace
+
+Resampler::Resampler(int interpolation, int decimation, int max_input_samples,
+                     const ResamplerParams& params) {
+  CARFAC_ASSERT(interpolation > 0 && decimation > 0 &&
+                "The resampling factors must be positive.");
+  CARFAC_ASSERT(max_input_samples > 0);
+  CARFAC_ASSERT(params.num_zero_crossings > 0 && params.cutoff > 0 &&
+                params.cutoff <= 1);
+  const int divisor = std::gcd(interpolation, decimation);
+  interpolation_ = interpolation / divisor;
+  decimation_ = decimation / divisor;
+  max_input_samples_ = max_input_samples;
+
+  // The prototype filter runs at the interpolated rate, where its cutoff is
+  // at this fraction of the Nyquist frequency, and spans num_zero_crossings
+  // zero crossings of the sinc on each side of its center.
+  const double cutoff =
+      params.cutoff / std::max(interpolation_, decimation_);
+  const double half_length = params.num_zero_crossings / cutoff;
+  num_taps_ = static_cast<int>(std::ceil(2 * half_length / interpolation_));
+  const int length = num_taps_ * interpolation_;
+  const double center = (length - 1) / 2.0;
+  const double window_scale = 1 / BesselI0(params.kaiser_beta);
+  phases_.resize(length);
+  for (int phase = 0; phase < interpolation_; ++phase) {
+    // Tap k of the phase weighs the input sample k samples before the
+    // newest one, and is stored at num_taps_ - 1 - k.
+    FPType* taps = &phases_[phase * num_taps_];
+    double sum = 0;
+    for (int k = 0; k < num_taps_; ++k) {
+      const double t = phase + k * interpolation_ - center;
+      const double x = t / (length / 2.0);
+      const double window =
+          BesselI0(params.kaiser_beta * std::sqrt(std::max(0.0, 1 - x * x))) *
+          window_scale;
+      const double sinc =
+          t == 0 ? 1 : std::sin(M_PI * cutoff * t) / (M_PI * cutoff * t);
+      const double tap = sinc * window;
+      taps[num_taps_ - 1 - k] = tap;
+      sum += tap;
+    }
+    // Each phase has unit gain at DC, so a constant input gives a constant
+    // output.
+    for (int k = 0; k < num_taps_; ++k) {
+      taps[k] /= sum;
+    }
+  }
+  buffer_.resize(num_taps_ - 1 + max_input_samples_);
+  Reset();
+}
+
+void Resampler::Reset() {
+  std::fill(buffer_.begin(), buffer_.end(), 0);
+  next_input_ = 0;
+  next_phase_ = 0;
+}
+
+int Resampler::Process(const FPType* input, int num_samples, FPType* output) {
+  CARFAC_ASSERT(num_samples <= max_input_samples_ &&
+                "Input is longer than max_input_samples.");
+  const int history = num_taps_ - 1;
+  std::copy(input, input + num_samples, buffer_.begin() + history);
+  int num_outputs = 0;
+  while (next_input_ < num_samples) {
+    const FPType* taps = &phases_[next_phase_ * num_taps_];
+    const FPType* window = &buffer_[next_input_];
+    FPType sum = 0;
+    for (int k = 0; k < num_taps_; ++k) {
+      sum += taps[k] * window[k];
+    }
+    output[num_outputs++] = sum;
+    next_phase_ += decimation_;
+    next_input_ += next_phase_ / interpolation_;
+    next_phase_ %= interpolation_;
+  }
+  next_input_ -= num_samples;
+  std::copy(buffer_.begin() + num_samples,
+            buffer_.begin() + num_samples + history, buffer_.begin());
+  return num_outputs;
+}
+
+int Resampler::MaxOutputSamples(int num_samples) const {
+  return (static_cast<int64_t>(num_samples) * interpolation_ + decimation_ -
+          1) / decimation_;
+}
+
+FPType Resampler::delay() const {
+  return (num_taps_ * interpolation_ - 1) / (2.0 * interpolation_);
+}
+
+std::size_t Resampler::state_size_bytes() const {
+  return (num_taps_ - 1) * sizeof(FPType) + 2 * sizeof(int);
+}
+
+void Resampler::SaveState(void* state_data) const {
+  char* data = static_cast<char*>(state_data);
+  const std::size_t history_size_bytes = (num_taps_ - 1) * sizeof(FPType);
+  std::memcpy(data, buffer_.data(), history_size_bytes);
+  data += history_size_bytes;
+  std::memcpy(data, &next_input_, sizeof(int));
+  std::memcpy(data + sizeof(int), &next_phase_, sizeof(int));
+}
+
+void Resampler::RestoreState(const void* state_data) {
+  const char* data = static_cast<const char*>(state_data);
+  const std::size_t history_size_bytes = (num_taps_ - 1) * sizeof(FPType);
+  std::memcpy(buffer_.data(), data, history_size_bytes);
+  data += history_size_bytes;
+  std::memcpy(&next_input_, data, sizeof(int));
+  std::memcpy(&next_phase_, data + sizeof(int), sizeof(int));
+}
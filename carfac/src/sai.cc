@@ -18,6 +18,11 @@
 
 #include "sai.h"
 
+#include <algorithm>
+#include <cmath>
+
+#include "kernels.h"
+
 SAI::SAI(const SAIParams& params) : SAIBase(params) {
   // SAI::Reset() must be called here.  It may seem like Reset() is
   // already being called in the SAIBase constructor, but that's
@@ -26,8 +31,30 @@ SAI::SAI(const SAIParams& params) : SAIBase(params) {
 }
 
 void SAI::Reset() {
-  input_buffer_.setZero(params().num_channels, buffer_width());
-  output_buffer_.setZero(params().num_channels, params().sai_width);
+  input_history_.Reset(params().num_channels, buffer_width());
+  output_buffer_.setZero(params().num_channels, output_width());
+}
+
+std::size_t SAI::state_size_bytes() const {
+  return (input_history_.num_channels() * input_history_.width() +
+          output_buffer_.size()) *
+         sizeof(FPType);
+}
+
+void SAI::SaveState(void* state_data) const {
+  FPType* data = static_cast<FPType*>(state_data);
+  input_history_.Save(data);
+  // The output is saved in column major order, as the history.
+  ArrayXX::Map(data + input_history_.num_channels() * input_history_.width(),
+               output_buffer_.rows(), output_buffer_.cols()) = output_buffer_;
+}
+
+void SAI::RestoreState(const void* state_data) {
+  const FPType* data = static_cast<const FPType*>(state_data);
+  input_history_.Restore(data);
+  output_buffer_ = ArrayXX::Map(
+      data + input_history_.num_channels() * input_history_.width(),
+      output_buffer_.rows(), output_buffer_.cols());
 }
 
 void SAI::RunSegment(const ArrayXX& input_segment, ArrayXX* output_frame) {
@@ -38,16 +65,173 @@ void SAI::RunSegment(const ArrayXX& input_segment, ArrayXX* output_frame) {
 }
 
 void SAI::RunInput(const ArrayXX& input_segment) {
-  ShiftAndAppendInput(input_segment, &input_buffer_);
+  CARFAC_ASSERT(input_segment.rows() == params().num_channels &&
+                "Unexpected number of input channels.");
+  input_history_.Append(input_segment);
+}
+
+void SAI::BeginSegment(int /*num_samples*/) {
+  // The history appends samples one at a time, so there is nothing to
+  // prepare.
+}
+
+void SAI::AppendSample(
+    int /*sample_index*/,
+    const Eigen::Ref<const ArrayX, 0, Eigen::InnerStride<>>& nap) {
+  CARFAC_ASSERT(nap.size() == params().num_channels &&
+                "Unexpected number of input channels.");
+  input_history_.AppendSample(nap);
 }
 
 void SAI::GetOutput(ArrayXX* output_frame) {
-  StabilizeSegment(input_buffer_, input_buffer_, &output_buffer_);
+  StabilizeSegment(input_history_.samples(), input_history_.samples(),
+                   &output_buffer_);
   *output_frame = output_buffer_;
 }
 
+LagCell::LagCell(float left_edge, float right_edge) {
+  float cell_width = right_edge - left_edge;
+
+  if (cell_width < 1.0f) {  // Make the cell width at least one sample period.
+    float grow = 0.5f * (1.0f - cell_width);
+    left_edge -= grow;
+    right_edge += grow;
+  }
+
+  left_edge = std::max<float>(0.0f, left_edge);
+  right_edge = std::max<float>(0.0f, right_edge);
+  cell_width = right_edge - left_edge;
+
+  left_index = static_cast<int>(std::round(left_edge));
+  right_index = static_cast<int>(std::round(right_edge));
+  if (right_index > left_index && cell_width > 0.999f) {
+    left_weight = (0.5f - (left_edge - left_index)) / cell_width;
+    interior_weight = 1.0f / cell_width;
+    right_weight = (0.5f + (right_edge - right_index)) / cell_width;
+  } else {
+    left_weight = 1.0f;
+    interior_weight = 0.0f;
+    right_weight = 0.0f;
+  }
+}
+
+float LagCell::CellAverage(const ArrayX& samples) const {
+  if (left_index == right_index) { return samples[left_index]; }
+  return left_weight * samples[left_index] +
+          interior_weight *
+              samples.segment(left_index + 1, right_index - left_index - 1)
+                  .sum() +
+          right_weight * samples[right_index];
+}
+
+float LagCell::CellAverage(const FPType* samples) const {
+  if (left_index == right_index) { return samples[left_index]; }
+  constexpr int kNumSums = 8;
+  FPType sums[kNumSums] = {0};
+  int i = left_index + 1;
+  for (; i + kNumSums <= right_index; i += kNumSums) {
+    for (int k = 0; k < kNumSums; ++k) {
+      sums[k] += samples[i + k];
+    }
+  }
+  for (; i < right_index; ++i) {
+    sums[0] += samples[i];
+  }
+  const FPType interior_sum = ((sums[0] + sums[4]) + (sums[1] + sums[5])) +
+                              ((sums[2] + sums[6]) + (sums[3] + sums[7]));
+  return left_weight * samples[left_index] + interior_weight * interior_sum +
+         right_weight * samples[right_index];
+}
+
+std::vector<LagCell> LinearLagCells(int sai_width, int num_cells) {
+  CARFAC_ASSERT(num_cells > 0 && num_cells <= sai_width &&
+                "There must be between 1 and sai_width cells.");
+  // The cells split the span of the lag sample positions, [0, sai_width -
+  // 1], so that the first and last lags count half.
+  const double cell_width = static_cast<double>(sai_width - 1) / num_cells;
+  std::vector<LagCell> cells;
+  for (int i = 0; i < num_cells; ++i) {
+    cells.emplace_back(i * cell_width,
+                       i + 1 < num_cells ? (i + 1) * cell_width
+                                         : sai_width - 1);
+  }
+  return cells;
+}
+
+std::vector<LagCell> LogLagCells(FPType sample_rate, int sai_width,
+                                 float lags_per_octave, float min_lag_s,
+                                 float log_offset_s) {
+  // The ith cell covers the interval
+  //
+  //   (min_lag_s + log_offset_s) * spacing^i - log_offset_s
+  //   <= lag
+  //   <= (min_lag_s + log_offset_s) * spacing^(i + 1) - log_offset_s
+  //
+  // with spacing = 2^(1/lags_per_octave) such that
+  //
+  //   i / lags_per_octave
+  //   <= log2(lag + log_offset_s) - log2(min_lag_s + log_offset_s)
+  //   <= (i + 1) / lags_per_octave.
+  //
+  // We iteratively construct cells until we exceed sai_width.
+  const double spacing = std::exp2(1.0 / lags_per_octave);
+  const double log_offset = sample_rate * log_offset_s;
+  double left_edge = sample_rate * min_lag_s;
+
+  std::vector<LagCell> cells;
+  while (true) {
+    const double right_edge = (left_edge + log_offset) * spacing - log_offset;
+    LagCell cell(left_edge, right_edge);
+    if (cell.right_index >= sai_width) { break; }
+    cells.push_back(cell);
+    left_edge = right_edge;
+  }
+  return cells;
+}
+
 namespace sai_internal {
 
+void InputHistory::Reset(int num_channels, int width) {
+  width_ = width;
+  head_ = 0;
+  buffer_.setZero(num_channels, 2 * width);
+}
+
+void InputHistory::Append(const Eigen::Ref<const ArrayXX>& segment) {
+  CARFAC_ASSERT(segment.rows() == num_channels());
+  // Samples older than the history are dropped.
+  const int num_samples = std::min<int>(segment.cols(), width_);
+  const auto kept = segment.rightCols(num_samples);
+  // The segment goes to columns [head_, head_ + num_samples), which do not
+  // wrap around the end of buffer_, and the mirror of each of them is
+  // width_ columns away.
+  buffer_.middleCols(head_, num_samples) = kept;
+  const int first_width = std::min(num_samples, width_ - head_);
+  buffer_.middleCols(head_ + width_, first_width) = kept.leftCols(first_width);
+  buffer_.leftCols(num_samples - first_width) =
+      kept.rightCols(num_samples - first_width);
+  head_ = (head_ + num_samples) % width_;
+}
+
+void InputHistory::AppendSample(
+    const Eigen::Ref<const ArrayX, 0, Eigen::InnerStride<>>& sample) {
+  // The oldest sample is overwritten by the newest one.
+  buffer_.col(head_) = sample;
+  buffer_.col(head_ + width_) = sample;
+  head_ = head_ + 1 == width_ ? 0 : head_ + 1;
+}
+
+void InputHistory::Save(FPType* data) const {
+  ArrayXX::Map(data, num_channels(), width_) = samples();
+}
+
+void InputHistory::Restore(const FPType* data) {
+  const auto saved = ArrayXX::Map(data, num_channels(), width_);
+  buffer_.leftCols(width_) = saved;
+  buffer_.rightCols(width_) = saved;
+  head_ = 0;
+}
+
 SAIBase::SAIBase(const SAIParams& params) {
   Redesign(params);
 }
@@ -65,12 +249,44 @@ void SAIBase::Redesign(const SAIParams& params) {
 
   window_ = ArrayX::LinSpaced(params_.trigger_window_width,
                               M_PI / params_.trigger_window_width, M_PI).sin();
+  active_channels_.resize(params_.num_channels);
+  for (int i = 0; i < params_.num_channels; ++i) {
+    active_channels_[i] = i;
+  }
+  lag_cells_.clear();
   Reset();
 }
 
-void SAIBase::StabilizeSegment(const ArrayXX& triggering_input_buffer,
-                               const ArrayXX& nontriggering_input_buffer,
-                               ArrayXX* output_buffer) const {
+void SAIBase::SetChannelMask(const std::vector<bool>& channel_mask) {
+  CARFAC_ASSERT((channel_mask.empty() ||
+                 static_cast<int>(channel_mask.size()) ==
+                     params_.num_channels) &&
+                "The channel mask must have an entry per channel.");
+  active_channels_.clear();
+  for (int i = 0; i < params_.num_channels; ++i) {
+    if (channel_mask.empty() || channel_mask[i]) {
+      active_channels_.push_back(i);
+    }
+  }
+  // The rows of the channels that are no longer computed are cleared.
+  Reset();
+}
+
+void SAIBase::SetLagCells(const std::vector<LagCell>& lag_cells) {
+  for ([[maybe_unused]] const LagCell& cell : lag_cells) {
+    CARFAC_ASSERT(cell.left_index >= 0 && cell.left_index <= cell.right_index &&
+                  cell.right_index < params_.sai_width &&
+                  "Lag cells must be within the SAI frame.");
+  }
+  lag_cells_ = lag_cells;
+  // The output buffers are resized to the cells.
+  Reset();
+}
+
+void SAIBase::StabilizeSegment(
+    const Eigen::Ref<const RowMajorArrayXX>& triggering_input_buffer,
+    const Eigen::Ref<const RowMajorArrayXX>& nontriggering_input_buffer,
+    RowMajorArrayXX* output_buffer) const {
   CARFAC_ASSERT(
       triggering_input_buffer.cols() == nontriggering_input_buffer.cols() &&
       "Number of columns must match.");
@@ -87,38 +303,73 @@ void SAIBase::StabilizeSegment(const ArrayXX& triggering_input_buffer,
 
   int offset_range_start = 1 + window_start - params_.sai_width;
   CARFAC_ASSERT(offset_range_start >= 0);
-  for (int i = 0; i < params_.num_channels; ++i) {
-    // TODO(kwwilson): Figure out if operating on rows is a
-    // performance bottleneck when elements are noncontiguous.
-    const ArrayX& triggering_nap_wave = triggering_input_buffer.row(i);
-    const ArrayX& nontriggering_nap_wave = nontriggering_input_buffer.row(i);
-    // TODO(ronw): Smooth triggering signal to be consistent with the
-    // Matlab implementation.
-
-    for (int w = 0; w < params_.num_triggers_per_frame; ++w) {
-      int current_window_offset = w * window_hop;
-      // Choose a trigger point.
-      int trigger_time;
-      const ArrayX& trigger_window = triggering_nap_wave.segment(
-          window_range_start + current_window_offset,
-          params_.trigger_window_width);
-      // TODO(kwwilson): If peak-finding is a performance bottleneck,
-      // do something more SSE friendly.
-      FPType peak_val = (trigger_window * window_).maxCoeff(&trigger_time);
-      if (peak_val <= 0) {
-        peak_val = window_.maxCoeff(&trigger_time);
+  const KernelTable& kernels = ActiveKernels();
+  // The rows are contiguous.
+  const int input_stride = 1;
+  const int output_stride = 1;
+  // Computes the rows of active_channels_[begin, end).
+  auto stabilize_channels = [&](int begin, int end) {
+    for (int k = begin; k < end; ++k) {
+      const int i = active_channels_[k];
+      const FPType* triggering_nap_wave =
+          triggering_input_buffer.row(i).data();
+      const FPType* nontriggering_nap_wave =
+          nontriggering_input_buffer.row(i).data();
+      FPType* output_row = output_buffer->row(i).data();
+      // TODO(ronw): Smooth triggering signal to be consistent with the
+      // Matlab implementation.
+
+      for (int w = 0; w < params_.num_triggers_per_frame; ++w) {
+        int current_window_offset = w * window_hop;
+        // Choose a trigger point.
+        int trigger_time;
+        FPType peak_val = kernels.windowed_peak(
+            params_.trigger_window_width,
+            triggering_nap_wave +
+                (window_range_start + current_window_offset) * input_stride,
+            input_stride, window_.data(), &trigger_time);
+        if (peak_val <= 0) {
+          peak_val = window_.maxCoeff(&trigger_time);
+        }
+        trigger_time += current_window_offset;
+
+        // Blend the window following the trigger into the output
+        // buffer, weighted according to the the trigger strength (0.05
+        // to near 1.0).
+        FPType alpha = (0.025f + peak_val) / (0.5f + peak_val);
+        const FPType* window =
+            nontriggering_nap_wave +
+            (trigger_time + offset_range_start) * input_stride;
+        if (lag_cells_.empty()) {
+          kernels.blend(params_.sai_width, alpha, window, input_stride,
+                        output_row, output_stride);
+        } else {
+          // Blending is linear, so blending the averages of the window over
+          // the cells gives the averages of the blended frame.
+          const FPType output_weight = 1 - alpha;
+          const int num_cells = lag_cells_.size();
+          for (int c = 0; c < num_cells; ++c) {
+            output_row[c] = output_row[c] * output_weight +
+                            alpha * lag_cells_[c].CellAverage(window);
+          }
+        }
       }
-      trigger_time += current_window_offset;
-
-      // Blend the window following the trigger into the output
-      // buffer, weighted according to the the trigger strength (0.05
-      // to near 1.0).
-      FPType alpha = (0.025f + peak_val) / (0.5f + peak_val);
-      output_buffer->row(i) *= 1 - alpha;
-      output_buffer->row(i) +=
-          alpha * nontriggering_nap_wave.segment(
-                      trigger_time + offset_range_start, params_.sai_width);
     }
+  };
+
+  const int num_channels = active_channels_.size();
+  const int num_blocks =
+      worker_pool_ != nullptr
+          ? std::min(worker_pool_->num_threads(), num_channels)
+          : 1;
+  if (num_blocks > 1) {
+    // Each block writes its own output rows.
+    worker_pool_->ParallelFor(num_blocks, [&](int block) {
+      stabilize_channels(block * num_channels / num_blocks,
+                         (block + 1) * num_channels / num_blocks);
+    });
+  } else {
+    stabilize_channels(0, num_channels);
   }
 }
 
@@ -30,6 +30,7 @@
 #include "common.h"
 #include "ihc.h"
 #include "test_util.h"
+#include "worker_pool.h"
 #include <Eigen/Core>
 
 using testing::Values;
@@ -125,3 +126,31 @@ TEST_F(BinauralSAITest, DiesIfNotTwoEars) {
   ASSERT_DEATH(binaural_sai.RunSegment(input_segment, &output_frame),
                "input_segment.size()");
 }
+
+TEST_F(BinauralSAITest, WorkerPoolMatchesSerial) {
+  const int kNumChannels = 11;
+  const int kInputSegmentWidth = 38;
+  const int kSAIWidth = 15;
+  SAIParams sai_params = CreateSAIParams(kNumChannels, kInputSegmentWidth,
+                                         kInputSegmentWidth, kSAIWidth);
+  BinauralSAI binaural_sai(sai_params);
+  BinauralSAI parallel_binaural_sai(sai_params);
+  WorkerPool worker_pool(4);
+  parallel_binaural_sai.set_worker_pool(&worker_pool);
+
+  std::vector<ArrayXX> output_frame;
+  std::vector<ArrayXX> parallel_output_frame;
+  for (int i = 0; i < 5; ++i) {
+    std::vector<ArrayXX> input_segment;
+    for (int ear = 0; ear < 2; ++ear) {
+      input_segment.push_back(
+          ArrayXX::Random(kNumChannels, kInputSegmentWidth).abs());
+    }
+    binaural_sai.RunSegment(input_segment, &output_frame);
+    parallel_binaural_sai.RunSegment(input_segment, &parallel_output_frame);
+    for (int ear = 0; ear < 2; ++ear) {
+      EXPECT_TRUE((output_frame[ear] == parallel_output_frame[ear]).all())
+          << "segment: " << i << " ear: " << ear;
+    }
+  }
+}
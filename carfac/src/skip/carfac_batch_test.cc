@@ -0,0 +1,208 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// This file is part of an implementation of Lyon's cochlear model:
+// "Cascade of Asymmetric Resonators with Fast-Acting Compression"
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "carfac_batch.h"
+
+#include <cmath>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "gtest/gtest.h"
+#include "agc.h"
+#include "car.h"
+#include "carfac.h"
+#include "common.h"
+#include "ihc.h"
+#include "test_util.h"
+
+class CARFACBatchTest : public testing::Test {
+ protected:
+  // Returns a different chirp for each stream, so that a mixup between
+  // streams shows up in the outputs.
+  static ArrayXX MakeInput(int num_streams, int num_samples,
+                           FPType sample_rate) {
+    ArrayXX sound_data(num_streams, num_samples);
+    for (int stream = 0; stream < num_streams; ++stream) {
+      const FPType f0 = 200.0 * (stream + 1);
+      for (int i = 0; i < num_samples; ++i) {
+        const FPType t = i / sample_rate;
+        sound_data(stream, i) =
+            0.1 * (stream + 1) * std::sin(2 * M_PI * f0 * t * (1 + t));
+      }
+    }
+    return sound_data;
+  }
+
+  // Runs the batch engine over two segments and compares each stream with a
+  // single-ear CARFAC fed the same samples.
+  void RunAndCompareWithCARFAC(int num_streams, bool open_loop) {
+    const FPType kSampleRate = 22050.0;
+    const int kNumSamples = 1500;
+    const ArrayXX sound_data = MakeInput(num_streams, kNumSamples, kSampleRate);
+
+    CARFACBatch batch(num_streams, kSampleRate, car_params_, ihc_params_,
+                      agc_params_);
+    std::vector<std::unique_ptr<CARFACOutput>> batch_outputs;
+    std::vector<CARFACOutput*> batch_output_ptrs;
+    for (int stream = 0; stream < num_streams; ++stream) {
+      batch_outputs.emplace_back(new CARFACOutput(true, true, true, true));
+      batch_output_ptrs.push_back(batch_outputs.back().get());
+    }
+
+    std::vector<std::unique_ptr<CARFAC>> carfacs;
+    for (int stream = 0; stream < num_streams; ++stream) {
+      carfacs.emplace_back(new CARFAC(1, kSampleRate, car_params_, ihc_params_,
+                                      agc_params_));
+    }
+    ASSERT_EQ(carfacs[0]->num_channels(), batch.num_channels());
+
+    // Split the input into two uneven segments, to check that state carries
+    // over correctly between calls.
+    const int kSplit = 701;
+    for (int segment = 0; segment < 2; ++segment) {
+      const int start = segment == 0 ? 0 : kSplit;
+      const int length = segment == 0 ? kSplit : kNumSamples - kSplit;
+      batch.RunSegment(sound_data.middleCols(start, length), open_loop,
+                       batch_output_ptrs);
+      for (int stream = 0; stream < num_streams; ++stream) {
+        CARFACOutput expected(true, true, true, true);
+        carfacs[stream]->RunSegment(
+            sound_data.block(stream, start, 1, length), open_loop, &expected);
+        const CARFACOutput& actual = *batch_outputs[stream];
+        AssertArrayNear(expected.nap()[0], actual.nap()[0], kTestPrecision);
+        AssertArrayNear(expected.bm()[0], actual.bm()[0], kTestPrecision);
+        AssertArrayNear(expected.ohc()[0], actual.ohc()[0], kTestPrecision);
+        AssertArrayNear(expected.agc()[0], actual.agc()[0], kTestPrecision);
+      }
+    }
+  }
+
+  CARParams car_params_;
+  IHCParams ihc_params_;
+  AGCParams agc_params_;
+};
+
+TEST_F(CARFACBatchTest, MatchesCARFAC) {
+  RunAndCompareWithCARFAC(5, false);
+}
+
+TEST_F(CARFACBatchTest, MatchesCARFACWithSingleStream) {
+  RunAndCompareWithCARFAC(1, false);
+}
+
+TEST_F(CARFACBatchTest, MatchesCARFACOpenLoop) {
+  RunAndCompareWithCARFAC(3, true);
+}
+
+TEST_F(CARFACBatchTest, MatchesCARFACWithOneCapacitor) {
+  ihc_params_.one_capacitor = true;
+  RunAndCompareWithCARFAC(3, false);
+}
+
+TEST_F(CARFACBatchTest, MatchesCARFACWithIHCJustHalfWaveRectifyOn) {
+  ihc_params_.just_half_wave_rectify = true;
+  RunAndCompareWithCARFAC(3, false);
+}
+
+TEST_F(CARFACBatchTest, MatchesCARFACWithDoubleExponentialSmoothing) {
+  // A large spread makes the AGC design fall back on IIR spatial smoothing.
+  agc_params_.agc1_scales[0] = 4.0;
+  agc_params_.agc2_scales[0] = 1.65 * 4.0;
+  for (std::size_t i = 1; i < agc_params_.agc1_scales.size(); ++i) {
+    agc_params_.agc1_scales[i] = agc_params_.agc1_scales[i - 1] * sqrt(2.0);
+    agc_params_.agc2_scales[i] = agc_params_.agc2_scales[i - 1] * sqrt(2.0);
+  }
+  RunAndCompareWithCARFAC(3, false);
+}
+
+TEST_F(CARFACBatchTest, ResetRestoresInitialState) {
+  const FPType kSampleRate = 22050.0;
+  const int kNumStreams = 2;
+  const ArrayXX sound_data = MakeInput(kNumStreams, 500, kSampleRate);
+  CARFACBatch batch(kNumStreams, kSampleRate, car_params_, ihc_params_,
+                    agc_params_);
+  CARFACOutput output0(true, false, false, false);
+  CARFACOutput output1(true, false, false, false);
+  const std::vector<CARFACOutput*> outputs = {&output0, &output1};
+  batch.RunSegment(sound_data, false, outputs);
+  const ArrayXX first_nap = output1.nap()[0];
+  batch.Reset();
+  batch.RunSegment(sound_data, false, outputs);
+  AssertArrayNear(first_nap, output1.nap()[0], 0.0);
+}
+
+TEST_F(CARFACBatchTest, NAPSinkReceivesStoredNAP) {
+  const FPType kSampleRate = 22050.0;
+  const int kNumStreams = 2;
+  const ArrayXX sound_data = MakeInput(kNumStreams, 500, kSampleRate);
+  CARFACBatch expected(kNumStreams, kSampleRate, car_params_, ihc_params_,
+                       agc_params_);
+  CARFACBatch actual(kNumStreams, kSampleRate, car_params_, ihc_params_,
+                     agc_params_);
+  CARFACOutput expected0(true, false, false, false);
+  CARFACOutput expected1(true, false, false, false);
+  CARFACOutput actual0(true, false, false, false);
+  CARFACOutput actual1(true, false, false, false);
+  SegmentNAPSink sink(actual.num_channels());
+  actual1.set_nap_sink(0, &sink);
+  expected.RunSegment(sound_data, false, {&expected0, &expected1});
+  actual.RunSegment(sound_data, false, {&actual0, &actual1});
+  EXPECT_EQ(0, actual1.nap()[0].cols());
+  EXPECT_TRUE((expected1.nap()[0] == sink.segment()).all());
+  EXPECT_TRUE((expected0.nap()[0] == actual0.nap()[0]).all());
+}
+
+void BM_CarfacBatchSegment(benchmark::State& state) {
+  const int num_streams = state.range(0);
+  const int segment_length_samples = state.range(1);
+  const FPType sample_rate = 22050.0;
+  CARParams car_params;
+  IHCParams ihc_params;
+  AGCParams agc_params;
+  CARFACBatch batch(num_streams, sample_rate, car_params, ihc_params,
+                    agc_params);
+  // Sinusoid input, with a different frequency for each stream.
+  ArrayXX sound_data(num_streams, segment_length_samples);
+  for (int stream = 0; stream < num_streams; ++stream) {
+    const float frequency = 500.0 + 10.0 * stream;  // Hz.
+    sound_data.row(stream) =
+        ArrayX::LinSpaced(segment_length_samples, 0.0, 2 * frequency * M_PI)
+            .sin();
+  }
+  std::vector<std::unique_ptr<CARFACOutput>> outputs;
+  std::vector<CARFACOutput*> output_ptrs;
+  for (int stream = 0; stream < num_streams; ++stream) {
+    outputs.emplace_back(new CARFACOutput(true, false, false, false));
+    output_ptrs.push_back(outputs.back().get());
+  }
+
+  const bool open_loop = false;
+  for (auto s : state) {
+    batch.RunSegment(sound_data, open_loop, output_ptrs);
+  }
+  state.SetItemsProcessed(state.iterations() * num_streams *
+                          segment_length_samples);
+}
+
+BENCHMARK(BM_CarfacBatchSegment)
+    ->Args({1, 22050})
+    ->Args({4, 22050})
+    ->Args({8, 22050})
+    ->Args({16, 22050})
+    ->Args({32, 22050});
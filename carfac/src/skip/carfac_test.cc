@@ -19,6 +19,7 @@
 #include "carfac.h"
 
 #include <cmath>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -112,6 +113,136 @@ class CARFACTest : public testing::Test {
     // WriteNAPOutput(output, test_name + "-cpp-nap2.txt", 1);
   }
 
+  // Runs the given kernel and the per-sample kernel on the same input, split
+  // into uneven segments, and checks that all outputs agree, or are
+  // identical if bit_exact.  The input is a sinusoid of the given amplitude.
+  void RunKernelAndCompareWithPerSample(
+      CARKernel kernel, int num_ears, FPType amplitude = 0.1,
+      NonlinearityPrecision precision = NonlinearityPrecision::kExact,
+      bool bit_exact = false) const {
+    const FPType kSampleRate = 22050.0;
+    const int kNumSamples = 3000;
+    ArrayXX sound_data(num_ears, kNumSamples);
+    for (int ear = 0; ear < num_ears; ++ear) {
+      sound_data.row(ear) =
+          amplitude *
+          ArrayX::LinSpaced(kNumSamples, 0.0, 300.0 * (ear + 1) * M_PI)
+              .sin()
+              .transpose();
+    }
+    CARFAC expected_carfac(num_ears, kSampleRate, car_params_, ihc_params_,
+                           agc_params_);
+    CARFAC actual_carfac(num_ears, kSampleRate, car_params_, ihc_params_,
+                         agc_params_);
+    actual_carfac.set_car_kernel(kernel);
+    expected_carfac.set_nonlinearity_precision(precision);
+    actual_carfac.set_nonlinearity_precision(precision);
+    const std::vector<int> kSegmentLengths = {1, 13, 300, 2686};
+    int start = 0;
+    for (int length : kSegmentLengths) {
+      CARFACOutput expected(true, true, true, true);
+      expected_carfac.RunSegment(sound_data.middleCols(start, length),
+                                 open_loop_, &expected);
+      CARFACOutput actual(true, true, true, true);
+      actual_carfac.RunSegment(sound_data.middleCols(start, length),
+                               open_loop_, &actual);
+      AssertCARFACOutputNear(expected.nap(), actual.nap());
+      AssertCARFACOutputNear(expected.bm(), actual.bm());
+      AssertCARFACOutputNear(expected.ohc(), actual.ohc());
+      AssertCARFACOutputNear(expected.agc(), actual.agc());
+      if (bit_exact) {
+        for (int ear = 0; ear < num_ears; ++ear) {
+          ASSERT_TRUE((expected.nap()[ear] == actual.nap()[ear]).all());
+          ASSERT_TRUE((expected.bm()[ear] == actual.bm()[ear]).all());
+        }
+      }
+      start += length;
+    }
+  }
+
+  // Runs the given kernel with the ears in sequence and in parallel, and
+  // checks that all outputs are identical.
+  void RunParallelEarsAndCompareWithSequential(CARKernel kernel,
+                                               int num_ears) const {
+    const FPType kSampleRate = 22050.0;
+    const int kNumSamples = 3000;
+    ArrayXX sound_data(num_ears, kNumSamples);
+    for (int ear = 0; ear < num_ears; ++ear) {
+      sound_data.row(ear) =
+          0.1 * ArrayX::LinSpaced(kNumSamples, 0.0, 300.0 * (ear + 1) * M_PI)
+                    .sin()
+                    .transpose();
+    }
+    CARFAC expected_carfac(num_ears, kSampleRate, car_params_, ihc_params_,
+                           agc_params_);
+    expected_carfac.set_car_kernel(kernel);
+    CARFAC actual_carfac(num_ears, kSampleRate, car_params_, ihc_params_,
+                         agc_params_);
+    actual_carfac.set_car_kernel(kernel);
+    actual_carfac.set_parallel_ears(true);
+    const std::vector<int> kSegmentLengths = {1, 13, 300, 2686};
+    int start = 0;
+    for (int length : kSegmentLengths) {
+      CARFACOutput expected(true, true, true, true);
+      expected_carfac.RunSegment(sound_data.middleCols(start, length),
+                                 open_loop_, &expected);
+      CARFACOutput actual(true, true, true, true);
+      actual_carfac.RunSegment(sound_data.middleCols(start, length),
+                               open_loop_, &actual);
+      for (int ear = 0; ear < num_ears; ++ear) {
+        ASSERT_TRUE((expected.nap()[ear] == actual.nap()[ear]).all());
+        ASSERT_TRUE((expected.bm()[ear] == actual.bm()[ear]).all());
+        ASSERT_TRUE((expected.ohc()[ear] == actual.ohc()[ear]).all());
+        ASSERT_TRUE((expected.agc()[ear] == actual.agc()[ear]).all());
+      }
+      start += length;
+    }
+  }
+
+  // Runs the given kernel with the NAP of the last ear sent to a NAPSink, and
+  // checks that the sink receives exactly the NAP stored without it.
+  void RunNAPSinkAndCompareWithStored(CARKernel kernel, int num_ears,
+                                      bool parallel_ears) const {
+    const FPType kSampleRate = 22050.0;
+    const int kNumSamples = 3000;
+    ArrayXX sound_data(num_ears, kNumSamples);
+    for (int ear = 0; ear < num_ears; ++ear) {
+      sound_data.row(ear) =
+          0.1 * ArrayX::LinSpaced(kNumSamples, 0.0, 300.0 * (ear + 1) * M_PI)
+                    .sin()
+                    .transpose();
+    }
+    CARFAC expected_carfac(num_ears, kSampleRate, car_params_, ihc_params_,
+                           agc_params_);
+    expected_carfac.set_car_kernel(kernel);
+    CARFAC actual_carfac(num_ears, kSampleRate, car_params_, ihc_params_,
+                         agc_params_);
+    actual_carfac.set_car_kernel(kernel);
+    actual_carfac.set_parallel_ears(parallel_ears);
+    const int sink_ear = num_ears - 1;
+    SegmentNAPSink sink(actual_carfac.num_channels());
+    CARFACOutput actual(true, true, false, false);
+    actual.set_nap_sink(sink_ear, &sink);
+    const std::vector<int> kSegmentLengths = {1, 13, 300, 2686};
+    int start = 0;
+    for (int length : kSegmentLengths) {
+      CARFACOutput expected(true, true, false, false);
+      expected_carfac.RunSegment(sound_data.middleCols(start, length),
+                                 open_loop_, &expected);
+      actual_carfac.RunSegment(sound_data.middleCols(start, length),
+                               open_loop_, &actual);
+      ASSERT_EQ(0, actual.nap()[sink_ear].cols());
+      ASSERT_TRUE((expected.nap()[sink_ear] == sink.segment()).all());
+      for (int ear = 0; ear < num_ears; ++ear) {
+        if (ear != sink_ear) {
+          ASSERT_TRUE((expected.nap()[ear] == actual.nap()[ear]).all());
+        }
+        ASSERT_TRUE((expected.bm()[ear] == actual.bm()[ear]).all());
+      }
+      start += length;
+    }
+  }
+
   CARParams car_params_;
   IHCParams ihc_params_;
   AGCParams agc_params_;
@@ -173,6 +304,164 @@ TEST_F(CARFACTest, CanDisableAGC) {
   }
 }
 
+TEST_F(CARFACTest, WavefrontKernelMatchesPerSample) {
+  RunKernelAndCompareWithPerSample(CARKernel::kWavefront, 1);
+}
+
+TEST_F(CARFACTest, WavefrontKernelMatchesPerSampleOnBinauralData) {
+  RunKernelAndCompareWithPerSample(CARKernel::kWavefront, 2);
+}
+
+TEST_F(CARFACTest, WavefrontKernelMatchesPerSampleOpenLoop) {
+  open_loop_ = true;
+  RunKernelAndCompareWithPerSample(CARKernel::kWavefront, 1);
+}
+
+TEST_F(CARFACTest, WavefrontKernelMatchesPerSampleWithAGCOff) {
+  agc_params_.num_stages = 0;
+  RunKernelAndCompareWithPerSample(CARKernel::kWavefront, 1);
+}
+
+TEST_F(CARFACTest, FusedBlockKernelMatchesPerSample) {
+  RunKernelAndCompareWithPerSample(CARKernel::kFusedBlock, 1);
+}
+
+TEST_F(CARFACTest, FusedBlockKernelMatchesPerSampleOnBinauralData) {
+  RunKernelAndCompareWithPerSample(CARKernel::kFusedBlock, 2);
+}
+
+TEST_F(CARFACTest, FusedBlockKernelMatchesPerSampleOpenLoop) {
+  open_loop_ = true;
+  RunKernelAndCompareWithPerSample(CARKernel::kFusedBlock, 1);
+}
+
+TEST_F(CARFACTest, FusedBlockKernelMatchesPerSampleWithAGCOff) {
+  agc_params_.num_stages = 0;
+  RunKernelAndCompareWithPerSample(CARKernel::kFusedBlock, 1);
+}
+
+TEST_F(CARFACTest, FusedBlockKernelMatchesPerSampleWithTwoCapacitors) {
+  ihc_params_.one_capacitor = false;
+  RunKernelAndCompareWithPerSample(CARKernel::kFusedBlock, 2);
+}
+
+TEST_F(CARFACTest, FusedBlockKernelMatchesPerSampleWithIHCJustHalfWaveRectifyOn) {
+  ihc_params_.just_half_wave_rectify = true;
+  RunKernelAndCompareWithPerSample(CARKernel::kFusedBlock, 2);
+}
+
+TEST_F(CARFACTest, FusedBlockKernelMatchesPerSampleWithLinearCAR) {
+  car_params_.velocity_scale = 0;
+  car_params_.v_offset = 0;
+  // Without the compression of the OHC nonlinearity, the CAR has a gain of
+  // thousands, so the input is quiet.
+  const FPType kAmplitude = 0.001;
+  for (NonlinearityPrecision precision :
+       {NonlinearityPrecision::kExact, NonlinearityPrecision::kFast}) {
+    open_loop_ = false;
+    RunKernelAndCompareWithPerSample(CARKernel::kFusedBlock, 2, kAmplitude,
+                                     precision, true /* bit_exact */);
+    open_loop_ = true;
+    RunKernelAndCompareWithPerSample(CARKernel::kFusedBlock, 2, kAmplitude,
+                                     precision, true /* bit_exact */);
+  }
+}
+
+TEST_F(CARFACTest, LinearCAROpenLoopIsLinear) {
+  car_params_.velocity_scale = 0;
+  car_params_.v_offset = 0;
+  const int kNumSamples = 1000;
+  ArrayXX sound_data(1, kNumSamples);
+  sound_data.row(0) =
+      ArrayX::LinSpaced(kNumSamples, 0.0, 100.0 * M_PI).sin().transpose();
+  CARFAC carfac(1, 22050.0, car_params_, ihc_params_, agc_params_);
+  carfac.set_car_kernel(CARKernel::kFusedBlock);
+  const bool kOpenLoop = true;
+  CARFACOutput output(false, true, false, false);
+  carfac.RunSegment(0.01 * sound_data, kOpenLoop, &output);
+  const ArrayXX quiet_bm = output.bm()[0];
+  carfac.Reset();
+  carfac.RunSegment(sound_data, kOpenLoop, &output);
+  AssertArrayNear(100 * quiet_bm, output.bm()[0],
+                  1e-4 * output.bm()[0].abs().maxCoeff());
+}
+
+TEST_F(CARFACTest, ParallelEarsMatchSequentialOnBinauralData) {
+  RunParallelEarsAndCompareWithSequential(CARKernel::kPerSample, 2);
+}
+
+TEST_F(CARFACTest, ParallelEarsMatchSequentialWithThreeEars) {
+  RunParallelEarsAndCompareWithSequential(CARKernel::kPerSample, 3);
+}
+
+TEST_F(CARFACTest, ParallelEarsMatchSequentialOpenLoop) {
+  open_loop_ = true;
+  RunParallelEarsAndCompareWithSequential(CARKernel::kPerSample, 2);
+}
+
+TEST_F(CARFACTest, ParallelEarsMatchSequentialWithBlockKernels) {
+  RunParallelEarsAndCompareWithSequential(CARKernel::kWavefront, 2);
+  RunParallelEarsAndCompareWithSequential(CARKernel::kFusedBlock, 2);
+}
+
+TEST_F(CARFACTest, NAPSinkReceivesStoredNAP) {
+  for (CARKernel kernel : {CARKernel::kPerSample, CARKernel::kWavefront,
+                           CARKernel::kFusedBlock}) {
+    RunNAPSinkAndCompareWithStored(kernel, 1, false);
+    RunNAPSinkAndCompareWithStored(kernel, 2, false);
+    RunNAPSinkAndCompareWithStored(kernel, 2, true);
+  }
+}
+
+TEST_F(CARFACTest, NAPSinkReceivesStoredNAPOpenLoop) {
+  open_loop_ = true;
+  RunNAPSinkAndCompareWithStored(CARKernel::kFusedBlock, 2, false);
+}
+
+TEST_F(CARFACTest, EarStateCanBeCopiedAndRestored) {
+  const FPType kSampleRate = 22050.0;  // Hz.
+  const ArrayX pole_freqs = CARPoleFrequencies(kSampleRate, car_params_);
+  CARCoeffs car_coeffs;
+  IHCCoeffs ihc_coeffs;
+  std::vector<AGCCoeffs> agc_coeffs;
+  CARFAC::DesignCARCoeffs(car_params_, kSampleRate, pole_freqs, &car_coeffs);
+  CARFAC::DesignIHCCoeffs(ihc_params_, kSampleRate, &ihc_coeffs);
+  CARFAC::DesignAGCCoeffs(agc_params_, kSampleRate, &agc_coeffs);
+  Ear ear(pole_freqs.size(), car_coeffs, ihc_coeffs, agc_coeffs);
+  Ear restored_ear(pole_freqs.size(), car_coeffs, ihc_coeffs, agc_coeffs);
+  EXPECT_EQ(0, reinterpret_cast<uintptr_t>(ear.zb_memory().data()) %
+                   kCacheLineBytes);
+
+  const int kNumSamples = 1000;
+  const ArrayX sound_data =
+      0.1 * ArrayX::LinSpaced(kNumSamples, 0.0, 200 * M_PI).sin();
+  auto step = [](FPType input, Ear* ear) {
+    ear->CARStep(input);
+    ear->IHCStep(ear->car_out());
+    if (ear->AGCStep(ear->ihc_out())) {
+      ear->CloseAGCLoop(false);
+    }
+  };
+  // Copy the state in the middle of an AGC decimation period.
+  for (int i = 0; i < 501; ++i) {
+    step(sound_data(i), &ear);
+  }
+  std::vector<char> state(
+      static_cast<const char*>(ear.state_data()),
+      static_cast<const char*>(ear.state_data()) + ear.state_size_bytes());
+  restored_ear.RestoreState(state.data());
+  for (int i = 501; i < kNumSamples; ++i) {
+    step(sound_data(i), &ear);
+    step(sound_data(i), &restored_ear);
+    ASSERT_TRUE((ear.ihc_out() == restored_ear.ihc_out()).all());
+  }
+  for (int stage = 0; stage < ear.agc_num_stages(); ++stage) {
+    EXPECT_EQ(ear.agc_decim_phase(stage), restored_ear.agc_decim_phase(stage));
+    EXPECT_TRUE(
+        (ear.agc_memory(stage) == restored_ear.agc_memory(stage)).all());
+  }
+}
+
 TEST_F(CARFACTest, PoleFrequenciesAreDecreasing) {
   const FPType kSampleRate = 8000.0;  // Hz.
   const int kNumEars = 1;
@@ -327,3 +616,106 @@ BENCHMARK(BM_CarfacSegment)->ThreadRange(1, 128)
     ->Arg(22050)
     ->Arg(44100)
     ->Arg(220500);
+
+void BM_CarfacSegmentKernel(benchmark::State& state) {
+  const auto segment_length_samples = state.range(0);
+  const CARKernel kernel = static_cast<CARKernel>(state.range(1));
+  const bool open_loop = state.range(2);
+  const int num_ears = 1;
+  const FPType sample_rate = 22050.0;
+  CARParams car_params;
+  IHCParams ihc_params;
+  AGCParams agc_params;
+  CARFAC carfac(num_ears, sample_rate, car_params, ihc_params, agc_params);
+  carfac.set_car_kernel(kernel);
+  // Sinusoid input.
+  const float kFrequency = 500.0;  // Hz.
+  ArrayXX sound_data(num_ears, segment_length_samples);
+  sound_data.row(0) =
+      ArrayX::LinSpaced(segment_length_samples, 0.0, 2 * kFrequency * M_PI)
+          .sin();
+
+  CARFACOutput output(true, false, false, false);
+  for (auto s : state) {
+    carfac.RunSegment(sound_data, open_loop, &output);
+  }
+}
+
+BENCHMARK(BM_CarfacSegmentKernel)
+    ->ArgNames({"samples", "kernel", "open_loop"})
+    ->ArgsProduct({{1024, 22050},
+                   {static_cast<int>(CARKernel::kPerSample),
+                    static_cast<int>(CARKernel::kWavefront),
+                    static_cast<int>(CARKernel::kFusedBlock)},
+                   {0, 1}});
+
+// Compares the kernels running open loop, with and without the OHC
+// nonlinearity.  The default CARParams keep it, so only linear_car:1 takes the
+// linear step of the fused block.
+void BM_CarfacOpenLoopLinearCAR(benchmark::State& state) {
+  const auto segment_length_samples = state.range(0);
+  const CARKernel kernel = static_cast<CARKernel>(state.range(1));
+  const bool linear_car = state.range(2);
+  const int num_ears = 1;
+  const FPType sample_rate = 22050.0;
+  CARParams car_params;
+  if (linear_car) {
+    car_params.velocity_scale = 0;
+    car_params.v_offset = 0;
+  }
+  IHCParams ihc_params;
+  AGCParams agc_params;
+  CARFAC carfac(num_ears, sample_rate, car_params, ihc_params, agc_params);
+  carfac.set_car_kernel(kernel);
+  // Sinusoid input.
+  const float kFrequency = 500.0;  // Hz.
+  ArrayXX sound_data(num_ears, segment_length_samples);
+  sound_data.row(0) =
+      0.001 *
+      ArrayX::LinSpaced(segment_length_samples, 0.0, 2 * kFrequency * M_PI)
+          .sin();
+
+  CARFACOutput output(true, false, false, false);
+  const bool kOpenLoop = true;
+  for (auto s : state) {
+    carfac.RunSegment(sound_data, kOpenLoop, &output);
+  }
+  state.SetItemsProcessed(state.iterations() * segment_length_samples);
+}
+
+BENCHMARK(BM_CarfacOpenLoopLinearCAR)
+    ->ArgNames({"samples", "kernel", "linear_car"})
+    ->ArgsProduct({{22050},
+                   {static_cast<int>(CARKernel::kPerSample),
+                    static_cast<int>(CARKernel::kFusedBlock)},
+                   {0, 1}});
+
+void BM_CarfacParallelEars(benchmark::State& state) {
+  const int num_ears = state.range(0);
+  const bool parallel_ears = state.range(1);
+  const int segment_length_samples = 1024;
+  const FPType sample_rate = 22050.0;
+  CARParams car_params;
+  IHCParams ihc_params;
+  AGCParams agc_params;
+  CARFAC carfac(num_ears, sample_rate, car_params, ihc_params, agc_params);
+  carfac.set_parallel_ears(parallel_ears);
+  // Sinusoid input.
+  const float kFrequency = 500.0;  // Hz.
+  ArrayXX sound_data(num_ears, segment_length_samples);
+  for (int ear = 0; ear < num_ears; ++ear) {
+    sound_data.row(ear) =
+        ArrayX::LinSpaced(segment_length_samples, 0.0, 2 * kFrequency * M_PI)
+            .sin();
+  }
+
+  CARFACOutput output(true, false, false, false);
+  for (auto s : state) {
+    carfac.RunSegment(sound_data, false /* open_loop */, &output);
+  }
+}
+
+BENCHMARK(BM_CarfacParallelEars)
+    ->ArgNames({"ears", "parallel"})
+    ->ArgsProduct({{1, 2, 4}, {0, 1}})
+    ->UseRealTime();
@@ -0,0 +1,156 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "chunked_pipeline.h"
+
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#include "carfac.h"
+#include "pitchogram_pipeline.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+constexpr float kSampleRateHz = 16000.0f;
+constexpr int kSegmentWidth = 256;
+constexpr int kNumFrames = 60;
+
+// Returns a tone that gets louder over time and then stops, so that the AGC
+// state differs between chunks.
+std::vector<float> MakeRecording() {
+  std::vector<float> samples(kNumFrames * kSegmentWidth + kSegmentWidth / 2);
+  for (std::size_t i = 0; i < samples.size(); ++i) {
+    const float t = i / kSampleRateHz;
+    const float amplitude = (t < 0.7f) ? 0.02f + 0.2f * t : 0.0f;
+    samples[i] = amplitude * std::sin(2 * M_PI * (200.0f + 300.0f * t) * t);
+  }
+  return samples;
+}
+
+PitchogramPipelineParams MakePipelineParams() {
+  PitchogramPipelineParams params;
+  params.num_frames = kNumFrames;
+  params.num_samples_per_segment = kSegmentWidth;
+  params.max_lag_s = 0.01f;
+  return params;
+}
+
+// Returns the SAI frames of a sequential run over the recording.
+std::vector<ArrayXX> RunSequential(const std::vector<float>& samples) {
+  PitchogramPipeline pipeline(kSampleRateHz, MakePipelineParams());
+  std::vector<ArrayXX> sai_frames;
+  for (int frame = 0; frame < kNumFrames; ++frame) {
+    pipeline.ProcessJustSamples(samples.data() + frame * kSegmentWidth,
+                                kSegmentWidth);
+    sai_frames.push_back(pipeline.sai_output());
+  }
+  return sai_frames;
+}
+
+}  // namespace
+
+TEST(ChunkedPipelineTest, StitchesFramesOfAllChunks) {
+  const std::vector<float> samples = MakeRecording();
+  const std::vector<ArrayXX> expected_sai_frames = RunSequential(samples);
+
+  ChunkedPipelineParams params;
+  params.num_threads = 2;
+  params.num_chunks = 3;
+  params.warmup_s = 0.2f;
+  ChunkedPipeline chunked(kSampleRateHz, MakePipelineParams(), params);
+  ASSERT_EQ(kNumFrames, chunked.NumFrames(samples.size()));
+  std::vector<ArrayXX> sai_frames(kNumFrames);
+  std::vector<int> num_calls(kNumFrames, 0);
+  chunked.Run(samples.data(), samples.size(),
+              [&](int frame_index,
+                  const Eigen::Ref<const RowMajorArrayXX>& /*nap*/,
+                  const ArrayXX& sai_output) {
+                sai_frames[frame_index] = sai_output;
+                ++num_calls[frame_index];
+              });
+
+  for (int frame = 0; frame < kNumFrames; ++frame) {
+    ASSERT_EQ(1, num_calls[frame]) << "frame: " << frame;
+    ASSERT_EQ(expected_sai_frames[frame].rows(), sai_frames[frame].rows());
+    ASSERT_EQ(expected_sai_frames[frame].cols(), sai_frames[frame].cols());
+  }
+  // The first chunk has no warm-up, so it matches the sequential run exactly.
+  for (int frame = 0; frame < kNumFrames / 3; ++frame) {
+    EXPECT_TRUE((expected_sai_frames[frame] == sai_frames[frame]).all())
+        << "frame: " << frame;
+  }
+}
+
+TEST(ChunkedPipelineTest, StitchedNAPMatchesFrames) {
+  const std::vector<float> samples = MakeRecording();
+  ChunkedPipelineParams params;
+  params.num_threads = 3;
+  params.warmup_s = 0.1f;
+  ChunkedPipeline chunked(kSampleRateHz, MakePipelineParams(), params);
+  ArrayXX nap;
+  chunked.RunNAP(samples.data(), samples.size(), &nap);
+  ASSERT_EQ(kNumFrames * kSegmentWidth, nap.cols());
+
+  std::vector<ArrayXX> nap_frames(kNumFrames);
+  chunked.Run(samples.data(), samples.size(),
+              [&](int frame_index,
+                  const Eigen::Ref<const RowMajorArrayXX>& frame_nap,
+                  const ArrayXX& /*sai_output*/) {
+                nap_frames[frame_index] = frame_nap;
+              });
+  for (int frame = 0; frame < kNumFrames; ++frame) {
+    EXPECT_TRUE((nap.middleCols(frame * kSegmentWidth, kSegmentWidth) ==
+                 nap_frames[frame]).all())
+        << "frame: " << frame;
+  }
+}
+
+TEST(ChunkedPipelineTest, LongerWarmupReducesDivergence) {
+  const std::vector<float> samples = MakeRecording();
+  ChunkedPipelineParams params;
+  params.num_threads = 1;
+  params.num_chunks = 4;
+
+  params.warmup_s = 0.0f;
+  ChunkedPipeline cold(kSampleRateHz, MakePipelineParams(), params);
+  const std::vector<ChunkDivergence> cold_divergences =
+      cold.MeasureDivergence(samples.data(), samples.size());
+  params.warmup_s = 0.25f;
+  ChunkedPipeline warm(kSampleRateHz, MakePipelineParams(), params);
+  const std::vector<ChunkDivergence> warm_divergences =
+      warm.MeasureDivergence(samples.data(), samples.size());
+
+  ASSERT_EQ(4, cold_divergences.size());
+  ASSERT_EQ(4, warm_divergences.size());
+  EXPECT_EQ(0.0f, cold_divergences[0].max_nap_error);
+  EXPECT_EQ(0.0f, cold_divergences[0].max_sai_error);
+  int num_frames = 0;
+  for (int chunk = 0; chunk < 4; ++chunk) {
+    EXPECT_EQ(num_frames, warm_divergences[chunk].first_frame);
+    num_frames += warm_divergences[chunk].num_frames;
+    EXPECT_LE(warm_divergences[chunk].max_nap_error,
+              cold_divergences[chunk].max_nap_error);
+    EXPECT_LE(warm_divergences[chunk].max_sai_error,
+              cold_divergences[chunk].max_sai_error);
+    EXPECT_LT(warm_divergences[chunk].max_nap_error,
+              0.1f * warm_divergences[chunk].max_nap + 1e-6f)
+        << "chunk: " << chunk;
+  }
+  EXPECT_EQ(kNumFrames, num_frames);
+  // Without warm-up, the chunks start from silence and differ noticeably.
+  EXPECT_GT(cold_divergences[1].max_nap_error,
+            0.1f * cold_divergences[1].max_nap);
+}
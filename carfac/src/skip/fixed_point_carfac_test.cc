@@ -0,0 +1,372 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// This file is part of an implementation of Lyon's cochlear model:
+// "Cascade of Asymmetric Resonators with Fast-Acting Compression"
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fixed_point_carfac.h"
+
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "gtest/gtest.h"
+#include "agc.h"
+#include "car.h"
+#include "carfac.h"
+#include "carfac_batch.h"
+#include "common.h"
+#include "ihc.h"
+#include "kernels.h"
+#include "sai.h"
+#include "test_util.h"
+
+namespace {
+
+constexpr FPType kSampleRate = 22050.0;
+constexpr KernelISA kAllISAs[] = {KernelISA::kGeneric, KernelISA::kSSE4,
+                                  KernelISA::kAVX2, KernelISA::kAVX512};
+
+// Returns a different chirp for each stream, so that a mixup between
+// streams shows up in the outputs.
+ArrayXX MakeInput(int num_streams, int num_samples, FPType scale = 1.0) {
+  ArrayXX sound_data(num_streams, num_samples);
+  for (int stream = 0; stream < num_streams; ++stream) {
+    const FPType f0 = 200.0 * (stream + 1);
+    for (int i = 0; i < num_samples; ++i) {
+      const FPType t = i / kSampleRate;
+      sound_data(stream, i) = scale * 0.1 * (stream + 1) *
+                              std::sin(2 * M_PI * f0 * t * (1 + t));
+    }
+  }
+  return sound_data;
+}
+
+std::vector<std::unique_ptr<CARFACOutput>> MakeOutputs(int num_streams) {
+  std::vector<std::unique_ptr<CARFACOutput>> outputs;
+  for (int stream = 0; stream < num_streams; ++stream) {
+    outputs.emplace_back(new CARFACOutput(true, true, true, true));
+  }
+  return outputs;
+}
+
+std::vector<CARFACOutput*> OutputPointers(
+    const std::vector<std::unique_ptr<CARFACOutput>>& outputs) {
+  std::vector<CARFACOutput*> pointers;
+  for (const auto& output : outputs) {
+    pointers.push_back(output.get());
+  }
+  return pointers;
+}
+
+void ExpectOutputsEqual(const CARFACOutput& expected,
+                        const CARFACOutput& actual) {
+  EXPECT_TRUE((expected.nap()[0] == actual.nap()[0]).all());
+  EXPECT_TRUE((expected.bm()[0] == actual.bm()[0]).all());
+  EXPECT_TRUE((expected.ohc()[0] == actual.ohc()[0]).all());
+  EXPECT_TRUE((expected.agc()[0] == actual.agc()[0]).all());
+}
+
+// Restores the kernels that were active on construction.
+class ScopedKernelISA {
+ public:
+  explicit ScopedKernelISA(KernelISA isa) : saved_isa_(ActiveKernelISA()) {
+    EXPECT_TRUE(SetKernelISA(isa)) << KernelISAName(isa);
+  }
+  ~ScopedKernelISA() { SetKernelISA(saved_isa_); }
+
+ private:
+  KernelISA saved_isa_;
+};
+
+}  // namespace
+
+class FixedPointCARFACTest : public testing::Test {
+ protected:
+  // Runs the fixed-point and the floating point engines on one stream and
+  // returns the SNR of the fixed-point NAP, BM and SAI, in this order.
+  std::vector<FPType> MeasureSNR(bool open_loop, FPType scale) {
+    constexpr int kSegmentWidth = 441;
+    constexpr int kNumSegments = 20;
+    const ArrayXX sound_data =
+        MakeInput(1, kSegmentWidth * kNumSegments, scale);
+    FixedPointCARFAC fixed(1, kSampleRate, car_params_, ihc_params_,
+                           agc_params_);
+    CARFACBatch reference(1, kSampleRate, car_params_, ihc_params_,
+                          agc_params_);
+    SAIParams sai_params;
+    sai_params.num_channels = fixed.num_channels();
+    sai_params.sai_width = 200;
+    sai_params.future_lags = sai_params.sai_width / 2;
+    sai_params.num_triggers_per_frame = 2;
+    sai_params.trigger_window_width = kSegmentWidth + 1;
+    sai_params.input_segment_width = kSegmentWidth;
+    sai_params.channel_smoothing_scale = 0;
+    SAI fixed_sai(sai_params);
+    SAI reference_sai(sai_params);
+
+    CARFACOutput fixed_output(true, true, false, false);
+    CARFACOutput reference_output(true, true, false, false);
+    ArrayXX fixed_nap(fixed.num_channels(), sound_data.cols());
+    ArrayXX reference_nap(fixed.num_channels(), sound_data.cols());
+    ArrayXX fixed_bm(fixed.num_channels(), sound_data.cols());
+    ArrayXX reference_bm(fixed.num_channels(), sound_data.cols());
+    ArrayXX fixed_sai_frames(fixed.num_channels(),
+                             sai_params.sai_width * kNumSegments);
+    ArrayXX reference_sai_frames(fixed.num_channels(),
+                                 sai_params.sai_width * kNumSegments);
+    ArrayXX sai_frame;
+    for (int segment = 0; segment < kNumSegments; ++segment) {
+      const int start = segment * kSegmentWidth;
+      const auto segment_data = sound_data.middleCols(start, kSegmentWidth);
+      fixed.RunSegment(segment_data, open_loop, {&fixed_output});
+      reference.RunSegment(segment_data, open_loop, {&reference_output});
+      fixed_nap.middleCols(start, kSegmentWidth) = fixed_output.nap()[0];
+      fixed_bm.middleCols(start, kSegmentWidth) = fixed_output.bm()[0];
+      reference_nap.middleCols(start, kSegmentWidth) =
+          reference_output.nap()[0];
+      reference_bm.middleCols(start, kSegmentWidth) = reference_output.bm()[0];
+      fixed_sai.RunSegment(fixed_output.nap()[0], &sai_frame);
+      fixed_sai_frames.middleCols(segment * sai_params.sai_width,
+                                  sai_params.sai_width) = sai_frame;
+      reference_sai.RunSegment(reference_output.nap()[0], &sai_frame);
+      reference_sai_frames.middleCols(segment * sai_params.sai_width,
+                                      sai_params.sai_width) = sai_frame;
+    }
+    return {SignalToNoiseRatioDb(reference_nap, fixed_nap),
+            SignalToNoiseRatioDb(reference_bm, fixed_bm),
+            SignalToNoiseRatioDb(reference_sai_frames, fixed_sai_frames)};
+  }
+
+  CARParams car_params_;
+  IHCParams ihc_params_;
+  AGCParams agc_params_;
+};
+
+TEST_F(FixedPointCARFACTest, MatchesFloatingPoint) {
+  const std::vector<FPType> snr = MeasureSNR(false, 1.0);
+  EXPECT_GT(snr[0], 48.0);
+  EXPECT_GT(snr[1], 48.0);
+  // Rounding noise moves some triggers, which costs the SAI more.
+  EXPECT_GT(snr[2], 35.0);
+}
+
+TEST_F(FixedPointCARFACTest, MatchesFloatingPointOpenLoop) {
+  const std::vector<FPType> snr = MeasureSNR(true, 1.0);
+  EXPECT_GT(snr[0], 40.0);
+  EXPECT_GT(snr[1], 45.0);
+  EXPECT_GT(snr[2], 30.0);
+}
+
+TEST_F(FixedPointCARFACTest, MatchesFloatingPointOnQuietSound) {
+  const std::vector<FPType> snr = MeasureSNR(false, 0.01);
+  EXPECT_GT(snr[0], 40.0);
+  EXPECT_GT(snr[1], 40.0);
+  EXPECT_GT(snr[2], 35.0);
+}
+
+TEST_F(FixedPointCARFACTest, MatchesFloatingPointWithTwoCapacitors) {
+  ihc_params_.one_capacitor = false;
+  const std::vector<FPType> snr = MeasureSNR(false, 1.0);
+  EXPECT_GT(snr[0], 50.0);
+  EXPECT_GT(snr[2], 35.0);
+}
+
+TEST_F(FixedPointCARFACTest, MatchesFloatingPointWithJustHalfWaveRectify) {
+  ihc_params_.just_half_wave_rectify = true;
+  const std::vector<FPType> snr = MeasureSNR(false, 1.0);
+  EXPECT_GT(snr[0], 50.0);
+  EXPECT_GT(snr[2], 35.0);
+}
+
+TEST_F(FixedPointCARFACTest, StreamsMatchSingleStreamEngines) {
+  constexpr int kNumStreams = 3;
+  const ArrayXX sound_data = MakeInput(kNumStreams, 1500);
+  FixedPointCARFAC batch(kNumStreams, kSampleRate, car_params_, ihc_params_,
+                         agc_params_);
+  auto batch_outputs = MakeOutputs(kNumStreams);
+  batch.RunSegment(sound_data, false, OutputPointers(batch_outputs));
+  for (int stream = 0; stream < kNumStreams; ++stream) {
+    FixedPointCARFAC single(1, kSampleRate, car_params_, ihc_params_,
+                            agc_params_);
+    CARFACOutput expected(true, true, true, true);
+    single.RunSegment(sound_data.row(stream), false, {&expected});
+    ExpectOutputsEqual(expected, *batch_outputs[stream]);
+  }
+}
+
+TEST_F(FixedPointCARFACTest, SegmentsMatchWholeInput) {
+  constexpr int kNumStreams = 2;
+  constexpr int kSplit = 701;
+  const ArrayXX sound_data = MakeInput(kNumStreams, 1500);
+  FixedPointCARFAC whole(kNumStreams, kSampleRate, car_params_, ihc_params_,
+                         agc_params_);
+  auto whole_outputs = MakeOutputs(kNumStreams);
+  whole.RunSegment(sound_data, false, OutputPointers(whole_outputs));
+
+  FixedPointCARFAC split(kNumStreams, kSampleRate, car_params_, ihc_params_,
+                         agc_params_);
+  auto split_outputs = MakeOutputs(kNumStreams);
+  split.RunSegment(sound_data.leftCols(kSplit), false,
+                   OutputPointers(split_outputs));
+  const ArrayXX first_nap = split_outputs[1]->nap()[0];
+  split.RunSegment(sound_data.rightCols(sound_data.cols() - kSplit), false,
+                   OutputPointers(split_outputs));
+  EXPECT_TRUE((whole_outputs[1]->nap()[0].leftCols(kSplit) == first_nap).all());
+  EXPECT_TRUE((whole_outputs[1]->nap()[0].rightCols(sound_data.cols() -
+                                                     kSplit) ==
+               split_outputs[1]->nap()[0])
+                  .all());
+}
+
+TEST_F(FixedPointCARFACTest, ResetRestoresInitialState) {
+  constexpr int kNumStreams = 2;
+  const ArrayXX sound_data = MakeInput(kNumStreams, 500);
+  FixedPointCARFAC fixed(kNumStreams, kSampleRate, car_params_, ihc_params_,
+                         agc_params_);
+  auto outputs = MakeOutputs(kNumStreams);
+  fixed.RunSegment(sound_data, false, OutputPointers(outputs));
+  const ArrayXX first_nap = outputs[1]->nap()[0];
+  fixed.Reset();
+  fixed.RunSegment(sound_data, false, OutputPointers(outputs));
+  EXPECT_TRUE((first_nap == outputs[1]->nap()[0]).all());
+}
+
+TEST_F(FixedPointCARFACTest, RestoreStateResumes) {
+  constexpr int kNumStreams = 2;
+  const ArrayXX sound_data = MakeInput(kNumStreams, 1000);
+  FixedPointCARFAC fixed(kNumStreams, kSampleRate, car_params_, ihc_params_,
+                         agc_params_);
+  auto outputs = MakeOutputs(kNumStreams);
+  // An odd length leaves the AGC decimation mid-phase.
+  fixed.RunSegment(sound_data.leftCols(333), false, OutputPointers(outputs));
+  std::vector<char> state(fixed.state_size_bytes());
+  fixed.SaveState(state.data());
+  fixed.RunSegment(sound_data.rightCols(667), false, OutputPointers(outputs));
+  FixedPointCARFAC restored(kNumStreams, kSampleRate, car_params_,
+                            ihc_params_, agc_params_);
+  restored.RestoreState(state.data());
+  auto restored_outputs = MakeOutputs(kNumStreams);
+  restored.RunSegment(sound_data.rightCols(667), false,
+                      OutputPointers(restored_outputs));
+  for (int stream = 0; stream < kNumStreams; ++stream) {
+    ExpectOutputsEqual(*outputs[stream], *restored_outputs[stream]);
+  }
+}
+
+TEST_F(FixedPointCARFACTest, NAPSinkReceivesStoredNAP) {
+  constexpr int kNumStreams = 2;
+  const ArrayXX sound_data = MakeInput(kNumStreams, 500);
+  FixedPointCARFAC expected(kNumStreams, kSampleRate, car_params_,
+                            ihc_params_, agc_params_);
+  FixedPointCARFAC actual(kNumStreams, kSampleRate, car_params_, ihc_params_,
+                          agc_params_);
+  auto expected_outputs = MakeOutputs(kNumStreams);
+  auto actual_outputs = MakeOutputs(kNumStreams);
+  SegmentNAPSink sink(actual.num_channels());
+  actual_outputs[1]->set_nap_sink(0, &sink);
+  expected.RunSegment(sound_data, false, OutputPointers(expected_outputs));
+  actual.RunSegment(sound_data, false, OutputPointers(actual_outputs));
+  EXPECT_EQ(0, actual_outputs[1]->nap()[0].cols());
+  EXPECT_TRUE((expected_outputs[1]->nap()[0] == sink.segment()).all());
+  EXPECT_TRUE(
+      (expected_outputs[0]->nap()[0] == actual_outputs[0]->nap()[0]).all());
+}
+
+TEST_F(FixedPointCARFACTest, SaturatesOnLoudSound) {
+  const ArrayXX sound_data = MakeInput(1, 2000, 1000.0);
+  FixedPointCARFAC fixed(1, kSampleRate, car_params_, ihc_params_,
+                         agc_params_);
+  CARFACOutput output(true, true, false, false);
+  fixed.RunSegment(sound_data, false, {&output});
+  EXPECT_TRUE(output.bm()[0].isFinite().all());
+  EXPECT_LE(output.bm()[0].abs().maxCoeff(), 64.0);
+  // The NAP would go far below its rest level, about -1.04, if the signals
+  // wrapped around.
+  EXPECT_GE(output.nap()[0].minCoeff(), -1.1);
+}
+
+TEST_F(FixedPointCARFACTest, AllISAsMatchGeneric) {
+  constexpr int kNumStreams = 3;
+  const ArrayXX sound_data = MakeInput(kNumStreams, 1500);
+  auto expected = MakeOutputs(kNumStreams);
+  {
+    ScopedKernelISA generic(KernelISA::kGeneric);
+    FixedPointCARFAC fixed(kNumStreams, kSampleRate, car_params_, ihc_params_,
+                           agc_params_);
+    fixed.RunSegment(sound_data, false, OutputPointers(expected));
+  }
+  for (KernelISA isa : kAllISAs) {
+    if (!IsKernelISASupported(isa)) {
+      continue;
+    }
+    SCOPED_TRACE(KernelISAName(isa));
+    ScopedKernelISA scoped_isa(isa);
+    FixedPointCARFAC fixed(kNumStreams, kSampleRate, car_params_, ihc_params_,
+                           agc_params_);
+    auto actual = MakeOutputs(kNumStreams);
+    fixed.RunSegment(sound_data, false, OutputPointers(actual));
+    for (int stream = 0; stream < kNumStreams; ++stream) {
+      ExpectOutputsEqual(*expected[stream], *actual[stream]);
+    }
+  }
+}
+
+TEST(SignalToNoiseRatioDbTest, MeasuresNoise) {
+  ArrayXX reference = ArrayXX::Constant(2, 10, 1.0);
+  ArrayXX test = reference;
+  EXPECT_EQ(SignalToNoiseRatioDb(reference, test),
+            std::numeric_limits<FPType>::infinity());
+  test += 0.1;
+  EXPECT_NEAR(SignalToNoiseRatioDb(reference, test), 20.0, 1e-3);
+}
+
+void BM_FixedPointCarfacSegment(benchmark::State& state) {
+  const int num_streams = state.range(0);
+  const int segment_length_samples = state.range(1);
+  const FPType sample_rate = 22050.0;
+  CARParams car_params;
+  IHCParams ihc_params;
+  AGCParams agc_params;
+  FixedPointCARFAC fixed(num_streams, sample_rate, car_params, ihc_params,
+                         agc_params);
+  // Sinusoid input, with a different frequency for each stream.
+  ArrayXX sound_data(num_streams, segment_length_samples);
+  for (int stream = 0; stream < num_streams; ++stream) {
+    const float frequency = 500.0 + 10.0 * stream;  // Hz.
+    sound_data.row(stream) =
+        ArrayX::LinSpaced(segment_length_samples, 0.0, 2 * frequency * M_PI)
+            .sin();
+  }
+  std::vector<std::unique_ptr<CARFACOutput>> outputs;
+  std::vector<CARFACOutput*> output_ptrs;
+  for (int stream = 0; stream < num_streams; ++stream) {
+    outputs.emplace_back(new CARFACOutput(true, false, false, false));
+    output_ptrs.push_back(outputs.back().get());
+  }
+
+  const bool open_loop = false;
+  for (auto s : state) {
+    fixed.RunSegment(sound_data, open_loop, output_ptrs);
+  }
+  state.SetItemsProcessed(state.iterations() * num_streams *
+                          segment_length_samples);
+}
+
+BENCHMARK(BM_FixedPointCarfacSegment)
+    ->Args({1, 22050})
+    ->Args({8, 22050})
+    ->Args({32, 22050});
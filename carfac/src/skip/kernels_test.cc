@@ -0,0 +1,474 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "carfac.h"
+#include "gtest/gtest.h"
+#include "sai.h"
+
+namespace {
+
+constexpr KernelISA kAllISAs[] = {KernelISA::kGeneric, KernelISA::kSSE4,
+                                  KernelISA::kAVX2, KernelISA::kAVX512};
+constexpr FPType kSampleRate = 22050.0;
+
+// Restores the kernels that were active on construction.
+class ScopedKernelISA {
+ public:
+  explicit ScopedKernelISA(KernelISA isa) : saved_isa_(ActiveKernelISA()) {
+    EXPECT_TRUE(SetKernelISA(isa)) << KernelISAName(isa);
+  }
+  ~ScopedKernelISA() { SetKernelISA(saved_isa_); }
+
+ private:
+  KernelISA saved_isa_;
+};
+
+ArrayXX MakeSound(int num_ears, int num_samples) {
+  ArrayXX sound(num_ears, num_samples);
+  for (int ear = 0; ear < num_ears; ++ear) {
+    for (int i = 0; i < num_samples; ++i) {
+      const FPType t = i / kSampleRate;
+      sound(ear, i) = (0.05 + 0.1 * ear) *
+                      std::sin(2 * M_PI * (300.0 + 2000.0 * t) * t);
+    }
+  }
+  return sound;
+}
+
+// Returns the NAP and BM of both ears, and the SAI of the first ear for each
+// segment, concatenated.
+std::vector<ArrayXX> RunModel(
+    const IHCParams& ihc_params, const AGCParams& agc_params,
+    NonlinearityPrecision precision = NonlinearityPrecision::kExact,
+    CARKernel car_kernel = CARKernel::kPerSample) {
+  constexpr int kNumEars = 2;
+  constexpr int kSegmentWidth = 441;
+  constexpr int kNumSegments = 8;
+  CARFAC carfac(kNumEars, kSampleRate, CARParams(), ihc_params, agc_params);
+  carfac.set_nonlinearity_precision(precision);
+  carfac.set_car_kernel(car_kernel);
+  CARFACOutput output(true, true, false, false);
+  SAIParams sai_params;
+  sai_params.num_channels = carfac.num_channels();
+  sai_params.sai_width = 200;
+  sai_params.future_lags = sai_params.sai_width / 2;
+  sai_params.num_triggers_per_frame = 2;
+  sai_params.trigger_window_width = kSegmentWidth + 1;
+  sai_params.input_segment_width = kSegmentWidth;
+  sai_params.channel_smoothing_scale = 0;
+  SAI sai(sai_params);
+  ArrayXX sai_frame;
+
+  const ArrayXX sound = MakeSound(kNumEars, kNumSegments * kSegmentWidth);
+  std::vector<ArrayXX> outputs;
+  for (int segment = 0; segment < kNumSegments; ++segment) {
+    carfac.RunSegment(sound.middleCols(segment * kSegmentWidth, kSegmentWidth),
+                      false /* open_loop */, &output);
+    sai.RunSegment(output.nap()[0], &sai_frame);
+    for (int ear = 0; ear < kNumEars; ++ear) {
+      outputs.push_back(output.nap()[ear]);
+      outputs.push_back(output.bm()[ear]);
+    }
+    outputs.push_back(sai_frame);
+  }
+  return outputs;
+}
+
+void ExpectAllISAsMatchGeneric(
+    const IHCParams& ihc_params, const AGCParams& agc_params,
+    NonlinearityPrecision precision = NonlinearityPrecision::kExact) {
+  std::vector<ArrayXX> expected;
+  {
+    ScopedKernelISA generic(KernelISA::kGeneric);
+    expected = RunModel(ihc_params, agc_params, precision);
+  }
+  for (KernelISA isa : kAllISAs) {
+    if (!IsKernelISASupported(isa)) {
+      continue;
+    }
+    SCOPED_TRACE(KernelISAName(isa));
+    ScopedKernelISA scoped_isa(isa);
+    const std::vector<ArrayXX> actual =
+        RunModel(ihc_params, agc_params, precision);
+    ASSERT_EQ(expected.size(), actual.size());
+    for (std::size_t i = 0; i < expected.size(); ++i) {
+      ASSERT_TRUE((expected[i] == actual[i]).all()) << "output " << i;
+    }
+  }
+}
+
+// The maximum deviations of the outputs of RunModel from the expected ones,
+// relative to the largest expected value of each kind of output.
+struct OutputDeviation {
+  FPType max_nap_deviation = 0;
+  FPType max_sai_deviation = 0;
+};
+
+OutputDeviation MeasureDeviation(const std::vector<ArrayXX>& expected,
+                                 const std::vector<ArrayXX>& actual) {
+  // Each segment produces the NAP and BM of each of the two ears, then the
+  // SAI.
+  constexpr int kOutputsPerSegment = 5;
+  FPType max_nap = 0;
+  FPType max_sai = 0;
+  FPType max_nap_error = 0;
+  FPType max_sai_error = 0;
+  for (std::size_t i = 0; i < expected.size(); ++i) {
+    const FPType max_error = (expected[i] - actual[i]).abs().maxCoeff();
+    const FPType max_value = expected[i].abs().maxCoeff();
+    if (i % kOutputsPerSegment == kOutputsPerSegment - 1) {
+      max_sai = std::max(max_sai, max_value);
+      max_sai_error = std::max(max_sai_error, max_error);
+    } else if (i % 2 == 0) {
+      max_nap = std::max(max_nap, max_value);
+      max_nap_error = std::max(max_nap_error, max_error);
+    }
+  }
+  OutputDeviation deviation;
+  deviation.max_nap_deviation = max_nap_error / max_nap;
+  deviation.max_sai_deviation = max_sai_error / max_sai;
+  return deviation;
+}
+
+// The state of the step kernels for kFixedStepKernelNumChannels channels,
+// initialized to random values in the ranges they take when running.
+struct StepKernelState {
+  StepKernelState() {
+    constexpr int n = kFixedStepKernelNumChannels;
+    for (ArrayX* coeffs : {&r1_coeffs, &a0_coeffs, &c0_coeffs, &h_coeffs}) {
+      *coeffs = 0.5 + 0.4 * ArrayX::Random(n);
+    }
+    for (ArrayX* state : {&dg_memory, &dzb_memory}) {
+      *state = 1e-4 * ArrayX::Random(n);
+    }
+    for (ArrayX* state : {&g_memory, &zb_memory, &cap1_voltage,
+                          &cap2_voltage}) {
+      *state = 0.5 + 0.4 * ArrayX::Random(n);
+    }
+    for (ArrayX* state : {&z1_memory, &z2_memory, &za_memory, &zy_memory,
+                          &ac_coupler, &ihc_out, &lpf1_state, &lpf2_state}) {
+      *state = 0.1 * ArrayX::Random(n);
+    }
+    ihc_coeffs = {false, true, 0.1, 0.01, 0.005, 0.002, 0.003, 1.5,
+                  0.1,   0.5,  0.6, 0.001, 0.5,  0.6};
+  }
+
+  // Runs num_steps steps of the CAR and IHC step kernels of the given
+  // variant and topology.
+  void Run(int variant, IHCTopology topology, int num_steps) {
+    const CARKernelArrays car = {
+        r1_coeffs.data(), a0_coeffs.data(), c0_coeffs.data(),
+        h_coeffs.data(),  dg_memory.data(), dzb_memory.data(),
+        g_memory.data(),  zb_memory.data(), z1_memory.data(),
+        z2_memory.data(), za_memory.data(), zy_memory.data()};
+    const IHCKernelArrays ihc = {ac_coupler.data(),   ihc_out.data(),
+                                 cap1_voltage.data(), cap2_voltage.data(),
+                                 lpf1_state.data(),   lpf2_state.data()};
+    const KernelTable& kernels = ActiveKernels();
+    for (int step = 0; step < num_steps; ++step) {
+      kernels.car_step[variant](kFixedStepKernelNumChannels, 0.1, 0.04, car);
+      kernels.ihc_step[variant][static_cast<int>(topology)](
+          kFixedStepKernelNumChannels, ihc_coeffs, zy_memory.data(), ihc);
+    }
+  }
+
+  ArrayX r1_coeffs, a0_coeffs, c0_coeffs, h_coeffs, dg_memory, dzb_memory;
+  ArrayX g_memory, zb_memory, z1_memory, z2_memory, za_memory, zy_memory;
+  ArrayX ac_coupler, ihc_out, cap1_voltage, cap2_voltage, lpf1_state,
+      lpf2_state;
+  IHCCoeffs ihc_coeffs;
+};
+
+}  // namespace
+
+TEST(KernelsTest, GenericIsAlwaysSupported) {
+  EXPECT_TRUE(IsKernelISASupported(KernelISA::kGeneric));
+  EXPECT_TRUE(IsKernelISASupported(ActiveKernelISA()));
+}
+
+TEST(KernelsTest, DefaultsToWidestSupportedISA) {
+  if (std::getenv("CARFAC_KERNEL_ISA") != nullptr) {
+    GTEST_SKIP() << "CARFAC_KERNEL_ISA is set.";
+  }
+  KernelISA widest_isa = KernelISA::kGeneric;
+  for (KernelISA isa : kAllISAs) {
+    if (IsKernelISASupported(isa)) {
+      widest_isa = isa;
+    }
+  }
+  EXPECT_EQ(KernelISAName(widest_isa), KernelISAName(ActiveKernelISA()));
+}
+
+TEST(KernelsTest, SetKernelISASelectsKernels) {
+  for (KernelISA isa : kAllISAs) {
+    if (!IsKernelISASupported(isa)) {
+      continue;
+    }
+    ScopedKernelISA scoped_isa(isa);
+    EXPECT_EQ(KernelISAName(isa), KernelISAName(ActiveKernelISA()));
+  }
+}
+
+TEST(KernelsTest, AllISAsMatchGeneric) {
+  ExpectAllISAsMatchGeneric(IHCParams(), AGCParams());
+}
+
+TEST(KernelsTest, AllISAsMatchGenericWithTwoCapacitors) {
+  IHCParams ihc_params;
+  ihc_params.one_capacitor = false;
+  ExpectAllISAsMatchGeneric(ihc_params, AGCParams());
+}
+
+TEST(KernelsTest, AllISAsMatchGenericWithJustHalfWaveRectify) {
+  IHCParams ihc_params;
+  ihc_params.just_half_wave_rectify = true;
+  ExpectAllISAsMatchGeneric(ihc_params, AGCParams());
+}
+
+TEST(KernelsTest, AllISAsMatchGenericWithFastNonlinearities) {
+  ExpectAllISAsMatchGeneric(IHCParams(), AGCParams(),
+                            NonlinearityPrecision::kFast);
+  IHCParams ihc_params;
+  ihc_params.one_capacitor = false;
+  ExpectAllISAsMatchGeneric(ihc_params, AGCParams(),
+                            NonlinearityPrecision::kFast);
+}
+
+TEST(KernelsTest, ApproximateReciprocalIsAccurate) {
+  for (FPType x = 1e-3; x < 1e6; x *= 1.001) {
+    EXPECT_NEAR(1, x * ApproximateReciprocal(x), 1e-6) << x;
+  }
+}
+
+TEST(KernelsTest, FastNonlinearitiesStayCloseToExact) {
+  for (CARKernel car_kernel : {CARKernel::kPerSample, CARKernel::kWavefront,
+                               CARKernel::kFusedBlock}) {
+    SCOPED_TRACE(static_cast<int>(car_kernel));
+    const std::vector<ArrayXX> exact =
+        RunModel(IHCParams(), AGCParams(), NonlinearityPrecision::kExact,
+                 car_kernel);
+    const std::vector<ArrayXX> fast = RunModel(
+        IHCParams(), AGCParams(), NonlinearityPrecision::kFast, car_kernel);
+    const OutputDeviation deviation = MeasureDeviation(exact, fast);
+    EXPECT_GT(deviation.max_nap_deviation, 0);
+    EXPECT_LT(deviation.max_nap_deviation, 1e-3);
+    EXPECT_LT(deviation.max_sai_deviation, 1e-3);
+  }
+}
+
+TEST(KernelsTest, StepKernelVariantSelectsFixedChannelCount) {
+  EXPECT_EQ(0, StepKernelVariant(71, NonlinearityPrecision::kExact));
+  EXPECT_EQ(1, StepKernelVariant(71, NonlinearityPrecision::kFast));
+  EXPECT_EQ(2, StepKernelVariant(kFixedStepKernelNumChannels,
+                                 NonlinearityPrecision::kExact));
+  EXPECT_EQ(3, StepKernelVariant(kFixedStepKernelNumChannels,
+                                 NonlinearityPrecision::kFast));
+}
+
+TEST(KernelsTest, FixedChannelStepKernelsMatchDynamic) {
+  constexpr int kNumSteps = 100;
+  for (KernelISA isa : kAllISAs) {
+    if (!IsKernelISASupported(isa)) {
+      continue;
+    }
+    ScopedKernelISA scoped_isa(isa);
+    for (NonlinearityPrecision precision :
+         {NonlinearityPrecision::kExact, NonlinearityPrecision::kFast}) {
+      const int dynamic_variant = StepKernelVariant(0, precision);
+      const int fixed_variant =
+          StepKernelVariant(kFixedStepKernelNumChannels, precision);
+      for (IHCTopology topology :
+           {IHCTopology::kJustHalfWaveRectify, IHCTopology::kOneCapacitor,
+            IHCTopology::kTwoCapacitors}) {
+        SCOPED_TRACE(testing::Message()
+                     << KernelISAName(isa) << " variant " << fixed_variant
+                     << " topology " << static_cast<int>(topology));
+        StepKernelState expected;
+        StepKernelState actual = expected;
+        expected.Run(dynamic_variant, topology, kNumSteps);
+        actual.Run(fixed_variant, topology, kNumSteps);
+        EXPECT_TRUE((expected.zy_memory == actual.zy_memory).all());
+        EXPECT_TRUE((expected.z1_memory == actual.z1_memory).all());
+        EXPECT_TRUE((expected.ihc_out == actual.ihc_out).all());
+        EXPECT_TRUE((expected.cap2_voltage == actual.cap2_voltage).all());
+      }
+    }
+  }
+}
+
+TEST(KernelsTest, PitchogramDesignUsesFixedChannelCount) {
+  // The channel count is set by highest_pole_hz in PitchogramPipelineParams.
+  for (FPType sample_rate : {16000.0, 22050.0, 44100.0, 48000.0}) {
+    CARParams car_params;
+    car_params.first_pole_theta = 2 * M_PI * 7000.0 / sample_rate;
+    CARFAC carfac(1, sample_rate, car_params, IHCParams(), AGCParams());
+    EXPECT_EQ(kFixedStepKernelNumChannels, carfac.num_channels());
+  }
+}
+
+TEST(KernelsTest, WindowedPeakFindsFirstPeak) {
+  constexpr int kMaxWidth = 300;
+  constexpr int kMaxStride = 3;
+  // Few distinct values, so that the peak is often repeated.
+  std::vector<FPType> input(kMaxWidth * kMaxStride);
+  for (std::size_t i = 0; i < input.size(); ++i) {
+    input[i] = static_cast<FPType>((i * 7919) % 13) - 6;
+  }
+  std::vector<FPType> window(kMaxWidth, 0.5);
+  for (KernelISA isa : kAllISAs) {
+    if (!IsKernelISASupported(isa)) {
+      continue;
+    }
+    ScopedKernelISA scoped_isa(isa);
+    for (int stride : {1, kMaxStride}) {
+      for (int width = 1; width <= kMaxWidth; ++width) {
+        FPType expected_peak = input[0] * window[0];
+        int expected_index = 0;
+        for (int i = 1; i < width; ++i) {
+          if (input[i * stride] * window[i] > expected_peak) {
+            expected_peak = input[i * stride] * window[i];
+            expected_index = i;
+          }
+        }
+        int index;
+        const FPType peak = ActiveKernels().windowed_peak(
+            width, input.data(), stride, window.data(), &index);
+        ASSERT_EQ(expected_peak, peak) << KernelISAName(isa);
+        ASSERT_EQ(expected_index, index)
+            << KernelISAName(isa) << " width: " << width
+            << " stride: " << stride;
+      }
+    }
+  }
+}
+
+// Compares the SAI kernels on the rows of a row major buffer, with unit
+// stride, and of a column major one, with a stride of the number of
+// channels, over the buffers of a pitchogram frame at 44.1 kHz.
+void BM_SAIKernelsStride(benchmark::State& state) {
+  const bool row_major = state.range(0);
+  constexpr int kNumChannels = 71;
+  constexpr int kTriggerWindowWidth = 1025;
+  constexpr int kSAIWidth = 2205;
+  constexpr int kBufferWidth = kSAIWidth + 3 * kTriggerWindowWidth / 2;
+  state.SetLabel(row_major ? "row major" : "column major");
+  const ArrayXX input =
+      ArrayXX::Random(kNumChannels, kBufferWidth).abs();
+  ArrayXX output = ArrayXX::Zero(kNumChannels, kSAIWidth);
+  const ArrayX window =
+      ArrayX::LinSpaced(kTriggerWindowWidth, M_PI / kTriggerWindowWidth, M_PI)
+          .sin();
+  const int input_stride = row_major ? 1 : kNumChannels;
+  const int output_stride = row_major ? 1 : kNumChannels;
+  const KernelTable& kernels = ActiveKernels();
+  for (auto _ : state) {
+    for (int channel = 0; channel < kNumChannels; ++channel) {
+      // A row major buffer holds each channel at a contiguous offset.
+      const FPType* row = row_major ? input.data() + channel * kBufferWidth
+                                    : input.data() + channel;
+      FPType* output_row = row_major ? output.data() + channel * kSAIWidth
+                                     : output.data() + channel;
+      for (int w = 0; w < 2; ++w) {
+        int trigger;
+        const FPType peak = kernels.windowed_peak(
+            kTriggerWindowWidth,
+            row + (kSAIWidth / 2 + w * kTriggerWindowWidth / 2) * input_stride,
+            input_stride, window.data(), &trigger);
+        kernels.blend(kSAIWidth, peak / (0.5f + peak),
+                      row + (trigger + w * kTriggerWindowWidth / 2) *
+                                input_stride,
+                      input_stride, output_row, output_stride);
+      }
+    }
+    benchmark::DoNotOptimize(output.data());
+  }
+}
+BENCHMARK(BM_SAIKernelsStride)->ArgName("row_major")->Arg(0)->Arg(1);
+
+void BM_CarfacSegmentISA(benchmark::State& state) {
+  const KernelISA isa = kAllISAs[state.range(0)];
+  if (!IsKernelISASupported(isa)) {
+    state.SkipWithError("Unsupported instruction set.");
+    return;
+  }
+  ScopedKernelISA scoped_isa(isa);
+  state.SetLabel(KernelISAName(isa));
+  constexpr int kNumSamples = 2205;
+  CARFAC carfac(1, kSampleRate, CARParams(), IHCParams(), AGCParams());
+  CARFACOutput output(true, false, false, false);
+  const ArrayXX sound = MakeSound(1, kNumSamples);
+  for (auto _ : state) {
+    carfac.RunSegment(sound, false /* open_loop */, &output);
+  }
+  state.SetItemsProcessed(state.iterations() * kNumSamples);
+}
+BENCHMARK(BM_CarfacSegmentISA)->DenseRange(0, 3);
+
+// Reports the time to run the model with each nonlinearity precision and CAR
+// kernel, along with the maximum NAP and SAI deviations of the fast
+// precision from the exact one, relative to the largest output.
+void BM_CarfacNonlinearityPrecision(benchmark::State& state) {
+  const NonlinearityPrecision precision =
+      static_cast<NonlinearityPrecision>(state.range(0));
+  const CARKernel car_kernel = static_cast<CARKernel>(state.range(1));
+  constexpr int kNumSamples = 2205;
+  CARFAC carfac(1, kSampleRate, CARParams(), IHCParams(), AGCParams());
+  carfac.set_nonlinearity_precision(precision);
+  carfac.set_car_kernel(car_kernel);
+  CARFACOutput output(true, false, false, false);
+  const ArrayXX sound = MakeSound(1, kNumSamples);
+  for (auto _ : state) {
+    carfac.RunSegment(sound, false /* open_loop */, &output);
+  }
+  state.SetItemsProcessed(state.iterations() * kNumSamples);
+  const OutputDeviation deviation = MeasureDeviation(
+      RunModel(IHCParams(), AGCParams(), NonlinearityPrecision::kExact,
+               car_kernel),
+      RunModel(IHCParams(), AGCParams(), precision, car_kernel));
+  state.counters["max_nap_deviation"] = deviation.max_nap_deviation;
+  state.counters["max_sai_deviation"] = deviation.max_sai_deviation;
+}
+BENCHMARK(BM_CarfacNonlinearityPrecision)
+    ->ArgNames({"precision", "kernel"})
+    ->ArgsProduct({{static_cast<int>(NonlinearityPrecision::kExact),
+                    static_cast<int>(NonlinearityPrecision::kFast)},
+                   {static_cast<int>(CARKernel::kPerSample),
+                    static_cast<int>(CARKernel::kFusedBlock)}});
+
+// Compares the step kernels with a dynamic and a fixed channel count.
+void BM_StepKernels(benchmark::State& state) {
+  const int variant = state.range(0);
+  const IHCTopology topology = static_cast<IHCTopology>(state.range(1));
+  StepKernelState kernel_state;
+  for (auto _ : state) {
+    kernel_state.Run(variant, topology, 1);
+    benchmark::DoNotOptimize(kernel_state.ihc_out.data());
+  }
+}
+BENCHMARK(BM_StepKernels)
+    ->ArgNames({"variant", "topology"})
+    ->ArgsProduct({{StepKernelVariant(0, NonlinearityPrecision::kExact),
+                    StepKernelVariant(kFixedStepKernelNumChannels,
+                                      NonlinearityPrecision::kExact)},
+                   {static_cast<int>(IHCTopology::kOneCapacitor),
+                    static_cast<int>(IHCTopology::kTwoCapacitors)}});
@@ -19,11 +19,19 @@
 
 #include "pitchogram_pipeline.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cmath>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <memory>
+#include <new>
 #include <vector>
 
+#include "carfac.h"
+#include "fixed_point_carfac.h"
 #include "image.h"
 #include "test_util.h"
 #include "testing/base/public/gunit.h"
@@ -32,6 +40,77 @@ char* goldens_dir = NULL;
 
 namespace {
 
+// Heap allocations are counted only while this is set.
+std::atomic<bool> counting_allocations(false);
+std::atomic<int> allocation_count(0);
+
+void CountAllocation() {
+  if (counting_allocations.load(std::memory_order_relaxed)) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+}  // namespace
+
+// The allocation counter hooks malloc itself where the C library allows it,
+// which also catches the allocations of Eigen and of operator new.  Elsewhere
+// it can only replace the global operator new.
+#if defined(__GLIBC__)
+extern "C" {
+void* __libc_malloc(std::size_t size);
+void* __libc_calloc(std::size_t count, std::size_t size);
+void* __libc_realloc(void* ptr, std::size_t size);
+void* __libc_memalign(std::size_t alignment, std::size_t size);
+
+void* malloc(std::size_t size) {
+  CountAllocation();
+  return __libc_malloc(size);
+}
+
+void* calloc(std::size_t count, std::size_t size) {
+  CountAllocation();
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, std::size_t size) {
+  CountAllocation();
+  return __libc_realloc(ptr, size);
+}
+
+void* aligned_alloc(std::size_t alignment, std::size_t size) {
+  CountAllocation();
+  return __libc_memalign(alignment, size);
+}
+}  // extern "C"
+#else
+void* operator new(std::size_t size) {
+  CountAllocation();
+  void* ptr = std::malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+#endif
+
+namespace {
+
+// Counts the heap allocations made by this thread and any other during its
+// lifetime.
+class ScopedAllocationCounter {
+ public:
+  ScopedAllocationCounter() {
+    allocation_count = 0;
+    counting_allocations = true;
+  }
+  ~ScopedAllocationCounter() { counting_allocations = false; }
+
+  int num_allocations() const { return allocation_count; }
+};
+
 // Reads an int16 in little endian byte order from `f`.
 int16_t ReadInt16Le(std::FILE* f) {
   uint16_t sample_u16 = static_cast<uint16_t>(std::getc(f));
@@ -116,6 +195,613 @@ TEST_P(PitchogramPipelineTest, CheckGolden) {
 INSTANTIATE_TEST_SUITE_P(Params, PitchogramPipelineTest,
                          testing::Values(TestParams{false}, TestParams{true}));
 
+// Fills samples with a chirp starting at sample start, so that successive
+// segments drive the AGC through changing levels.
+void FillChirp(int start, float sample_rate_hz, std::vector<float>* samples) {
+  const int num_samples = samples->size();
+  for (int i = 0; i < num_samples; ++i) {
+    const float t = (start + i) / sample_rate_hz;
+    (*samples)[i] = 0.1f * std::sin(2 * M_PI * (100.0f + 500.0f * t) * t);
+  }
+}
+
+TEST(PitchogramPipelineAllocationTest, ProcessJustSamplesDoesNotAllocate) {
+  constexpr float kSampleRateHz = 44100.0f;
+  constexpr int kChunkSize = 512;
+  constexpr int kNumChunks = 50;
+
+  for (float internal_sample_rate_hz : {0.0f, 22050.0f}) {
+    PitchogramPipelineParams params;
+    params.num_frames = kNumChunks;
+    params.num_samples_per_segment = kChunkSize;
+    params.internal_sample_rate_hz = internal_sample_rate_hz;
+    PitchogramPipeline pipeline(kSampleRateHz, params);
+    std::vector<float> input(kChunkSize);
+    // The first call sizes the output buffers.
+    FillChirp(0, kSampleRateHz, &input);
+    pipeline.ProcessJustSamples(input.data(), kChunkSize);
+
+    for (int i = 1; i < kNumChunks; ++i) {
+      FillChirp(i * kChunkSize, kSampleRateHz, &input);
+      ScopedAllocationCounter counter;
+      pipeline.ProcessJustSamples(input.data(), kChunkSize);
+      ASSERT_EQ(counter.num_allocations(), 0)
+          << "Allocated in chunk " << i << " at " << internal_sample_rate_hz
+          << " Hz";
+    }
+  }
+}
+
+TEST(PitchogramPipelineAllocationTest, CARFACKernelsDoNotAllocate) {
+  constexpr float kSampleRateHz = 22050.0f;
+  constexpr int kChunkSize = 300;
+  constexpr int kNumChunks = 20;
+
+  for (CARKernel kernel : {CARKernel::kPerSample, CARKernel::kWavefront,
+                           CARKernel::kFusedBlock}) {
+    SCOPED_TRACE(static_cast<int>(kernel));
+    CARFAC carfac(1, kSampleRateHz, CARParams(), IHCParams(), AGCParams());
+    carfac.set_car_kernel(kernel);
+    CARFACOutput output(true, true, true, true);
+    std::vector<float> input(kChunkSize);
+    FillChirp(0, kSampleRateHz, &input);
+    carfac.RunSegment(ArrayXX::Map(input.data(), 1, kChunkSize), false,
+                      &output);
+
+    for (int i = 1; i < kNumChunks; ++i) {
+      FillChirp(i * kChunkSize, kSampleRateHz, &input);
+      ScopedAllocationCounter counter;
+      carfac.RunSegment(ArrayXX::Map(input.data(), 1, kChunkSize), false,
+                        &output);
+      ASSERT_EQ(counter.num_allocations(), 0) << "Allocated in chunk " << i;
+    }
+  }
+}
+
+TEST(PitchogramPipelineStateTest, RestoredStateResumesExactly) {
+  constexpr float kSampleRateHz = 22050.0f;
+  constexpr int kChunkSize = 256;
+  constexpr int kNumChunks = 20;
+
+  PitchogramPipelineParams params;
+  params.num_frames = kNumChunks;
+  params.num_samples_per_segment = kChunkSize;
+  PitchogramPipeline pipeline(kSampleRateHz, params);
+  PitchogramPipeline restored_pipeline(kSampleRateHz, params);
+  std::vector<float> input(kChunkSize);
+  std::vector<uint8_t> state;
+  for (int i = 0; i < kNumChunks; ++i) {
+    if (i == kNumChunks / 2) {
+      pipeline.SaveState(&state);
+      ASSERT_TRUE(restored_pipeline.RestoreState(state));
+    }
+    FillChirp(i * kChunkSize, kSampleRateHz, &input);
+    pipeline.ProcessSamples(input.data(), kChunkSize);
+    if (i >= kNumChunks / 2) {
+      restored_pipeline.ProcessSamples(input.data(), kChunkSize);
+      ASSERT_TRUE((pipeline.sai_output() == restored_pipeline.sai_output())
+                      .all()) << "chunk: " << i;
+      ASSERT_EQ(pipeline.vowel_coords(), restored_pipeline.vowel_coords());
+    }
+  }
+
+  // A pipeline with a different design rejects the state.
+  params.num_samples_per_segment = kChunkSize / 2;
+  PitchogramPipeline other_pipeline(kSampleRateHz, params);
+  EXPECT_FALSE(other_pipeline.RestoreState(state));
+  // So does one whose state has the same size.
+  params.num_samples_per_segment = kChunkSize;
+  params.pitchogram_params.vowel_time_constant_s *= 2;
+  PitchogramPipeline same_size_pipeline(kSampleRateHz, params);
+  std::vector<uint8_t> same_size_state;
+  same_size_pipeline.SaveState(&same_size_state);
+  ASSERT_EQ(same_size_state.size(), state.size());
+  EXPECT_FALSE(same_size_pipeline.RestoreState(state));
+  state.pop_back();
+  EXPECT_FALSE(restored_pipeline.RestoreState(state));
+}
+
+TEST(PitchogramPipelineStateTest, KeyframeIndexSeeksToAnyFrame) {
+  constexpr float kSampleRateHz = 22050.0f;
+  constexpr int kChunkSize = 256;
+  constexpr int kNumChunks = 40;
+
+  PitchogramPipelineParams params;
+  params.num_frames = kNumChunks;
+  params.num_samples_per_segment = kChunkSize;
+  PitchogramPipeline pipeline(kSampleRateHz, params);
+  // About 8.6 frames, rounded to 9.
+  PitchogramKeyframeIndex keyframes(pipeline, 0.1f);
+  ASSERT_EQ(9, keyframes.keyframe_interval());
+
+  std::vector<float> input(kChunkSize);
+  std::vector<ArrayXX> sai_frames;
+  for (int i = 0; i < kNumChunks; ++i) {
+    FillChirp(i * kChunkSize, kSampleRateHz, &input);
+    pipeline.ProcessJustSamples(input.data(), kChunkSize);
+    keyframes.Update(i + 1, pipeline);
+    sai_frames.push_back(pipeline.sai_output());
+  }
+  EXPECT_EQ(5, keyframes.num_keyframes());
+
+  PitchogramPipeline seeking_pipeline(kSampleRateHz, params);
+  for (int target : {31, 5, 18, 9, 40}) {
+    const int start = keyframes.Seek(target, &seeking_pipeline);
+    EXPECT_EQ(std::min(target / 9, 4) * 9, start);
+    for (int i = start; i < target; ++i) {
+      FillChirp(i * kChunkSize, kSampleRateHz, &input);
+      seeking_pipeline.ProcessJustSamples(input.data(), kChunkSize);
+    }
+    if (target > start) {
+      EXPECT_TRUE(
+          (seeking_pipeline.sai_output() == sai_frames[target - 1]).all())
+          << "target: " << target;
+    }
+  }
+}
+
+TEST(PitchogramPipelineResamplingTest, RunsModelAtInternalSampleRate) {
+  PitchogramPipelineParams params;
+  params.num_samples_per_segment = 512;
+  params.internal_sample_rate_hz = 22050.0f;
+  PitchogramPipeline pipeline(44100.0f, params);
+  EXPECT_EQ(22050.0f, pipeline.model_sample_rate_hz());
+  EXPECT_EQ(512, pipeline.num_samples_per_segment());
+  EXPECT_EQ(256, pipeline.model_samples_per_segment());
+  // The lags are rescaled to the same max_lag_s.
+  EXPECT_EQ(1103, pipeline.sai_params_.sai_width);
+  // The channels are set by highest_pole_hz.
+  PitchogramPipeline native_pipeline(44100.0f, PitchogramPipelineParams());
+  EXPECT_EQ(native_pipeline.pole_frequencies().size(),
+            pipeline.pole_frequencies().size());
+
+  std::vector<float> input(512);
+  FillChirp(0, 44100.0f, &input);
+  pipeline.ProcessJustSamples(input.data(), 512);
+  EXPECT_EQ(256, pipeline.nap().cols());
+  EXPECT_EQ(1103, pipeline.sai_output().cols());
+}
+
+TEST(PitchogramPipelineResamplingTest, RoundsInternalSampleRate) {
+  // 1024 samples at 48 kHz are 470.4 samples at 22.05 kHz.
+  PitchogramPipelineParams params;
+  params.num_samples_per_segment = 1024;
+  params.internal_sample_rate_hz = 22050.0f;
+  PitchogramPipeline pipeline(48000.0f, params);
+  EXPECT_EQ(470, pipeline.model_samples_per_segment());
+  EXPECT_EQ(22031.25f, pipeline.model_sample_rate_hz());
+
+  // No resampling at the input rate.
+  params.internal_sample_rate_hz = 48000.0f;
+  PitchogramPipeline native_pipeline(48000.0f, params);
+  EXPECT_EQ(1024, native_pipeline.model_samples_per_segment());
+  EXPECT_EQ(nullptr, native_pipeline.resampler_);
+}
+
+TEST(PitchogramPipelineResamplingTest, RestoredStateResumesExactly) {
+  constexpr float kSampleRateHz = 48000.0f;
+  constexpr int kChunkSize = 1024;
+  constexpr int kNumChunks = 10;
+
+  PitchogramPipelineParams params;
+  params.num_frames = kNumChunks;
+  params.num_samples_per_segment = kChunkSize;
+  params.internal_sample_rate_hz = 16000.0f;
+  PitchogramPipeline pipeline(kSampleRateHz, params);
+  PitchogramPipeline restored_pipeline(kSampleRateHz, params);
+  std::vector<float> input(kChunkSize);
+  std::vector<uint8_t> state;
+  for (int i = 0; i < kNumChunks; ++i) {
+    if (i == kNumChunks / 2) {
+      pipeline.SaveState(&state);
+      ASSERT_TRUE(restored_pipeline.RestoreState(state));
+    }
+    FillChirp(i * kChunkSize, kSampleRateHz, &input);
+    pipeline.ProcessSamples(input.data(), kChunkSize);
+    if (i >= kNumChunks / 2) {
+      restored_pipeline.ProcessSamples(input.data(), kChunkSize);
+      ASSERT_TRUE((pipeline.sai_output() == restored_pipeline.sai_output())
+                      .all()) << "chunk: " << i;
+    }
+  }
+
+  // A pipeline running at the input rate rejects the state.
+  params.internal_sample_rate_hz = 0.0f;
+  PitchogramPipeline native_pipeline(kSampleRateHz, params);
+  EXPECT_FALSE(native_pipeline.RestoreState(state));
+}
+
+TEST(PitchogramPipelineFixedPointTest, MatchesFloatingPointPipeline) {
+  constexpr float kSampleRateHz = 22050.0f;
+  constexpr int kChunkSize = 512;
+  constexpr int kNumChunks = 20;
+
+  PitchogramPipelineParams params;
+  params.num_frames = kNumChunks;
+  params.num_samples_per_segment = kChunkSize;
+  PitchogramPipeline pipeline(kSampleRateHz, params);
+  params.fixed_point_carfac = true;
+  PitchogramPipeline fixed_point_pipeline(kSampleRateHz, params);
+  EXPECT_FALSE(pipeline.params() == fixed_point_pipeline.params());
+  ASSERT_TRUE((pipeline.pole_frequencies() ==
+               fixed_point_pipeline.pole_frequencies())
+                  .all());
+
+  std::vector<float> input(kChunkSize);
+  for (int i = 0; i < kNumChunks; ++i) {
+    FillChirp(i * kChunkSize, kSampleRateHz, &input);
+    pipeline.ProcessSamples(input.data(), kChunkSize);
+    fixed_point_pipeline.ProcessSamples(input.data(), kChunkSize);
+  }
+  EXPECT_GT(SignalToNoiseRatioDb(pipeline.nap(), fixed_point_pipeline.nap()),
+            40.0);
+  EXPECT_GT(SignalToNoiseRatioDb(pipeline.sai_output(),
+                                 fixed_point_pipeline.sai_output()),
+            30.0);
+}
+
+TEST(PitchogramPipelineFixedPointTest, RestoredStateResumesExactly) {
+  constexpr float kSampleRateHz = 22050.0f;
+  constexpr int kChunkSize = 512;
+  constexpr int kNumChunks = 10;
+
+  PitchogramPipelineParams params;
+  params.num_frames = kNumChunks;
+  params.num_samples_per_segment = kChunkSize;
+  params.fixed_point_carfac = true;
+  PitchogramPipeline pipeline(kSampleRateHz, params);
+  PitchogramPipeline restored_pipeline(kSampleRateHz, params);
+  std::vector<float> input(kChunkSize);
+  std::vector<uint8_t> state;
+  for (int i = 0; i < kNumChunks; ++i) {
+    if (i == kNumChunks / 2) {
+      pipeline.SaveState(&state);
+      ASSERT_TRUE(restored_pipeline.RestoreState(state));
+    }
+    FillChirp(i * kChunkSize, kSampleRateHz, &input);
+    pipeline.ProcessJustSamples(input.data(), kChunkSize);
+    if (i >= kNumChunks / 2) {
+      // The first call sizes the output buffers.
+      ScopedAllocationCounter counter;
+      restored_pipeline.ProcessJustSamples(input.data(), kChunkSize);
+      if (i > kNumChunks / 2) {
+        ASSERT_EQ(counter.num_allocations(), 0) << "chunk: " << i;
+      }
+      ASSERT_TRUE((pipeline.sai_output() == restored_pipeline.sai_output())
+                      .all()) << "chunk: " << i;
+    }
+  }
+
+  // A floating point pipeline rejects the state.
+  params.fixed_point_carfac = false;
+  PitchogramPipeline float_pipeline(kSampleRateHz, params);
+  EXPECT_FALSE(float_pipeline.RestoreState(state));
+}
+
+TEST(PitchogramPipelineThreadTest, SAIThreadsMatchSerial) {
+  constexpr float kSampleRateHz = 22050.0f;
+  constexpr int kChunkSize = 64;
+  constexpr int kNumChunks = 40;
+  PitchogramPipelineParams params;
+  params.num_frames = kNumChunks;
+  params.num_samples_per_segment = kChunkSize;
+  PitchogramPipeline pipeline(kSampleRateHz, params);
+  params.num_sai_threads = 3;
+  PitchogramPipeline threaded_pipeline(kSampleRateHz, params);
+  EXPECT_FALSE(pipeline.params() == threaded_pipeline.params());
+
+  std::vector<float> input(kChunkSize);
+  for (int i = 0; i < kNumChunks; ++i) {
+    FillChirp(i * kChunkSize, kSampleRateHz, &input);
+    pipeline.ProcessSamples(input.data(), kChunkSize);
+    ScopedAllocationCounter counter;
+    threaded_pipeline.ProcessJustSamples(input.data(), kChunkSize);
+    if (i > 0) {
+      ASSERT_EQ(counter.num_allocations(), 0) << "Allocated in chunk " << i;
+    }
+    ASSERT_TRUE((pipeline.sai_output() == threaded_pipeline.sai_output()).all())
+        << "chunk: " << i;
+  }
+}
+
+TEST(PitchogramPipelineLagCellTest, PoolsSAILags) {
+  constexpr float kSampleRateHz = 22050.0f;
+  constexpr int kChunkSize = 512;
+  constexpr int kNumChunks = 20;
+  constexpr int kSAIOutputWidth = 64;
+  PitchogramPipelineParams params;
+  params.num_frames = kNumChunks;
+  params.num_samples_per_segment = kChunkSize;
+  PitchogramPipeline pipeline(kSampleRateHz, params);
+  params.sai_output_width = kSAIOutputWidth;
+  PitchogramPipeline pooled_pipeline(kSampleRateHz, params);
+  params.sai_output_width = 0;
+  params.sai_log_lag_output = true;
+  PitchogramPipeline log_lag_pipeline(kSampleRateHz, params);
+  EXPECT_FALSE(pipeline.params() == pooled_pipeline.params());
+  EXPECT_FALSE(pipeline.params() == log_lag_pipeline.params());
+
+  std::vector<float> input(kChunkSize);
+  for (int i = 0; i < kNumChunks; ++i) {
+    FillChirp(i * kChunkSize, kSampleRateHz, &input);
+    pipeline.ProcessJustSamples(input.data(), kChunkSize);
+    pooled_pipeline.ProcessJustSamples(input.data(), kChunkSize);
+    log_lag_pipeline.ProcessJustSamples(input.data(), kChunkSize);
+  }
+  const ArrayXX& sai_output = pipeline.sai_output();
+  const PitchogramParams& pitchogram_params = params.pitchogram_params;
+  const std::vector<LagCell> log_lag_cells = LogLagCells(
+      kSampleRateHz, sai_output.cols(), pitchogram_params.lags_per_octave,
+      pitchogram_params.min_lag_s, pitchogram_params.log_offset_s);
+  for (const auto& [lag_cells, pooled_sai_output] :
+       {std::make_pair(LinearLagCells(sai_output.cols(), kSAIOutputWidth),
+                       pooled_pipeline.sai_output()),
+        std::make_pair(log_lag_cells, log_lag_pipeline.sai_output())}) {
+    const int num_cells = lag_cells.size();
+    ASSERT_EQ(sai_output.rows(), pooled_sai_output.rows());
+    ASSERT_EQ(num_cells, pooled_sai_output.cols());
+    for (int channel = 0; channel < sai_output.rows(); ++channel) {
+      const ArrayX sai_row = sai_output.row(channel);
+      for (int c = 0; c < num_cells; ++c) {
+        ASSERT_NEAR(lag_cells[c].CellAverage(sai_row),
+                    pooled_sai_output(channel, c), 1e-5f)
+            << "channel: " << channel << " cell: " << c;
+      }
+    }
+  }
+}
+
+TEST(PitchogramPipelineBandTest, ComputesRowsOfActiveBands) {
+  constexpr float kSampleRateHz = 22050.0f;
+  constexpr int kChunkSize = 512;
+  PitchogramPipelineParams params;
+  params.num_samples_per_segment = kChunkSize;
+  PitchogramPipeline pipeline(kSampleRateHz, params);
+  PitchogramPipeline band_pipeline(kSampleRateHz, params);
+  constexpr int kMarginChannels = 1;
+  band_pipeline.SetActiveBands({{200.0f, 400.0f}, {1000.0f, 1010.0f}},
+                               kMarginChannels);
+  const ArrayX& pole_frequencies = pipeline.pole_frequencies();
+  const int num_channels = pole_frequencies.size();
+  ASSERT_LT(band_pipeline.num_active_channels(), num_channels / 2);
+
+  std::vector<float> input(kChunkSize);
+  for (int i = 0; i < 10; ++i) {
+    FillChirp(i * kChunkSize, kSampleRateHz, &input);
+    pipeline.ProcessJustSamples(input.data(), kChunkSize);
+    band_pipeline.ProcessJustSamples(input.data(), kChunkSize);
+  }
+  int num_computed_rows = 0;
+  for (int channel = 0; channel < num_channels; ++channel) {
+    const bool computed = (band_pipeline.sai_output().row(channel) ==
+                           pipeline.sai_output().row(channel)).all();
+    num_computed_rows += computed;
+    if (pole_frequencies(channel) >= 200.0f &&
+        pole_frequencies(channel) <= 400.0f) {
+      EXPECT_TRUE(computed) << "channel: " << channel;
+    } else if (!computed) {
+      EXPECT_TRUE((band_pipeline.sai_output().row(channel) == 0).all())
+          << "channel: " << channel;
+    }
+  }
+  EXPECT_EQ(band_pipeline.num_active_channels(), num_computed_rows);
+
+  // The narrow band selects its nearest channel.
+  int nearest_channel;
+  (pole_frequencies - std::sqrt(1000.0f * 1010.0f)).abs().minCoeff(
+      &nearest_channel);
+  EXPECT_TRUE((band_pipeline.sai_output().row(nearest_channel) ==
+               pipeline.sai_output().row(nearest_channel)).all());
+
+  band_pipeline.SetActiveBands({});
+  EXPECT_EQ(num_channels, band_pipeline.num_active_channels());
+}
+
+TEST(PitchogramPipelineBandTest, MinPoleHzDropsLowChannels) {
+  PitchogramPipelineParams params;
+  PitchogramPipeline pipeline(22050.0f, params);
+  params.min_pole_hz = 200.0f;
+  PitchogramPipeline narrow_pipeline(22050.0f, params);
+  EXPECT_LT(narrow_pipeline.pole_frequencies().size(),
+            pipeline.pole_frequencies().size());
+  EXPECT_GT(narrow_pipeline.pole_frequencies().minCoeff(), 200.0f);
+}
+
+// Returns true if the pipelines have the same outputs.
+bool SameOutputs(const PitchogramPipeline& a, const PitchogramPipeline& b) {
+  return (a.sai_output() == b.sai_output()).all() &&
+         a.vowel_coords() == b.vowel_coords() &&
+         std::equal(a.image().data(),
+                    a.image().data() + a.image().num_pixels() * 4,
+                    b.image().data());
+}
+
+TEST(PitchogramPipelinePoolTest, ResetPipelineMatchesNewPipeline) {
+  constexpr float kSampleRateHz = 22050.0f;
+  constexpr int kChunkSize = 256;
+  constexpr int kNumChunks = 20;
+  PitchogramPipelineParams params;
+  params.num_frames = kNumChunks;
+  params.num_samples_per_segment = kChunkSize;
+  params.internal_sample_rate_hz = 16000.0f;
+  PitchogramPipeline pipeline(kSampleRateHz, params);
+  std::vector<float> input(kChunkSize);
+  for (int i = 0; i < kNumChunks; ++i) {
+    FillChirp(i * kChunkSize, kSampleRateHz, &input);
+    pipeline.ProcessSamples(input.data(), kChunkSize);
+  }
+
+  pipeline.Reset();
+  PitchogramPipeline new_pipeline(kSampleRateHz, params);
+  ASSERT_TRUE(SameOutputs(pipeline, new_pipeline));
+  for (int i = 0; i < kNumChunks; ++i) {
+    FillChirp(i * kChunkSize * 3, kSampleRateHz, &input);
+    pipeline.ProcessSamples(input.data(), kChunkSize);
+    new_pipeline.ProcessSamples(input.data(), kChunkSize);
+    ASSERT_TRUE(SameOutputs(pipeline, new_pipeline)) << "chunk: " << i;
+  }
+}
+
+TEST(PitchogramPipelinePoolTest, ReusesReleasedPipelines) {
+  constexpr float kSampleRateHz = 22050.0f;
+  constexpr int kChunkSize = 256;
+  PitchogramPipelineParams params;
+  params.num_samples_per_segment = kChunkSize;
+  PitchogramPipelinePool pool(2);
+
+  std::unique_ptr<PitchogramPipeline> pipeline =
+      pool.Acquire(kSampleRateHz, params);
+  std::vector<float> input(kChunkSize);
+  FillChirp(0, kSampleRateHz, &input);
+  pipeline->SetActiveBands({{200.0f, 400.0f}});
+  pipeline->ProcessSamples(input.data(), kChunkSize);
+  const PitchogramPipeline* released = pipeline.get();
+  pool.Release(std::move(pipeline));
+  EXPECT_EQ(1, pool.num_idle_pipelines());
+
+  // Other designs are not matched.
+  PitchogramPipelineParams other_params = params;
+  other_params.max_lag_s = 0.02f;
+  std::unique_ptr<PitchogramPipeline> other_pipeline =
+      pool.Acquire(kSampleRateHz, other_params);
+  EXPECT_NE(released, other_pipeline.get());
+  std::unique_ptr<PitchogramPipeline> other_rate_pipeline =
+      pool.Acquire(16000.0f, params);
+  EXPECT_NE(released, other_rate_pipeline.get());
+
+  pipeline = pool.Acquire(kSampleRateHz, params);
+  EXPECT_EQ(released, pipeline.get());
+  EXPECT_EQ(0, pool.num_idle_pipelines());
+  EXPECT_EQ(pipeline->pole_frequencies().size(),
+            pipeline->num_active_channels());
+  PitchogramPipeline new_pipeline(kSampleRateHz, params);
+  EXPECT_TRUE(SameOutputs(*pipeline, new_pipeline));
+
+  // The pool keeps the most recently released pipelines.
+  pool.Release(std::move(pipeline));
+  pool.Release(std::move(other_pipeline));
+  pool.Release(std::move(other_rate_pipeline));
+  EXPECT_EQ(2, pool.num_idle_pipelines());
+  pool.Acquire(kSampleRateHz, params);
+  EXPECT_EQ(2, pool.num_idle_pipelines());
+}
+
+TEST(PitchogramPipelineSAIBankTest, MatchesSeparatePipelines) {
+  constexpr float kSampleRateHz = 22050.0f;
+  constexpr int kChunkSize = 256;
+  constexpr int kNumChunks = 30;
+  PitchogramPipelineParams params;
+  params.num_frames = kNumChunks;
+  params.num_samples_per_segment = kChunkSize;
+  PitchogramPipeline pipeline(kSampleRateHz, params);
+  // A bank of a long and a short pooled SAI.
+  std::vector<PitchogramSAIParams> sai_bank(2);
+  sai_bank[0].max_lag_s = 0.08f;
+  sai_bank[0].num_triggers_per_frame = 3;
+  sai_bank[1].max_lag_s = 0.01f;
+  sai_bank[1].output_width = 40;
+  std::vector<std::unique_ptr<PitchogramPipeline>> separate_pipelines;
+  for (const PitchogramSAIParams& bank_params : sai_bank) {
+    PitchogramPipelineParams separate_params = params;
+    separate_params.max_lag_s = bank_params.max_lag_s;
+    separate_params.num_triggers_per_frame =
+        bank_params.num_triggers_per_frame;
+    separate_params.sai_output_width = bank_params.output_width;
+    separate_pipelines.emplace_back(
+        new PitchogramPipeline(kSampleRateHz, separate_params));
+  }
+  params.sai_bank = sai_bank;
+  PitchogramPipeline bank_pipeline(kSampleRateHz, params);
+  EXPECT_FALSE(pipeline.params() == bank_pipeline.params());
+  ASSERT_EQ(2, bank_pipeline.sai_bank_size());
+
+  std::vector<float> input(kChunkSize);
+  std::vector<uint8_t> state;
+  for (int i = 0; i < kNumChunks; ++i) {
+    FillChirp(i * kChunkSize, kSampleRateHz, &input);
+    pipeline.ProcessSamples(input.data(), kChunkSize);
+    bank_pipeline.ProcessSamples(input.data(), kChunkSize);
+    for (auto& separate_pipeline : separate_pipelines) {
+      separate_pipeline->ProcessJustSamples(input.data(), kChunkSize);
+    }
+    ASSERT_TRUE(SameOutputs(pipeline, bank_pipeline)) << "chunk: " << i;
+    for (int j = 0; j < 2; ++j) {
+      ASSERT_TRUE((separate_pipelines[j]->sai_output() ==
+                   bank_pipeline.sai_bank_output(j))
+                      .all())
+          << "chunk: " << i << " bank SAI: " << j;
+    }
+    if (i == kNumChunks / 2) {
+      bank_pipeline.SaveState(&state);
+    }
+  }
+
+  // The state covers the bank.
+  PitchogramPipeline restored_pipeline(kSampleRateHz, params);
+  ASSERT_TRUE(restored_pipeline.RestoreState(state));
+  EXPECT_FALSE(pipeline.RestoreState(state));
+  bank_pipeline.RestoreState(state);
+  for (int i = kNumChunks / 2 + 1; i < kNumChunks; ++i) {
+    FillChirp(i * kChunkSize, kSampleRateHz, &input);
+    bank_pipeline.ProcessJustSamples(input.data(), kChunkSize);
+    restored_pipeline.ProcessJustSamples(input.data(), kChunkSize);
+    for (int j = 0; j < 2; ++j) {
+      ASSERT_TRUE((restored_pipeline.sai_bank_output(j) ==
+                   bank_pipeline.sai_bank_output(j))
+                      .all())
+          << "chunk: " << i << " bank SAI: " << j;
+    }
+  }
+}
+
+TEST(PitchogramPipelineImageTest, RingOfColumnsMatchesScrollingImage) {
+  constexpr float kSampleRateHz = 22050.0f;
+  constexpr int kChunkSize = 256;
+  constexpr int kNumFrames = 8;
+  PitchogramPipelineParams params;
+  params.num_frames = kNumFrames;
+  params.num_samples_per_segment = kChunkSize;
+  PitchogramPipeline pipeline(kSampleRateHz, params);
+  // The image of a pipeline plotting one frame is the newest column.
+  params.num_frames = 1;
+  PitchogramPipeline column_pipeline(kSampleRateHz, params);
+  const int num_bytes = pipeline.image().size_in_bytes();
+  std::vector<uint8_t> expected(pipeline.image().data(),
+                                pipeline.image().data() + num_bytes);
+
+  std::vector<float> input(kChunkSize);
+  for (int i = 0; i < 3 * kNumFrames + 3; ++i) {
+    FillChirp(i * kChunkSize, kSampleRateHz, &input);
+    pipeline.ProcessSamples(input.data(), kChunkSize);
+    column_pipeline.ProcessSamples(input.data(), kChunkSize);
+    // Scroll the expected image one pixel left, and draw the new column.
+    std::memmove(expected.data(), expected.data() + 4, num_bytes - 4);
+    for (int y = 0; y < pipeline.height(); ++y) {
+      std::memcpy(&expected[4 * (y * kNumFrames + kNumFrames - 1)],
+                  &column_pipeline.image()(0, y, 0), 4);
+    }
+
+    const std::array<Image<const uint8_t>, 2> spans = pipeline.image_spans();
+    ASSERT_EQ(kNumFrames, spans[0].width() + spans[1].width());
+    int x = 0;
+    for (const Image<const uint8_t>& span : spans) {
+      ASSERT_EQ(pipeline.height(), span.height());
+      for (int span_x = 0; span_x < span.width(); ++span_x, ++x) {
+        for (int y = 0; y < span.height(); ++y) {
+          for (int c = 0; c < 4; ++c) {
+            ASSERT_EQ(expected[4 * (y * kNumFrames + x) + c],
+                      span(span_x, y, c))
+                << "frame: " << i << " x: " << x << " y: " << y;
+          }
+        }
+      }
+    }
+    ASSERT_TRUE(std::equal(expected.begin(), expected.end(),
+                           pipeline.image().data()))
+        << "frame: " << i;
+  }
+}
+
 }  // namespace
 
 int main(int argc, char** argv) {
@@ -0,0 +1,189 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "gtest/gtest.h"
+#include "pitchogram_pipeline.h"
+
+namespace {
+
+std::vector<FPType> MakeSine(FPType frequency_hz, FPType sample_rate_hz,
+                             int num_samples) {
+  std::vector<FPType> sine(num_samples);
+  for (int i = 0; i < num_samples; ++i) {
+    sine[i] = std::sin(2 * M_PI * frequency_hz * i / sample_rate_hz);
+  }
+  return sine;
+}
+
+// Resamples input in blocks of block_size samples.
+std::vector<FPType> ResampleInBlocks(Resampler* resampler,
+                                     const std::vector<FPType>& input,
+                                     int block_size) {
+  std::vector<FPType> output;
+  std::vector<FPType> block_output(resampler->MaxOutputSamples(block_size));
+  const int input_size = input.size();
+  for (int start = 0; start < input_size; start += block_size) {
+    const int num_samples = std::min(block_size, input_size - start);
+    const int num_outputs = resampler->Process(&input[start], num_samples,
+                                               block_output.data());
+    EXPECT_LE(num_outputs, resampler->MaxOutputSamples(num_samples));
+    output.insert(output.end(), block_output.begin(),
+                  block_output.begin() + num_outputs);
+  }
+  return output;
+}
+
+// Returns the maximum error of output from a sine of the given frequency at
+// the output rate, delayed by the resampler, after the filter has settled.
+FPType MaxSineError(const Resampler& resampler,
+                    const std::vector<FPType>& output, FPType frequency_hz,
+                    FPType output_rate_hz) {
+  const FPType ratio =
+      static_cast<FPType>(resampler.interpolation()) / resampler.decimation();
+  const FPType delay = resampler.delay() * ratio;
+  FPType max_error = 0;
+  const int output_size = output.size();
+  for (int i = 2 * resampler.num_taps_per_phase(); i < output_size; ++i) {
+    const FPType expected =
+        std::sin(2 * M_PI * frequency_hz * (i - delay) / output_rate_hz);
+    max_error = std::max(max_error, std::abs(output[i] - expected));
+  }
+  return max_error;
+}
+
+}  // namespace
+
+TEST(ResamplerTest, ReducesFactors) {
+  Resampler resampler(22050, 44100, 1024);
+  EXPECT_EQ(1, resampler.interpolation());
+  EXPECT_EQ(2, resampler.decimation());
+}
+
+TEST(ResamplerTest, PreservesPassband) {
+  struct Rates {
+    int input_hz;
+    int output_hz;
+  };
+  for (const Rates& rates : {Rates{44100, 22050}, Rates{48000, 16000},
+                             Rates{96000, 22050}, Rates{16000, 22050}}) {
+    SCOPED_TRACE(testing::Message()
+                 << rates.input_hz << " Hz to " << rates.output_hz << " Hz");
+    Resampler resampler(rates.output_hz, rates.input_hz, 1000);
+    const FPType kFrequencyHz = 1000;
+    const std::vector<FPType> output = ResampleInBlocks(
+        &resampler, MakeSine(kFrequencyHz, rates.input_hz, 20000), 1000);
+    EXPECT_LT(MaxSineError(resampler, output, kFrequencyHz, rates.output_hz),
+              1e-3);
+  }
+}
+
+TEST(ResamplerTest, RemovesAliases) {
+  // 15 kHz would alias to 7.05 kHz at 22.05 kHz.
+  Resampler resampler(1, 2, 1024);
+  const std::vector<FPType> output =
+      ResampleInBlocks(&resampler, MakeSine(15000, 44100, 20000), 1024);
+  FPType max_output = 0;
+  const int output_size = output.size();
+  for (int i = 2 * resampler.num_taps_per_phase(); i < output_size; ++i) {
+    max_output = std::max(max_output, std::abs(output[i]));
+  }
+  EXPECT_LT(max_output, 1e-3);
+}
+
+TEST(ResamplerTest, BlocksResampleToWholeNumberOfSamples) {
+  // 1024 samples at 48 kHz resample to 470 samples at about 22 kHz.
+  Resampler resampler(470, 1024, 1024);
+  const std::vector<FPType> input = MakeSine(440, 48000, 1024);
+  std::vector<FPType> output(resampler.MaxOutputSamples(1024));
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(470, resampler.Process(input.data(), 1024, output.data()));
+  }
+}
+
+TEST(ResamplerTest, OutputDoesNotDependOnBlockSize) {
+  const std::vector<FPType> input = MakeSine(440, 48000, 10000);
+  Resampler resampler(147, 320, 10000);
+  const std::vector<FPType> expected =
+      ResampleInBlocks(&resampler, input, 10000);
+  for (int block_size : {1, 7, 320, 999}) {
+    resampler.Reset();
+    EXPECT_EQ(expected, ResampleInBlocks(&resampler, input, block_size))
+        << block_size;
+  }
+}
+
+TEST(ResamplerTest, RestoredStateResumesExactly) {
+  const std::vector<FPType> input = MakeSine(440, 44100, 2048);
+  Resampler resampler(160, 441, 1024);
+  std::vector<FPType> expected(resampler.MaxOutputSamples(1024));
+  std::vector<FPType> actual(resampler.MaxOutputSamples(1024));
+  resampler.Process(input.data(), 1024, expected.data());
+  std::vector<char> state(resampler.state_size_bytes());
+  resampler.SaveState(state.data());
+  const int num_expected =
+      resampler.Process(&input[1024], 1024, expected.data());
+
+  Resampler restored(160, 441, 1024);
+  restored.RestoreState(state.data());
+  ASSERT_EQ(num_expected, restored.Process(&input[1024], 1024, actual.data()));
+  EXPECT_EQ(expected, actual);
+}
+
+void BM_Resampler(benchmark::State& state) {
+  const int input_rate_hz = state.range(0);
+  const int output_rate_hz = state.range(1);
+  constexpr int kBlockSize = 1024;
+  Resampler resampler(output_rate_hz, input_rate_hz, kBlockSize);
+  const std::vector<FPType> input =
+      MakeSine(440, input_rate_hz, kBlockSize);
+  std::vector<FPType> output(resampler.MaxOutputSamples(kBlockSize));
+  for (auto _ : state) {
+    resampler.Process(input.data(), kBlockSize, output.data());
+    benchmark::DoNotOptimize(output.data());
+  }
+  state.SetItemsProcessed(state.iterations() * kBlockSize);
+}
+BENCHMARK(BM_Resampler)
+    ->ArgNames({"input_hz", "output_hz"})
+    ->Args({44100, 22050})
+    ->Args({48000, 22050})
+    ->Args({96000, 16000});
+
+// Compares the cost per segment of a PitchogramPipeline at 44.1 kHz with the
+// model running at the given rate.
+void BM_PitchogramPipelineInternalSampleRate(benchmark::State& state) {
+  constexpr float kSampleRateHz = 44100.0f;
+  constexpr int kBlockSize = 1024;
+  PitchogramPipelineParams params;
+  params.num_samples_per_segment = kBlockSize;
+  params.internal_sample_rate_hz = state.range(0);
+  PitchogramPipeline pipeline(kSampleRateHz, params);
+  const std::vector<FPType> input = MakeSine(440, kSampleRateHz, kBlockSize);
+  for (auto _ : state) {
+    pipeline.ProcessJustSamples(input.data(), kBlockSize);
+  }
+  state.SetItemsProcessed(state.iterations() * kBlockSize);
+}
+BENCHMARK(BM_PitchogramPipelineInternalSampleRate)
+    ->ArgName("internal_hz")
+    ->Arg(44100)
+    ->Arg(22050)
+    ->Arg(16000);
@@ -19,9 +19,12 @@
 #include "sai.h"
 
 #include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <string>
+#include <vector>
 
+#include "benchmark/benchmark.h"
 #include "gtest/gtest.h"
 
 #include "agc.h"
@@ -30,6 +33,7 @@
 #include "common.h"
 #include "ihc.h"
 #include "test_util.h"
+#include "worker_pool.h"
 #include <Eigen/Core>
 
 using testing::Values;
@@ -81,6 +85,46 @@ INSTANTIATE_TEST_SUITE_P(PeriodicInputVariations, SAIPeriodicInputTest,
 
 class SAITest : public SAITestBase {};
 
+TEST(InputHistoryTest, MatchesShiftedBuffer) {
+  const int kNumChannels = 3;
+  const int kWidth = 10;
+  sai_internal::InputHistory history;
+  history.Reset(kNumChannels, kWidth);
+  ArrayXX expected = ArrayXX::Zero(kNumChannels, kWidth);
+  // Segments that wrap around the ring, fill it exactly, and overflow it.
+  const std::vector<int> kSegmentWidths = {3, 4, 7, 10, 1, 13, 0, 9};
+  int next_value = 0;
+  for (int width : kSegmentWidths) {
+    ArrayXX segment(kNumChannels, width);
+    for (int i = 0; i < segment.size(); ++i) {
+      segment(i) = ++next_value;
+    }
+    ArrayXX shifted(kNumChannels, kWidth + width);
+    shifted << expected, segment;
+    expected = shifted.rightCols(kWidth);
+    history.Append(segment);
+    ASSERT_TRUE((expected == history.samples()).all()) << "width: " << width;
+  }
+  for (int t = 0; t < 25; ++t) {
+    const ArrayX sample = ArrayX::Constant(kNumChannels, ++next_value);
+    history.AppendSample(sample);
+    expected.leftCols(kWidth - 1) = expected.rightCols(kWidth - 1).eval();
+    expected.col(kWidth - 1) = sample;
+    ASSERT_TRUE((expected == history.samples()).all()) << "sample: " << t;
+  }
+
+  std::vector<FPType> state(kNumChannels * kWidth);
+  history.Save(state.data());
+  sai_internal::InputHistory restored;
+  restored.Reset(kNumChannels, kWidth);
+  restored.Restore(state.data());
+  EXPECT_TRUE((expected == restored.samples()).all());
+  const ArrayXX segment = ArrayXX::Constant(kNumChannels, 4, ++next_value);
+  history.Append(segment);
+  restored.Append(segment);
+  EXPECT_TRUE((history.samples() == restored.samples()).all());
+}
+
 TEST_F(SAITest, DiesIfInputSegmentWidthIsLargerThanBuffer) {
   const int kNumChannels = 2;
   const int kSAIWidth = 10;
@@ -167,6 +211,151 @@ TEST_F(SAITest, InputSegmentWidthSmallerThanTriggerWindow) {  // I.e. small hop.
   }
 }
 
+TEST_F(SAITest, ChannelMaskSkipsMaskedRows) {
+  const int kNumChannels = 8;
+  const int kInputSegmentWidth = 40;
+  const int kSAIWidth = 15;
+  SAIParams sai_params = CreateSAIParams(kNumChannels, kInputSegmentWidth,
+                                         kInputSegmentWidth, kSAIWidth);
+  SAI sai(sai_params);
+  SAI masked_sai(sai_params);
+  const std::vector<bool> channel_mask = {false, true, true,  false,
+                                          false, true, false, true};
+  masked_sai.SetChannelMask(channel_mask);
+  EXPECT_EQ(4, masked_sai.num_active_channels());
+
+  ArrayXX sai_frame;
+  ArrayXX masked_sai_frame;
+  for (int i = 0; i < 5; ++i) {
+    ArrayXX segment = ArrayXX::Random(kNumChannels, kInputSegmentWidth).abs();
+    sai.RunSegment(segment, &sai_frame);
+    masked_sai.RunSegment(segment, &masked_sai_frame);
+    for (int channel = 0; channel < kNumChannels; ++channel) {
+      if (channel_mask[channel]) {
+        EXPECT_TRUE((sai_frame.row(channel) == masked_sai_frame.row(channel))
+                        .all()) << "channel: " << channel;
+      } else {
+        EXPECT_TRUE((masked_sai_frame.row(channel) == 0).all())
+            << "channel: " << channel;
+      }
+    }
+  }
+
+  // An empty mask selects all channels again.
+  masked_sai.SetChannelMask({});
+  EXPECT_EQ(kNumChannels, masked_sai.num_active_channels());
+}
+
+TEST_F(SAITest, WorkerPoolMatchesSerial) {
+  const int kNumChannels = 13;
+  const int kInputSegmentWidth = 40;
+  const int kSAIWidth = 15;
+  SAIParams sai_params = CreateSAIParams(kNumChannels, kInputSegmentWidth,
+                                         kInputSegmentWidth, kSAIWidth);
+  SAI sai(sai_params);
+  SAI parallel_sai(sai_params);
+  SAI masked_parallel_sai(sai_params);
+  // The parallel SAIs share the pool, with more threads than the masked SAI
+  // has channels.
+  WorkerPool worker_pool(3);
+  parallel_sai.set_worker_pool(&worker_pool);
+  masked_parallel_sai.set_worker_pool(&worker_pool);
+  std::vector<bool> channel_mask(kNumChannels, false);
+  channel_mask[4] = channel_mask[9] = true;
+  masked_parallel_sai.SetChannelMask(channel_mask);
+
+  ArrayXX sai_frame;
+  ArrayXX parallel_sai_frame;
+  ArrayXX masked_parallel_sai_frame;
+  for (int i = 0; i < 5; ++i) {
+    ArrayXX segment = ArrayXX::Random(kNumChannels, kInputSegmentWidth).abs();
+    sai.RunSegment(segment, &sai_frame);
+    parallel_sai.RunSegment(segment, &parallel_sai_frame);
+    masked_parallel_sai.RunSegment(segment, &masked_parallel_sai_frame);
+    ASSERT_TRUE((sai_frame == parallel_sai_frame).all()) << "segment: " << i;
+    for (int channel = 0; channel < kNumChannels; ++channel) {
+      if (channel_mask[channel]) {
+        EXPECT_TRUE((sai_frame.row(channel) ==
+                     masked_parallel_sai_frame.row(channel)).all())
+            << "channel: " << channel;
+      } else {
+        EXPECT_TRUE((masked_parallel_sai_frame.row(channel) == 0).all())
+            << "channel: " << channel;
+      }
+    }
+  }
+}
+
+TEST_F(SAITest, LagCellsMatchPooledFullFrame) {
+  const int kNumChannels = 6;
+  const int kInputSegmentWidth = 64;
+  const int kSAIWidth = 300;
+  const float kSampleRate = 8000.0f;
+  SAIParams sai_params = CreateSAIParams(kNumChannels, kInputSegmentWidth,
+                                         kInputSegmentWidth + 1, kSAIWidth);
+  sai_params.future_lags = kSAIWidth - 1;
+  const std::vector<std::vector<LagCell>> lag_cell_sets = {
+      LinearLagCells(kSAIWidth, 40), LinearLagCells(kSAIWidth, kSAIWidth),
+      LogLagCells(kSampleRate, kSAIWidth, 12.0f, 0.0005f, 0.0025f)};
+  for (const std::vector<LagCell>& lag_cells : lag_cell_sets) {
+    SAI sai(sai_params);
+    SAI pooled_sai(sai_params);
+    pooled_sai.SetLagCells(lag_cells);
+    pooled_sai.SetChannelMask({true, true, false, true, true, true});
+    ASSERT_EQ(lag_cells.size(), pooled_sai.output_width());
+
+    ArrayXX sai_frame;
+    ArrayXX pooled_sai_frame;
+    for (int i = 0; i < 10; ++i) {
+      ArrayXX segment =
+          ArrayXX::Random(kNumChannels, kInputSegmentWidth).abs();
+      sai.RunSegment(segment, &sai_frame);
+      pooled_sai.RunSegment(segment, &pooled_sai_frame);
+    }
+    const int num_cells = lag_cells.size();
+    ASSERT_EQ(kNumChannels, pooled_sai_frame.rows());
+    ASSERT_EQ(num_cells, pooled_sai_frame.cols());
+    for (int channel = 0; channel < kNumChannels; ++channel) {
+      const ArrayX sai_row = sai_frame.row(channel);
+      for (int c = 0; c < num_cells; ++c) {
+        const float expected =
+            channel == 2 ? 0.0f : lag_cells[c].CellAverage(sai_row);
+        EXPECT_NEAR(expected, pooled_sai_frame(channel, c), 1e-5f)
+            << "channel: " << channel << " cell: " << c;
+      }
+    }
+  }
+}
+
+TEST_F(SAITest, LagCellsStateResumesExactly) {
+  const int kNumChannels = 4;
+  const int kInputSegmentWidth = 50;
+  const int kSAIWidth = 120;
+  SAIParams sai_params = CreateSAIParams(kNumChannels, kInputSegmentWidth,
+                                         kInputSegmentWidth, kSAIWidth);
+  SAI sai(sai_params);
+  sai.SetLagCells(LinearLagCells(kSAIWidth, 30));
+  ArrayXX sai_frame;
+  for (int i = 0; i < 7; ++i) {
+    sai.RunSegment(ArrayXX::Random(kNumChannels, kInputSegmentWidth).abs(),
+                   &sai_frame);
+  }
+  std::vector<uint8_t> state(sai.state_size_bytes());
+  sai.SaveState(state.data());
+
+  SAI restored_sai(sai_params);
+  restored_sai.SetLagCells(LinearLagCells(kSAIWidth, 30));
+  ASSERT_EQ(state.size(), restored_sai.state_size_bytes());
+  restored_sai.RestoreState(state.data());
+  ArrayXX restored_sai_frame;
+  for (int i = 0; i < 5; ++i) {
+    ArrayXX segment = ArrayXX::Random(kNumChannels, kInputSegmentWidth).abs();
+    sai.RunSegment(segment, &sai_frame);
+    restored_sai.RunSegment(segment, &restored_sai_frame);
+    ASSERT_TRUE((sai_frame == restored_sai_frame).all()) << "segment: " << i;
+  }
+}
+
 TEST_F(SAITest, MatchesMatlabOnBinauralData) {
   const std::string kTestName = "binaural_test";
   const int kInputSegmentWidth = 882;
@@ -219,3 +408,95 @@ TEST_F(SAITest, CARFACIntegration) {
 
   // TODO(ronw): Test something about the output.
 }
+
+TEST_F(SAITest, NAPSinkMatchesRunSegment) {
+  const int kInputSegmentWidth = 300;
+  const int kNumSegments = 5;
+  ArrayXX sound_data(1, kInputSegmentWidth * kNumSegments);
+  sound_data.row(0) =
+      0.1 * ArrayX::LinSpaced(sound_data.cols(), 0.0, 200 * M_PI).sin();
+
+  CARParams car_params;
+  IHCParams ihc_params;
+  AGCParams agc_params;
+  CARFAC carfac(1, 8000, car_params, ihc_params, agc_params);
+  carfac.set_car_kernel(CARKernel::kFusedBlock);
+  CARFAC streamed_carfac(1, 8000, car_params, ihc_params, agc_params);
+  streamed_carfac.set_car_kernel(CARKernel::kFusedBlock);
+  SAIParams sai_params = CreateSAIParams(
+      carfac.num_channels(), kInputSegmentWidth, kInputSegmentWidth, 20);
+  SAI sai(sai_params);
+  SAI streamed_sai(sai_params);
+  CARFACOutput output(true, false, false, false);
+  CARFACOutput streamed_output(true, false, false, false);
+  streamed_output.set_nap_sink(0, &streamed_sai);
+
+  ArrayXX sai_frame;
+  ArrayXX streamed_sai_frame;
+  for (int segment = 0; segment < kNumSegments; ++segment) {
+    const auto segment_data =
+        sound_data.middleCols(segment * kInputSegmentWidth, kInputSegmentWidth);
+    carfac.RunSegment(segment_data, false, &output);
+    sai.RunSegment(output.nap()[0], &sai_frame);
+    streamed_carfac.RunSegment(segment_data, false, &streamed_output);
+    streamed_sai.GetOutput(&streamed_sai_frame);
+    ASSERT_TRUE((output.nap()[0] == streamed_sai.latest_input_segment()).all());
+    ASSERT_TRUE((sai_frame == streamed_sai_frame).all());
+  }
+}
+
+// Computes SAI frames of a pitchogram at 22.05 kHz with a small hop, where
+// the SAI is a large share of the time per frame, on worker pools of
+// different sizes.
+void BM_SAIWorkerPool(benchmark::State& state) {
+  const int num_threads = state.range(0);
+  constexpr int kNumChannels = 71;
+  constexpr int kInputSegmentWidth = 64;
+  constexpr int kSAIWidth = 1103;
+  SAIParams sai_params;
+  sai_params.num_channels = kNumChannels;
+  sai_params.sai_width = kSAIWidth;
+  sai_params.future_lags = kSAIWidth - 1;
+  sai_params.num_triggers_per_frame = 2;
+  sai_params.trigger_window_width = kInputSegmentWidth + 1;
+  sai_params.input_segment_width = kInputSegmentWidth;
+  SAI sai(sai_params);
+  WorkerPool worker_pool(num_threads);
+  sai.set_worker_pool(&worker_pool);
+  const ArrayXX segment =
+      ArrayXX::Random(kNumChannels, kInputSegmentWidth).abs();
+  ArrayXX sai_frame;
+  for (auto _ : state) {
+    sai.RunSegment(segment, &sai_frame);
+    benchmark::DoNotOptimize(sai_frame.data());
+  }
+}
+BENCHMARK(BM_SAIWorkerPool)->ArgName("num_threads")->Arg(1)->Arg(2)->Arg(4);
+
+// Computes SAI frames of a pitchogram at 44.1 kHz with every lag, and with
+// the lags pooled into coarser resolutions, like the ones the models consume.
+void BM_SAILagCells(benchmark::State& state) {
+  const int num_cells = state.range(0);
+  constexpr int kNumChannels = 71;
+  constexpr int kInputSegmentWidth = 1024;
+  constexpr int kSAIWidth = 2205;
+  SAIParams sai_params;
+  sai_params.num_channels = kNumChannels;
+  sai_params.sai_width = kSAIWidth;
+  sai_params.future_lags = kSAIWidth - 1;
+  sai_params.num_triggers_per_frame = 2;
+  sai_params.trigger_window_width = kInputSegmentWidth + 1;
+  sai_params.input_segment_width = kInputSegmentWidth;
+  SAI sai(sai_params);
+  if (num_cells > 0) {
+    sai.SetLagCells(LinearLagCells(kSAIWidth, num_cells));
+  }
+  const ArrayXX segment =
+      ArrayXX::Random(kNumChannels, kInputSegmentWidth).abs();
+  ArrayXX sai_frame;
+  for (auto _ : state) {
+    sai.RunSegment(segment, &sai_frame);
+    benchmark::DoNotOptimize(sai_frame.data());
+  }
+}
+BENCHMARK(BM_SAILagCells)->ArgName("num_cells")->Arg(0)->Arg(128)->Arg(32);
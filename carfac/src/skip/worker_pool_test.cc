@@ -0,0 +1,92 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "worker_pool.h"
+
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+TEST(WorkerPoolTest, RunsEveryTaskOnce) {
+  WorkerPool pool(3);
+  for (int num_tasks : {0, 1, 2, 3, 10}) {
+    std::vector<int> num_calls(num_tasks, 0);
+    pool.ParallelFor(num_tasks, [&](int task_index) {
+      ++num_calls[task_index];
+    });
+    for (int task_index = 0; task_index < num_tasks; ++task_index) {
+      EXPECT_EQ(1, num_calls[task_index]) << "task_index: " << task_index;
+    }
+  }
+}
+
+TEST(WorkerPoolTest, AssignsTasksToThreadsDeterministically) {
+  constexpr int kNumThreads = 3;
+  constexpr int kNumTasks = 8;
+  WorkerPool pool(kNumThreads);
+  std::vector<std::thread::id> thread_ids(kNumTasks);
+  pool.ParallelFor(kNumTasks, [&](int task_index) {
+    thread_ids[task_index] = std::this_thread::get_id();
+  });
+  EXPECT_EQ(std::this_thread::get_id(), thread_ids[0]);
+  for (int task_index = 0; task_index < kNumTasks; ++task_index) {
+    for (int other = 0; other < kNumTasks; ++other) {
+      EXPECT_EQ(task_index % kNumThreads == other % kNumThreads,
+                thread_ids[task_index] == thread_ids[other]);
+    }
+  }
+}
+
+TEST(WorkerPoolTest, ConcurrentTasksCanMeetAtBarrier) {
+  constexpr int kNumThreads = 4;
+  constexpr int kNumRounds = 100;
+  WorkerPool pool(kNumThreads);
+  SpinBarrier barrier(kNumThreads);
+  std::vector<int> values(kNumThreads, 0);
+  int sum = 0;
+  std::vector<int> sums_seen(kNumThreads * kNumRounds, -1);
+  pool.ParallelFor(kNumThreads, [&](int task_index) {
+    for (int round = 0; round < kNumRounds; ++round) {
+      values[task_index] = round + task_index;
+      // The completion runs once all tasks have written their values, and
+      // its result is visible to all of them on return.
+      barrier.ArriveAndWait([&] {
+        sum = 0;
+        for (int value : values) {
+          sum += value;
+        }
+      });
+      sums_seen[round * kNumThreads + task_index] = sum;
+      barrier.ArriveAndWait();
+    }
+  });
+  for (int round = 0; round < kNumRounds; ++round) {
+    const int expected_sum =
+        kNumThreads * round + kNumThreads * (kNumThreads - 1) / 2;
+    for (int task_index = 0; task_index < kNumThreads; ++task_index) {
+      EXPECT_EQ(expected_sum, sums_seen[round * kNumThreads + task_index]);
+    }
+  }
+}
+
+TEST(WorkerPoolTest, SingleThreadRunsOnCaller) {
+  WorkerPool pool(1);
+  int num_calls = 0;
+  pool.ParallelFor(5, [&](int task_index) {
+    EXPECT_EQ(num_calls, task_index);
+    ++num_calls;
+  });
+  EXPECT_EQ(5, num_calls);
+}
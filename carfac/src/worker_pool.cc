@@ -0,0 +1,74 @@
+// Copyright 2026 The CARFAC Authors. All Rights Reserved.
+//
+// This file is part of an implementation of Lyon's cochlear model:
+// "Cascade of Asymmetric Resonators with Fast-Acting Compression"
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "worker_pool.h"
+
+WorkerPool::WorkerPool(int num_threads)
+    : num_threads_(num_threads), generation_(0), num_busy_workers_(0) {
+  CARFAC_ASSERT(num_threads > 0);
+  workers_.reserve(num_threads_ - 1);
+  for (int thread_index = 1; thread_index < num_threads_; ++thread_index) {
+    workers_.emplace_back(&WorkerPool::WorkerLoop, this, thread_index);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  stopping_ = true;
+  generation_.fetch_add(1, std::memory_order_release);
+  generation_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+void WorkerPool::Run(int num_tasks, TaskFunction function, const void* task) {
+  if (workers_.empty() || num_tasks <= 1) {
+    for (int task_index = 0; task_index < num_tasks; ++task_index) {
+      function(task, task_index);
+    }
+    return;
+  }
+  num_tasks_ = num_tasks;
+  function_ = function;
+  task_ = task;
+  num_busy_workers_.store(workers_.size(), std::memory_order_relaxed);
+  generation_.fetch_add(1, std::memory_order_release);
+  generation_.notify_all();
+  for (int task_index = 0; task_index < num_tasks;
+       task_index += num_threads_) {
+    function(task, task_index);
+  }
+  SpinWait([this] {
+    return num_busy_workers_.load(std::memory_order_acquire) == 0;
+  });
+}
+
+void WorkerPool::WorkerLoop(int thread_index) {
+  uint32_t generation = 0;
+  while (true) {
+    generation_.wait(generation, std::memory_order_acquire);
+    generation = generation_.load(std::memory_order_acquire);
+    if (stopping_) {
+      return;
+    }
+    for (int task_index = thread_index; task_index < num_tasks_;
+         task_index += num_threads_) {
+      function_(task_, task_index);
+    }
+    num_busy_workers_.fetch_sub(1, std::memory_order_acq_rel);
+  }
+}
@@ -118,6 +118,7 @@ struct runner_t
         av_packet_t result;
         result.activations = model->get_activations_image();
         result.voting = model->voting.get_voting_image();
+        model->core.carfac_reader.render(note_image);
 
         draw_notes_as_keys(note_image);
         model->draw_regions(note_image);
@@ -0,0 +1,130 @@
+#include "tbt_model.h"
+#include "accuracy_score.h"
+#include "named_models.h"
+#include <carfac/fixed_point_carfac.h>
+
+// Compares the fixed-point CARFAC with the float one on the dataset/train files:
+// the SNR of the NAP and the SAI, and the note F1 of a trained model fed by each,
+// to decide when fixed_point_carfac is safe to enable.
+
+static tbt_params_t params = bandits;
+
+// energy of the reference and of its difference from the test output, summed over frames
+struct snr_accum_t {
+  double signal = 0;
+  double noise = 0;
+
+  void update(ArrayXX const& reference, ArrayXX const& test)
+  {
+    signal += reference.cast<double>().square().sum();
+    noise += (reference.cast<double>() - test.cast<double>()).square().sum();
+  }
+
+  double db() const
+  {
+    return noise > 0 ? 10 * std::log10(signal / noise) : INFINITY;
+  }
+};
+
+std::vector<std::string> eval_files()
+{
+  std::vector<std::string> files;
+  for(auto& file : list_audio_files("../dataset/train"))
+    files.push_back(file.string());
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+void snr_test()
+{
+  snr_accum_t nap_snr;
+  snr_accum_t sai_snr;
+  for(auto file : eval_files()){
+    std::cout << "snr of file: " << file << std::endl;
+    if(check_and_gen_if_midi(file))
+      file = "midi_train.wav";
+
+    carfac_reader_t float_reader;
+    carfac_reader_t fixed_reader;
+    float_reader.set(params.core.sample_rate, params.core.buffer_size, params.core.loudness_coef, params.core.internal_sample_rate, false);
+    fixed_reader.set(params.core.sample_rate, params.core.buffer_size, params.core.loudness_coef, params.core.internal_sample_rate, true);
+    float_reader.init(file);
+    fixed_reader.init(file);
+    auto total_bytes = readWavFile(file).size() * sizeof(float);
+
+    snr_accum_t file_nap_snr;
+    snr_accum_t file_sai_snr;
+    while(float_reader.get_render_pos() < total_bytes){
+      float_reader.next();
+      fixed_reader.next();
+      auto& float_pipeline = float_reader.get_pipeline();
+      auto& fixed_pipeline = fixed_reader.get_pipeline();
+      file_nap_snr.update(float_pipeline.nap(), fixed_pipeline.nap());
+      file_sai_snr.update(float_pipeline.sai_output(), fixed_pipeline.sai_output());
+    }
+    std::cout << "\tnap snr: " << file_nap_snr.db() << " dB, sai snr: " << file_sai_snr.db() << " dB" << std::endl;
+
+    nap_snr.signal += file_nap_snr.signal;
+    nap_snr.noise += file_nap_snr.noise;
+    sai_snr.signal += file_sai_snr.signal;
+    sai_snr.noise += file_sai_snr.noise;
+  }
+  std::cout << "total nap snr: " << nap_snr.db() << " dB, sai snr: " << sai_snr.db() << " dB" << std::endl;
+}
+
+// runs the model over a file and returns its predictions for each frame
+std::vector<std::vector<int>> predict_file(tbt_model_t& tbt, std::string const& file, bool fixed_point_carfac, AccuracyStats* stats)
+{
+  tbt.core.params.fixed_point_carfac = fixed_point_carfac;
+  tbt.core.load_audio_file_and_notes(file);
+  tbt.reset_tms();
+
+  std::vector<std::vector<int>> predictions;
+  while(tbt.core.carfac_reader.get_render_pos() < tbt.core.audio.total_bytes()){
+    auto note_image = tbt.core.carfac_reader.next();
+    predictions.push_back(tbt.infer(note_image));
+    stats->update(midi_to_labels(note_image.midi), predictions.back());
+
+    std::cout << "\rstep... " << std::fixed << std::setprecision(2) << tbt.core.audio_progress() << "%";
+    std::cout.flush();
+  }
+  std::cout << "\n";
+  return predictions;
+}
+
+void f1_test()
+{
+  tbt_model_t tbt;
+  if(!fs::exists(params.core.models_path)){
+    std::cout << "no trained model at " << params.core.models_path << ", skipping the f1 test" << std::endl;
+    return;
+  }
+  tbt.params.core.models_path = params.core.models_path;
+  tbt.loadv2();
+
+  AccuracyStats float_stats;
+  AccuracyStats fixed_stats;
+  // the fixed-point predictions scored against the float ones
+  AccuracyStats agreement_stats;
+  for(auto file : eval_files()){
+    std::cout << "f1 of file: " << file << std::endl;
+    if(check_and_gen_if_midi(file))
+      file = "midi_train.wav";
+
+    auto float_predictions = predict_file(tbt, file, false, &float_stats);
+    auto fixed_predictions = predict_file(tbt, file, true, &fixed_stats);
+    for(auto i = 0; i < float_predictions.size(); i++)
+      agreement_stats.update(float_predictions[i], fixed_predictions[i]);
+
+    std::cout << "\tfloat[" << float_stats << "]    fixed[" << fixed_stats << "]    agreement[" << agreement_stats << "]" << std::endl;
+  }
+  std::cout << "float[" << float_stats << "]" << std::endl;
+  std::cout << "fixed[" << fixed_stats << "]" << std::endl;
+  std::cout << "agreement[" << agreement_stats << "]" << std::endl;
+}
+
+int main()
+{
+  snr_test();
+  f1_test();
+}
@@ -8,6 +8,7 @@
 #include <filesystem>
 #include <iostream>
 #include <cassert>
+#include <memory>
 #include <mutex>
 #include <carfac/carfac.h>
 #include <carfac/pitchogram_pipeline.h>
@@ -126,34 +127,107 @@ public:
 };
 
 
+// Compact features of a frame, emitted instead of the SAI image in the feature stream mode
+// of carfac_reader_t, a few hundred floats per frame.
+struct feature_frame_t {
+    // log-lag pitchogram column, the SAI averaged over the channels
+    std::vector<float> pitchogram;
+    // smoothed mean NAP of each CARFAC channel, from the highest to the lowest frequency
+    std::vector<float> channel_energy;
+    // 2D vowel embedding, empty unless requested
+    std::vector<float> vowel_coords;
+    bool is_valid() const { return !pitchogram.empty(); }
+};
+
 struct note_image_t {
+    // rendered SAI image, empty in the feature stream mode or when the reader does not render it,
+    // see carfac_reader_t::render()
     cv::Mat mat;
+    // current SAI frame, channels by lags, valid until the next call of carfac_reader_t::next()
+    const ArrayXX* sai = nullptr;
+    // features of the frame, only in the feature stream mode
+    feature_frame_t features;
     std::vector<str_note_event_t> midi;
     std::vector<float> wav_chunk;
     int64_t midi_ts = 0;
-    bool is_valid() const { return !mat.empty(); }
+    bool is_valid() const { return !mat.empty() || features.is_valid(); }
 };
 
+// Pipelines of all readers, reused across files instead of being rebuilt for each one.
+inline PitchogramPipelinePool& pipeline_pool()
+{
+    static PitchogramPipelinePool pool;
+    return pool;
+}
+
 class carfac_reader_t {
 public:
+    ~carfac_reader_t();
     void init(std::string file_path);
     void init(std::vector<float> const& wav);
-    void set(int sample_rate, int buffer_size, float loudness_coef);
+    // internal_sample_rate is the rate CARFAC runs at, 0 runs it at sample_rate.
+    // fixed_point_carfac runs CARFAC in fixed-point arithmetic.
+    void set(int sample_rate, int buffer_size, float loudness_coef, int internal_sample_rate = 0, bool fixed_point_carfac = false);
+    // Restricts the computed SAI rows to the frequency bands in Hz, or computes all rows if empty.
+    // With narrow_poles the CARFAC channels above and below the bands are dropped too,
+    // which changes the channel layout of the image.
+    void set_bands(std::vector<std::pair<float, float>> const& bands, bool narrow_poles = false);
+    // Pools the SAI lags into width columns while computing them, which is cheaper when width
+    // is a small fraction of the lags, e.g. the 32 pixels the note models see of a region.
+    // 0 keeps a column per lag, as the trained models expect.
+    void set_sai_output_width(int width);
+    // Extra SAIs with their own max lag, trigger count and output width, fed from the same
+    // CARFAC pass as the main SAI, e.g. long lags for the low notes and short fine lags for the
+    // high ones. Their outputs are get_pipeline().sai_bank_output(i).
+    void set_sai_bank(std::vector<PitchogramSAIParams> const& sai_bank);
+    // Makes next() emit the features of the frame in note_image_t::features instead of rendering
+    // the SAI image, which costs a small fraction of the image processing. The pitchogram needs
+    // every lag of the SAI, so the SAI output width is ignored in this mode.
+    void set_feature_stream(bool enabled, bool with_vowel_coords = true);
+    // With render_image false next() does not render the SAI image, for models that sample their
+    // regions from note_image_t::sai directly, see sample_sai_region().
+    void set_render_image(bool render_image);
     int64_t get_render_pos() const;
+    // the pipeline of the current file, valid after init()
+    PitchogramPipeline const& get_pipeline() const { return *pipeline; }
     note_image_t next();
+    // Renders the SAI image of the frame next() returned into note_image.mat, if it was not rendered,
+    // for the visualizations. Must be called before the next call of next().
+    void render(note_image_t& note_image);
     void reset();
     int64_t total_note_count() const;
     void clear_all_notes();
 
+    // size of the images returned by next()
+    static constexpr int image_width = 800;
+    static constexpr int image_height = 600;
+
 private:
+    void create_pipeline();
+    // renders the current SAI frame to an image_width by image_height BGR image
+    cv::Mat render_sai();
 
     int sample_rate = 44100;
     int buffer_size = 1024;
     float loudness_coef = 0.1;
+    int internal_sample_rate = 0;
+    bool fixed_point_carfac = false;
+    std::vector<std::pair<float, float>> bands;
+    bool narrow_poles = false;
+    int sai_output_width = 0;
+    std::vector<PitchogramSAIParams> sai_bank;
+    bool feature_stream = false;
+    bool feature_vowel_coords = true;
+    bool render_image = true;
     int64_t render_pos = 0;
     std::vector<float> sample_data;
     active_notes_t active_notes;
-    PitchogramPipeline* pipeline = nullptr;
+    std::unique_ptr<PitchogramPipeline> pipeline;
+
+    // Scratch buffers of render_sai(), kept between frames to avoid reallocating them
+    cv::Mat rotated_mat;
+    cv::Mat resized_mat;
+    cv::Mat bgr_mat;
 };
 
 inline int64_t carfac_reader_t::total_note_count() const
@@ -161,11 +235,46 @@ inline int64_t carfac_reader_t::total_note_count() const
     return active_notes.all_notes.size();
 }
 
-inline void carfac_reader_t::set(int sample_rate_arg, int buffer_size_arg, float loudness_coef_arg)
+inline void carfac_reader_t::set(int sample_rate_arg, int buffer_size_arg, float loudness_coef_arg, int internal_sample_rate_arg, bool fixed_point_carfac_arg)
 {
     sample_rate = sample_rate_arg;
     buffer_size = buffer_size_arg;
     loudness_coef = loudness_coef_arg;
+    internal_sample_rate = internal_sample_rate_arg;
+    fixed_point_carfac = fixed_point_carfac_arg;
+}
+
+inline carfac_reader_t::~carfac_reader_t()
+{
+    if(pipeline)
+        pipeline_pool().Release(std::move(pipeline));
+}
+
+inline void carfac_reader_t::set_bands(std::vector<std::pair<float, float>> const& bands_arg, bool narrow_poles_arg)
+{
+    bands = bands_arg;
+    narrow_poles = narrow_poles_arg;
+}
+
+inline void carfac_reader_t::set_sai_output_width(int width)
+{
+    sai_output_width = width;
+}
+
+inline void carfac_reader_t::set_sai_bank(std::vector<PitchogramSAIParams> const& sai_bank_arg)
+{
+    sai_bank = sai_bank_arg;
+}
+
+inline void carfac_reader_t::set_feature_stream(bool enabled, bool with_vowel_coords)
+{
+    feature_stream = enabled;
+    feature_vowel_coords = with_vowel_coords;
+}
+
+inline void carfac_reader_t::set_render_image(bool render_image_arg)
+{
+    render_image = render_image_arg;
 }
 
 inline void carfac_reader_t::clear_all_notes()
@@ -176,36 +285,51 @@ inline void carfac_reader_t::clear_all_notes()
 
 inline void carfac_reader_t::init(std::string file_path)
 {
-    if(pipeline){
-        delete pipeline;
-        pipeline = 0;
-    }
-    sample_data = readWavFile(file_path);
+    // Files are read at their own rate, which the pipeline resamples from.
+    sample_data = readWavFile(file_path, &sample_rate);
     std::string notes_path = replaced(file_path, ".wav", ".csv");
     if(std::filesystem::exists(notes_path))
         active_notes.all_notes = read_notes(notes_path);
 
     render_pos = 0;
-    PitchogramPipelineParams params;
-    params.num_frames = sample_data.size() / buffer_size;
-    params.num_samples_per_segment = buffer_size;
-    params.pitchogram_params.light_color_theme = false;
-    pipeline = new PitchogramPipeline(sample_rate, params);
+    create_pipeline();
 }
 
 inline void carfac_reader_t::init(std::vector<float> const& wav)
 {
-    if(pipeline){
-        delete pipeline;
-        pipeline = 0;
-    }
     sample_data = wav;
     render_pos = 0;
+    create_pipeline();
+}
+
+inline void carfac_reader_t::create_pipeline()
+{
+    if(pipeline)
+        pipeline_pool().Release(std::move(pipeline));
+
     PitchogramPipelineParams params;
-    params.num_frames = sample_data.size() / buffer_size;
+    // only the SAI is read, so the pitchogram image does not need a column per frame,
+    // which also lets files of any length share pipelines
+    params.num_frames = 1;
     params.num_samples_per_segment = buffer_size;
+    params.internal_sample_rate_hz = internal_sample_rate;
+    params.fixed_point_carfac = fixed_point_carfac;
+    params.sai_output_width = feature_stream ? 0 : sai_output_width;
+    params.sai_bank = sai_bank;
     params.pitchogram_params.light_color_theme = false;
-    pipeline = new PitchogramPipeline(sample_rate, params);
+    if(narrow_poles && !bands.empty()){
+        // keep half an octave around the bands for the channels at their edges
+        float low = bands.front().first;
+        float high = bands.front().second;
+        for(auto& [band_low, band_high] : bands){
+            low = std::min(low, band_low);
+            high = std::max(high, band_high);
+        }
+        params.highest_pole_hz = std::min(params.highest_pole_hz, high * float(M_SQRT2));
+        params.min_pole_hz = std::max(params.min_pole_hz, low / float(M_SQRT2));
+    }
+    pipeline = pipeline_pool().Acquire(sample_rate, params);
+    pipeline->SetActiveBands(bands);
 }
 
 inline note_image_t carfac_reader_t::next()
@@ -217,18 +341,24 @@ inline note_image_t carfac_reader_t::next()
     for(auto i = 0; i < buffer_size; i++)
         input[i] *= loudness_coef; // adjusting volume for algorithms
 
-    pipeline->ProcessJustSamples(input, buffer_size);
-    auto& nap = pipeline->sai_output().transpose().eval();
-    // auto& nap = pipeline.carfac_output().nap()[0].transpose().eval();
-    cv::Mat mat(nap.rows(), nap.cols(), CV_32F, (void*)nap.data());
-    cv::Mat rot_mat;
-    cv::rotate(mat, rot_mat, cv::ROTATE_90_CLOCKWISE);
-    cv::resize(rot_mat, rot_mat, cv::Size(800, 600));
-    cv::cvtColor(rot_mat, rot_mat, cv::COLOR_GRAY2BGR);
-    rot_mat.convertTo(rot_mat, CV_8U, 255);
-
     note_image_t result;
-    result.mat = rot_mat;
+    if(feature_stream){
+        // the pitchogram of one frame is all that is drawn, so this adds little to the SAI
+        pipeline->ProcessSamples(input, buffer_size);
+        auto& features = result.features;
+        auto& pitchogram = pipeline->pitchogram_output();
+        features.pitchogram.assign(pitchogram.data(), pitchogram.data() + pitchogram.size());
+        auto& channel_energy = pipeline->channel_energy();
+        features.channel_energy.assign(channel_energy.data(), channel_energy.data() + channel_energy.size());
+        if(feature_vowel_coords)
+            features.vowel_coords = {pipeline->vowel_coords()[0], pipeline->vowel_coords()[1]};
+    }
+    else{
+        pipeline->ProcessJustSamples(input, buffer_size);
+        if(render_image)
+            result.mat = render_sai();
+    }
+    result.sai = &pipeline->sai_output();
     result.midi = active_notes.get();
     result.wav_chunk.assign(input, input + buffer_size);
 
@@ -243,6 +373,28 @@ inline note_image_t carfac_reader_t::next()
     return result;
 }
 
+inline void carfac_reader_t::render(note_image_t& note_image)
+{
+    if(note_image.mat.empty())
+        note_image.mat = render_sai();
+}
+
+inline cv::Mat carfac_reader_t::render_sai()
+{
+    // The column-major SAI, channels by lags, has the memory layout of a row-major image of a row
+    // per lag, like sai_output().transpose().eval() had, so it is wrapped without copying.
+    auto& sai = pipeline->sai_output();
+    // auto nap = pipeline.nap().transpose().eval();
+    cv::Mat mat(sai.cols(), sai.rows(), CV_32F, (void*)sai.data());
+    // The intermediate images are reused too, only the returned image is new.
+    cv::rotate(mat, rotated_mat, cv::ROTATE_90_CLOCKWISE);
+    cv::resize(rotated_mat, resized_mat, cv::Size(image_width, image_height));
+    cv::cvtColor(resized_mat, bgr_mat, cv::COLOR_GRAY2BGR);
+    cv::Mat rot_mat;
+    bgr_mat.convertTo(rot_mat, CV_8U, 255);
+    return rot_mat;
+}
+
 inline int64_t carfac_reader_t::get_render_pos() const
 {
     return render_pos;
@@ -318,4 +470,6 @@ inline void carfac_reader_t::reset()
 {
     render_pos = 0;
     active_notes.reset();
+    if(pipeline)
+        pipeline->Reset();
 }
\ No newline at end of file
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "carfac_reader.h"
+
+// Encodes the feature frames of the carfac_reader_t feature stream into the dense input of the
+// spatial pooler, in place of the thresholded SAI image.
+//
+// The input is cut into slots of bits_per_value bits, each encoding one value in [0, 1] as
+// active_bits adjacent active bits at a position that grows with the value, so that close values
+// share bits. Each vowel coordinate gets a slot, and the remaining slots are shared by the
+// pitchogram and the channel energy in proportion to their lengths, each slot pooling a run of
+// neighboring values by their mean.
+struct feature_encoder_t {
+    int bits_per_value = 8;
+    int active_bits = 2;
+    // The pitchogram and the channel energy are scaled by their peak in the frame, and peaks below
+    // these are not amplified further, so that silence stays low.
+    float min_pitchogram_peak = 0.01;
+    float min_energy_peak = 0.001;
+
+    std::vector<uint8_t> encode(feature_frame_t const& features, int size) const
+    {
+        std::vector<uint8_t> result(size, 0);
+        int num_slots = size / bits_per_value;
+        int vowel_slots = std::min<int>(features.vowel_coords.size(), num_slots);
+        int shared_slots = num_slots - vowel_slots;
+        int total = features.pitchogram.size() + features.channel_energy.size();
+        int pitchogram_slots = total > 0 ? shared_slots * int(features.pitchogram.size()) / total : 0;
+        if(!features.pitchogram.empty() && !features.channel_energy.empty() && shared_slots >= 2)
+            pitchogram_slots = std::clamp(pitchogram_slots, 1, shared_slots - 1);
+
+        int slot = 0;
+        auto set_slot = [&](float value){
+            int range = bits_per_value - active_bits;
+            int pos = std::clamp(int(value * range + 0.5f), 0, range);
+            std::fill_n(result.begin() + slot * bits_per_value + pos, active_bits, 255);
+            slot++;
+        };
+        auto encode_group = [&](std::vector<float> const& values, int slots, float min_peak){
+            if(values.empty())
+                return;
+            float peak = std::max(min_peak, *std::max_element(values.begin(), values.end()));
+            int n = values.size();
+            for(int i = 0; i < slots; i++){
+                int begin = i * n / slots;
+                int end = std::max(begin + 1, (i + 1) * n / slots);
+                float sum = 0;
+                for(int j = begin; j < end; j++)
+                    sum += values[j];
+                set_slot(sum / (end - begin) / peak);
+            }
+        };
+        encode_group(features.pitchogram, pitchogram_slots, min_pitchogram_peak);
+        encode_group(features.channel_energy, shared_slots - pitchogram_slots, min_energy_peak);
+        // vowel coordinates are mostly within [-1, 1]
+        for(int i = 0; i < vowel_slots; i++)
+            set_slot(0.5f + 0.5f * features.vowel_coords[i]);
+        return result;
+    }
+};
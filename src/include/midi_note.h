@@ -190,6 +190,20 @@ inline std::pair<int, int> get_midi_range_for_region(
     return {midi_low, midi_high};
 }
 
+// Frequency bands in Hz of the notes the regions can read, for restricting
+// the computed SAI rows to them.
+inline std::vector<std::pair<float, float>> get_freq_bands_for_regions(
+    std::vector<cv::Rect> const& regions,
+    cv::Size image_size
+) {
+    std::vector<std::pair<float, float>> bands;
+    for(auto& region : regions){
+        auto [midi_low, midi_high] = get_midi_range_for_region(region.y, region.height, image_size.height);
+        bands.emplace_back(midi_to_freq(midi_low), midi_to_freq(midi_high));
+    }
+    return bands;
+}
+
 inline std::vector<uint32_t> filter_and_remap_midi(
     const std::vector<uint32_t>& midi_notes,
     uint32_t midi_low,
@@ -11,8 +11,10 @@
 #include <htm/os/Timer.hpp>
 
 #include "carfac_reader.h"
+#include "feature_encoder.h"
 #include "helpers.h"
 #include "note_location.h"
+#include "sai_region.h"
 #include "crow.h"
 
 using namespace std;
@@ -43,6 +45,17 @@ struct note_model_params_t {
   float loudness_coef = 0.1;
   int sample_rate = 44100;
   int buffer_size = 1024;
+  // rate CARFAC runs at, 0 runs it at sample_rate
+  int internal_sample_rate = 0;
+  // run CARFAC in fixed-point arithmetic, see fixed_point_eval for its accuracy
+  bool fixed_point_carfac = false;
+  // feed the model the compact features of the carfac_reader_t feature stream instead of the SAI
+  // image, which has no regions, so tbt_model_t rejects it
+  bool feature_input = false;
+  bool feature_vowel_coords = true;
+  // sample the region straight from the SAI instead of from the rendered image, which is then
+  // only rendered for the visualizations
+  bool direct_sai_input = false;
 
   bool operator==(note_model_params_t const& other) const;
 };
@@ -60,6 +73,7 @@ public:
   SDR columns;
   SDR outTM;
   Classifier clsr;
+  feature_encoder_t feature_encoder;
 
   carfac_reader_t carfac_reader;
   AudioData audio;
@@ -112,8 +126,10 @@ public:
   {
     carfac_reader.reset();
     carfac_reader.clear_all_notes();
+    carfac_reader.set(params.sample_rate, params.buffer_size, params.loudness_coef, params.internal_sample_rate, params.fixed_point_carfac);
+    carfac_reader.set_feature_stream(params.feature_input, params.feature_vowel_coords);
+    carfac_reader.set_render_image(!params.direct_sai_input);
     carfac_reader.init(file_path);
-    carfac_reader.set(params.sample_rate, params.buffer_size, params.loudness_coef);
     audio.buffer = readWavFile(file_path);
   }
 
@@ -121,8 +137,10 @@ public:
   {
     carfac_reader.reset();
     carfac_reader.clear_all_notes();
+    carfac_reader.set(params.sample_rate, params.buffer_size, params.loudness_coef, params.internal_sample_rate, params.fixed_point_carfac);
+    carfac_reader.set_feature_stream(params.feature_input, params.feature_vowel_coords);
+    carfac_reader.set_render_image(!params.direct_sai_input);
     carfac_reader.init(wav);
-    carfac_reader.set(params.sample_rate, params.buffer_size, params.loudness_coef);
     audio.buffer = wav;
   }
 
@@ -182,11 +200,51 @@ public:
     return img;
   }
 
+  // the region of the SAI frame as preproc_input makes it of the rendered image, the whole frame if
+  // the region is empty
+  cv::Mat preproc_sai(ArrayXX const& sai)
+  {
+    sai_region_t region;
+    if(!params.region.empty())
+      region = sai_region_t::from_rect(params.region, {carfac_reader_t::image_width, carfac_reader_t::image_height});
+    return sample_sai_region(sai, region, params.width, params.width, params.binary_thresh);
+  }
+
   void feedforward(cv::Mat const& sai, std::vector<uint> const& labels, bool train)
   {
     input_image = preproc_input(sai);
-    auto vec_img = mat_to_vector(input_image);
+    feedforward_input(mat_to_vector(input_image), labels, train);
+  }
+
+  void feedforward(feature_frame_t const& features, std::vector<uint> const& labels, bool train)
+  {
+    // the note location takes the end of the input, as it does of the image
+    int size = params.height * params.width;
+    if(params.with_note_location)
+      size = std::max<int>(0, size - note_location_resolution);
+    auto vec_img = feature_encoder.encode(features, size);
+    input_image = vector_to_mat(vec_img, params.height, params.width);
+    feedforward_input(vec_img, labels, train);
+  }
+
+  // features in the feature stream mode, the region of the SAI otherwise, sampled from the SAI
+  // frame with direct_sai_input, or else cropped from the image
+  void feedforward(note_image_t const& note_image, std::vector<uint> const& labels, bool train)
+  {
+    if(note_image.features.is_valid())
+      feedforward(note_image.features, labels, train);
+    else if(params.direct_sai_input && note_image.sai){
+      input_image = preproc_sai(*note_image.sai);
+      feedforward_input(mat_to_vector(input_image), labels, train);
+    }
+    else if(params.region.empty())
+      feedforward(note_image.mat, labels, train);
+    else
+      feedforward(note_image.mat(params.region), labels, train);
+  }
 
+  void feedforward_input(std::vector<uint8_t> vec_img, std::vector<uint> const& labels, bool train)
+  {
     if(params.with_note_location){
       auto orig = vec_img.size();
       note_sdr = {};
@@ -241,6 +299,7 @@ public:
 
   void visualize(note_image_t note_image, std::vector<int> pred_midi)
   {
+    carfac_reader.render(note_image);
     // cv::Mat columns_mat;
     // if(params.with_note_location)
     //   columns_mat = draw_sp_output(columns, params.dim, params.dim, note_location_resolution);
@@ -301,6 +360,11 @@ inline crow::json::wvalue params_to_json(const note_model_params_t& params) {
   j["loudness_coef"] = params.loudness_coef;
   j["sample_rate"] = params.sample_rate;
   j["buffer_size"] = params.buffer_size;
+  j["internal_sample_rate"] = params.internal_sample_rate;
+  j["fixed_point_carfac"] = params.fixed_point_carfac;
+  j["feature_input"] = params.feature_input;
+  j["feature_vowel_coords"] = params.feature_vowel_coords;
+  j["direct_sai_input"] = params.direct_sai_input;
 
   return j;
 }
@@ -329,6 +393,16 @@ inline note_model_params_t params_from_json(const crow::json::rvalue& j) {
   params.loudness_coef = static_cast<float>(j["loudness_coef"].d());
   params.sample_rate = j["sample_rate"].i();
   params.buffer_size = j["buffer_size"].i();
+  if (j.has("internal_sample_rate"))
+    params.internal_sample_rate = j["internal_sample_rate"].i();
+  if (j.has("fixed_point_carfac"))
+    params.fixed_point_carfac = j["fixed_point_carfac"].b();
+  if (j.has("feature_input"))
+    params.feature_input = j["feature_input"].b();
+  if (j.has("feature_vowel_coords"))
+    params.feature_vowel_coords = j["feature_vowel_coords"].b();
+  if (j.has("direct_sai_input"))
+    params.direct_sai_input = j["direct_sai_input"].b();
 
   return params;
 }
@@ -351,5 +425,10 @@ inline bool note_model_params_t::operator==(note_model_params_t const& other) co
     region == other.region && 
     loudness_coef == other.loudness_coef && 
     sample_rate == other.sample_rate && 
-    buffer_size == other.buffer_size;
+    buffer_size == other.buffer_size && 
+    internal_sample_rate == other.internal_sample_rate && 
+    fixed_point_carfac == other.fixed_point_carfac && 
+    feature_input == other.feature_input && 
+    feature_vowel_coords == other.feature_vowel_coords && 
+    direct_sai_input == other.direct_sai_input;
 }
\ No newline at end of file
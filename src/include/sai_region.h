@@ -0,0 +1,56 @@
+#pragma once
+
+#include <algorithm>
+#include <carfac/common.h>
+#include <opencv2/core.hpp>
+
+// A region of the SAI in normalized coordinates of the image carfac_reader_t renders of it:
+// x runs from the longest lag at 0 to lag 0 at 1, and y from the highest frequency channel at 0
+// to the lowest at 1.
+struct sai_region_t {
+    float x = 0;
+    float y = 0;
+    float width = 1;
+    float height = 1;
+
+    // the region of a rectangle of pixels of an image of image_size, e.g. of the rendered SAI
+    static sai_region_t from_rect(cv::Rect rect, cv::Size image_size)
+    {
+        return {float(rect.x) / image_size.width, float(rect.y) / image_size.height,
+                float(rect.width) / image_size.width, float(rect.height) / image_size.height};
+    }
+};
+
+// Samples a region straight from the SAI frame, channels by lags, into a binary rows by cols
+// image like the one note_model_t::preproc_input makes of the region of the rendered image,
+// without rendering it. Like the resizes of the render, which do not average, each pixel
+// interpolates the SAI bilinearly at its center. It is scaled to 0-255 as in the render and
+// thresholded at binary_thresh. The cost is a few reads per pixel of the result.
+inline cv::Mat sample_sai_region(ArrayXX const& sai, sai_region_t const& region, int rows, int cols, int binary_thresh)
+{
+    int num_channels = sai.rows();
+    int num_lags = sai.cols();
+    // index and weight of the upper of the two of n SAI rows or columns around the center of the
+    // ith of count pixels of [start, start+size)
+    auto interpolate = [](float start, float size, int i, int count, int n){
+        float pos = std::clamp((start + size * (i + 0.5f) / count) * n - 0.5f, 0.0f, n - 1.0f);
+        int index = std::min(int(pos), n - 2);
+        return std::pair{index, pos - index};
+    };
+
+    cv::Mat result(rows, cols, CV_8U);
+    for(int i = 0; i < rows; i++){
+        auto [channel, channel_weight] = interpolate(region.y, region.height, i, rows, num_channels);
+        for(int j = 0; j < cols; j++){
+            // the image shows the lags in reverse, lag 0 on the right
+            auto [col, col_weight] = interpolate(region.x, region.width, j, cols, num_lags);
+            int lag = num_lags - 2 - col;
+            float lag_weight = 1 - col_weight;
+            auto block = sai.block<2, 2>(channel, lag);
+            float value = (1 - channel_weight) * ((1 - lag_weight) * block(0, 0) + lag_weight * block(0, 1)) +
+                          channel_weight * ((1 - lag_weight) * block(1, 0) + lag_weight * block(1, 1));
+            result.at<uint8_t>(i, j) = value * 255 > binary_thresh ? 255 : 0;
+        }
+    }
+    return result;
+}
@@ -5,6 +5,7 @@
 #include "crow.h"
 #include "voting.h"
 #include <semaphore>
+#include <stdexcept>
 
 template <typename T>
 using ptr = std::shared_ptr<T>;
@@ -20,6 +21,9 @@ struct tbt_params_t
 
   bool use_voting_tm = false;
   bool limit_region_notes = false;
+  // only compute the SAI rows the regions read, band_narrow_poles also drops the CARFAC channels outside them
+  bool band_select = false;
+  bool band_narrow_poles = false;
   voting_params_t voting_params;
   int vote_repeats = 0;
   float pred_thresh = 0.1;
@@ -54,8 +58,25 @@ struct tbt_model_t
       task.get();
   }
 
+  void setup_bands()
+  {
+    std::vector<std::pair<float, float>> bands;
+    if(params.band_select)
+      bands = get_freq_bands_for_regions(params.regions, {carfac_reader_t::image_width, carfac_reader_t::image_height});
+    core.carfac_reader.set_bands(bands, params.band_narrow_poles);
+  }
+
+  // the feature stream has no regions to give each region model its own part of the frame
+  static void check_params(tbt_params_t const& params)
+  {
+    if(params.core.feature_input)
+      throw std::invalid_argument("feature_input is not supported by region models");
+  }
+
   void setup(tbt_params_t in_params, bool create_models = true) {
+    check_params(in_params);
     params = in_params;
+    setup_bands();
     if(params.core.with_note_location && !params.use_voting_tm)
       core.setup_note_map(params.core.note_map_path);
 
@@ -97,13 +118,11 @@ struct tbt_model_t
 
     auto train_step = [&](auto i){
       auto model = models.at(i);
-      auto img = note_image.mat(model->params.region);
-
-      model->feedforward(img, labels, true);
+      model->feedforward(note_image, labels, true);
       if(core.carfac_reader.total_note_count() != 0){
         auto local_labels = labels;
         if(params.limit_region_notes)
-          local_labels = labels_to_region_specific(labels, model->params.region, note_image.mat.size());
+          local_labels = labels_to_region_specific(labels, model->params.region, image_size());
         if(model->params.with_tm)
           model->clsr.learn(model->outTM, local_labels);
         else
@@ -118,6 +137,9 @@ struct tbt_model_t
       task.get();
   }
 
+  // size of the rendered SAI image the regions are in, also when it is not rendered
+  static cv::Size image_size() { return {carfac_reader_t::image_width, carfac_reader_t::image_height}; }
+
   std::vector<uint32_t> get_labels(note_image_t const& note_image)
   {
     auto labels_int = midi_to_labels(note_image.midi);
@@ -141,8 +163,7 @@ struct tbt_model_t
   }
 
   std::vector<int> infer_step(ptr<note_model_t> model, note_image_t const& note_image) {
-    auto img = note_image.mat(model->params.region);
-    model->feedforward(img, {0}, false);
+    model->feedforward(note_image, {0}, false);
     PDF pdf;
     if(model->params.with_tm)
       pdf = model->clsr.infer(model->outTM);
@@ -150,7 +171,7 @@ struct tbt_model_t
       pdf = model->clsr.infer(model->columns);
     auto labels = note_model_t::get_labels(pdf, params.pred_thresh);
     if(params.limit_region_notes)
-      labels = labels_from_region_to_global(labels, model->params.region, note_image.mat.size());
+      labels = labels_from_region_to_global(labels, model->params.region, image_size());
     return remove_zero(labels);
   }
 
@@ -241,6 +262,7 @@ struct tbt_model_t
 
   void visualize(note_image_t& note_image, std::vector<int> pred_midi = {})
   {
+    core.carfac_reader.render(note_image);
     core.draw_notes(note_image, pred_midi);
     draw_regions(note_image);
     auto nn_mat = get_activations_image();
@@ -289,6 +311,8 @@ struct tbt_model_t
   {
     auto full_path = params.core.models_path;
     params = tbt_params_from_json(crow::json::load(read_text_file(params.core.models_path+"/main_params.json")));
+    check_params(params);
+    setup_bands();
     params.core.models_path = full_path;
     if(params.core.with_note_location && !params.use_voting_tm)
       core.note_map = read_note_map_from_file(params.core.models_path+"/note_map.txt");
@@ -324,6 +348,8 @@ struct tbt_model_t
   // something to do with setup + load sequence??
   void load(){
     params = tbt_params_from_json(crow::json::load(read_text_file(params.core.models_path+"/main_params.json")));
+    check_params(params);
+    setup_bands();
     if(params.core.with_note_location && !params.use_voting_tm)
       core.note_map = read_note_map_from_file(params.core.models_path+"/note_map.txt");
     models.clear();
@@ -423,6 +449,8 @@ inline crow::json::wvalue tbt_params_to_json(const tbt_params_t& params) {
   result["vote_repeats"] = params.vote_repeats;
   result["pred_thresh"] = params.pred_thresh;
   result["limit_region_notes"] = params.limit_region_notes;
+  result["band_select"] = params.band_select;
+  result["band_narrow_poles"] = params.band_narrow_poles;
   return result;
 }
 
@@ -443,6 +471,10 @@ inline tbt_params_t tbt_params_from_json(const crow::json::rvalue& j) {
   result.vote_repeats = j["vote_repeats"].i();
   result.pred_thresh = j["pred_thresh"].d();
   result.limit_region_notes = j["limit_region_notes"].b();
+  if(j.has("band_select"))
+    result.band_select = j["band_select"].b();
+  if(j.has("band_narrow_poles"))
+    result.band_narrow_poles = j["band_narrow_poles"].b();
   return result;
 }
 
@@ -456,5 +488,7 @@ inline bool tbt_params_t::operator==(tbt_params_t const& other) const
     use_voting_tm == other.use_voting_tm && 
     voting_params == other.voting_params && 
     vote_repeats == other.vote_repeats && 
-    pred_thresh == other.pred_thresh;
+    pred_thresh == other.pred_thresh && 
+    band_select == other.band_select && 
+    band_narrow_poles == other.band_narrow_poles;
 }
\ No newline at end of file
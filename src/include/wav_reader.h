@@ -12,13 +12,16 @@ inline float normalize_sample(float sample) {
 }
 
 // Read WAV from file and merge to mono, normalized to [0,1]
-inline std::vector<float> readWavFile(const std::string& path) {
+// The file's sample rate is stored to sample_rate if it is given.
+inline std::vector<float> readWavFile(const std::string& path, int* sample_rate = nullptr) {
     SF_INFO sfinfo = {};
     SNDFILE* sndfile = sf_open(path.c_str(), SFM_READ, &sfinfo);
     if (!sndfile) {
         throw std::runtime_error(std::string("Failed to open file: ") + sf_strerror(nullptr));
     }
 
+    if (sample_rate)
+        *sample_rate = sfinfo.samplerate;
     int channels = sfinfo.channels;
     sf_count_t frames = sfinfo.frames;
     std::vector<float> interleaved(frames * channels);
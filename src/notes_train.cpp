@@ -44,7 +44,7 @@ void train_notes(note_model_t& model)
         if(labels.empty())
           labels.push_back(0);
 
-        model.feedforward(note_image.mat, labels, true);
+        model.feedforward(note_image, labels, true);
 
         if(model.carfac_reader.total_note_count() != 0){
           if(model.params.with_tm)
@@ -101,7 +101,7 @@ void test_notes(note_model_t& model)
       auto note_image = model.carfac_reader.next();
       auto labels = midi_to_labels(note_image.midi);
 
-      model.feedforward(note_image.mat, {0}, false);
+      model.feedforward(note_image, {0}, false);
 
       PDF pdf;
       if(model.params.with_tm)